@@ -6,6 +6,7 @@
 #include "forward.glsl"
 
 #define SHADOW_MAPPING_SCREEN_COORD (ivec2(gl_FragCoord.xy) + camera.pairs[control.base_camera_index + gl_ViewIndex].current.pan.zw * control.size * 128.0f)
+#define LIGHT_CLUSTER_CAMERA_INDEX (control.base_camera_index + gl_ViewIndex)
 
 #include "ggx.glsl"
 #include "spherical_harmonics.glsl"
@@ -19,9 +20,18 @@ layout(location = 3) in vec2 in_uv;
 layout(location = 4) in vec3 in_tangent;
 layout(location = 5) in vec3 in_bitangent;
 
+#ifdef INDIRECT_DRAW
+layout(location = 6) flat in uint in_instance_id;
+#define INSTANCE_ID in_instance_id
+#define FLIPPED_WINDING_ORDER has_draw_flag(INSTANCE_ID, DRAW_FLAG_FLIPPED_WINDING_ORDER)
+#else
+#define INSTANCE_ID control.instance_id
+#define FLIPPED_WINDING_ORDER (control.flipped_winding_order != 0)
+#endif
+
 sampled_material sample_material(inout vertex_data v)
 {
-    material mat = instances.o[control.instance_id].mat;
+    material mat = instances.o[INSTANCE_ID].mat;
     return sample_material(mat, v);
 }
 
@@ -44,7 +54,7 @@ vertex_data get_vertex_data()
     v.tangent = in_tangent;
     v.bitangent = in_bitangent;
     v.back_facing = !gl_FrontFacing;
-    if(control.flipped_winding_order != 0) v.back_facing = !v.back_facing;
+    if(FLIPPED_WINDING_ORDER) v.back_facing = !v.back_facing;
     if(v.back_facing)
     {
         v.smooth_normal = -v.smooth_normal;
@@ -131,7 +141,7 @@ void eval_indirect_light(
     vec3 incoming_diffuse = vec3(0);
     vec3 incoming_reflection = vec3(0);
 
-    int sh_grid_index = instances.o[control.instance_id].sh_grid_index;
+    int sh_grid_index = instances.o[INSTANCE_ID].sh_grid_index;
     if(sh_grid_index >= 0)
     {
         sh_grid sg = sh_grids.grids[sh_grid_index];
@@ -194,7 +204,7 @@ void main()
     write_gbuffer_normal(v.mapped_normal);
     write_gbuffer_pos(v.pos);
     write_gbuffer_screen_motion(get_camera_projection(camera.pairs[control.base_camera_index + gl_ViewIndex].previous, v.prev_pos));
-    write_gbuffer_instance_id(int(control.instance_id));
+    write_gbuffer_instance_id(int(INSTANCE_ID));
     write_gbuffer_linear_depth();
     write_gbuffer_flat_normal(v.hard_normal);
     write_gbuffer_curvature(curvature);
@@ -4,6 +4,9 @@
 #define SCENE_SET 0
 #define SCENE_RASTER_SET 1
 #include "scene_raster.glsl"
+#ifdef INDIRECT_DRAW
+#include "indirect_draw.glsl"
+#endif
 
 layout(push_constant) uniform push_constant_buffer
 {
@@ -21,15 +21,27 @@ layout(location = 3) out vec2 out_uv;
 layout(location = 4) out vec3 out_tangent;
 layout(location = 5) out vec3 out_bitangent;
 
+#ifdef INDIRECT_DRAW
+layout(location = 6) flat out uint out_instance_id;
+#define INSTANCE_ID uint(gl_InstanceIndex)
+#define HAS_PREV_POS_DATA has_draw_flag(INSTANCE_ID, DRAW_FLAG_HAS_PREV_POS)
+#else
+#define INSTANCE_ID control.instance_id
+#define HAS_PREV_POS_DATA (control.has_prev_pos_data != 0)
+#endif
+
 void main()
 {
-    instance o = instances.o[control.instance_id];
+    instance o = instances.o[INSTANCE_ID];
     out_pos = vec3(o.model * vec4(in_pos, 1.0f));
-    out_prev_pos = vec3(o.model_prev * vec4(control.has_prev_pos_data != 0 ? in_prev_pos : in_pos, 1.0f));
+    out_prev_pos = vec3(o.model_prev * vec4(HAS_PREV_POS_DATA ? in_prev_pos : in_pos, 1.0f));
     gl_Position = camera.pairs[control.base_camera_index + gl_ViewIndex].current.view_proj * vec4(out_pos, 1.0f);
     out_normal = normalize(mat3(o.model_normal) * in_normal);
     out_tangent = normalize(mat3(o.model_normal) * in_tangent.xyz);
     out_bitangent = (cross(out_normal, out_tangent) * in_tangent.w);
 
     out_uv = in_uv;
+#ifdef INDIRECT_DRAW
+    out_instance_id = INSTANCE_ID;
+#endif
 }
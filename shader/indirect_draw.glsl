@@ -0,0 +1,34 @@
+#ifndef INDIRECT_DRAW_GLSL
+#define INDIRECT_DRAW_GLSL
+#include "scene.glsl"
+
+// Only available when scene_stage has indirect_draw enabled. Entries are
+// indexed by instance ID, which is also gl_InstanceIndex in indirect draws.
+
+// These must match the DRAW_FLAG_* constants in src/scene_stage.cc
+#define DRAW_FLAG_FLIPPED_WINDING_ORDER (1u<<0)
+#define DRAW_FLAG_HAS_PREV_POS (1u<<1)
+#define DRAW_FLAG_POTENTIALLY_TRANSPARENT (1u<<2)
+
+struct draw_info
+{
+    // xyz = object space bounding sphere center, w = radius. Negative radius
+    // means that the instance is never culled.
+    vec4 bounds;
+    uint index_count;
+    uint first_index;
+    int vertex_offset;
+    uint flags;
+};
+
+layout(binding = 12, set = SCENE_SET, scalar) readonly buffer draw_info_buffer
+{
+    draw_info d[];
+} draw_infos;
+
+bool has_draw_flag(uint instance_id, uint flag)
+{
+    return (draw_infos.d[instance_id].flags & flag) != 0;
+}
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef LIGHT_CLUSTER_GLSL
+#define LIGHT_CLUSTER_GLSL
+// Included by scene.glsl when LIGHT_CLUSTERING is defined. Point lights and
+// spotlights are binned by shader/light_cluster.comp into a froxel grid for
+// each perspective camera. The grid is split into tiles in screen space and
+// exponentially into slices along the view-space depth.
+
+// These must match the LIGHT_CLUSTER_* constants in src/scene_stage.cc
+#define LIGHT_CLUSTER_TILES_X 16u
+#define LIGHT_CLUSTER_TILES_Y 8u
+#define LIGHT_CLUSTER_SLICES 24u
+#define LIGHT_CLUSTER_COUNT (LIGHT_CLUSTER_TILES_X * LIGHT_CLUSTER_TILES_Y * LIGHT_CLUSTER_SLICES)
+// Each cluster is a light count followed by up to LIGHT_CLUSTER_MAX_LIGHTS
+// indices to point_lights.
+#define LIGHT_CLUSTER_MAX_LIGHTS 31u
+#define LIGHT_CLUSTER_STRIDE (LIGHT_CLUSTER_MAX_LIGHTS + 1u)
+// Clusters with too many lights store this count, and all lights are visited
+// instead.
+#define LIGHT_CLUSTER_OVERFLOW 0xFFFFFFFFu
+
+struct light_cluster_slicing
+{
+    // The slice of view-space depth z is floor(log(z) * scale + bias). Scale
+    // is zero for cameras that have no clusters.
+    float scale;
+    float bias;
+};
+
+layout(binding = 13, set = SCENE_SET, scalar) readonly buffer light_cluster_slicing_buffer
+{
+    light_cluster_slicing s[];
+} light_cluster_slicings;
+
+#ifdef LIGHT_CLUSTER_BUILD
+layout(binding = 14, set = SCENE_SET) writeonly buffer light_cluster_buffer
+#else
+layout(binding = 14, set = SCENE_SET) readonly buffer light_cluster_buffer
+#endif
+{
+    uint data[];
+} light_clusters;
+
+#ifndef LIGHT_CLUSTER_BUILD
+// Finds the lights that may affect world_pos from the cluster containing it.
+// The lights are light_clusters.data[offset + i] for i < count if this returns
+// true. Otherwise, all count = point_light_count lights must be visited. That
+// happens outside of the camera's view frustum and in overflowing clusters.
+bool get_light_cluster(
+    uint camera_index,
+    vec3 world_pos,
+    out uint offset,
+    out uint count
+){
+    offset = 0;
+    count = scene_metadata.point_light_count;
+#if CAMERA_PROJECTION_TYPE == 0
+    light_cluster_slicing s = light_cluster_slicings.s[camera_index];
+    if(s.scale == 0.0f)
+        return false;
+
+    vec4 clip = camera.pairs[camera_index].current.view_proj * vec4(world_pos, 1.0f);
+    // w is the view-space depth with perspective projections.
+    if(clip.w <= 0.0f)
+        return false;
+
+    vec2 uv = clip.xy / clip.w * 0.5f + 0.5f;
+    if(any(lessThan(uv, vec2(0))) || any(greaterThanEqual(uv, vec2(1))))
+        return false;
+
+    uvec2 tile = uvec2(uv * vec2(LIGHT_CLUSTER_TILES_X, LIGHT_CLUSTER_TILES_Y));
+    uint slice = uint(clamp(
+        floor(log(clip.w) * s.scale + s.bias),
+        0.0f, float(LIGHT_CLUSTER_SLICES-1u)
+    ));
+    uint cluster_index = camera_index * LIGHT_CLUSTER_COUNT +
+        (slice * LIGHT_CLUSTER_TILES_Y + tile.y) * LIGHT_CLUSTER_TILES_X + tile.x;
+
+    uint cluster_offset = cluster_index * LIGHT_CLUSTER_STRIDE;
+    uint cluster_count = light_clusters.data[cluster_offset];
+    if(cluster_count == LIGHT_CLUSTER_OVERFLOW)
+        return false;
+
+    offset = cluster_offset + 1u;
+    count = cluster_count;
+    return true;
+#else
+    return false;
+#endif
+}
+#endif
+
+#endif
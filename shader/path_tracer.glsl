@@ -62,7 +62,7 @@ float bsdf_mis_pdf(
 
     float avg_nee_pdf =
         nee_pdf.directional_light_pdf * dir_prob / max(scene_metadata.directional_light_count, 1) +
-        nee_pdf.tri_light_pdf * triangle_prob / max(scene_metadata.tri_light_count, 1) +
+        nee_pdf.tri_light_pdf * triangle_prob +
         nee_pdf.envmap_pdf * envmap_prob +
         nee_pdf.point_light_pdf * point_prob / max(scene_metadata.point_light_count, 1);
 
@@ -117,7 +117,8 @@ bool get_intersection_info(
         mat = sample_material(payload.instance_id, vd);
         mat.albedo.a = 1.0; // Alpha blending was handled by the any-hit shader!
 #ifdef NEE_SAMPLE_EMISSIVE_TRIANGLES
-        nee_pdf.tri_light_pdf = pdf == 0.0f ? 0.0f : pdf;
+        nee_pdf.tri_light_pdf = pdf == 0.0f ? 0.0f :
+            pdf * tri_light_selection_pdf(payload.instance_id, payload.primitive_id);
         light = mat.emission;
         mat.emission = vec3(0);
 #else
@@ -226,8 +227,8 @@ vec3 sample_explicit_light(uvec4 rand_uint, vec3 pos, out vec3 out_dir, out floa
 #ifdef NEE_SAMPLE_EMISSIVE_TRIANGLES
     else if((u.w -= triangle_prob) < 0)
     { // Sample triangle light
-        const int light_count = int(scene_metadata.tri_light_count);
-        int light_index = clamp(int(u.z*light_count), 0, light_count-1);
+        float selection_pdf = 0.0f;
+        int light_index = select_tri_light(u.z, selection_pdf);
         tri_light tl = tri_lights.lights[light_index];
         vec3 A = tl.pos[0]-pos;
         vec3 B = tl.pos[1]-pos;
@@ -258,7 +259,7 @@ vec3 sample_explicit_light(uvec4 rand_uint, vec3 pos, out vec3 out_dir, out floa
         // Prevent shadow ray from intersecting with the target triangle
         out_length -= control.min_ray_dist;
 
-        pdf = triangle_prob * tri_pdf / light_count;
+        pdf = triangle_prob * tri_pdf * selection_pdf;
         return color;
     }
 #endif
@@ -390,6 +390,7 @@ void add_contribution(inout sum_contribution sc, vec4 contrib, float weight)
 
 #ifdef SHADE_ALL_EXPLICIT_LIGHTS
 #define SHADOW_MAPPING_SCREEN_COORD vec2(gl_GlobalInvocationID.xy)
+#define LIGHT_CLUSTER_CAMERA_INDEX pc.camera_index
 #include "shadow_mapping.glsl"
 vec3 shade_explicit_lights(
     int instance_id,
@@ -438,9 +439,8 @@ vec3 shade_explicit_lights(
     }
 #endif
 
-    for(uint i = 0; i < scene_metadata.point_light_count; ++i)
-    {
-        point_light pl = point_lights.lights[i];
+    POINT_LIGHT_FOR_BEGIN(vd.pos)
+        point_light pl = point_lights.lights[item_index];
         vec3 light_dir;
         float light_dist;
         vec3 light_color;
@@ -456,7 +456,7 @@ vec3 shade_explicit_lights(
             shadow = 0.0f;
 
         contrib += light_color * shadow * modulate_bsdf(mat, lobes);
-    }
+    POINT_LIGHT_FOR_END
 
     for(uint i = 0; i < scene_metadata.directional_light_count; ++i)
     {
@@ -699,7 +699,9 @@ bool resolve_reconnection_vertex(
         to.dir = normalize(vd.pos-to_domain.pos);
         to.dist = length(vd.pos-to_domain.pos);
         to.normal = vd.hard_normal;
-        to.nee_pdf = pdf * triangle_prob / max(scene_metadata.tri_light_count, 1u);
+        to.nee_pdf = pdf * triangle_prob * tri_light_selection_pdf(
+            int(rs.vertex.instance_id), int(rs.vertex.primitive_id)
+        );
 
 #if !defined(SHADE_ALL_EXPLICIT_LIGHTS) || defined(ASSUME_UNCHANGED_RECONNECTION_RADIANCE)
         // Normal operation: just find the emissiveness of the vertex.
@@ -1067,9 +1069,10 @@ light_sample sample_light(
     }
     else if((u.x -= triangle_prob) < 0)
     { // triangle light
-        int selected_index = clamp(int(u.y*scene_metadata.tri_light_count), 0, int(scene_metadata.tri_light_count-1));
+        float selection_pdf = 0.0f;
+        int selected_index = select_tri_light(u.y, selection_pdf);
 
-        ls.pdf = triangle_prob / max(scene_metadata.tri_light_count, 1);
+        ls.pdf = triangle_prob * selection_pdf;
 
         tri_light tl = tri_lights.lights[selected_index];
 
@@ -1183,7 +1186,9 @@ float calculate_light_pdf(
     }
     else
     { // Tri light
-        return local_pdf * triangle_prob / max(scene_metadata.tri_light_count, 1u);
+        return local_pdf * triangle_prob * tri_light_selection_pdf(
+            int(instance_id), int(primitive_id)
+        );
     }
     return 0;
 }
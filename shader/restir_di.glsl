@@ -278,10 +278,8 @@ void sample_canonical(
     else if((u.w -= triangle_prob) < 0) // triangle light
     {
         light_type = 1;
-        int light_count = int(scene_metadata.tri_light_count);
-
-        light_index = clamp(int(u.z*light_count), 0, light_count-1);
-        float selection_pmf = 1.0f / light_count;
+        float selection_pmf = 0.0f;
+        light_index = select_tri_light(u.z, selection_pmf);
 
         if(selection_pmf == 0)
         {
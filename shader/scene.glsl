@@ -169,10 +169,6 @@ layout(binding = 9, set = SCENE_SET, scalar) uniform scene_metadata_buffer
     int environment_proj;
 } scene_metadata;
 
-#define POINT_LIGHT_FOR_BEGIN(world_pos) \
-    for(uint item_index = 0; item_index < scene_metadata.point_light_count; ++item_index) {
-#define POINT_LIGHT_FOR_END }
-
 struct camera_pair
 {
     camera_data current;
@@ -188,4 +184,71 @@ layout(binding = 10, set = SCENE_SET) readonly buffer camera_data_buffer
 layout(binding = 11, set = SCENE_SET) uniform accelerationStructureEXT tlas;
 #endif
 
+#ifdef TRI_LIGHT_SELECTION_POWER
+// Entries are in the same order as tri_lights. 'pdf' is the probability of
+// selecting the entry's own triangle, not the pdf of the alias table slot.
+layout(binding = 15, set = SCENE_SET) readonly buffer tri_light_alias_table_buffer
+{
+    alias_table_entry entries[];
+} tri_light_alias_table;
+#endif
+
+// Picks an index to tri_lights with u in [0, 1). selection_pdf is only the
+// probability of picking that triangle, it excludes the NEE light type
+// probability.
+int select_tri_light(float u, out float selection_pdf)
+{
+    int light_count = int(scene_metadata.tri_light_count);
+    float scaled = u * light_count;
+    int light_index = clamp(int(scaled), 0, light_count-1);
+#ifdef TRI_LIGHT_SELECTION_POWER
+    alias_table_entry at = tri_light_alias_table.entries[light_index];
+    selection_pdf = at.pdf;
+    // The fractional part is still uniformly distributed, so it can pick
+    // between the slot and its alias.
+    if(scaled - float(light_index) >= ldexp(float(at.probability), -32))
+    {
+        light_index = int(at.alias_id);
+        selection_pdf = at.alias_pdf;
+    }
+#else
+    selection_pdf = 1.0f / max(light_count, 1);
+#endif
+    return light_index;
+}
+
+// The probability of select_tri_light() picking the given emissive triangle.
+float tri_light_selection_pdf(int instance_id, int primitive_id)
+{
+#ifdef TRI_LIGHT_SELECTION_POWER
+    int light_base_id = instances.o[instance_id].light_base_id;
+    if(light_base_id < 0) return 0.0f;
+    return tri_light_alias_table.entries[light_base_id + primitive_id].pdf;
+#else
+    return 1.0f / max(scene_metadata.tri_light_count, 1u);
+#endif
+}
+
+#ifdef LIGHT_CLUSTERING
+#include "light_cluster.glsl"
+
+// Shaders using these must define LIGHT_CLUSTER_CAMERA_INDEX, the camera whose
+// clusters are used for world_pos.
+#define POINT_LIGHT_FOR_BEGIN(world_pos) { \
+    uint light_cluster_offset, light_cluster_count; \
+    bool light_cluster_found = get_light_cluster( \
+        LIGHT_CLUSTER_CAMERA_INDEX, world_pos, \
+        light_cluster_offset, light_cluster_count \
+    ); \
+    for(uint light_cluster_i = 0; light_cluster_i < light_cluster_count; ++light_cluster_i) { \
+        uint item_index = light_cluster_found ? \
+            light_clusters.data[light_cluster_offset + light_cluster_i] : \
+            light_cluster_i;
+#define POINT_LIGHT_FOR_END }}
+#else
+#define POINT_LIGHT_FOR_BEGIN(world_pos) \
+    for(uint item_index = 0; item_index < scene_metadata.point_light_count; ++item_index) {
+#define POINT_LIGHT_FOR_END }
+#endif
+
 #endif
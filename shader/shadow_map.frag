@@ -7,15 +7,24 @@
 
 layout(location = 0) in vec2 in_uv;
 
+#ifdef INDIRECT_DRAW
+layout(location = 1) flat in uint in_instance_id;
+#define INSTANCE_ID in_instance_id
+#define ALPHA_CLIP (has_draw_flag(INSTANCE_ID, DRAW_FLAG_POTENTIALLY_TRANSPARENT) ? 0.5f : 1.0f)
+#else
+#define INSTANCE_ID control.instance_id
+#define ALPHA_CLIP control.alpha_clip
+#endif
+
 void main()
 {
-    instance o = instances.o[control.instance_id];
-    if(control.alpha_clip < 1.0f)
+    instance o = instances.o[INSTANCE_ID];
+    if(ALPHA_CLIP < 1.0f)
     {
         float alpha = o.mat.albedo_factor.a;
         if(o.mat.albedo_tex_id >= 0)
             alpha *= texture(textures[nonuniformEXT(o.mat.albedo_tex_id)], in_uv).a;
-        if(alpha < control.alpha_clip)
+        if(alpha < ALPHA_CLIP)
             discard;
     }
 }
@@ -9,11 +9,21 @@ layout(location = 0) in vec3 in_pos;
 layout(location = 2) in vec2 in_uv;
 layout(location = 0) out vec2 out_uv;
 
+#ifdef INDIRECT_DRAW
+layout(location = 1) flat out uint out_instance_id;
+#define INSTANCE_ID uint(gl_InstanceIndex)
+#else
+#define INSTANCE_ID control.instance_id
+#endif
+
 void main()
 {
-    instance o = instances.o[control.instance_id];
+    instance o = instances.o[INSTANCE_ID];
     vec3 pos = vec3(o.model * vec4(in_pos, 1.0f));
     gl_Position = shadow_camera.view_proj[control.camera_index] * vec4(pos, 1.0f);
     out_uv = in_uv;
+#ifdef INDIRECT_DRAW
+    out_instance_id = INSTANCE_ID;
+#endif
 }
 
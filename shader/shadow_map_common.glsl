@@ -4,6 +4,9 @@
 #define SHADOW_MAP_COMMON_GLSL
 
 #include "scene.glsl"
+#ifdef INDIRECT_DRAW
+#include "indirect_draw.glsl"
+#endif
 
 layout(binding = 0, set = 0) buffer shadow_camera_data_buffer
 {
@@ -15,9 +15,16 @@ layout(push_constant) uniform push_constant_buffer
     int base_camera_index;
 } control;
 
+#ifdef INDIRECT_DRAW
+#include "indirect_draw.glsl"
+#define INSTANCE_ID uint(gl_InstanceIndex)
+#else
+#define INSTANCE_ID control.instance_id
+#endif
+
 void main()
 {
-    instance o = instances.o[control.instance_id];
+    instance o = instances.o[INSTANCE_ID];
     vec3 pos = vec3(o.model * vec4(in_pos, 1.0f));
     gl_Position = camera.pairs[control.base_camera_index+gl_ViewIndex].current.view_proj * vec4(pos, 1.0f);
 }
@@ -1,6 +1,20 @@
 #include "acceleration_structure.hh"
 #include "mesh.hh"
 #include "misc.hh"
+#include <chrono>
+
+namespace
+{
+
+// Required alignment of acceleration structure offsets within a buffer.
+constexpr vk::DeviceSize AS_OFFSET_ALIGNMENT = 256;
+
+vk::DeviceSize align_as_offset(vk::DeviceSize offset)
+{
+    return (offset + AS_OFFSET_ALIGNMENT - 1) / AS_OFFSET_ALIGNMENT * AS_OFFSET_ALIGNMENT;
+}
+
+}
 
 namespace tr
 {
@@ -10,7 +24,8 @@ bottom_level_acceleration_structure::bottom_level_acceleration_structure(
     const std::vector<entry>& entries,
     bool backface_culled,
     bool dynamic,
-    bool compact
+    bool compact,
+    bool defer_build
 ):  updates_since_rebuild(0), geometry_count(entries.size()),
     backface_culled(backface_culled), dynamic(dynamic), compact(!dynamic && compact),
     buffers(dev)
@@ -27,11 +42,23 @@ bottom_level_acceleration_structure::bottom_level_acceleration_structure(
     for(size_t frame_index = 0; frame_index < MAX_FRAMES_IN_FLIGHT; ++frame_index)
         update_transforms(frame_index, entries);
 
+    if(defer_build) return;
+
     for(device& d: dev)
     {
+        blas_batch batch(d);
+        batch.add(*this, entries);
+
         vk::CommandBuffer cb = begin_command_buffer(d);
-        rebuild(d.id, 0, cb, entries, false);
+        batch.record_build(0, cb);
         end_command_buffer(d, cb);
+
+        if(this->compact)
+        {
+            cb = begin_command_buffer(d);
+            batch.record_compaction(cb, true);
+            end_command_buffer(d, cb);
+        }
     }
 }
 
@@ -53,6 +80,21 @@ void bottom_level_acceleration_structure::update_transforms(
     });
 }
 
+void bottom_level_acceleration_structure::build(
+    device_id id,
+    size_t frame_index,
+    vk::CommandBuffer cb,
+    const std::vector<entry>& entries,
+    vk::QueryPool compact_query,
+    uint32_t query_index,
+    vk::DeviceAddress scratch_address
+){
+    record_build(
+        id, *this, frame_index, cb, entries, false,
+        compact_query, query_index, scratch_address
+    );
+}
+
 void bottom_level_acceleration_structure::rebuild(
     device_id id,
     size_t frame_index,
@@ -71,14 +113,89 @@ void bottom_level_acceleration_structure::rebuild_from(
     const std::vector<entry>& entries,
     bool update
 ){
-    if(!update) updates_since_rebuild = 0;
+    record_build(id, other, frame_index, cb, entries, update, {}, 0, 0);
+}
+
+vk::DeviceSize bottom_level_acceleration_structure::get_build_scratch_size(
+    device_id id,
+    const std::vector<entry>& entries
+) const {
+    build_geometry geom;
+    get_build_geometry(id, entries, false, geom);
+    vk::AccelerationStructureBuildSizesInfoKHR size_info =
+        buffers.get_device(id).logical.getAccelerationStructureBuildSizesKHR(
+            vk::AccelerationStructureBuildTypeKHR::eDevice, geom.info,
+            geom.primitive_count
+        );
+    return size_info.buildScratchSize;
+}
+
+void bottom_level_acceleration_structure::compact_into(
+    device_id id,
+    vk::CommandBuffer cb,
+    vk::DeviceSize compact_size,
+    const std::shared_ptr<vkm<vk::Buffer>>& storage,
+    vk::DeviceSize offset
+){
     device& dev = buffers.get_device(id);
     buffer_data& bd = buffers[id];
 
-    std::vector<vk::AccelerationStructureGeometryKHR> geometries(entries.size());
-    std::vector<vk::TransformMatrixKHR> transforms(entries.size());
-    std::vector<vk::AccelerationStructureBuildRangeInfoKHR> ranges(entries.size());
-    std::vector<uint32_t> primitive_count(entries.size());
+    vkm<vk::AccelerationStructureKHR> fat_blas = std::move(bd.blas);
+    vkm<vk::Buffer> fat_blas_buffer(std::move(bd.blas_buffer));
+
+    bd.shared_blas_buffer = storage;
+    vk::AccelerationStructureCreateInfoKHR create_info(
+        {},
+        **storage,
+        offset,
+        compact_size,
+        vk::AccelerationStructureTypeKHR::eBottomLevel,
+        {}
+    );
+
+    bd.blas = vkm(dev, dev.logical.createAccelerationStructureKHR(create_info));
+
+    cb.copyAccelerationStructureKHR({
+        fat_blas,
+        bd.blas,
+        vk::CopyAccelerationStructureModeKHR::eCompact
+    });
+
+    fat_blas.drop();
+    fat_blas_buffer.drop();
+
+    bd.blas_address = dev.logical.getAccelerationStructureAddressKHR({bd.blas});
+    bd.built = true;
+}
+
+bool bottom_level_acceleration_structure::is_compact() const
+{
+    return compact;
+}
+
+bool bottom_level_acceleration_structure::is_built() const
+{
+    for(device& dev: buffers.get_mask())
+        if(!buffers[dev.id].built) return false;
+    return true;
+}
+
+vk::DeviceSize bottom_level_acceleration_structure::get_build_size(device_id id) const
+{
+    return buffers[id].build_size;
+}
+
+void bottom_level_acceleration_structure::get_build_geometry(
+    device_id id,
+    const std::vector<entry>& entries,
+    bool update,
+    build_geometry& geom
+) const {
+    device& dev = buffers.get_device(id);
+
+    geom.geometries.resize(entries.size());
+    geom.ranges.resize(entries.size());
+    geom.primitive_count.resize(entries.size());
 
     for(size_t i = 0; i < entries.size(); ++i)
     {
@@ -86,12 +203,12 @@ void bottom_level_acceleration_structure::rebuild_from(
         transform_address.deviceAddress =
             transform_buffer.get_address(id) + sizeof(vk::TransformMatrixKHR) * i;
 
-        vk::AccelerationStructureGeometryKHR geom{};
+        vk::AccelerationStructureGeometryKHR g{};
         const mesh* m = entries[i].m;
         if(m)
         {
-            geom.geometryType = vk::GeometryTypeKHR::eTriangles;
-            geom.geometry.triangles = vk::AccelerationStructureGeometryTrianglesDataKHR(
+            g.geometryType = vk::GeometryTypeKHR::eTriangles;
+            g.geometry.triangles = vk::AccelerationStructureGeometryTrianglesDataKHR(
                 vk::Format::eR32G32B32Sfloat,
                 dev.logical.getBufferAddress({m->get_vertex_buffer(id)}),
                 sizeof(mesh::vertex),
@@ -101,30 +218,30 @@ void bottom_level_acceleration_structure::rebuild_from(
                 transform_address
             );
             uint32_t triangle_count = m->get_indices().size()/3;
-            ranges[i] = vk::AccelerationStructureBuildRangeInfoKHR{triangle_count, 0, 0, 0};
-            primitive_count[i] = triangle_count;
+            geom.ranges[i] = vk::AccelerationStructureBuildRangeInfoKHR{triangle_count, 0, 0, 0};
+            geom.primitive_count[i] = triangle_count;
         }
         else
         {
-            geom.geometryType = vk::GeometryTypeKHR::eAabbs;
-            geom.geometry.aabbs = vk::AccelerationStructureGeometryAabbsDataKHR(
+            g.geometryType = vk::GeometryTypeKHR::eAabbs;
+            g.geometry.aabbs = vk::AccelerationStructureGeometryAabbsDataKHR(
                 entries[i].aabb_buffer->get_address(id),
                 sizeof(vk::AabbPositionsKHR)
             );
-            ranges[i] = vk::AccelerationStructureBuildRangeInfoKHR{
+            geom.ranges[i] = vk::AccelerationStructureBuildRangeInfoKHR{
                 (uint32_t)entries[i].aabb_count, 0, 0, 0
             };
-            primitive_count[i] = entries[i].aabb_count;
+            geom.primitive_count[i] = entries[i].aabb_count;
         }
 
-        geom.setFlags(entries[i].opaque ?
+        g.setFlags(entries[i].opaque ?
                 vk::GeometryFlagBitsKHR::eOpaque :
                 vk::GeometryFlagBitsKHR::eNoDuplicateAnyHitInvocation
         );
-        geometries[i] = geom;
+        geom.geometries[i] = g;
     }
 
-    vk::AccelerationStructureBuildGeometryInfoKHR blas_info(
+    geom.info = vk::AccelerationStructureBuildGeometryInfoKHR(
         vk::AccelerationStructureTypeKHR::eBottomLevel,
         dynamic ?
             vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild|
@@ -136,27 +253,50 @@ void bottom_level_acceleration_structure::rebuild_from(
             vk::BuildAccelerationStructureModeKHR::eBuild,
         VK_NULL_HANDLE,
         VK_NULL_HANDLE,
-        geometries.size(),
-        geometries.data()
+        geom.geometries.size(),
+        geom.geometries.data()
     );
+}
+
+void bottom_level_acceleration_structure::record_build(
+    device_id id,
+    bottom_level_acceleration_structure& other,
+    size_t frame_index,
+    vk::CommandBuffer cb,
+    const std::vector<entry>& entries,
+    bool update,
+    vk::QueryPool compact_query,
+    uint32_t query_index,
+    vk::DeviceAddress scratch_address
+){
+    if(update) updates_since_rebuild++;
+    else updates_since_rebuild = 0;
+    device& dev = buffers.get_device(id);
+    buffer_data& bd = buffers[id];
+
+    build_geometry geom;
+    get_build_geometry(id, entries, update, geom);
 
     if(!*bd.blas)
     {
         // Need to calculate BLAS size.
         vk::AccelerationStructureBuildSizesInfoKHR size_info = dev.logical.getAccelerationStructureBuildSizesKHR(
-            vk::AccelerationStructureBuildTypeKHR::eDevice, blas_info, primitive_count
-        );
-        vk::BufferCreateInfo scratch_info(
-            {}, size_info.buildScratchSize,
-            vk::BufferUsageFlagBits::eStorageBuffer|
-            vk::BufferUsageFlagBits::eShaderDeviceAddress,
-            vk::SharingMode::eExclusive
+            vk::AccelerationStructureBuildTypeKHR::eDevice, geom.info, geom.primitive_count
         );
-        bd.scratch_buffer = create_buffer_aligned(
-            dev, scratch_info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
-            dev.as_props.minAccelerationStructureScratchOffsetAlignment
-        );
-        bd.scratch_address = bd.scratch_buffer.get_address();
+        if(scratch_address == 0)
+        {
+            vk::BufferCreateInfo scratch_info(
+                {}, size_info.buildScratchSize,
+                vk::BufferUsageFlagBits::eStorageBuffer|
+                vk::BufferUsageFlagBits::eShaderDeviceAddress,
+                vk::SharingMode::eExclusive
+            );
+            bd.scratch_buffer = create_buffer_aligned(
+                dev, scratch_info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+                dev.as_props.minAccelerationStructureScratchOffsetAlignment
+            );
+            bd.scratch_address = bd.scratch_buffer.get_address();
+        }
 
         vk::BufferCreateInfo blas_buffer_info(
             {}, size_info.accelerationStructureSize,
@@ -165,6 +305,7 @@ void bottom_level_acceleration_structure::rebuild_from(
             vk::SharingMode::eExclusive
         );
         bd.blas_buffer = create_buffer(dev, blas_buffer_info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT);
+        bd.build_size = size_info.accelerationStructureSize;
 
         vk::AccelerationStructureCreateInfoKHR create_info(
             {},
@@ -176,96 +317,185 @@ void bottom_level_acceleration_structure::rebuild_from(
         );
         bd.blas = vkm(dev, dev.logical.createAccelerationStructureKHR(create_info));
     }
-    blas_info.srcAccelerationStructure = update ? *other.buffers[id].blas : VK_NULL_HANDLE;
-    blas_info.dstAccelerationStructure = bd.blas;
-    blas_info.scratchData.deviceAddress = bd.scratch_address;
+    geom.info.srcAccelerationStructure = update ? *other.buffers[id].blas : VK_NULL_HANDLE;
+    geom.info.dstAccelerationStructure = bd.blas;
+    geom.info.scratchData.deviceAddress =
+        scratch_address != 0 ? scratch_address : bd.scratch_address;
 
-    const vk::AccelerationStructureBuildRangeInfoKHR* range_ptr = ranges.data();
+    const vk::AccelerationStructureBuildRangeInfoKHR* range_ptr = geom.ranges.data();
 
-    vkm<vk::QueryPool> query_pool;
-    vk::CommandBuffer initial_cb;
-    if(compact)
-    {
-        initial_cb = begin_command_buffer(dev);
-        transform_buffer.upload(id, frame_index, initial_cb);
-        query_pool = vkm(dev, dev.logical.createQueryPool({
-            {},
-            vk::QueryType::eAccelerationStructureCompactedSizeKHR,
-            1,
-            {}
-        }));
-        initial_cb.resetQueryPool(query_pool, 0, 1);
-        initial_cb.buildAccelerationStructuresKHR({blas_info}, range_ptr);
+    transform_buffer.upload(id, frame_index, cb);
+    cb.buildAccelerationStructuresKHR({geom.info}, range_ptr);
 
+    if(compact && !bd.built && compact_query)
+    {
+        // The build is compacted with compact_into() once the compacted size
+        // has been read back.
         vk::MemoryBarrier barrier(
             vk::AccessFlagBits::eAccelerationStructureWriteKHR,
             vk::AccessFlagBits::eAccelerationStructureReadKHR
         );
-        initial_cb.pipelineBarrier(
+        cb.pipelineBarrier(
             vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
             vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
             {}, barrier, {}, {}
         );
 
-        initial_cb.writeAccelerationStructuresPropertiesKHR(
+        cb.writeAccelerationStructuresPropertiesKHR(
             *bd.blas,
             vk::QueryType::eAccelerationStructureCompactedSizeKHR,
-            query_pool,
-            0
-        );
-        end_command_buffer(dev, initial_cb);
-
-        // NVIDIA bug as of 460.27.04: Only the lower 32 bits of the parameter
-        // get written to, despite the spec saying that it's supposed to be a
-        // VkDeviceSize (uint64_t). We need to make sure that the size is
-        // zero-initialized to avoid the higher 32 bits breaking everything.
-        vk::DeviceSize compact_size = 0;
-        (void)dev.logical.getQueryPoolResults(
-            query_pool, 0, 1,
-            sizeof(vk::DeviceSize),
-            &compact_size,
-            sizeof(vk::DeviceSize),
-            vk::QueryResultFlagBits::eWait
+            compact_query,
+            query_index
         );
+    }
+    else bd.built = true;
+    bd.blas_address = dev.logical.getAccelerationStructureAddressKHR({bd.blas});
+}
 
-        vkm<vk::AccelerationStructureKHR> fat_blas = std::move(bd.blas);
-        vkm<vk::Buffer> fat_blas_buffer(std::move(bd.blas_buffer));
+blas_batch::blas_batch(device& dev)
+:   dev(&dev), compact_count(0), build_time(0), uncompacted_size(0),
+    compacted_size(0)
+{
+}
 
-        vk::BufferCreateInfo blas_buffer_info(
-            {}, compact_size,
-            vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|
+void blas_batch::add(
+    bottom_level_acceleration_structure& blas,
+    const std::vector<bottom_level_acceleration_structure::entry>& entries
+){
+    items.push_back({&blas, entries});
+}
+
+size_t blas_batch::size() const
+{
+    return items.size();
+}
+
+void blas_batch::record_build(size_t frame_index, vk::CommandBuffer cb)
+{
+    start = std::chrono::steady_clock::now();
+
+    // Compacted BLASes are static, so they only need scratch memory for this
+    // one build. They share a single scratch buffer for the whole batch.
+    vk::DeviceSize scratch_alignment =
+        dev->as_props.minAccelerationStructureScratchOffsetAlignment;
+    vk::DeviceSize scratch_size = 0;
+    std::vector<vk::DeviceSize> scratch_offsets(items.size(), 0);
+    compact_count = 0;
+    for(size_t i = 0; i < items.size(); ++i)
+    {
+        if(!items[i].blas->is_compact()) continue;
+        scratch_offsets[i] = scratch_size;
+        scratch_size += items[i].blas->get_build_scratch_size(dev->id, items[i].entries);
+        scratch_size = (scratch_size + scratch_alignment - 1) / scratch_alignment * scratch_alignment;
+        compact_count++;
+    }
+
+    vk::DeviceAddress scratch_address = 0;
+    if(compact_count != 0)
+    {
+        vk::BufferCreateInfo scratch_info(
+            {}, scratch_size,
+            vk::BufferUsageFlagBits::eStorageBuffer|
             vk::BufferUsageFlagBits::eShaderDeviceAddress,
             vk::SharingMode::eExclusive
         );
+        scratch_buffer = create_buffer_aligned(
+            *dev, scratch_info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+            scratch_alignment
+        );
+        scratch_address = scratch_buffer.get_address();
 
-        bd.blas_buffer = create_buffer(dev, blas_buffer_info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT);
-        vk::AccelerationStructureCreateInfoKHR create_info(
+        query_pool = vkm(*dev, dev->logical.createQueryPool({
             {},
-            bd.blas_buffer,
-            {},
-            compact_size,
-            vk::AccelerationStructureTypeKHR::eBottomLevel,
+            vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+            (uint32_t)compact_count,
             {}
-        );
+        }));
+        cb.resetQueryPool(query_pool, 0, compact_count);
+    }
 
-        bd.blas = vkm(dev, dev.logical.createAccelerationStructureKHR(create_info));
-        blas_info.dstAccelerationStructure = bd.blas;
+    uint32_t query_index = 0;
+    for(size_t i = 0; i < items.size(); ++i)
+    {
+        bottom_level_acceleration_structure& blas = *items[i].blas;
+        if(blas.is_compact())
+        {
+            blas.build(
+                dev->id, frame_index, cb, items[i].entries,
+                query_pool, query_index++, scratch_address + scratch_offsets[i]
+            );
+            uncompacted_size += blas.get_build_size(dev->id);
+        }
+        else blas.build(dev->id, frame_index, cb, items[i].entries);
+        // The meshes may be gone by the time the compaction is recorded.
+        items[i].entries.clear();
+    }
+}
 
-        cb.copyAccelerationStructureKHR({
-            fat_blas,
-            bd.blas,
-            vk::CopyAccelerationStructureModeKHR::eCompact
-        });
+bool blas_batch::record_compaction(vk::CommandBuffer cb, bool wait)
+{
+    if(compact_count == 0)
+        return true;
+
+    // Zero-initialized due to an old NVIDIA bug, where only the lower 32 bits
+    // were written.
+    std::vector<vk::DeviceSize> sizes(compact_count, 0);
+    vk::Result res = dev->logical.getQueryPoolResults(
+        query_pool, 0, compact_count,
+        sizes.size() * sizeof(vk::DeviceSize),
+        sizes.data(),
+        sizeof(vk::DeviceSize),
+        vk::QueryResultFlagBits::e64 |
+        (wait ? vk::QueryResultFlagBits::eWait : vk::QueryResultFlagBits{})
+    );
+    if(res == vk::Result::eNotReady)
+        return false;
+
+    vk::DeviceSize total_size = 0;
+    for(vk::DeviceSize size: sizes)
+        total_size += align_as_offset(size);
+
+    vk::BufferCreateInfo storage_info(
+        {}, total_size,
+        vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR|
+        vk::BufferUsageFlagBits::eShaderDeviceAddress,
+        vk::SharingMode::eExclusive
+    );
+    auto storage = std::make_shared<vkm<vk::Buffer>>(
+        create_buffer(*dev, storage_info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT)
+    );
 
-        fat_blas.drop();
-        fat_blas_buffer.drop();
-    }
-    else
+    vk::DeviceSize offset = 0;
+    size_t query_index = 0;
+    for(item& it: items)
     {
-        transform_buffer.upload(id, frame_index, cb);
-        cb.buildAccelerationStructuresKHR({blas_info}, range_ptr);
+        if(!it.blas->is_compact()) continue;
+        vk::DeviceSize size = sizes[query_index++];
+        it.blas->compact_into(dev->id, cb, size, storage, offset);
+        offset += align_as_offset(size);
     }
-    bd.blas_address = dev.logical.getAccelerationStructureAddressKHR({bd.blas});
+    compacted_size = total_size;
+    compact_count = 0;
+
+    query_pool.drop();
+    scratch_buffer.drop();
+    build_time = std::chrono::steady_clock::now() - start;
+    return true;
+}
+
+double blas_batch::get_build_time_ms() const
+{
+    return std::chrono::duration<double, std::milli>(build_time).count();
+}
+
+vk::DeviceSize blas_batch::get_uncompacted_size() const
+{
+    return uncompacted_size;
+}
+
+vk::DeviceSize blas_batch::get_compacted_size() const
+{
+    return compacted_size;
 }
 
 size_t bottom_level_acceleration_structure::get_updates_since_rebuild() const
@@ -4,6 +4,8 @@
 #include "transformable.hh"
 #include "gpu_buffer.hh"
 #include "vkm.hh"
+#include <chrono>
+#include <memory>
 
 namespace tr
 {
@@ -24,14 +26,50 @@ public:
         bool opaque = true;
     };
 
+    // With defer_build, nothing is built in the constructor. Build it through
+    // a blas_batch instead; it can be used once is_built() returns true.
     bottom_level_acceleration_structure(
         device_mask dev,
         const std::vector<entry>& entries,
         bool backface_culled,
         bool dynamic,
-        bool compact
+        bool compact,
+        bool defer_build = false
     );
 
+    // Records the initial build. Compacted BLASes write their compacted size
+    // to 'compact_query' and are only usable after compact_into(). A non-zero
+    // scratch_address replaces the scratch buffer of this BLAS for this
+    // build.
+    void build(
+        device_id id,
+        size_t frame_index,
+        vk::CommandBuffer cb,
+        const std::vector<entry>& entries,
+        vk::QueryPool compact_query = {},
+        uint32_t query_index = 0,
+        vk::DeviceAddress scratch_address = 0
+    );
+    vk::DeviceSize get_build_scratch_size(
+        device_id id,
+        const std::vector<entry>& entries
+    ) const;
+    // 'storage' is shared with other compacted BLASes, 'offset' must be
+    // aligned to 256 bytes.
+    void compact_into(
+        device_id id,
+        vk::CommandBuffer cb,
+        vk::DeviceSize compact_size,
+        const std::shared_ptr<vkm<vk::Buffer>>& storage,
+        vk::DeviceSize offset
+    );
+    bool is_compact() const;
+    // True once the build has been recorded on all devices, including the
+    // compaction.
+    bool is_built() const;
+    // Size before compaction.
+    vk::DeviceSize get_build_size(device_id id) const;
+
     void update_transforms(
         size_t frame_index,
         const std::vector<entry>& entries
@@ -52,6 +90,8 @@ public:
         const std::vector<entry>& entries,
         bool update = true
     );
+    // Counts recorded updates, so a command buffer that is replayed on many
+    // frames only counts once.
     size_t get_updates_since_rebuild() const;
     vk::AccelerationStructureKHR get_blas_handle(device_id id) const;
     vk::DeviceAddress get_blas_address(device_id id) const;
@@ -60,6 +100,31 @@ public:
     bool is_backface_culled() const;
 
 private:
+    struct build_geometry
+    {
+        std::vector<vk::AccelerationStructureGeometryKHR> geometries;
+        std::vector<vk::AccelerationStructureBuildRangeInfoKHR> ranges;
+        std::vector<uint32_t> primitive_count;
+        vk::AccelerationStructureBuildGeometryInfoKHR info;
+    };
+    void get_build_geometry(
+        device_id id,
+        const std::vector<entry>& entries,
+        bool update,
+        build_geometry& geom
+    ) const;
+    void record_build(
+        device_id id,
+        bottom_level_acceleration_structure& other,
+        size_t frame_index,
+        vk::CommandBuffer cb,
+        const std::vector<entry>& entries,
+        bool update,
+        vk::QueryPool compact_query,
+        uint32_t query_index,
+        vk::DeviceAddress scratch_address
+    );
+
     size_t updates_since_rebuild;
     size_t geometry_count;
     bool backface_culled;
@@ -73,12 +138,60 @@ private:
         vkm<vk::AccelerationStructureKHR> blas;
         vkm<vk::Buffer> blas_buffer;
         vk::DeviceAddress blas_address;
+        // Compacted BLASes live in a buffer shared with the rest of their
+        // batch instead of blas_buffer.
+        std::shared_ptr<vkm<vk::Buffer>> shared_blas_buffer;
+        vk::DeviceSize build_size = 0;
         vkm<vk::Buffer> scratch_buffer;
-        vk::DeviceAddress scratch_address;
+        vk::DeviceAddress scratch_address = 0;
+        bool built = false;
     };
     per_device<buffer_data> buffers;
 };
 
+// Builds a set of BLASes on one device together. Compacted BLASes share one
+// scratch buffer during the build, their compacted sizes are read back with a
+// single query pool, and the compacted BLASes are sub-allocated from one
+// buffer.
+class blas_batch
+{
+public:
+    blas_batch(device& dev);
+
+    // The BLAS must outlive the batch.
+    void add(
+        bottom_level_acceleration_structure& blas,
+        const std::vector<bottom_level_acceleration_structure::entry>& entries
+    );
+    size_t size() const;
+
+    void record_build(size_t frame_index, vk::CommandBuffer cb);
+    // Must be submitted after the command buffer from record_build(). Returns
+    // false if the compacted sizes aren't available yet without 'wait'.
+    bool record_compaction(vk::CommandBuffer cb, bool wait = false);
+
+    // Time from record_build() until the compaction was recorded.
+    double get_build_time_ms() const;
+    vk::DeviceSize get_uncompacted_size() const;
+    vk::DeviceSize get_compacted_size() const;
+
+private:
+    struct item
+    {
+        bottom_level_acceleration_structure* blas;
+        std::vector<bottom_level_acceleration_structure::entry> entries;
+    };
+    device* dev;
+    std::vector<item> items;
+    size_t compact_count;
+    vkm<vk::QueryPool> query_pool;
+    vkm<vk::Buffer> scratch_buffer;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::duration build_time;
+    vk::DeviceSize uncompacted_size;
+    vk::DeviceSize compacted_size;
+};
+
 class top_level_acceleration_structure
 {
 public:
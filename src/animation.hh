@@ -28,6 +28,15 @@ public:
         CUBICSPLINE
     };
 
+    // The keyframe each channel was at on the previous apply(). Playing
+    // forward from there takes constant time instead of a binary search.
+    struct cursor
+    {
+        uint32_t position = 0;
+        uint32_t scaling = 0;
+        uint32_t orientation = 0;
+    };
+
     animation();
 
     void set_position(
@@ -46,25 +55,37 @@ public:
     );
 
     void apply(transformable& node, time_ticks time) const;
+    void apply(transformable& node, time_ticks time, cursor& cur) const;
     time_ticks get_loop_time() const;
 
 private:
+    // Timestamps are kept apart from the values, so that finding the
+    // keyframes only reads the timestamps.
+    template<typename T>
+    struct channel
+    {
+        interpolation interp = LINEAR;
+        std::vector<time_ticks> timestamps;
+        std::vector<T> values;
+        // In and out tangents of each keyframe, only for CUBICSPLINE.
+        std::vector<T> tangents;
+
+        void set(interpolation interp, std::vector<sample<T>>&& samples);
+    };
+
     void determine_loop_time();
 
     template<typename T>
     T interpolate(
         time_ticks time,
-        const std::vector<sample<T>>& data,
-        interpolation interp
+        const channel<T>& ch,
+        uint32_t& cursor
     ) const;
 
     time_ticks loop_time;
-    interpolation position_interpolation;
-    std::vector<sample<vec3>> position;
-    interpolation scaling_interpolation;
-    std::vector<sample<vec3>> scaling;
-    interpolation orientation_interpolation;
-    std::vector<sample<quat>> orientation;
+    channel<vec3> position;
+    channel<vec3> scaling;
+    channel<quat> orientation;
 };
 
 // std::map used for alphabetical order.
@@ -133,6 +154,7 @@ protected:
 private:
     const animation_pool* pool;
     const animation* cur_anim;
+    animation::cursor cur_cursor;
 };
 
 }
@@ -35,39 +35,71 @@ struct numeric_mixer<glm::qua<T, Q>>
     }
 };
 
+template<typename T>
+void animation::channel<T>::set(
+    interpolation interp,
+    std::vector<sample<T>>&& samples
+){
+    this->interp = interp;
+    timestamps.resize(samples.size());
+    values.resize(samples.size());
+    tangents.clear();
+    for(size_t i = 0; i < samples.size(); ++i)
+    {
+        timestamps[i] = samples[i].timestamp;
+        values[i] = samples[i].data;
+        if(interp == CUBICSPLINE)
+        {
+            tangents.push_back(samples[i].in_tangent);
+            tangents.push_back(samples[i].out_tangent);
+        }
+    }
+}
+
 template<typename T>
 T animation::interpolate(
     time_ticks time,
-    const std::vector<sample<T>>& data,
-    interpolation interp
+    const channel<T>& ch,
+    uint32_t& cursor
 ) const
 {
-    auto it = std::upper_bound(
-        data.begin(), data.end(), time,
-        [](time_ticks time, const sample<T>& s){ return time < s.timestamp; }
-    );
-    if(it == data.end()) return data.back().data;
-    if(it == data.begin()) return data.front().data;
-
-    auto prev = it-1;
-    float frame_ticks = it->timestamp-prev->timestamp;
-    float ratio = (time-prev->timestamp)/frame_ticks;
-    switch(interp)
+    // 'next' is the first keyframe after 'time'. When playing forward, it is
+    // at most a few keyframes past the cursor.
+    const std::vector<time_ticks>& ts = ch.timestamps;
+    size_t next = cursor;
+    if(next > ts.size() || (next != 0 && ts[next-1] > time))
+        next = std::upper_bound(ts.begin(), ts.end(), time) - ts.begin();
+    else
+    {
+        size_t scan_end = std::min(next + 4, ts.size());
+        while(next < scan_end && ts[next] <= time) ++next;
+        if(next == scan_end && next < ts.size() && ts[next] <= time)
+            next = std::upper_bound(ts.begin()+next, ts.end(), time)-ts.begin();
+    }
+    cursor = next;
+
+    if(next == ts.size()) return ch.values.back();
+    if(next == 0) return ch.values.front();
+
+    size_t prev = next-1;
+    float frame_ticks = ts[next]-ts[prev];
+    float ratio = (time-ts[prev])/frame_ticks;
+    switch(ch.interp)
     {
     default:
     case LINEAR:
-        return numeric_mixer<T>()(prev->data, it->data, ratio);
+        return numeric_mixer<T>()(ch.values[prev], ch.values[next], ratio);
     case STEP:
-        return prev->data;
+        return ch.values[prev];
     case CUBICSPLINE:
         {
             // Scale factor has to use seconds unfortunately.
             float scale = frame_ticks * 0.000001f;
             return cubic_spline(
-                prev->data,
-                prev->out_tangent*scale,
-                it->data,
-                it->in_tangent*scale,
+                ch.values[prev],
+                ch.tangents[prev*2+1]*scale,
+                ch.values[next],
+                ch.tangents[next*2]*scale,
                 ratio
             );
         }
@@ -124,7 +124,7 @@ std::unique_ptr<texture> read_texture(
         // If height is set to 0, the texture is compressed, stbi handles that
         if (ai_texture->mHeight == 0)
         {
-            stbi_set_flip_vertically_on_load(false);
+            stbi_set_flip_vertically_on_load_thread(false);
             unsigned char *data = stbi_load_from_memory(
                 reinterpret_cast<unsigned char*>(ai_texture->pcData),
                 ai_texture->mWidth, &width, &height, &components, 4
@@ -67,5 +67,28 @@ void basic_pipeline::load_shader_module(
     stages.push_back({{}, stage, mod, "main", specialization.pData != nullptr ? &specialization : nullptr});
 }
 
+const void* basic_pipeline::begin_cache_feedback(uint32_t stage_count)
+{
+    if(!dev->has_pipeline_creation_feedback) return nullptr;
+    feedback = vk::PipelineCreationFeedbackEXT();
+    stage_feedback.assign(stage_count, vk::PipelineCreationFeedbackEXT());
+    feedback_info = vk::PipelineCreationFeedbackCreateInfoEXT(
+        &feedback, stage_feedback.size(), stage_feedback.data()
+    );
+    return &feedback_info;
+}
+
+void basic_pipeline::end_cache_feedback()
+{
+    if(
+        !dev->has_pipeline_creation_feedback ||
+        !(feedback.flags & vk::PipelineCreationFeedbackFlagBitsEXT::eValid)
+    ) return;
+
+    if(feedback.flags & vk::PipelineCreationFeedbackFlagBitsEXT::eApplicationPipelineCacheHit)
+        dev->pp_cache_hits++;
+    else dev->pp_cache_misses++;
+}
+
 
 }
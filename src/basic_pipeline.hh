@@ -52,6 +52,13 @@ protected:
         std::vector<vk::PipelineShaderStageCreateInfo>& stages,
         const vk::SpecializationInfo& specialization
     );
+    // Returns the pNext for a pipeline create info with the given number of
+    // stages, or nullptr if creation feedback isn't supported. Call
+    // end_cache_feedback() after creating the pipeline to count whether it
+    // was found in the pipeline cache.
+    const void* begin_cache_feedback(uint32_t stage_count);
+    void end_cache_feedback();
+
     device* dev;
     vk::PipelineBindPoint bind_point;
     vkm<vk::Pipeline> pipeline;
@@ -59,6 +66,9 @@ protected:
 
 private:
     std::vector<vk::PushConstantRange> push_constant_ranges;
+    vk::PipelineCreationFeedbackEXT feedback;
+    std::vector<vk::PipelineCreationFeedbackEXT> stage_feedback;
+    vk::PipelineCreationFeedbackCreateInfoEXT feedback_info;
 };
 
 }
@@ -36,23 +36,27 @@ bmfr_stage::bmfr_stage(
     bmfr_accumulate_output_timer(dev, "accumulated output(" + std::to_string(current_features.get_layer_count()) + " viewports)"),
     image_copy_timer(dev, "image copy(" + std::to_string(current_features.get_layer_count()) + " viewports)")
 {
+    auto preprocess_src = load_shader_source("shader/bmfr_preprocess.comp", opt);
+    auto fit_src = load_shader_source("shader/bmfr_fit.comp", opt);
+    auto weighted_sum_src = load_shader_source("shader/bmfr_weighted_sum.comp", opt);
+    auto accumulate_output_src = load_shader_source("shader/bmfr_accumulate_output.comp", opt);
     {
-        shader_source src = load_shader_source("shader/bmfr_preprocess.comp", opt);
+        const shader_source& src = preprocess_src.get();
         bmfr_preprocess_desc.add(src);
         bmfr_preprocess_comp.init(src, {&bmfr_preprocess_desc});
     }
     {
-        shader_source src = load_shader_source("shader/bmfr_fit.comp", opt);
+        const shader_source& src = fit_src.get();
         bmfr_fit_desc.add(src);
         bmfr_fit_comp.init(src, {&bmfr_fit_desc});
     }
     {
-        shader_source src = load_shader_source("shader/bmfr_weighted_sum.comp", opt);
+        const shader_source& src = weighted_sum_src.get();
         bmfr_weighted_sum_desc.add(src);
         bmfr_weighted_sum_comp.init(src, {&bmfr_weighted_sum_desc});
     }
     {
-        shader_source src = load_shader_source("shader/bmfr_accumulate_output.comp", opt);
+        const shader_source& src = accumulate_output_src.get();
         bmfr_accumulate_output_desc.add(src);
         bmfr_accumulate_output_comp.init(src, {&bmfr_accumulate_output_desc});
     }
@@ -60,7 +64,7 @@ bmfr_stage::bmfr_stage(
     record_command_buffers();
 }
 
-shader_source bmfr_stage::load_shader_source(const std::string& path, const options& opt)
+std::shared_future<shader_source> bmfr_stage::load_shader_source(const std::string& path, const options& opt)
 {
     std::map<std::string, std::string> defines = {};
     if (opt.settings == bmfr_settings::DIFFUSE_ONLY)
@@ -75,7 +79,7 @@ shader_source bmfr_stage::load_shader_source(const std::string& path, const opti
         defines.insert({ "NUM_WEIGHTS_PER_FEATURE", "2" });
     }
 
-    return shader_source(path, defines);
+    return shader_source::compile_async(path, defines);
 }
 
 void bmfr_stage::init_resources()
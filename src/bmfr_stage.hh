@@ -38,7 +38,7 @@ public:
 private:
     void init_resources();
     void record_command_buffers();
-    static shader_source load_shader_source(const std::string& path, const options& opt);
+    static std::shared_future<shader_source> load_shader_source(const std::string& path, const options& opt);
 
     void copy_image(vk::CommandBuffer& cb, render_target& src, render_target& dst);
 
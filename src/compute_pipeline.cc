@@ -26,8 +26,10 @@ void compute_pipeline::init(
         {}, {{}, vk::ShaderStageFlagBits::eCompute, comp, "main"},
         pipeline_layout, {}, 0
     );
+    pipeline_info.pNext = begin_cache_feedback(1);
 
     pipeline = vkm(*dev, dev->logical.createComputePipeline(dev->pp_cache, pipeline_info).value);
+    end_cache_feedback();
 }
 
 }
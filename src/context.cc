@@ -4,6 +4,7 @@
 #include "log.hh"
 #include "radix_sort/radix_sort_vk.h"
 #include <iostream>
+#include <filesystem>
 
 VULKAN_HPP_DEFAULT_DISPATCH_LOADER_DYNAMIC_STORAGE
 
@@ -64,6 +65,47 @@ bool has_extensions(
     return true;
 }
 
+// Pipeline caches are only valid for the exact device and driver that created
+// them, so those are in the file name.
+std::string get_pipeline_cache_file(
+    const std::string& dir,
+    const vk::PhysicalDeviceProperties& props
+){
+    std::string name = "pipeline_";
+    char buf[32];
+    snprintf(
+        buf, sizeof(buf), "%08x_%08x_%08x_",
+        props.vendorID, props.deviceID, props.driverVersion
+    );
+    name += buf;
+    for(uint8_t byte: props.pipelineCacheUUID)
+    {
+        snprintf(buf, sizeof(buf), "%02x", byte);
+        name += buf;
+    }
+    name += ".bin";
+    return (std::filesystem::path(dir)/name).string();
+}
+
+// Drivers should reject incompatible data themselves, but not all of them
+// are robust against garbage. This checks the header defined by the spec.
+bool is_compatible_pipeline_cache(
+    const std::string& data,
+    const vk::PhysicalDeviceProperties& props
+){
+    uint32_t header[4];
+    constexpr size_t header_size = sizeof(header) + VK_UUID_SIZE;
+    if(data.size() < header_size) return false;
+    memcpy(header, data.data(), sizeof(header));
+    return header[0] >= header_size &&
+        header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        header[2] == props.vendorID &&
+        header[3] == props.deviceID &&
+        memcmp(
+            data.data() + sizeof(header), props.pipelineCacheUUID, VK_UUID_SIZE
+        ) == 0;
+}
+
 }
 
 namespace tr
@@ -523,6 +565,16 @@ void context::init_devices()
             );
         }
 
+        if(has_extension(
+            VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME,
+            available_extensions
+        )){
+            enabled_device_extensions.push_back(
+                VK_EXT_PIPELINE_CREATION_FEEDBACK_EXTENSION_NAME
+            );
+            dev_data.has_pipeline_creation_feedback = true;
+        }
+
         radix_sort_vk_target_t* rs_target = radix_sort_vk_target_auto_detect(
             (VkPhysicalDeviceProperties*)&props,
             (VkPhysicalDeviceSubgroupProperties*)&subgroup_props,
@@ -652,7 +704,26 @@ void context::init_devices()
             dev_data.transfer_pool = dev_data.logical.createCommandPool(
                 {{}, dev_data.transfer_family_index}
             );
+            std::string pp_cache_data;
+            if(opt.pipeline_cache_path.size() != 0)
+            {
+                std::string path = get_pipeline_cache_file(
+                    opt.pipeline_cache_path, props
+                );
+                if(
+                    try_load_binary_file(path, pp_cache_data) &&
+                    !is_compatible_pipeline_cache(pp_cache_data, props)
+                ){
+                    TR_WARN("Ignoring incompatible pipeline cache ", path);
+                    pp_cache_data.clear();
+                }
+                TR_LOG(
+                    "Loaded ", pp_cache_data.size(),
+                    " bytes of pipeline cache for ", props.deviceName
+                );
+            }
             dev_data.pp_cache = dev_data.logical.createPipelineCache({
+                {}, pp_cache_data.size(), pp_cache_data.data()
             });
 
             VmaAllocatorCreateInfo allocator_info = {};
@@ -675,6 +746,27 @@ void context::deinit_devices()
     sync();
     for(device& dev_data: devices)
     {
+        if(opt.pipeline_cache_path.size() != 0)
+        {
+            std::vector<uint8_t> data =
+                dev_data.logical.getPipelineCacheData(dev_data.pp_cache);
+            // Fake devices share the same physical device, so only the first
+            // one needs to be written.
+            if(dev_data.id < devices.size() / max(opt.fake_device_multiplier, 1u))
+            {
+                std::string path = get_pipeline_cache_file(
+                    opt.pipeline_cache_path, dev_data.props
+                );
+                if(!write_file_atomically(path, data.data(), data.size()))
+                    TR_WARN("Failed to write pipeline cache ", path);
+            }
+        }
+        if(dev_data.has_pipeline_creation_feedback)
+            TR_LOG(
+                "Pipeline cache for ", dev_data.props.deviceName, ": ",
+                dev_data.pp_cache_hits, " hits, ",
+                dev_data.pp_cache_misses, " misses"
+            );
         dev_data.logical.destroyPipelineCache(dev_data.pp_cache);
         dev_data.logical.destroyCommandPool(dev_data.graphics_pool);
         dev_data.logical.destroyCommandPool(dev_data.compute_pool);
@@ -40,6 +40,9 @@ public:
         unsigned max_timestamps = 0;
         bool enable_vulkan_validation = false;
         unsigned fake_device_multiplier = 0;
+        // The pipeline cache of each device is loaded from this directory at
+        // startup and written back on exit. Empty disables this.
+        std::string pipeline_cache_path = "";
     };
 
     context(const options& opt);
@@ -45,6 +45,11 @@ struct device
     vk::CommandPool present_pool;
     vk::CommandPool transfer_pool;
     vk::PipelineCache pp_cache;
+    // Pipeline cache hits can only be counted with
+    // VK_EXT_pipeline_creation_feedback.
+    bool has_pipeline_creation_feedback = false;
+    size_t pp_cache_hits = 0;
+    size_t pp_cache_misses = 0;
     VmaAllocator allocator;
 };
 
@@ -1,6 +1,7 @@
 #include "dshgi_client.hh"
 #include "misc.hh"
-#include <czmq.h>
+#include "log.hh"
+#include "sh_grid_codec.hh"
 
 namespace
 {
@@ -310,8 +311,8 @@ bool dshgi_client::refresh()
         if(lg.topo_changed)
         {
             reset = true;
-            *lg.grid = *rg.grid;
-            *lg.transform = *rg.transform;
+            *lg.grid = rg.params;
+            lg.transform->set_transform(rg.params_transform);
         }
         lg.data_updated |= rg.data_updated;
         rg.data_updated = false;
@@ -359,99 +360,128 @@ dependencies dshgi_client::render(dependencies deps)
 
 void dshgi_client::receiver_worker(dshgi_client* s)
 {
-    zsys_handler_set(nullptr);
-    zsock_t* socket = zsock_new(ZMQ_SUB);
-    zsock_set_subscribe(socket, "sh_grid ");
-    zsock_set_subscribe(socket, "sh_grid_count ");
-    zsock_set_subscribe(socket, "timestamp ");
-    int err = zsock_connect(socket, "tcp://%s", s->opt.server_address.c_str());
-    if(err < 0)
-        throw std::runtime_error(strerror(errno));
-
-    zpoller_t* poller = zpoller_new(socket, nullptr);
-
-    for(;;)
+    using namespace std::chrono_literals;
+    std::unique_ptr<dshgi_subscriber> subscriber = create_dshgi_subscriber(
+        s->opt.transport, s->opt.server_address
+    );
+
+    dshgi_message msg;
+    std::vector<sh_grid_decoder> decoders;
+    sh_grid_stream_stats stats;
+    sh_grid_codec codec = sh_grid_codec::FP16;
+    size_t frame_raw_bytes = 0;
+    size_t frame_received_bytes = 0;
+
+    while(!s->exit_receiver)
     {
-        while(zpoller_wait(poller, 100) == nullptr)
+        if(!subscriber->receive(msg, 100ms))
+            continue;
+
+        // The lost messages may have had deltas for any grid.
+        if(msg.get_follows_loss())
         {
-            if(s->exit_receiver)
-                break;
+            for(sh_grid_decoder& decoder: decoders)
+                decoder.reset();
         }
-        if(s->exit_receiver)
-            break;
-        zmsg_t* msg = zmsg_recv(socket);
-        zframe_t* frame = zmsg_first(msg);
-        if(zframe_streq(frame, "sh_grid "))
+
+        const std::string& topic = msg.get_topic();
+        if(topic == "sh_grid ")
         {
             uint32_t index = 0;
-            frame = zmsg_next(msg);
-            memcpy(&index, zframe_data(frame), sizeof(index));
             int32_t order = 0;
-            frame = zmsg_next(msg);
-            memcpy(&order, zframe_data(frame), sizeof(order));
             float radius = 0;
-            frame = zmsg_next(msg);
-            memcpy(&radius, zframe_data(frame), sizeof(radius));
             mat4 transform = mat4(1);
-            frame = zmsg_next(msg);
-            memcpy(&transform, zframe_data(frame), sizeof(transform));
             puvec3 res = puvec3(1);
-            frame = zmsg_next(msg);
-            memcpy(&res, zframe_data(frame), sizeof(res));
             VkFormat fmt;
-            frame = zmsg_next(msg);
-            memcpy(&fmt, zframe_data(frame), sizeof(fmt));
+            uint32_t header_data[4] = {};
+            if(
+                msg.get_part_count() != 8 ||
+                !msg.read(0, index) ||
+                !msg.read(1, order) ||
+                !msg.read(2, radius) ||
+                !msg.read(3, transform) ||
+                !msg.read(4, res) ||
+                !msg.read(5, fmt) ||
+                !msg.read(6, header_data)
+            ) continue;
+
+            sh_grid_header header;
+            header.codec = (sh_grid_codec)header_data[0];
+            header.frame_index = header_data[1];
+            header.brick_count = header_data[2];
+            header.keyframe = header_data[3] & SH_GRID_STREAM_KEYFRAME_BIT;
+            header.raw = header_data[3] & SH_GRID_STREAM_RAW_BIT;
 
             //printf("sh_grid %u %d %f %ux%ux%u\n", index, order, radius, res.x, res.y, res.z);
 
-            frame = zmsg_next(msg);
+            // Deltas are applied here, so the rest of the client only ever
+            // sees complete grids.
+            if(index >= decoders.size())
+                decoders.resize(index+1);
+            sh_grid_decoder& decoder = decoders[index];
+            bool decoded = decoder.decode(
+                header, uvec3(res), sh_grid::get_coef_count(order),
+                msg.get_part_data(7), msg.get_part_size(7)
+            );
+            frame_raw_bytes += decoder.get_texels().size() * sizeof(uint16_t);
+            frame_received_bytes += msg.get_size();
+            codec = header.codec;
 
             std::unique_lock lk(s->remote_grids_mutex);
             if(index >= s->remote_grids.size())
                 s->remote_grids.resize(index+1);
 
             sh_grid_data& gd = s->remote_grids[index];
-            if(gd.grid->get_order() != order)
+            if(gd.params.get_order() != order)
             {
-                gd.grid->set_order(order);
+                gd.params.set_order(order);
                 gd.topo_changed = true;
             }
-            gd.grid->set_radius(order);
-            gd.transform->set_transform(transform);
-            if(gd.grid->get_resolution() != uvec3(res))
+            gd.params.set_radius(radius);
+            gd.params_transform = transform;
+            if(gd.params.get_resolution() != uvec3(res))
             {
-                gd.grid->set_resolution(res);
+                gd.params.set_resolution(res);
                 gd.topo_changed = true;
             }
-            gd.data_updated = true;
-            gd.data.resize(zframe_size(frame));
-            memcpy(gd.data.data(), zframe_data(frame), gd.data.size());
+            if(decoded)
+            {
+                const std::vector<uint16_t>& texels = decoder.get_texels();
+                gd.data_updated = true;
+                gd.data.resize(texels.size() * sizeof(uint16_t));
+                memcpy(gd.data.data(), texels.data(), gd.data.size());
+            }
         }
-        if(zframe_streq(frame, "sh_grid_count "))
+        else if(topic == "sh_grid_count ")
         {
             uint32_t count = 0;
-            frame = zmsg_next(msg);
-            memcpy(&count, zframe_data(frame), sizeof(count));
+            if(!msg.read(0, count)) continue;
             //printf("sh_grid_count %u\n", count);
             std::unique_lock lk(s->remote_grids_mutex);
             // Only scale down here!
             if(count < s->remote_grids.size())
                 s->remote_grids.resize(count);
         }
-        if(zframe_streq(frame, "timestamp "))
+        else if(topic == "timestamp ")
         {
+            // The server starts each frame with its timestamp.
+            if(frame_received_bytes != 0)
+                stats.add(frame_raw_bytes, frame_received_bytes);
+            frame_raw_bytes = 0;
+            frame_received_bytes = 0;
+            std::string report = stats.report(
+                "Received SH grids", codec, 0, 5s
+            );
+            if(report.size()) TR_LOG(report);
+
             time_ticks timestamp = 0;
-            frame = zmsg_next(msg);
-            memcpy(&timestamp, zframe_data(frame), sizeof(timestamp));
+            if(!msg.read(0, timestamp)) continue;
             //printf("timestamp %lu\n", timestamp);
             std::unique_lock lk(s->remote_grids_mutex);
             s->remote_timestamp = timestamp;
             s->new_remote_timestamp = true;
         }
-        zmsg_destroy(&msg);
     }
-    zpoller_destroy(&poller);
-    zsock_destroy(&socket);
 }
 
 }
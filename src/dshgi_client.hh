@@ -6,6 +6,7 @@
 #include "scene_stage.hh"
 #include "compute_pipeline.hh"
 #include "sh_grid.hh"
+#include "dshgi_transport.hh"
 #include <condition_variable>
 #include <thread>
 #include <mutex>
@@ -23,6 +24,7 @@ public:
     struct options
     {
         std::string server_address;
+        dshgi_transport_options transport;
     };
 
     dshgi_client(context& ctx, scene_stage& ss, const options& opt);
@@ -46,9 +48,13 @@ private:
     {
         bool topo_changed = true;
         bool data_updated = true;
+        // Only set for local grids. Remote grids are just the parameters
+        // received from the server.
         entity id = INVALID_ENTITY;
         sh_grid* grid = nullptr;
         transformable* transform = nullptr;
+        sh_grid params;
+        mat4 params_transform = mat4(1);
         std::vector<uint8_t> data;
     };
     std::vector<sh_grid_data> remote_grids;
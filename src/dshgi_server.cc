@@ -4,7 +4,6 @@
 #include "log.hh"
 #include <thread>
 #include <iostream>
-#include <czmq.h>
 
 namespace tr
 {
@@ -133,6 +132,7 @@ dshgi_server::~dshgi_server()
 
 void dshgi_server::set_scene(scene* s)
 {
+    cur_scene = s;
     scene_update->set_scene(s);
     update_event.emplace(s->subscribe([&](scene&, const animation_update_event& ev){
         timestamp = ev.reset ? ev.delta : timestamp + ev.delta;
@@ -156,9 +156,19 @@ void dshgi_server::render()
         }
 
         deps = sh->render(deps);
+
+        queued_frame frame{deps, timestamp, {}};
+        cur_scene->foreach([&](transformable& t, sh_grid& grid){
+            const texture& tex = scene_update->get_sh_grid_textures().at(&grid);
+            frame.grids.push_back({
+                &grid, grid.get_order(), grid.get_radius(),
+                t.get_global_transform(), grid.get_resolution(),
+                grid.get_coef_count(), (VkFormat)tex.get_format()
+            });
+        });
         {
             std::unique_lock lk(frame_queue_mutex);
-            frame_queue.emplace_back(deps);
+            frame_queue.emplace_back(std::move(frame));
         }
         frame_queue_cv.notify_one();
         deps = sh_grid_to_cpu->run(deps);
@@ -170,37 +180,36 @@ void dshgi_server::render()
 
 void dshgi_server::sender_worker(dshgi_server* s)
 {
-    zsys_handler_set(nullptr);
-    zsock_t* socket = zsock_new(ZMQ_XPUB);
-    int rate_limit = 1000000; // 1 Gbps rate limit for now.
-    zsock_set_rate(socket, rate_limit);
-    // TODO: Try PGM or NORM with multiple clients, they have multicast so they
-    // may be faster!
-    int err = zsock_bind(socket, "tcp://*:%d", (int)s->opt.port_number);
-    if(err < 0)
-        throw std::runtime_error(strerror(errno));
+    using namespace std::chrono_literals;
+    std::unique_ptr<dshgi_publisher> publisher = create_dshgi_publisher(
+        s->opt.transport, s->opt.port_number
+    );
 
     device& dev = s->ctx->get_display_device();
-    zpoller_t* poller = zpoller_new(socket, nullptr);
+
+    std::vector<sh_grid_encoder> encoders;
+    std::vector<uint8_t> encoded;
+    sh_grid_stream_stats stats;
+    bool keyframe_requested = true;
+    uint32_t frames_since_keyframe = 0;
 
     auto check_recv = [&](){
-        // Let's check for subscribers every now and then.
-        while(zpoller_wait(poller, 0) != nullptr)
+        // Let's check for subscribers every now and then. New clients and
+        // clients that lost messages can only apply deltas on top of a
+        // keyframe.
+        if(publisher->poll())
+            keyframe_requested = true;
+        unsigned count = publisher->get_subscriber_count();
+        if(count != s->subscriber_count)
         {
-            zmsg_t* msg = zmsg_recv(socket);
-            zframe_t* frame = zmsg_first(msg);
-            uint8_t tag = *(uint8_t*)zframe_data(frame);
-            frame = zmsg_next(msg);
-            if(tag != 0) s->subscriber_count++;
-            else s->subscriber_count--;
-            TR_LOG("Client count: ", s->subscriber_count);
-            zmsg_destroy(&msg);
+            s->subscriber_count = count;
+            TR_LOG("Client count: ", count);
         }
     };
 
     for(;;)
     {
-        dependencies deps;
+        queued_frame frame;
         {
             std::unique_lock<std::mutex> lk(s->frame_queue_mutex);
             check_recv();
@@ -214,68 +223,79 @@ void dshgi_server::sender_worker(dshgi_server* s)
             if(s->exit_sender)
                 break;
 
-            deps = std::move(s->frame_queue.front());
+            frame = std::move(s->frame_queue.front());
             s->frame_queue.erase(s->frame_queue.begin());
         }
-        deps.wait(dev);
+        frame.deps.wait(dev);
 
-        //const std::vector<sh_grid*>& grids = s->cur_scene->get_sh_grids();
-
-        { // Send animation timestamp
-            zmsg_t* msg = zmsg_new();
-            zmsg_addstr(msg, "timestamp ");
-            zmsg_addmem(msg, &s->timestamp, sizeof(timestamp));
-            zmsg_send(&msg, socket);
-        }
+        // Send animation timestamp
+        publisher->publish("timestamp ", {{&frame.timestamp, sizeof(frame.timestamp)}});
 
         // The total number of grids is also sent. The intention here is that
         // the client doesn't actually have to know anything about the locations
         // or number of SH grids ahead-of-time.
+        uint32_t count = frame.grids.size();
+        publisher->publish("sh_grid_count ", {{&count, sizeof(count)}});
+
+        bool keyframe = keyframe_requested || (
+            s->opt.keyframe_interval != 0 &&
+            frames_since_keyframe + 1 >= s->opt.keyframe_interval
+        );
+        keyframe_requested = false;
+        frames_since_keyframe = keyframe ? 0 : frames_since_keyframe + 1;
+
+        size_t raw_bytes = 0;
+        size_t sent_bytes = 0;
+        for(uint32_t index = 0; index < frame.grids.size(); ++index)
         {
-            zmsg_t* msg = zmsg_new();
-            zmsg_addstr(msg, "sh_grid_count ");
-            uint32_t count = s->cur_scene->count<sh_grid>();
-            zmsg_addmem(msg, &count, sizeof(count));
-            zmsg_send(&msg, socket);
-        }
-
-        int i = 0;
-        s->cur_scene->foreach([&](transformable& t, sh_grid& grid){
+            grid_snapshot& g = frame.grids[index];
             size_t size = 0;
             void* mem = nullptr;
-            s->sh_grid_to_cpu->get_memory(&grid, size, mem);
-
-            zmsg_t* msg = zmsg_new();
-            zmsg_addstr(msg, "sh_grid ");
+            s->sh_grid_to_cpu->get_memory(g.grid, size, mem);
 
-            uint32_t index = i;
-            zmsg_addmem(msg, &index, sizeof(index));
-
-            int32_t order = grid.get_order();
-            zmsg_addmem(msg, &order, sizeof(order));
-
-            float radius = grid.get_radius();
-            zmsg_addmem(msg, &radius, sizeof(radius));
-
-            mat4 transform = t.get_global_transform();
-            zmsg_addmem(msg, &transform, sizeof(transform));
-
-            puvec3 res = grid.get_resolution();
-            zmsg_addmem(msg, &res, sizeof(res));
-
-            VkFormat fmt = (VkFormat)s->scene_update->get_sh_grid_textures().at(&grid).get_format();
-            zmsg_addmem(msg, &fmt, sizeof(fmt));
-
-            zmsg_addmem(msg, mem, size);
+            if(encoders.size() <= index)
+                encoders.resize(index+1, sh_grid_encoder(s->opt.codec, s->opt.delta_threshold));
+            sh_grid_header header = encoders[index].encode(
+                (const uint16_t*)mem, uvec3(g.resolution), g.coef_count, encoded,
+                keyframe
+            );
+            uint32_t header_data[4] = {
+                (uint32_t)header.codec,
+                header.frame_index,
+                header.brick_count,
+                (header.keyframe ? SH_GRID_STREAM_KEYFRAME_BIT : 0u) |
+                (header.raw ? SH_GRID_STREAM_RAW_BIT : 0u)
+            };
+
+            // Raw keyframes are sent straight from the staging buffer.
+            std::vector<dshgi_message_part> parts = {
+                {&index, sizeof(index)},
+                {&g.order, sizeof(g.order)},
+                {&g.radius, sizeof(g.radius)},
+                {&g.transform, sizeof(g.transform)},
+                {&g.resolution, sizeof(g.resolution)},
+                {&g.format, sizeof(g.format)},
+                {header_data, sizeof(header_data)},
+                header.raw ?
+                    dshgi_message_part{mem, size} :
+                    dshgi_message_part{encoded.data(), encoded.size()}
+            };
+            publisher->publish("sh_grid ", parts);
+
+            raw_bytes += size;
+            sent_bytes += strlen("sh_grid ");
+            for(const dshgi_message_part& part: parts)
+                sent_bytes += part.size;
+        }
+        stats.add(raw_bytes, sent_bytes);
 
-            zmsg_send(&msg, socket);
-            ++i;
-        });
+        std::string report = stats.report(
+            "Streamed SH grids", s->opt.codec, s->subscriber_count, 5s
+        );
+        if(report.size()) TR_LOG(report);
 
-        dev.logical.signalSemaphore({*s->sender_semaphore, deps.value(dev.id, 0)});
+        dev.logical.signalSemaphore({*s->sender_semaphore, frame.deps.value(dev.id, 0)});
     }
-    zpoller_destroy(&poller);
-    zsock_destroy(&socket);
 }
 
 }
@@ -5,6 +5,8 @@
 #include "scene_stage.hh"
 #include "sh_renderer.hh"
 #include "renderer.hh"
+#include "sh_grid_codec.hh"
+#include "dshgi_transport.hh"
 #include <condition_variable>
 #include <thread>
 #include <mutex>
@@ -21,6 +23,15 @@ public:
     {
         sh_renderer::options sh;
         uint16_t port_number;
+        dshgi_transport_options transport;
+        sh_grid_codec codec = sh_grid_codec::FP16;
+        // Bricks of probes are only resent once some coefficient has changed
+        // by more than this.
+        float delta_threshold = 0.0f;
+        // Every grid is sent in full at this interval in frames, so that
+        // clients recover from lost messages. New clients always get a
+        // keyframe. 0 only sends keyframes for new clients.
+        uint32_t keyframe_interval = 0;
     };
 
     dshgi_server(context& ctx, const options& opt);
@@ -34,6 +45,27 @@ public:
 private:
     static void sender_worker(dshgi_server* s);
 
+    // The state of an SH grid when its frame was rendered. The sender thread
+    // must not touch the scene, since the next frame is already being
+    // prepared when it runs.
+    struct grid_snapshot
+    {
+        sh_grid* grid;
+        int32_t order;
+        float radius;
+        mat4 transform;
+        puvec3 resolution;
+        int coef_count;
+        VkFormat format;
+    };
+
+    struct queued_frame
+    {
+        dependencies deps;
+        time_ticks timestamp;
+        std::vector<grid_snapshot> grids;
+    };
+
     context* ctx;
     options opt;
     scene* cur_scene = nullptr;
@@ -43,7 +75,7 @@ private:
 
     std::mutex frame_queue_mutex;
     std::condition_variable frame_queue_cv;
-    std::vector<dependencies> frame_queue;
+    std::vector<queued_frame> frame_queue;
     vkm<vk::Semaphore> sender_semaphore;
 
     std::optional<event_subscription> update_event;
@@ -0,0 +1,1124 @@
+#include "dshgi_transport.hh"
+#include "log.hh"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <map>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <czmq.h>
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+using namespace tr;
+using namespace std::chrono_literals;
+
+// The serialized form of a message, as a list of the pieces of memory it
+// consists of. This way, the message can be written out piece by piece
+// instead of being gathered into one buffer first. The layout is:
+// uint32 topic size, topic, uint32 part count, and then uint32 size and data
+// for each part.
+struct serialized_message
+{
+    std::vector<uint32_t> sizes;
+    std::vector<dshgi_message_part> segments;
+    size_t size = 0;
+};
+
+void serialize(
+    const char* topic,
+    const std::vector<dshgi_message_part>& parts,
+    serialized_message& msg
+){
+    // The segments point to these, so they must not be reallocated below.
+    msg.sizes.resize(parts.size() + 2);
+    msg.segments.clear();
+    msg.size = 0;
+    auto add = [&](const void* data, size_t size){
+        if(size == 0) return;
+        msg.segments.push_back({data, size});
+        msg.size += size;
+    };
+
+    msg.sizes[0] = strlen(topic);
+    add(&msg.sizes[0], sizeof(uint32_t));
+    add(topic, msg.sizes[0]);
+    msg.sizes[1] = parts.size();
+    add(&msg.sizes[1], sizeof(uint32_t));
+    for(size_t i = 0; i < parts.size(); ++i)
+    {
+        msg.sizes[i+2] = parts[i].size;
+        add(&msg.sizes[i+2], sizeof(uint32_t));
+        add(parts[i].data, parts[i].size);
+    }
+}
+
+class zmq_publisher: public dshgi_publisher
+{
+public:
+    zmq_publisher(uint16_t port)
+    {
+        zsys_handler_set(nullptr);
+        socket = zsock_new(ZMQ_XPUB);
+        int rate_limit = 1000000; // 1 Gbps rate limit for now.
+        zsock_set_rate(socket, rate_limit);
+        // Otherwise, only the first subscription and the last unsubscription
+        // of each topic are reported. Later clients wouldn't get a keyframe,
+        // and the subscriber count would never drop back to zero.
+        int verboser = 1;
+        zmq_setsockopt(
+            zsock_resolve(socket), ZMQ_XPUB_VERBOSER,
+            &verboser, sizeof(verboser)
+        );
+        int err = zsock_bind(socket, "tcp://*:%d", (int)port);
+        if(err < 0)
+        {
+            zsock_destroy(&socket);
+            throw std::runtime_error(strerror(errno));
+        }
+        poller = zpoller_new(socket, nullptr);
+    }
+
+    ~zmq_publisher()
+    {
+        zpoller_destroy(&poller);
+        zsock_destroy(&socket);
+    }
+
+    void publish(
+        const char* topic,
+        const std::vector<dshgi_message_part>& parts
+    ) override
+    {
+        zmsg_t* msg = zmsg_new();
+        zmsg_addstr(msg, topic);
+        for(const dshgi_message_part& part: parts)
+            zmsg_addmem(msg, part.data, part.size);
+        zmsg_send(&msg, socket);
+    }
+
+    bool poll() override
+    {
+        bool joined = false;
+        while(zpoller_wait(poller, 0) != nullptr)
+        {
+            zmsg_t* msg = zmsg_recv(socket);
+            zframe_t* frame = zmsg_first(msg);
+            uint8_t tag = *(uint8_t*)zframe_data(frame);
+            if(tag != 0)
+            {
+                subscriber_count++;
+                joined = true;
+            }
+            else if(subscriber_count > 0) subscriber_count--;
+            zmsg_destroy(&msg);
+        }
+        return joined;
+    }
+
+    unsigned get_subscriber_count() const override
+    {
+        return subscriber_count;
+    }
+
+private:
+    zsock_t* socket;
+    zpoller_t* poller;
+    unsigned subscriber_count = 0;
+};
+
+class zmq_subscriber: public dshgi_subscriber
+{
+public:
+    zmq_subscriber(const std::string& server_address)
+    {
+        zsys_handler_set(nullptr);
+        socket = zsock_new(ZMQ_SUB);
+        // A single subscription, so that the server counts each client once.
+        zsock_set_subscribe(socket, "");
+        int err = zsock_connect(socket, "tcp://%s", server_address.c_str());
+        if(err < 0)
+        {
+            zsock_destroy(&socket);
+            throw std::runtime_error(strerror(errno));
+        }
+        poller = zpoller_new(socket, nullptr);
+    }
+
+    ~zmq_subscriber()
+    {
+        zpoller_destroy(&poller);
+        zsock_destroy(&socket);
+    }
+
+    bool receive(
+        dshgi_message& msg,
+        std::chrono::milliseconds timeout
+    ) override
+    {
+        if(zpoller_wait(poller, timeout.count()) == nullptr)
+            return false;
+
+        zmsg_t* zmsg = zmsg_recv(socket);
+        if(!zmsg) return false;
+
+        msg.clear();
+        zframe_t* frame = zmsg_first(zmsg);
+        msg.set_topic((const char*)zframe_data(frame), zframe_size(frame));
+        while((frame = zmsg_next(zmsg)) != nullptr)
+            msg.add_part(zframe_data(frame), zframe_size(frame));
+        zmsg_destroy(&zmsg);
+        return true;
+    }
+
+private:
+    zsock_t* socket;
+    zpoller_t* poller;
+};
+
+#ifndef _WIN32
+void split_address(const std::string& address, std::string& host, uint16_t& port)
+{
+    size_t colon = address.rfind(':');
+    if(colon == std::string::npos)
+        throw std::runtime_error("Expected host:port, got " + address);
+    host = address.substr(0, colon);
+    port = std::stoi(address.substr(colon+1));
+}
+
+sockaddr_in resolve_ipv4(const std::string& host, uint16_t port)
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* res = nullptr;
+    if(getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0 || !res)
+        throw std::runtime_error("Failed to resolve " + host);
+    sockaddr_in addr;
+    memcpy(&addr, res->ai_addr, sizeof(addr));
+    freeaddrinfo(res);
+    addr.sin_port = htons(port);
+    return addr;
+}
+
+int create_udp_socket()
+{
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if(fd < 0)
+        throw std::runtime_error(strerror(errno));
+    return fd;
+}
+
+constexpr uint32_t UDP_DATA_MAGIC = 0x54524447;
+constexpr uint32_t UDP_CONTROL_MAGIC = 0x54524443;
+// Fits in an Ethernet frame with the IP and UDP headers.
+constexpr size_t UDP_DATAGRAM_SIZE = 1400;
+constexpr uint32_t UDP_MAX_FRAGMENTS = 1<<20;
+constexpr auto UDP_HELLO_INTERVAL = 1s;
+constexpr auto UDP_SUBSCRIBER_TIMEOUT = 5s;
+// Clients that keep losing datagrams could otherwise make every message a
+// keyframe, which would only make them lose more.
+constexpr auto UDP_KEYFRAME_REQUEST_INTERVAL = 250ms;
+
+struct udp_datagram_header
+{
+    uint32_t magic;
+    // Same for all fragments of a message, increments by one per message.
+    uint32_t sequence;
+    uint32_t fragment;
+    uint32_t fragment_count;
+};
+
+constexpr size_t UDP_FRAGMENT_SIZE =
+    UDP_DATAGRAM_SIZE - sizeof(udp_datagram_header);
+
+enum udp_control_type: uint32_t
+{
+    // Sent periodically by clients, so that the server knows they are alive.
+    UDP_HELLO = 0,
+    UDP_KEYFRAME_REQUEST = 1,
+    UDP_GOODBYE = 2
+};
+
+struct udp_control_message
+{
+    uint32_t magic;
+    udp_control_type type;
+};
+
+class udp_publisher: public dshgi_publisher
+{
+public:
+    udp_publisher(const dshgi_transport_options& opt, uint16_t port)
+    {
+        group = resolve_ipv4(opt.multicast_group, port+1);
+
+        data_fd = create_udp_socket();
+        // Don't leave the local network.
+        unsigned char ttl = 1;
+        setsockopt(data_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        // Clients on the same machine also need the messages.
+        unsigned char loop = 1;
+        setsockopt(data_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        int send_buffer = 8 << 20;
+        setsockopt(data_fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof(send_buffer));
+
+        control_fd = create_udp_socket();
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if(bind(control_fd, (sockaddr*)&addr, sizeof(addr)) < 0)
+        {
+            std::string err = strerror(errno);
+            close(data_fd);
+            close(control_fd);
+            throw std::runtime_error(err);
+        }
+        fcntl(control_fd, F_SETFL, fcntl(control_fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    ~udp_publisher()
+    {
+        close(data_fd);
+        close(control_fd);
+    }
+
+    void publish(
+        const char* topic,
+        const std::vector<dshgi_message_part>& parts
+    ) override
+    {
+        serialize(topic, parts, msg);
+
+        udp_datagram_header header;
+        header.magic = UDP_DATA_MAGIC;
+        header.sequence = sequence++;
+        header.fragment_count = std::max(
+            (msg.size + UDP_FRAGMENT_SIZE - 1) / UDP_FRAGMENT_SIZE, size_t(1)
+        );
+
+        // The fragments are gathered straight from the parts.
+        size_t segment = 0;
+        size_t segment_offset = 0;
+        for(header.fragment = 0; header.fragment < header.fragment_count; ++header.fragment)
+        {
+            iov.clear();
+            iov.push_back({&header, sizeof(header)});
+            size_t left = UDP_FRAGMENT_SIZE;
+            while(left > 0 && segment < msg.segments.size())
+            {
+                const dshgi_message_part& seg = msg.segments[segment];
+                size_t size = std::min(left, seg.size - segment_offset);
+                iov.push_back({(uint8_t*)seg.data + segment_offset, size});
+                left -= size;
+                segment_offset += size;
+                if(segment_offset == seg.size)
+                {
+                    segment++;
+                    segment_offset = 0;
+                }
+            }
+
+            msghdr mh = {};
+            mh.msg_name = &group;
+            mh.msg_namelen = sizeof(group);
+            mh.msg_iov = iov.data();
+            mh.msg_iovlen = iov.size();
+            while(sendmsg(data_fd, &mh, 0) < 0)
+            {
+                if(errno == ENOBUFS)
+                    std::this_thread::yield();
+                else if(errno != EINTR)
+                {
+                    TR_ERR("Failed to send DSHGI datagram: ", strerror(errno));
+                    return;
+                }
+            }
+        }
+    }
+
+    bool poll() override
+    {
+        auto now = std::chrono::steady_clock::now();
+        bool joined = false;
+        udp_control_message ctrl;
+        sockaddr_in from;
+        socklen_t from_size = sizeof(from);
+        ssize_t size;
+        while((size = recvfrom(
+            control_fd, &ctrl, sizeof(ctrl), 0, (sockaddr*)&from, &from_size
+        )) >= 0)
+        {
+            from_size = sizeof(from);
+            if(size != sizeof(ctrl) || ctrl.magic != UDP_CONTROL_MAGIC)
+                continue;
+
+            uint64_t key = (uint64_t(from.sin_addr.s_addr) << 16) | from.sin_port;
+            switch(ctrl.type)
+            {
+            case UDP_HELLO:
+                joined |= subscribers.insert_or_assign(key, now).second;
+                break;
+            case UDP_KEYFRAME_REQUEST:
+                subscribers[key] = now;
+                keyframe_requested = true;
+                break;
+            case UDP_GOODBYE:
+                subscribers.erase(key);
+                break;
+            }
+        }
+
+        // Clients that exited without saying goodbye.
+        for(auto it = subscribers.begin(); it != subscribers.end();)
+        {
+            if(now - it->second > UDP_SUBSCRIBER_TIMEOUT)
+                it = subscribers.erase(it);
+            else ++it;
+        }
+
+        if(joined || (
+            keyframe_requested &&
+            now - last_keyframe >= UDP_KEYFRAME_REQUEST_INTERVAL
+        )){
+            keyframe_requested = false;
+            last_keyframe = now;
+            return true;
+        }
+        return false;
+    }
+
+    unsigned get_subscriber_count() const override
+    {
+        return subscribers.size();
+    }
+
+private:
+    int data_fd;
+    int control_fd;
+    sockaddr_in group;
+    uint32_t sequence = 0;
+    serialized_message msg;
+    std::vector<iovec> iov;
+    std::map<uint64_t, std::chrono::steady_clock::time_point> subscribers;
+    bool keyframe_requested = false;
+    std::chrono::steady_clock::time_point last_keyframe;
+};
+
+class udp_subscriber: public dshgi_subscriber
+{
+public:
+    udp_subscriber(
+        const dshgi_transport_options& opt,
+        const std::string& server_address
+    ){
+        std::string host;
+        uint16_t port = 0;
+        split_address(server_address, host, port);
+        server = resolve_ipv4(host, port);
+        sockaddr_in group = resolve_ipv4(opt.multicast_group, port+1);
+
+        data_fd = create_udp_socket();
+        // Allows multiple clients on the same machine.
+        int reuse = 1;
+        setsockopt(data_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        int receive_buffer = 8 << 20;
+        setsockopt(data_fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = group.sin_port;
+        ip_mreq mreq = {};
+        mreq.imr_multiaddr = group.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if(
+            bind(data_fd, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+            setsockopt(data_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0
+        ){
+            std::string err = strerror(errno);
+            close(data_fd);
+            throw std::runtime_error(err);
+        }
+
+        control_fd = create_udp_socket();
+        datagram.resize(UDP_DATAGRAM_SIZE);
+        send_control(UDP_HELLO);
+        last_hello = std::chrono::steady_clock::now();
+    }
+
+    ~udp_subscriber()
+    {
+        send_control(UDP_GOODBYE);
+        close(data_fd);
+        close(control_fd);
+    }
+
+    bool receive(
+        dshgi_message& msg,
+        std::chrono::milliseconds timeout
+    ) override
+    {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        for(;;)
+        {
+            auto now = std::chrono::steady_clock::now();
+            if(now - last_hello >= UDP_HELLO_INTERVAL)
+            {
+                send_control(UDP_HELLO);
+                last_hello = now;
+            }
+            if(
+                keyframe_needed &&
+                now - last_keyframe_request >= UDP_KEYFRAME_REQUEST_INTERVAL
+            ){
+                send_control(UDP_KEYFRAME_REQUEST);
+                last_keyframe_request = now;
+                keyframe_needed = false;
+            }
+            if(now >= deadline)
+                return false;
+
+            pollfd pfd = {data_fd, POLLIN, 0};
+            int wait_ms = std::chrono::ceil<std::chrono::milliseconds>(
+                std::min(deadline - now, std::chrono::steady_clock::duration(UDP_KEYFRAME_REQUEST_INTERVAL))
+            ).count();
+            if(::poll(&pfd, 1, wait_ms) <= 0)
+                continue;
+
+            ssize_t size = recv(data_fd, datagram.data(), datagram.size(), 0);
+            if(size < (ssize_t)sizeof(udp_datagram_header))
+                continue;
+
+            udp_datagram_header header;
+            memcpy(&header, datagram.data(), sizeof(header));
+            if(
+                header.magic != UDP_DATA_MAGIC ||
+                header.fragment_count > UDP_MAX_FRAGMENTS ||
+                header.fragment >= header.fragment_count
+            ) continue;
+
+            if(add_fragment(
+                header,
+                datagram.data() + sizeof(header),
+                size - sizeof(header)
+            )){
+                pending.resize(pending_size);
+                if(msg.deserialize(pending))
+                {
+                    msg.set_follows_loss(lost);
+                    lost = false;
+                    return true;
+                }
+                lost = true;
+            }
+        }
+    }
+
+private:
+    // Returns true when the message is complete.
+    bool add_fragment(
+        const udp_datagram_header& header,
+        const uint8_t* data,
+        size_t size
+    ){
+        if(!receiving || header.sequence != pending_sequence)
+        {
+            // Stragglers from messages that were already given up on.
+            if(has_sequence && int32_t(header.sequence - next_sequence) < 0)
+                return false;
+
+            // Either the previous message is incomplete, or whole messages
+            // were skipped. The grids can't be trusted until a keyframe.
+            if(receiving || (has_sequence && header.sequence != next_sequence))
+            {
+                keyframe_needed = true;
+                lost = true;
+            }
+
+            receiving = true;
+            has_sequence = true;
+            pending_sequence = header.sequence;
+            next_sequence = header.sequence + 1;
+            pending_fragment_count = header.fragment_count;
+            received.assign(header.fragment_count, false);
+            received_fragments = 0;
+            pending.resize(header.fragment_count * UDP_FRAGMENT_SIZE);
+            pending_size = 0;
+        }
+
+        if(
+            header.fragment_count != pending_fragment_count ||
+            received[header.fragment] ||
+            size > UDP_FRAGMENT_SIZE ||
+            // Only the last fragment may be shorter.
+            (header.fragment + 1 != pending_fragment_count && size != UDP_FRAGMENT_SIZE)
+        ) return false;
+
+        memcpy(pending.data() + header.fragment * UDP_FRAGMENT_SIZE, data, size);
+        received[header.fragment] = true;
+        received_fragments++;
+        if(header.fragment + 1 == pending_fragment_count)
+            pending_size = header.fragment * UDP_FRAGMENT_SIZE + size;
+
+        if(received_fragments != pending_fragment_count)
+            return false;
+        receiving = false;
+        return true;
+    }
+
+    void send_control(udp_control_type type)
+    {
+        udp_control_message ctrl = {UDP_CONTROL_MAGIC, type};
+        sendto(
+            control_fd, &ctrl, sizeof(ctrl), 0,
+            (const sockaddr*)&server, sizeof(server)
+        );
+    }
+
+    int data_fd;
+    int control_fd;
+    sockaddr_in server;
+    std::vector<uint8_t> datagram;
+    std::chrono::steady_clock::time_point last_hello;
+    std::chrono::steady_clock::time_point last_keyframe_request;
+    bool keyframe_needed = false;
+    // Whether messages were lost since the previous one that was returned.
+    bool lost = false;
+
+    bool has_sequence = false;
+    uint32_t next_sequence = 0;
+    bool receiving = false;
+    uint32_t pending_sequence = 0;
+    uint32_t pending_fragment_count = 0;
+    uint32_t received_fragments = 0;
+    std::vector<bool> received;
+    std::vector<uint8_t> pending;
+    size_t pending_size = 0;
+};
+
+constexpr uint32_t SHM_MAGIC = 0x54525348;
+constexpr size_t SHM_DATA_OFFSET = 4096;
+constexpr auto SHM_POLL_INTERVAL = 500us;
+constexpr size_t SHM_MAX_SUBSCRIBERS = 256;
+constexpr auto SHM_HEARTBEAT_INTERVAL = 1s;
+constexpr auto SHM_SUBSCRIBER_TIMEOUT = 5s;
+
+// Placed at the start of the shared memory, followed by the ring at
+// SHM_DATA_OFFSET. Each message in the ring is a uint64 size followed by the
+// serialized message, padded to 8 bytes.
+struct shm_header
+{
+    uint32_t magic;
+    uint64_t capacity;
+    // The positions are byte counts since the start, so they only grow. The
+    // writer moves write_begin before overwriting anything, and write_end
+    // once the message is complete. Readers compare their position to
+    // write_begin to tell if what they read was overwritten meanwhile.
+    std::atomic<uint64_t> write_begin;
+    std::atomic<uint64_t> write_end;
+    // Incremented by clients that join or fall behind.
+    std::atomic<uint32_t> keyframe_requests;
+    // Each client claims a slot and keeps writing the current time there,
+    // zero marks a free slot. The server frees the slots of clients that
+    // stop updating theirs, so crashed clients aren't counted forever.
+    std::atomic<uint64_t> heartbeats[SHM_MAX_SUBSCRIBERS];
+};
+static_assert(sizeof(shm_header) <= SHM_DATA_OFFSET);
+
+// steady_clock is CLOCK_MONOTONIC on the platforms with shared memory
+// support, so the times are comparable between processes.
+uint64_t get_shm_time(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        t.time_since_epoch()
+    ).count();
+}
+
+bool is_shm_heartbeat_alive(uint64_t heartbeat, uint64_t now)
+{
+    uint64_t timeout = std::chrono::nanoseconds(SHM_SUBSCRIBER_TIMEOUT).count();
+    // The client may have written its time after 'now' was taken.
+    return heartbeat != 0 && (heartbeat > now || now - heartbeat <= timeout);
+}
+
+std::string get_shm_name(uint16_t port)
+{
+    return "/tauray-dshgi-" + std::to_string(port);
+}
+
+uint64_t get_shm_record_size(uint64_t message_size)
+{
+    return (sizeof(uint64_t) + message_size + 7) & ~uint64_t(7);
+}
+
+class shm_publisher: public dshgi_publisher
+{
+public:
+    shm_publisher(const dshgi_transport_options& opt, uint16_t port)
+    : name(get_shm_name(port))
+    {
+        capacity = opt.shared_memory_size & ~size_t(7);
+        size = SHM_DATA_OFFSET + capacity;
+
+        // Left behind by a server that crashed.
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+        if(fd < 0)
+            throw std::runtime_error(name + ": " + strerror(errno));
+        void* mem = MAP_FAILED;
+        if(ftruncate(fd, size) == 0)
+            mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(mem == MAP_FAILED)
+        {
+            std::string err = strerror(errno);
+            shm_unlink(name.c_str());
+            throw std::runtime_error(name + ": " + err);
+        }
+
+        header = new (mem) shm_header();
+        header->capacity = capacity;
+        header->write_begin = 0;
+        header->write_end = 0;
+        header->keyframe_requests = 0;
+        for(auto& heartbeat: header->heartbeats)
+            heartbeat = 0;
+        ring = (uint8_t*)mem + SHM_DATA_OFFSET;
+        // Written last, clients don't touch the header before it's set.
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = SHM_MAGIC;
+    }
+
+    ~shm_publisher()
+    {
+        munmap(header, size);
+        shm_unlink(name.c_str());
+    }
+
+    void publish(
+        const char* topic,
+        const std::vector<dshgi_message_part>& parts
+    ) override
+    {
+        serialize(topic, parts, msg);
+        uint64_t record_size = get_shm_record_size(msg.size);
+        if(record_size > capacity / 2)
+        {
+            TR_ERR(
+                "DSHGI message of ", msg.size, " bytes does not fit in the "
+                "shared memory ring of ", capacity, " bytes"
+            );
+            return;
+        }
+
+        uint64_t pos = header->write_end.load(std::memory_order_relaxed);
+        header->write_begin.store(pos + record_size, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        uint64_t message_size = msg.size;
+        write(pos, &message_size, sizeof(message_size));
+        pos += sizeof(message_size);
+        // This is the only copy of the message that all clients share.
+        for(const dshgi_message_part& seg: msg.segments)
+        {
+            write(pos, seg.data, seg.size);
+            pos += seg.size;
+        }
+
+        header->write_end.store(
+            header->write_begin.load(std::memory_order_relaxed),
+            std::memory_order_release
+        );
+    }
+
+    bool poll() override
+    {
+        // Clients that exited without detaching.
+        uint64_t now = get_shm_time(std::chrono::steady_clock::now());
+        for(auto& heartbeat: header->heartbeats)
+        {
+            uint64_t value = heartbeat.load();
+            // The client may have just updated it, so only clear the value
+            // that was seen to be stale.
+            if(value != 0 && !is_shm_heartbeat_alive(value, now))
+                heartbeat.compare_exchange_strong(value, 0);
+        }
+
+        uint32_t requests = header->keyframe_requests.load();
+        bool keyframe = requests != handled_keyframe_requests;
+        handled_keyframe_requests = requests;
+        return keyframe;
+    }
+
+    unsigned get_subscriber_count() const override
+    {
+        uint64_t now = get_shm_time(std::chrono::steady_clock::now());
+        unsigned count = 0;
+        for(const auto& heartbeat: header->heartbeats)
+        {
+            if(is_shm_heartbeat_alive(heartbeat.load(), now))
+                count++;
+        }
+        return count;
+    }
+
+private:
+    void write(uint64_t pos, const void* data, size_t size)
+    {
+        size_t offset = pos % capacity;
+        size_t first = std::min(size, capacity - offset);
+        memcpy(ring + offset, data, first);
+        memcpy(ring, (const uint8_t*)data + first, size - first);
+    }
+
+    std::string name;
+    size_t capacity;
+    size_t size;
+    shm_header* header;
+    uint8_t* ring;
+    serialized_message msg;
+    uint32_t handled_keyframe_requests = 0;
+};
+
+class shm_subscriber: public dshgi_subscriber
+{
+public:
+    shm_subscriber(const std::string& server_address)
+    {
+        std::string host;
+        uint16_t port = 0;
+        split_address(server_address, host, port);
+        name = get_shm_name(port);
+    }
+
+    ~shm_subscriber()
+    {
+        detach();
+    }
+
+    bool receive(
+        dshgi_message& msg,
+        std::chrono::milliseconds timeout
+    ) override
+    {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        for(;;)
+        {
+            // The server may not be running yet.
+            if(!header && !attach())
+            {
+                if(std::chrono::steady_clock::now() >= deadline)
+                    return false;
+                std::this_thread::sleep_for(10ms);
+                continue;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+            if(now - last_heartbeat >= SHM_HEARTBEAT_INTERVAL)
+                heartbeat(now);
+
+            uint64_t end = header->write_end.load(std::memory_order_acquire);
+            if(end == read_pos)
+            {
+                if(std::chrono::steady_clock::now() >= deadline)
+                    return false;
+                std::this_thread::sleep_for(SHM_POLL_INTERVAL);
+                continue;
+            }
+
+            uint64_t message_size = 0;
+            if(end - read_pos <= capacity)
+            {
+                read(read_pos, &message_size, sizeof(message_size));
+                // A garbage size means that the writer has passed us.
+                if(message_size <= capacity)
+                {
+                    buffer.resize(message_size);
+                    read(read_pos + sizeof(message_size), buffer.data(), message_size);
+                }
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            uint64_t begin = header->write_begin.load(std::memory_order_relaxed);
+            if(message_size > capacity || begin - read_pos > capacity)
+            {
+                // We fell behind and the messages were overwritten, skip to
+                // the newest one.
+                read_pos = header->write_end.load(std::memory_order_acquire);
+                header->keyframe_requests++;
+                lost = true;
+                continue;
+            }
+
+            read_pos += get_shm_record_size(message_size);
+            if(msg.deserialize(buffer))
+            {
+                msg.set_follows_loss(lost);
+                lost = false;
+                return true;
+            }
+        }
+    }
+
+private:
+    bool attach()
+    {
+        int fd = shm_open(name.c_str(), O_RDWR, 0);
+        if(fd < 0) return false;
+
+        struct stat st;
+        void* mem = MAP_FAILED;
+        if(fstat(fd, &st) == 0 && size_t(st.st_size) > SHM_DATA_OFFSET)
+            mem = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(mem == MAP_FAILED) return false;
+
+        shm_header* h = (shm_header*)mem;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(h->magic != SHM_MAGIC || SHM_DATA_OFFSET + h->capacity > size_t(st.st_size))
+        {
+            munmap(mem, st.st_size);
+            return false;
+        }
+
+        header = h;
+        size = st.st_size;
+        capacity = h->capacity;
+        ring = (const uint8_t*)mem + SHM_DATA_OFFSET;
+        read_pos = header->write_end.load(std::memory_order_acquire);
+        slot = -1;
+        heartbeat(std::chrono::steady_clock::now());
+        if(slot < 0)
+        {
+            TR_ERR(
+                "More than ", SHM_MAX_SUBSCRIBERS,
+                " DSHGI clients in shared memory, this one is not counted"
+            );
+        }
+        // Nothing can be applied before a keyframe.
+        header->keyframe_requests++;
+        return true;
+    }
+
+    void detach()
+    {
+        if(!header) return;
+        if(slot >= 0)
+            header->heartbeats[slot].compare_exchange_strong(heartbeat_value, 0);
+        munmap(header, size);
+        header = nullptr;
+    }
+
+    void heartbeat(std::chrono::steady_clock::time_point now)
+    {
+        last_heartbeat = now;
+        uint64_t value = get_shm_time(now);
+        uint64_t expected = heartbeat_value;
+        heartbeat_value = value;
+        if(
+            slot >= 0 &&
+            header->heartbeats[slot].compare_exchange_strong(expected, value)
+        ) return;
+
+        // The server has timed us out and may have given the slot to another
+        // client, or we don't have one yet.
+        bool timed_out = slot >= 0;
+        slot = -1;
+        for(size_t i = 0; i < SHM_MAX_SUBSCRIBERS; ++i)
+        {
+            expected = 0;
+            if(header->heartbeats[i].compare_exchange_strong(expected, value))
+            {
+                slot = i;
+                break;
+            }
+        }
+        // The server may have stopped sending grids when it saw no clients.
+        if(timed_out)
+            header->keyframe_requests++;
+    }
+
+    void read(uint64_t pos, void* data, size_t size) const
+    {
+        size_t offset = pos % capacity;
+        size_t first = std::min(size, capacity - offset);
+        memcpy(data, ring + offset, first);
+        memcpy((uint8_t*)data + first, ring, size - first);
+    }
+
+    std::string name;
+    shm_header* header = nullptr;
+    size_t size = 0;
+    size_t capacity = 0;
+    const uint8_t* ring = nullptr;
+    uint64_t read_pos = 0;
+    std::vector<uint8_t> buffer;
+    // Whether messages were lost since the previous one that was returned.
+    bool lost = false;
+    int slot = -1;
+    uint64_t heartbeat_value = 0;
+    std::chrono::steady_clock::time_point last_heartbeat;
+};
+#endif
+
+}
+
+namespace tr
+{
+
+void dshgi_message::clear()
+{
+    topic.clear();
+    data.clear();
+    parts.clear();
+    follows_loss = false;
+}
+
+void dshgi_message::set_topic(const char* topic, size_t size)
+{
+    this->topic.assign(topic, size);
+}
+
+void dshgi_message::add_part(const void* data, size_t size)
+{
+    size_t offset = this->data.size();
+    this->data.resize(offset + size);
+    memcpy(this->data.data() + offset, data, size);
+    parts.push_back({offset, size});
+}
+
+bool dshgi_message::deserialize(std::vector<uint8_t>& data)
+{
+    clear();
+    std::swap(this->data, data);
+
+    size_t offset = 0;
+    size_t size = this->data.size();
+    auto read_size = [&](uint32_t& value){
+        if(size - offset < sizeof(value))
+            return false;
+        memcpy(&value, this->data.data() + offset, sizeof(value));
+        offset += sizeof(value);
+        return size - offset >= value;
+    };
+
+    uint32_t topic_size = 0;
+    if(!read_size(topic_size)) return false;
+    topic.assign((const char*)this->data.data() + offset, topic_size);
+    offset += topic_size;
+
+    uint32_t part_count = 0;
+    if(size - offset < sizeof(part_count)) return false;
+    memcpy(&part_count, this->data.data() + offset, sizeof(part_count));
+    offset += sizeof(part_count);
+
+    for(uint32_t i = 0; i < part_count; ++i)
+    {
+        uint32_t part_size = 0;
+        if(!read_size(part_size)) return false;
+        parts.push_back({offset, part_size});
+        offset += part_size;
+    }
+    return offset == size;
+}
+
+const std::string& dshgi_message::get_topic() const
+{
+    return topic;
+}
+
+size_t dshgi_message::get_part_count() const
+{
+    return parts.size();
+}
+
+const uint8_t* dshgi_message::get_part_data(size_t i) const
+{
+    return data.data() + parts[i].first;
+}
+
+size_t dshgi_message::get_part_size(size_t i) const
+{
+    return parts[i].second;
+}
+
+size_t dshgi_message::get_size() const
+{
+    size_t size = topic.size();
+    for(const auto& part: parts)
+        size += part.second;
+    return size;
+}
+
+void dshgi_message::set_follows_loss(bool follows_loss)
+{
+    this->follows_loss = follows_loss;
+}
+
+bool dshgi_message::get_follows_loss() const
+{
+    return follows_loss;
+}
+
+std::unique_ptr<dshgi_publisher> create_dshgi_publisher(
+    const dshgi_transport_options& opt,
+    uint16_t port
+){
+    switch(opt.type)
+    {
+    case dshgi_transport_type::TCP:
+        return std::make_unique<zmq_publisher>(port);
+#ifndef _WIN32
+    case dshgi_transport_type::UDP_MULTICAST:
+        return std::make_unique<udp_publisher>(opt, port);
+    case dshgi_transport_type::SHARED_MEMORY:
+        return std::make_unique<shm_publisher>(opt, port);
+#else
+    default:
+        throw std::runtime_error(
+            "Only the TCP transport is supported for DSHGI on Windows"
+        );
+#endif
+    }
+    return nullptr;
+}
+
+std::unique_ptr<dshgi_subscriber> create_dshgi_subscriber(
+    const dshgi_transport_options& opt,
+    const std::string& server_address
+){
+    switch(opt.type)
+    {
+    case dshgi_transport_type::TCP:
+        return std::make_unique<zmq_subscriber>(server_address);
+#ifndef _WIN32
+    case dshgi_transport_type::UDP_MULTICAST:
+        return std::make_unique<udp_subscriber>(opt, server_address);
+    case dshgi_transport_type::SHARED_MEMORY:
+        return std::make_unique<shm_subscriber>(server_address);
+#else
+    default:
+        throw std::runtime_error(
+            "Only the TCP transport is supported for DSHGI on Windows"
+        );
+#endif
+    }
+    return nullptr;
+}
+
+}
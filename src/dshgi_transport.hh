@@ -0,0 +1,137 @@
+#ifndef TAURAY_DSHGI_TRANSPORT_HH
+#define TAURAY_DSHGI_TRANSPORT_HH
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace tr
+{
+
+// How messages get from dshgi_server to dshgi_clients.
+enum class dshgi_transport_type
+{
+    // One TCP stream per client. Every client gets its own copy of each
+    // message, so the server's bandwidth grows with the number of clients.
+    TCP,
+    // Each message is sent once to a multicast group, split into datagrams.
+    // Clients ask the server for a keyframe when they miss a datagram.
+    UDP_MULTICAST,
+    // Each message is written once to a ring buffer in shared memory, which
+    // all clients on the same machine read from. Clients that fall behind by
+    // more than the ring ask the server for a keyframe.
+    SHARED_MEMORY
+};
+
+struct dshgi_transport_options
+{
+    dshgi_transport_type type = dshgi_transport_type::TCP;
+    // Messages are sent to this group on the port after the server's port.
+    // Clients send their control messages to the server's port.
+    std::string multicast_group = "239.255.42.42";
+    // Size of the shared memory ring, only used by the server. The largest
+    // message must fit in half of it.
+    size_t shared_memory_size = size_t(256) << 20;
+};
+
+// Piece of a message to publish. The data is only read during publish(), so
+// it can point to memory that is overwritten right after, like the mapped
+// staging buffers of the grids.
+struct dshgi_message_part
+{
+    const void* data;
+    size_t size;
+};
+
+// A received message: a topic and the parts that were published with it.
+class dshgi_message
+{
+public:
+    void clear();
+    void set_topic(const char* topic, size_t size);
+    void add_part(const void* data, size_t size);
+
+    // Parses a message serialized by a dshgi_publisher. 'data' is taken
+    // over, and the previous buffer of the message is left in it for reuse.
+    bool deserialize(std::vector<uint8_t>& data);
+
+    const std::string& get_topic() const;
+    size_t get_part_count() const;
+    const uint8_t* get_part_data(size_t i) const;
+    size_t get_part_size(size_t i) const;
+    // Topic and parts, without any transport overhead.
+    size_t get_size() const;
+
+    // Set by subscribers when messages were lost right before this one, so
+    // anything that built on the lost messages must wait for a keyframe.
+    void set_follows_loss(bool follows_loss);
+    bool get_follows_loss() const;
+
+    // Returns false if the part doesn't exist or is too small.
+    template<typename T>
+    bool read(size_t i, T& value) const
+    {
+        if(i >= parts.size() || parts[i].second < sizeof(T))
+            return false;
+        memcpy(&value, data.data() + parts[i].first, sizeof(T));
+        return true;
+    }
+
+private:
+    std::string topic;
+    std::vector<uint8_t> data;
+    // Offset and size of each part in 'data'.
+    std::vector<std::pair<size_t, size_t>> parts;
+    bool follows_loss = false;
+};
+
+class dshgi_publisher
+{
+public:
+    virtual ~dshgi_publisher() = default;
+
+    // Sends the message to every current subscriber.
+    virtual void publish(
+        const char* topic,
+        const std::vector<dshgi_message_part>& parts
+    ) = 0;
+
+    // Handles messages from subscribers. Returns true if a subscriber has
+    // joined or lost messages since the previous call, so the next grids
+    // must be sent as keyframes.
+    virtual bool poll() = 0;
+    virtual unsigned get_subscriber_count() const = 0;
+};
+
+class dshgi_subscriber
+{
+public:
+    virtual ~dshgi_subscriber() = default;
+
+    // Waits for the next message for up to 'timeout'. Returns false if none
+    // arrived.
+    virtual bool receive(
+        dshgi_message& msg,
+        std::chrono::milliseconds timeout
+    ) = 0;
+};
+
+// The server listens on 'port'. UDP_MULTICAST also sends to the next port.
+std::unique_ptr<dshgi_publisher> create_dshgi_publisher(
+    const dshgi_transport_options& opt,
+    uint16_t port
+);
+
+// 'server_address' is "host:port". The host is ignored with SHARED_MEMORY,
+// which only works on the same machine.
+std::unique_ptr<dshgi_subscriber> create_dshgi_subscriber(
+    const dshgi_transport_options& opt,
+    const std::string& server_address
+);
+
+}
+
+#endif
@@ -35,7 +35,6 @@ vk::Buffer environment_map::get_alias_table(size_t device_index) const
     return alias_table_buffers[device_index];
 }
 
-// Based on CC0 code from https://gist.github.com/juliusikkala/6c8c186f0150fe877a55cee4d266b1b0
 void environment_map::generate_alias_table()
 {
     alias_table.clear();
@@ -62,52 +61,7 @@ void environment_map::generate_alias_table()
     float* importance = nullptr;
     vmaMapMemory(dev.allocator, readback_buffer.get_allocation(), (void**)&importance);
 
-    double sum_importance = 0;
-    for(unsigned i = 0; i < pixel_count; ++i)
-        sum_importance += importance[i];
-
-    double average = sum_importance / double(pixel_count);
-    average_luminance = sum_importance;
-    float inv_average = 1.0 / average;
-    for(unsigned i = 0; i < pixel_count; ++i)
-        importance[i] *= inv_average;
-
-    // Average of 'probability' is now 1.
-    // Sweeping alias table build idea from: https://arxiv.org/pdf/1903.00227.pdf
-    alias_table.resize(pixel_count);
-    for(unsigned i = 0; i < pixel_count; ++i)
-        alias_table[i] = {i, 0xFFFFFFFF, 1.0f, 1.0f};
-
-    // i tracks light items, j tracks heavy items.
-    unsigned i = 0, j = 0;
-    while(i < pixel_count && importance[i] > 1.0f) ++i;
-    while(j < pixel_count && importance[j] <= 1.0f) ++j;
-
-    float weight = j < pixel_count ? importance[j] : 0.0f;
-    while(j < pixel_count)
-    {
-        if(weight > 1.0f)
-        {
-            if(i > pixel_count) break;
-            alias_table[i].probability = ldexp(importance[i], 32);
-            alias_table[i].alias_id = j;
-            weight = (weight + importance[i]) - 1.0f;
-            ++i;
-            while(i < pixel_count && importance[i]> 1.0f) ++i;
-        }
-        else
-        {
-            alias_table[j].probability = ldexp(weight, 32);
-            unsigned old_j = j;
-            ++j;
-            while(j < pixel_count && importance[j] <= 1.0f) ++j;
-            if(j < pixel_count)
-            {
-                alias_table[old_j].alias_id = j;
-                weight = (weight + importance[j]) - 1.0f;
-            }
-        }
-    }
+    average_luminance = build_alias_table(importance, pixel_count, alias_table);
 
     std::vector<float> sin_theta(size.y);
     for(int i = 0; i < size.y; ++i)
@@ -34,13 +34,6 @@ private:
     projection proj;
 
     double average_luminance;
-    struct alias_table_entry
-    {
-        uint32_t alias_id;
-        uint32_t probability;
-        float pdf;
-        float alias_pdf;
-    };
     std::vector<alias_table_entry> alias_table;
 
     per_device<vkm<vk::Buffer>> alias_table_buffers;
@@ -1,21 +1,23 @@
 #include "frame_client.hh"
+#include "frame_codec.hh"
+#include "log.hh"
+#include "misc.hh"
 #include <nng/nng.h>
 #include <nng/protocol/bus0/bus.h>
 
 namespace tr
 {
 
-void upload_texture(nng_msg* msg, SDL_Texture* tex, int width, int height)
+void upload_texture(const uint8_t* src, SDL_Texture* tex, int width, int height)
 {
-    uint8_t* src = (uint8_t*)nng_msg_body(msg);
     uint8_t* dst = nullptr;
     int pitch = 0;
     SDL_LockTexture(tex, nullptr, reinterpret_cast<void **>(&dst), &pitch);
 
-    memcpy(dst, src, width*height*3);
+    for(int y = 0; y < height; ++y)
+        memcpy(dst + y * pitch, src + y * width * 3, width*3);
 
     SDL_UnlockTexture(tex);
-    nng_msg_free(msg);
 }
 
 void frame_client(const options& opt)
@@ -46,6 +48,15 @@ void frame_client(const options& opt)
     std::string address = "tcp://"+opt.connect;
     nng_dial(socket, address.c_str(), nullptr, NNG_FLAG_NONBLOCK);
 
+    // The preferred codec first, then fallbacks.
+    std::vector<frame_codec> codecs = {opt.stream_codec};
+    unsorted_insert(codecs, frame_codec::DELTA_ZSTD);
+    unsorted_insert(codecs, frame_codec::RAW);
+
+    frame_decoder decoder;
+    frame_codec_stats stats;
+    bool need_keyframe = true;
+
     using namespace std::chrono_literals;
     auto last_request_timestamp = std::chrono::steady_clock::now();
 
@@ -77,12 +88,21 @@ void frame_client(const options& opt)
         auto timestamp = std::chrono::steady_clock::now();
         auto duration_since_last_request = timestamp - last_request_timestamp;
         bool timeout_close = duration_since_last_request > 0.5s;
+        // Don't flood the server with keyframe requests while waiting for one.
+        bool request_keyframe =
+            need_keyframe && duration_since_last_request > 0.1s;
 
-        if(new_events.size() != 0 || timeout_close)
+        if(new_events.size() != 0 || timeout_close || request_keyframe)
         {
             last_request_timestamp = timestamp;
             nng_msg* msg = nullptr;
             nng_msg_alloc(&msg, 0);
+            nng_msg_append_u32(
+                msg, need_keyframe ? FRAME_STREAM_REQUEST_KEYFRAME_BIT : 0
+            );
+            nng_msg_append_u32(msg, codecs.size());
+            for(frame_codec codec: codecs)
+                nng_msg_append_u32(msg, (uint32_t)codec);
             nng_msg_append(msg, new_events.data(), sizeof(SDL_Event)*new_events.size());
             if(nng_sendmsg(socket, msg, 0) != 0)
                 nng_msg_free(msg);
@@ -93,33 +113,62 @@ void frame_client(const options& opt)
         int result = nng_recvmsg(socket, &msg, NNG_FLAG_NONBLOCK);
         if(result == 0)
         {
-            uint32_t channels = 0;
-            uint32_t new_width = 0;
-            uint32_t new_height = 0;
-            nng_msg_trim_u32(msg, &new_width);
-            nng_msg_trim_u32(msg, &new_height);
-            nng_msg_trim_u32(msg, &channels);
-
-            if(new_width <= 16384 && new_height <= 16384)
-            {
-                if(new_width != width || new_height != height)
+            frame_header header = {};
+            uint32_t codec = 0;
+            uint32_t flags = 0;
+            // Messages too short for a header are skipped.
+            bool header_ok =
+                nng_msg_trim_u32(msg, &header.size.x) == 0 &&
+                nng_msg_trim_u32(msg, &header.size.y) == 0 &&
+                nng_msg_trim_u32(msg, &codec) == 0 &&
+                nng_msg_trim_u32(msg, &header.frame_index) == 0 &&
+                nng_msg_trim_u32(msg, &flags) == 0;
+            header.codec = (frame_codec)codec;
+            header.keyframe = flags & FRAME_STREAM_KEYFRAME_BIT;
+
+            if(
+                header_ok &&
+                header.size.x <= 16384 && header.size.y <= 16384 &&
+                is_known_frame_codec(codec)
+            ){
+                auto start = std::chrono::steady_clock::now();
+                bool decoded = decoder.decode(
+                    header,
+                    (const uint8_t*)nng_msg_body(msg),
+                    nng_msg_len(msg)
+                );
+                stats.add(
+                    header.size.x * header.size.y * 3, nng_msg_len(msg),
+                    std::chrono::steady_clock::now() - start
+                );
+                need_keyframe = !decoded;
+
+                if(decoded)
                 {
-                    width = new_width;
-                    height = new_height;
-                    SDL_DestroyTexture(tex);
-                    tex = SDL_CreateTexture(
-                        ren, SDL_PIXELFORMAT_RGB24,
-                        SDL_TEXTUREACCESS_STREAMING, width, height
-                    );
+                    if(header.size.x != width || header.size.y != height)
+                    {
+                        width = header.size.x;
+                        height = header.size.y;
+                        SDL_DestroyTexture(tex);
+                        tex = SDL_CreateTexture(
+                            ren, SDL_PIXELFORMAT_RGB24,
+                            SDL_TEXTUREACCESS_STREAMING, width, height
+                        );
+                    }
+
+                    upload_texture(decoder.get_frame(), tex, width, height);
+
+                    SDL_RenderCopy(ren, tex, nullptr, nullptr);
+
+                    SDL_RenderPresent(ren);
                 }
 
-                upload_texture(msg, tex, width, height);
-
-                SDL_RenderCopy(ren, tex, nullptr, nullptr);
-
-                SDL_RenderPresent(ren);
+                std::string report = stats.report(
+                    "Received", header.codec, 5s
+                );
+                if(report.size()) TR_LOG(report);
             }
-            else nng_msg_free(msg);
+            nng_msg_free(msg);
         }
     }
 
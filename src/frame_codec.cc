@@ -0,0 +1,399 @@
+#include "frame_codec.hh"
+#include <zstd.h>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+using namespace tr;
+
+constexpr uint32_t TILE_SIZE = 32;
+// Speed matters more than ratio for live streaming.
+constexpr int ZSTD_LEVEL = 1;
+
+uvec2 get_tile_count(uvec2 size)
+{
+    return (size + TILE_SIZE - 1u) / TILE_SIZE;
+}
+
+size_t get_tile_mask_bytes(uvec2 size)
+{
+    uvec2 tiles = get_tile_count(size);
+    return (tiles.x * tiles.y + 7) / 8;
+}
+
+uvec2 get_chroma_size(uvec2 size)
+{
+    return (size + 1u) / 2u;
+}
+
+uint8_t clamp_u8(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Replaces each value with its difference to the left neighbour.
+void predict_rows(uint8_t* data, uvec2 size)
+{
+    if(size.x == 0) return;
+    for(uint32_t y = 0; y < size.y; ++y)
+    {
+        uint8_t* row = data + y * size.x;
+        for(uint32_t x = size.x-1; x > 0; --x)
+            row[x] -= row[x-1];
+    }
+}
+
+void unpredict_rows(uint8_t* data, uvec2 size)
+{
+    for(uint32_t y = 0; y < size.y; ++y)
+    {
+        uint8_t* row = data + y * size.x;
+        for(uint32_t x = 1; x < size.x; ++x)
+            row[x] += row[x-1];
+    }
+}
+
+}
+
+namespace tr
+{
+
+const char* get_frame_codec_name(frame_codec codec)
+{
+    switch(codec)
+    {
+    case frame_codec::RAW: return "raw";
+    case frame_codec::DELTA_ZSTD: return "delta-zstd";
+    case frame_codec::YCOCG420_ZSTD: return "ycocg420-zstd";
+    }
+    return "unknown";
+}
+
+bool is_known_frame_codec(uint32_t codec)
+{
+    return codec <= (uint32_t)frame_codec::YCOCG420_ZSTD;
+}
+
+frame_encoder::frame_encoder(frame_codec codec, uvec2 size)
+: codec(codec), size(size)
+{
+    if(codec != frame_codec::RAW)
+    {
+        cctx = ZSTD_createCCtx();
+        if(!cctx) throw std::runtime_error("Failed to create zstd context");
+    }
+}
+
+frame_encoder::~frame_encoder()
+{
+    if(cctx) ZSTD_freeCCtx(cctx);
+}
+
+frame_codec frame_encoder::get_codec() const
+{
+    return codec;
+}
+
+uvec2 frame_encoder::get_size() const
+{
+    return size;
+}
+
+frame_header frame_encoder::encode(
+    const uint8_t* rgb,
+    std::vector<uint8_t>& out,
+    bool force_keyframe
+){
+    frame_header header;
+    header.size = size;
+    header.codec = codec;
+    header.frame_index = frame_index++;
+    header.keyframe = true;
+
+    size_t frame_bytes = size_t(size.x) * size.y * 3;
+    switch(codec)
+    {
+    case frame_codec::RAW:
+        out.assign(rgb, rgb + frame_bytes);
+        break;
+    case frame_codec::DELTA_ZSTD:
+        header.keyframe = force_keyframe || !has_previous;
+        encode_delta(rgb, header.keyframe);
+        compress(out);
+        break;
+    case frame_codec::YCOCG420_ZSTD:
+        encode_ycocg420(rgb);
+        compress(out);
+        break;
+    }
+    return header;
+}
+
+void frame_encoder::encode_delta(const uint8_t* rgb, bool keyframe)
+{
+    uvec2 tiles = get_tile_count(size);
+    size_t row_bytes = size_t(size.x) * 3;
+
+    residual.assign(get_tile_mask_bytes(size), 0);
+    residual.reserve(residual.size() + row_bytes * size.y);
+    previous.resize(row_bytes * size.y);
+
+    for(uint32_t ty = 0; ty < tiles.y; ++ty)
+    for(uint32_t tx = 0; tx < tiles.x; ++tx)
+    {
+        uvec2 start = uvec2(tx, ty) * TILE_SIZE;
+        uvec2 end = min(start + TILE_SIZE, size);
+        size_t offset = start.x * 3;
+        size_t tile_row_bytes = (end.x - start.x) * 3;
+
+        bool changed = keyframe;
+        for(uint32_t y = start.y; !changed && y < end.y; ++y)
+        {
+            size_t row = y * row_bytes + offset;
+            changed = memcmp(rgb + row, previous.data() + row, tile_row_bytes);
+        }
+        if(!changed) continue;
+
+        uint32_t tile_index = ty * tiles.x + tx;
+        residual[tile_index/8] |= 1 << (tile_index%8);
+
+        for(uint32_t y = start.y; y < end.y; ++y)
+        {
+            size_t row = y * row_bytes + offset;
+            const uint8_t* cur = rgb + row;
+            const uint8_t* prev = previous.data() + row;
+            size_t base = residual.size();
+            residual.resize(base + tile_row_bytes);
+            uint8_t* dst = residual.data() + base;
+            if(keyframe)
+            {
+                for(size_t i = 0; i < 3; ++i)
+                    dst[i] = cur[i];
+                for(size_t i = 3; i < tile_row_bytes; ++i)
+                    dst[i] = cur[i] - cur[i-3];
+            }
+            else
+            {
+                for(size_t i = 0; i < tile_row_bytes; ++i)
+                    dst[i] = cur[i] - prev[i];
+            }
+        }
+    }
+
+    memcpy(previous.data(), rgb, previous.size());
+    has_previous = true;
+}
+
+void frame_encoder::encode_ycocg420(const uint8_t* rgb)
+{
+    uvec2 chroma_size = get_chroma_size(size);
+    size_t luma_bytes = size_t(size.x) * size.y;
+    size_t chroma_bytes = size_t(chroma_size.x) * chroma_size.y;
+    residual.resize(luma_bytes + 2 * chroma_bytes);
+
+    uint8_t* luma = residual.data();
+    uint8_t* co = luma + luma_bytes;
+    uint8_t* cg = co + chroma_bytes;
+
+    for(uint32_t cy = 0; cy < chroma_size.y; ++cy)
+    for(uint32_t cx = 0; cx < chroma_size.x; ++cx)
+    {
+        int co_sum = 0;
+        int cg_sum = 0;
+        int count = 0;
+        for(uint32_t y = cy*2; y < min(cy*2+2, size.y); ++y)
+        for(uint32_t x = cx*2; x < min(cx*2+2, size.x); ++x)
+        {
+            const uint8_t* p = rgb + (size_t(y) * size.x + x) * 3;
+            int r = p[0], g = p[1], b = p[2];
+            luma[size_t(y) * size.x + x] = (r + 2*g + b + 2) >> 2;
+            co_sum += r - b;
+            cg_sum += 2*g - r - b;
+            count++;
+        }
+        size_t i = size_t(cy) * chroma_size.x + cx;
+        co[i] = clamp_u8((int)std::lround(co_sum / (2.0f * count)) + 128);
+        cg[i] = clamp_u8((int)std::lround(cg_sum / (4.0f * count)) + 128);
+    }
+
+    predict_rows(luma, size);
+    predict_rows(co, chroma_size);
+    predict_rows(cg, chroma_size);
+}
+
+void frame_encoder::compress(std::vector<uint8_t>& out)
+{
+    out.resize(ZSTD_compressBound(residual.size()));
+    size_t bytes = ZSTD_compressCCtx(
+        cctx, out.data(), out.size(), residual.data(), residual.size(),
+        ZSTD_LEVEL
+    );
+    if(ZSTD_isError(bytes))
+        throw std::runtime_error(
+            std::string("Frame compression failed: ") + ZSTD_getErrorName(bytes)
+        );
+    out.resize(bytes);
+}
+
+frame_decoder::frame_decoder()
+{
+    dctx = ZSTD_createDCtx();
+    if(!dctx) throw std::runtime_error("Failed to create zstd context");
+}
+
+frame_decoder::~frame_decoder()
+{
+    ZSTD_freeDCtx(dctx);
+}
+
+bool frame_decoder::decode(
+    const frame_header& header,
+    const uint8_t* data,
+    size_t data_size
+){
+    uvec2 new_size = header.size;
+    size_t frame_bytes = size_t(new_size.x) * new_size.y * 3;
+
+    bool has_reference =
+        has_previous && size == new_size &&
+        previous_index + 1 == header.frame_index;
+    has_previous = false;
+
+    if(!header.keyframe && !has_reference)
+        return false;
+
+    size = new_size;
+    frame.resize(frame_bytes);
+
+    switch(header.codec)
+    {
+    case frame_codec::RAW:
+        if(data_size != frame_bytes) return false;
+        memcpy(frame.data(), data, frame_bytes);
+        break;
+    case frame_codec::DELTA_ZSTD:
+        {
+            size_t mask_bytes = get_tile_mask_bytes(size);
+            if(!decompress(data, data_size, mask_bytes + frame_bytes))
+                return false;
+            if(residual.size() < mask_bytes) return false;
+
+            uvec2 tiles = get_tile_count(size);
+            size_t row_bytes = size_t(size.x) * 3;
+            const uint8_t* src = residual.data() + mask_bytes;
+            const uint8_t* src_end = residual.data() + residual.size();
+            for(uint32_t ty = 0; ty < tiles.y; ++ty)
+            for(uint32_t tx = 0; tx < tiles.x; ++tx)
+            {
+                uint32_t tile_index = ty * tiles.x + tx;
+                bool changed = (residual[tile_index/8] >> (tile_index%8)) & 1;
+                if(!changed)
+                {
+                    if(header.keyframe) return false;
+                    continue;
+                }
+
+                uvec2 start = uvec2(tx, ty) * TILE_SIZE;
+                uvec2 end = min(start + TILE_SIZE, size);
+                size_t tile_row_bytes = (end.x - start.x) * 3;
+                if(size_t(src_end - src) < tile_row_bytes * (end.y - start.y))
+                    return false;
+
+                for(uint32_t y = start.y; y < end.y; ++y)
+                {
+                    uint8_t* dst = frame.data() + y * row_bytes + start.x * 3;
+                    if(header.keyframe)
+                    {
+                        for(size_t i = 0; i < 3; ++i)
+                            dst[i] = src[i];
+                        for(size_t i = 3; i < tile_row_bytes; ++i)
+                            dst[i] = src[i] + dst[i-3];
+                    }
+                    else
+                    {
+                        for(size_t i = 0; i < tile_row_bytes; ++i)
+                            dst[i] += src[i];
+                    }
+                    src += tile_row_bytes;
+                }
+            }
+            if(src != src_end) return false;
+        }
+        break;
+    case frame_codec::YCOCG420_ZSTD:
+        {
+            uvec2 chroma_size = get_chroma_size(size);
+            size_t luma_bytes = size_t(size.x) * size.y;
+            size_t chroma_bytes = size_t(chroma_size.x) * chroma_size.y;
+            size_t expected = luma_bytes + 2 * chroma_bytes;
+            if(!decompress(data, data_size, expected)) return false;
+            if(residual.size() != expected) return false;
+
+            uint8_t* luma = residual.data();
+            uint8_t* co = luma + luma_bytes;
+            uint8_t* cg = co + chroma_bytes;
+            unpredict_rows(luma, size);
+            unpredict_rows(co, chroma_size);
+            unpredict_rows(cg, chroma_size);
+
+            for(uint32_t y = 0; y < size.y; ++y)
+            for(uint32_t x = 0; x < size.x; ++x)
+            {
+                size_t ci = size_t(y/2) * chroma_size.x + x/2;
+                int l = luma[size_t(y) * size.x + x];
+                int co2 = int(co[ci]) - 128;
+                int cg4 = int(cg[ci]) - 128;
+                uint8_t* p = frame.data() + (size_t(y) * size.x + x) * 3;
+                p[0] = clamp_u8(l - cg4 + co2);
+                p[1] = clamp_u8(l + cg4);
+                p[2] = clamp_u8(l - cg4 - co2);
+            }
+        }
+        break;
+    default:
+        return false;
+    }
+
+    has_previous = true;
+    previous_index = header.frame_index;
+    return true;
+}
+
+const uint8_t* frame_decoder::get_frame() const
+{
+    return frame.data();
+}
+
+bool frame_decoder::decompress(
+    const uint8_t* data,
+    size_t data_size,
+    size_t max_size
+){
+    unsigned long long content_size = ZSTD_getFrameContentSize(data, data_size);
+    if(
+        content_size == ZSTD_CONTENTSIZE_ERROR ||
+        content_size == ZSTD_CONTENTSIZE_UNKNOWN ||
+        content_size > max_size
+    ) return false;
+
+    residual.resize(content_size);
+    size_t bytes = ZSTD_decompressDCtx(
+        dctx, residual.data(), residual.size(), data, data_size
+    );
+    return !ZSTD_isError(bytes) && bytes == content_size;
+}
+
+std::string frame_codec_stats::report(
+    const char* label,
+    frame_codec codec,
+    std::chrono::steady_clock::duration interval
+){
+    std::string summary = stream_stats::report(interval);
+    if(summary.empty()) return summary;
+    return std::string(label) + " " + get_frame_codec_name(codec) + ": " +
+        summary;
+}
+
+}
@@ -0,0 +1,127 @@
+#ifndef TAURAY_FRAME_CODEC_HH
+#define TAURAY_FRAME_CODEC_HH
+#include "math.hh"
+#include "stream_stats.hh"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+namespace tr
+{
+
+// Codecs used for streaming RGB8 frames from frame_server to frame_client. The
+// values are sent over the network, so don't reorder them.
+enum class frame_codec: uint32_t
+{
+    // Uncompressed RGB8.
+    RAW = 0,
+    // Lossless. Tiles that are identical to the previous frame are skipped,
+    // the rest are delta coded against it and compressed with zstd. Keyframes
+    // use the left neighbour as the prediction instead.
+    DELTA_ZSTD = 1,
+    // Lossy. YCoCg with 2x2-subsampled chroma, compressed with zstd. Every
+    // frame is independent, so a lost frame never causes a stall.
+    YCOCG420_ZSTD = 2
+};
+
+const char* get_frame_codec_name(frame_codec codec);
+bool is_known_frame_codec(uint32_t codec);
+
+// Flag bits in the frame messages sent by frame_server.
+constexpr uint32_t FRAME_STREAM_KEYFRAME_BIT = 1<<0;
+// Flag bits in the input messages sent by frame_client.
+constexpr uint32_t FRAME_STREAM_REQUEST_KEYFRAME_BIT = 1<<0;
+
+struct frame_header
+{
+    uvec2 size;
+    frame_codec codec;
+    uint32_t frame_index;
+    // Keyframes can be decoded without any previous frame. Other frames can
+    // only be decoded if the previous frame (frame_index-1) was decoded.
+    bool keyframe;
+};
+
+class frame_encoder
+{
+public:
+    frame_encoder(frame_codec codec, uvec2 size);
+    frame_encoder(const frame_encoder& other) = delete;
+    frame_encoder(frame_encoder&& other) = delete;
+    ~frame_encoder();
+
+    frame_codec get_codec() const;
+    uvec2 get_size() const;
+
+    // Encodes a tightly packed RGB8 frame into 'out'. If force_keyframe is
+    // false, the codec may still decide to make a keyframe, e.g. for the first
+    // frame. Returns the header for the encoded frame.
+    frame_header encode(
+        const uint8_t* rgb,
+        std::vector<uint8_t>& out,
+        bool force_keyframe = false
+    );
+
+private:
+    void encode_delta(const uint8_t* rgb, bool keyframe);
+    void encode_ycocg420(const uint8_t* rgb);
+    void compress(std::vector<uint8_t>& out);
+
+    frame_codec codec;
+    uvec2 size;
+    uint32_t frame_index = 0;
+    bool has_previous = false;
+    std::vector<uint8_t> previous;
+    std::vector<uint8_t> residual;
+    ZSTD_CCtx_s* cctx = nullptr;
+};
+
+class frame_decoder
+{
+public:
+    frame_decoder();
+    frame_decoder(const frame_decoder& other) = delete;
+    frame_decoder(frame_decoder&& other) = delete;
+    ~frame_decoder();
+
+    // Decodes a frame into an internal RGB8 buffer. Returns false if the data
+    // is corrupt or references a frame that was not decoded; a keyframe is
+    // needed to continue after that.
+    bool decode(
+        const frame_header& header,
+        const uint8_t* data,
+        size_t data_size
+    );
+
+    // Valid after a successful decode(). Tightly packed RGB8.
+    const uint8_t* get_frame() const;
+
+private:
+    bool decompress(const uint8_t* data, size_t data_size, size_t expected);
+
+    bool has_previous = false;
+    uint32_t previous_index = 0;
+    uvec2 size = uvec2(0);
+    std::vector<uint8_t> frame;
+    std::vector<uint8_t> residual;
+    ZSTD_DCtx_s* dctx = nullptr;
+};
+
+// stream_stats with the codec name in the summary.
+class frame_codec_stats: public stream_stats
+{
+public:
+    std::string report(
+        const char* label,
+        frame_codec codec,
+        std::chrono::steady_clock::duration interval
+    );
+};
+
+}
+
+#endif
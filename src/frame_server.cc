@@ -1,11 +1,14 @@
 #include "frame_server.hh"
 #include "misc.hh"
+#include "pixel_conversion.hh"
+#include "log.hh"
 #include "tinyexr.h"
 #include "stb_image_write.h"
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include <csignal>
+#include <optional>
 #include <nng/nng.h>
 #include <nng/protocol/bus0/bus.h>
 
@@ -24,7 +27,8 @@ namespace tr
 {
 
 frame_server::frame_server(const options& opt)
-:   context(opt), opt(opt), exit_streamer(0), pause_rendering(false),
+:   context(opt), opt(opt), sent_frames(0), dropped_frames(0),
+    exit_streamer(0), pause_rendering(false),
     image_reader_thread(read_image_worker, this),
     streamer_thread(streamer_worker, this)
 {
@@ -40,8 +44,10 @@ frame_server::~frame_server()
 {
     exit_streamer = true;
     frame_queue_cv.notify_one();
+    frame_free_cv.notify_one();
     copy_start_cv.notify_one();
     streamer_thread.join();
+    image_reader_thread.join();
 
     deinit_resources();
     deinit_images();
@@ -57,6 +63,16 @@ bool frame_server::init_frame()
     return should_exit;
 }
 
+size_t frame_server::get_sent_frame_count() const
+{
+    return sent_frames;
+}
+
+size_t frame_server::get_dropped_frame_count() const
+{
+    return dropped_frames;
+}
+
 uint32_t frame_server::prepare_next_image(uint32_t frame_index)
 {
     device& d = get_display_device();
@@ -162,8 +178,9 @@ void frame_server::init_images()
         );
 
         per_image_data id;
+        // The image is RGBA8, so 4 bytes per pixel.
         vk::BufferCreateInfo staging_info(
-            {}, opt.size.x*opt.size.y*sizeof(float)*4*image_array_layers,
+            {}, opt.size.x*opt.size.y*4*image_array_layers,
             vk::BufferUsageFlagBits::eTransferDst,
             vk::SharingMode::eExclusive
         );
@@ -195,6 +212,17 @@ void frame_server::init_images()
         per_image.emplace_back(std::move(id));
     }
     reset_image_views();
+
+    std::unique_lock lk(frame_queue_mutex);
+    uint32_t capacity = max(opt.queue_capacity, 1u);
+    frame_buffers.resize(capacity);
+    frame_queue.clear();
+    free_frames.clear();
+    for(uint32_t i = 0; i < capacity; ++i)
+    {
+        frame_buffers[i].resize(opt.size.x * opt.size.y * 3);
+        free_frames.push_back(i);
+    }
 }
 
 void frame_server::deinit_images()
@@ -240,7 +268,31 @@ void frame_server::read_image_worker(frame_server* s)
         device& d = s->get_display_device();
         auto& id = s->per_image[image_index];
 
-        std::vector<uint8_t> latest_frame(s->opt.size.x * s->opt.size.y * 3);
+        uint32_t frame_index = 0;
+        {
+            std::unique_lock lk(s->frame_queue_mutex);
+            s->frame_free_cv.wait(lk, [&](){
+                return s->exit_streamer || s->free_frames.size() != 0 || (
+                    s->opt.policy == LATEST_WINS && s->frame_queue.size() != 0
+                );
+            });
+            if(s->exit_streamer)
+                break;
+
+            if(s->free_frames.size() != 0)
+            {
+                frame_index = s->free_frames.back();
+                s->free_frames.pop_back();
+            }
+            else
+            {
+                // Steal the oldest frame that hasn't been sent yet.
+                frame_index = s->frame_queue.front();
+                s->frame_queue.pop_front();
+                s->dropped_frames++;
+            }
+        }
+        std::vector<uint8_t>& latest_frame = s->frame_buffers[frame_index];
 
         (void)d.logical.waitForFences(*id.copy_fence, true, UINT64_MAX);
         d.logical.resetFences(*id.copy_fence);
@@ -248,18 +300,13 @@ void frame_server::read_image_worker(frame_server* s)
         uint8_t* mem = nullptr;
         vmaMapMemory(d.allocator, id.staging_buffer.get_allocation(), (void**)&mem);
 
-        for(uint32_t i = 0; i < s->opt.size.x * s->opt.size.y; ++i)
-        {
-            latest_frame[i*3 + 0] = mem[i*4 + 0];
-            latest_frame[i*3 + 1] = mem[i*4 + 1];
-            latest_frame[i*3 + 2] = mem[i*4 + 2];
-        }
+        rgba8_to_rgb8(mem, latest_frame.data(), s->opt.size.x * s->opt.size.y);
 
         vmaUnmapMemory(d.allocator, id.staging_buffer.get_allocation());
 
         {
             std::unique_lock lk(s->frame_queue_mutex);
-            s->frame_queue.emplace_back(std::move(latest_frame));
+            s->frame_queue.push_back(frame_index);
         }
         {
             std::unique_lock lk(s->image_mutex);
@@ -285,9 +332,17 @@ void frame_server::streamer_worker(frame_server* s)
 
     nng_msg* msg = nullptr;
 
+    frame_codec codec = s->opt.default_codec;
+    bool keyframe_requested = true;
+    std::unique_ptr<frame_encoder> encoder;
+    std::vector<uint8_t> encoded;
+    frame_codec_stats stats;
+
+    size_t reported_dropped_frames = 0;
+
     for(;;)
     {
-        std::vector<uint8_t> frame_data;
+        std::optional<uint32_t> frame_index;
         {
             std::unique_lock<std::mutex> lk(s->frame_queue_mutex);
             while(!s->frame_queue_cv.wait_for(
@@ -304,17 +359,40 @@ void frame_server::streamer_worker(frame_server* s)
 
             if(!s->frame_queue.empty())
             {
-                frame_data = std::move(s->frame_queue.front());
-                s->frame_queue.erase(s->frame_queue.begin());
+                frame_index = s->frame_queue.front();
+                s->frame_queue.pop_front();
             }
         }
 
         if(msg != nullptr)
-        { // Read input events from clients
-            SDL_Event* events = (SDL_Event*)nng_msg_body(msg);
-            size_t event_count = nng_msg_len(msg)/sizeof(SDL_Event);
-            for(size_t i = 0; i < event_count; ++i)
-                SDL_PushEvent(events+i);
+        { // Read codec preferences and input events from clients
+            uint32_t flags = 0;
+            uint32_t codec_count = 0;
+            if(
+                nng_msg_trim_u32(msg, &flags) == 0 &&
+                nng_msg_trim_u32(msg, &codec_count) == 0
+            ){
+                bool picked = false;
+                for(uint32_t i = 0; i < codec_count; ++i)
+                {
+                    uint32_t c = 0;
+                    if(nng_msg_trim_u32(msg, &c) != 0) break;
+                    if(!picked && is_known_frame_codec(c))
+                    {
+                        if(codec != (frame_codec)c)
+                            TR_LOG("Switching to ", get_frame_codec_name((frame_codec)c));
+                        codec = (frame_codec)c;
+                        picked = true;
+                    }
+                }
+                if(flags & FRAME_STREAM_REQUEST_KEYFRAME_BIT)
+                    keyframe_requested = true;
+
+                SDL_Event* events = (SDL_Event*)nng_msg_body(msg);
+                size_t event_count = nng_msg_len(msg)/sizeof(SDL_Event);
+                for(size_t i = 0; i < event_count; ++i)
+                    SDL_PushEvent(events+i);
+            }
             nng_msg_free(msg);
             msg = nullptr;
 
@@ -329,16 +407,61 @@ void frame_server::streamer_worker(frame_server* s)
                 s->pause_rendering = true;
         }
 
-        if(frame_data.size())
+        if(frame_index)
         { // Send frame to clients
+            const std::vector<uint8_t>& frame_data =
+                s->frame_buffers[*frame_index];
+            if(
+                !encoder ||
+                encoder->get_codec() != codec ||
+                encoder->get_size() != s->opt.size
+            ){
+                encoder.reset(new frame_encoder(codec, s->opt.size));
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            frame_header header = encoder->encode(
+                frame_data.data(), encoded, keyframe_requested
+            );
+            stats.add(
+                frame_data.size(), encoded.size(),
+                std::chrono::steady_clock::now() - start
+            );
+            if(header.keyframe) keyframe_requested = false;
+
+            {
+                std::unique_lock lk(s->frame_queue_mutex);
+                s->free_frames.push_back(*frame_index);
+            }
+            s->frame_free_cv.notify_one();
+
             nng_msg* msg = nullptr;
             nng_msg_alloc(&msg, 0);
-            nng_msg_append_u32(msg, s->opt.size.x);
-            nng_msg_append_u32(msg, s->opt.size.y);
-            nng_msg_append_u32(msg, 3);
-            nng_msg_append(msg, frame_data.data(), frame_data.size());
+            nng_msg_append_u32(msg, header.size.x);
+            nng_msg_append_u32(msg, header.size.y);
+            nng_msg_append_u32(msg, (uint32_t)header.codec);
+            nng_msg_append_u32(msg, header.frame_index);
+            nng_msg_append_u32(msg, header.keyframe ? FRAME_STREAM_KEYFRAME_BIT : 0);
+            nng_msg_append(msg, encoded.data(), encoded.size());
             if(nng_sendmsg(socket, msg, 0) != 0)
+            {
                 nng_msg_free(msg);
+                // Clients may be missing the reference for the next frame now.
+                keyframe_requested = true;
+                s->dropped_frames++;
+            }
+            else s->sent_frames++;
+
+            std::string report = stats.report("Streamed", codec, 5s);
+            if(report.size())
+            {
+                size_t dropped = s->dropped_frames;
+                TR_LOG(
+                    report, ", ", dropped - reported_dropped_frames,
+                    " frames dropped"
+                );
+                reported_dropped_frames = dropped;
+            }
         }
     }
 
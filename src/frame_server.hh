@@ -1,6 +1,7 @@
 #ifndef TAURAY_FRAME_SERVER_HH
 #define TAURAY_FRAME_SERVER_HH
 #include "context.hh"
+#include "frame_codec.hh"
 
 #if _WIN32
 #include <SDL.h>
@@ -14,6 +15,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <map>
+#include <deque>
 #include <atomic>
 
 namespace tr
@@ -26,12 +28,30 @@ namespace tr
 class frame_server: public context
 {
 public:
+    // What happens when the network can't keep up with the renderer.
+    enum drop_policy
+    {
+        // The oldest queued frame is dropped, so the client always gets the
+        // most recent frames with bounded latency.
+        LATEST_WINS = 0,
+        // The renderer waits until a frame has been sent.
+        BLOCK_RENDERER
+    };
+
     struct options: context::options
     {
         uvec2 size = uvec2(1280, 720);
         uint16_t port_number;
 
-        // TODO: Compression schemes?
+        // Used until a client states its preferences. Clients list the codecs
+        // they support in order of preference, and the first one known by the
+        // server is picked.
+        frame_codec default_codec = frame_codec::RAW;
+
+        // Number of frames that can wait for the network, including the one
+        // being sent. Memory use and worst-case latency scale with this.
+        unsigned queue_capacity = 2;
+        drop_policy policy = LATEST_WINS;
     };
 
     frame_server(const options& opt);
@@ -41,6 +61,9 @@ public:
 
     bool init_frame() override;
 
+    size_t get_sent_frame_count() const;
+    size_t get_dropped_frame_count() const;
+
 protected:
     uint32_t prepare_next_image(uint32_t frame_index) override;
     void finish_image(
@@ -80,9 +103,15 @@ private:
     std::condition_variable copy_start_cv, copy_finish_cv;
     std::vector<uint32_t> image_read_queue;
 
+    // Fixed ring of RGB8 frame buffers. Each buffer is either free, being
+    // written by the reader, queued or being sent by the streamer.
     std::mutex frame_queue_mutex;
-    std::condition_variable frame_queue_cv;
-    std::vector<std::vector<uint8_t>> frame_queue;
+    std::condition_variable frame_queue_cv, frame_free_cv;
+    std::vector<std::vector<uint8_t>> frame_buffers;
+    std::vector<uint32_t> free_frames;
+    std::deque<uint32_t> frame_queue;
+    std::atomic<size_t> sent_frames;
+    std::atomic<size_t> dropped_frames;
 
     std::atomic_bool exit_streamer;
     std::atomic_bool pause_rendering;
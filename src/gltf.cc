@@ -15,6 +15,10 @@
 #include <algorithm>
 #include <numeric>
 #include <unordered_set>
+#include <chrono>
+#include <filesystem>
+#include <cstring>
+namespace fs = std::filesystem;
 
 namespace
 {
@@ -507,78 +511,299 @@ void load_gltf_node(
 namespace tr
 {
 
-scene_assets load_gltf(
-    device_mask dev,
-    scene& s,
-    const std::string& path,
-    bool force_single_sided,
-    bool force_double_sided
+struct gltf_file
+{
+    std::string path;
+    device_mask dev;
+    bool force_single_sided;
+    bool force_double_sided;
+
+    tinygltf::Model model;
+    std::vector<bool> opaque_images;
+    // Animation pools are moved into the scene_assets once instantiated.
+    std::vector<std::unique_ptr<animation_pool>> animation_pools;
+    node_meta_info meta;
+
+    struct primitive
+    {
+        std::unique_ptr<mesh> m;
+        int material;
+    };
+    // Indexed by glTF mesh index, then by primitive index.
+    std::vector<std::vector<primitive>> meshes;
+
+    gltf_load_times times;
+};
+
+namespace
+{
+
+// Bump this whenever decoding or the cache file layout changes.
+constexpr uint32_t SCENE_CACHE_VERSION = 1;
+constexpr char SCENE_CACHE_MAGIC[4] = {'T', 'R', 'G', 'C'};
+
+static std::string scene_cache_path;
+
+// The key is stored in the cache file and compared in full, its hash only
+// names the file.
+std::string build_scene_cache_key(const std::string& path)
+{
+    std::error_code ec;
+    uintmax_t size = fs::file_size(path, ec);
+    if(ec) return "";
+    fs::file_time_type mtime = fs::last_write_time(path, ec);
+    if(ec) return "";
+    fs::path abs_path = fs::absolute(path, ec);
+    if(ec) return "";
+
+    return "tauray-gltf " + std::to_string(SCENE_CACHE_VERSION) + "\n" +
+        "source " + abs_path.lexically_normal().generic_string() + " " +
+        std::to_string(size) + " " +
+        std::to_string(mtime.time_since_epoch().count()) + "\n" +
+        "layout " + std::to_string(sizeof(mesh::vertex)) + " " +
+        std::to_string(sizeof(mesh::skin_data)) + "\n";
+}
+
+template<typename T>
+void write_pod(std::string& out, const T& value)
+{
+    out.append((const char*)&value, sizeof(value));
+}
+
+template<typename T>
+void write_array(std::string& out, const std::vector<T>& data)
+{
+    write_pod(out, uint64_t(data.size()));
+    out.append((const char*)data.data(), data.size() * sizeof(T));
+}
+
+struct scene_cache_reader
+{
+    const uint8_t* data;
+    size_t size;
+    size_t offset = 0;
+    bool ok = true;
+
+    template<typename T>
+    T read_pod()
+    {
+        T value = {};
+        if(!ok || size - offset < sizeof(value))
+        {
+            ok = false;
+            return value;
+        }
+        memcpy(&value, data + offset, sizeof(value));
+        offset += sizeof(value);
+        return value;
+    }
+
+    // This is a single copy per array, there is no per-element conversion.
+    template<typename T>
+    void read_array(std::vector<T>& out)
+    {
+        uint64_t count = read_pod<uint64_t>();
+        if(!ok || count > (size - offset) / sizeof(T))
+        {
+            ok = false;
+            return;
+        }
+        out.resize(count);
+        memcpy((void*)out.data(), data + offset, count * sizeof(T));
+        offset += count * sizeof(T);
+    }
+};
+
+// Used on cache hits, where the images are already in the cache.
+bool skip_image_data(
+    tinygltf::Image*, const int, std::string*, std::string*,
+    int, int, const unsigned char*, int, void*
 ){
-    TR_LOG("Started loading glTF scene from ", path);
-    scene_assets md;
+    return true;
+}
 
-    std::string err, warn;
-    tinygltf::Model gltf_model;
-    tinygltf::TinyGLTF loader;
+bool read_scene_cache_header(scene_cache_reader& r, const std::string& key)
+{
+    char magic[4];
+    for(char& c: magic) c = r.read_pod<char>();
+    if(!r.ok || memcmp(magic, SCENE_CACHE_MAGIC, sizeof(magic)) != 0)
+        return false;
+    if(r.read_pod<uint32_t>() != SCENE_CACHE_VERSION)
+        return false;
+    std::vector<char> stored_key;
+    r.read_array(stored_key);
+    return r.ok && std::string(stored_key.begin(), stored_key.end()) == key;
+}
 
-    // TinyGLTF uses stb_image too, and expects this value.
-    stbi_set_flip_vertically_on_load(true);
+// Fills in the embedded images and primitives of an already parsed file.
+bool read_scene_cache(scene_cache_reader& r, gltf_file& file)
+{
+    tinygltf::Model& model = file.model;
+    if(r.read_pod<uint32_t>() != model.images.size())
+        return false;
+    file.opaque_images.resize(model.images.size(), false);
+    for(size_t i = 0; r.ok && i < model.images.size(); ++i)
+    {
+        tinygltf::Image& image = model.images[i];
+        bool embedded = r.read_pod<uint8_t>();
+        if(embedded != (image.bufferView != -1))
+            return false;
+        if(!embedded) continue;
+        image.width = r.read_pod<int32_t>();
+        image.height = r.read_pod<int32_t>();
+        image.component = r.read_pod<int32_t>();
+        image.bits = r.read_pod<int32_t>();
+        image.pixel_type = r.read_pod<int32_t>();
+        file.opaque_images[i] = r.read_pod<uint8_t>();
+        r.read_array(image.image);
+    }
 
-    if(!loader.LoadBinaryFromFile(&gltf_model, &err, &warn, path))
-        throw std::runtime_error(err);
+    if(r.read_pod<uint32_t>() != model.meshes.size())
+        return false;
+    file.meshes.resize(model.meshes.size());
+    for(size_t i = 0; r.ok && i < model.meshes.size(); ++i)
+    {
+        if(r.read_pod<uint32_t>() != model.meshes[i].primitives.size())
+            return false;
+        file.meshes[i].resize(model.meshes[i].primitives.size());
+        for(gltf_file::primitive& p: file.meshes[i])
+        {
+            p.material = r.read_pod<int32_t>();
+            p.m.reset(new mesh(file.dev));
+            r.read_array(p.m->get_vertices());
+            r.read_array(p.m->get_indices());
+            r.read_array(p.m->get_skin());
+        }
+    }
+    return r.ok;
+}
 
-    for(tinygltf::Image& image: gltf_model.images)
+std::string write_scene_cache(const std::string& key, const gltf_file& file)
+{
+    std::string out;
+    out.append(SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+    write_pod(out, SCENE_CACHE_VERSION);
+    write_array(out, std::vector<char>(key.begin(), key.end()));
+
+    const tinygltf::Model& model = file.model;
+    write_pod(out, uint32_t(model.images.size()));
+    for(size_t i = 0; i < model.images.size(); ++i)
     {
-        if(image.bufferView != -1)
-        {// Embedded image
-            vk::Format format;
+        const tinygltf::Image& image = model.images[i];
+        bool embedded = image.bufferView != -1;
+        write_pod(out, uint8_t(embedded));
+        if(!embedded) continue;
+        write_pod(out, int32_t(image.width));
+        write_pod(out, int32_t(image.height));
+        write_pod(out, int32_t(image.component));
+        write_pod(out, int32_t(image.bits));
+        write_pod(out, int32_t(image.pixel_type));
+        write_pod(out, uint8_t(file.opaque_images[i]));
+        write_array(out, image.image);
+    }
 
-            switch(image.component)
-            {
-            case 1:
-                format = image.bits > 8 ? vk::Format::eR16Unorm : vk::Format::eR8Unorm;
-                break;
-            case 2:
-                format = image.bits > 8 ?
-                    vk::Format::eR16G16Unorm : vk::Format::eR8G8Unorm;
-                break;
-            default:
-            case 3:
-                format = image.bits > 8 ?
-                    vk::Format::eR16G16B16Unorm : vk::Format::eR8G8B8Unorm;
-                break;
-            case 4:
-                format = image.bits > 8 ?
-                    vk::Format::eR16G16B16A16Unorm :
-                    vk::Format::eR8G8B8A8Unorm;
-                break;
-            }
+    write_pod(out, uint32_t(file.meshes.size()));
+    for(const std::vector<gltf_file::primitive>& primitives: file.meshes)
+    {
+        write_pod(out, uint32_t(primitives.size()));
+        for(const gltf_file::primitive& p: primitives)
+        {
+            write_pod(out, int32_t(p.material));
+            write_array(out, p.m->get_vertices());
+            write_array(out, p.m->get_indices());
+            write_array(out, p.m->get_skin());
+        }
+    }
+    return out;
+}
 
-            flip_vector_image(image.image, image.height);
+}
 
-            md.textures.emplace_back(new texture(
-                dev,
-                uvec2(image.width, image.height),
-                1,
-                format,
-                image.image.size(),
-                image.image.data(),
-                vk::ImageTiling::eOptimal,
-                vk::ImageUsageFlagBits::eSampled,
-                vk::ImageLayout::eShaderReadOnlyOptimal
-            ));
+void set_gltf_cache_path(const std::string& path)
+{
+    scene_cache_path = path;
+}
 
-            if(check_opaque(image))
-                md.textures.back()->set_opaque(true);
+std::shared_ptr<gltf_file> decode_gltf(
+    device_mask dev,
+    const std::string& path,
+    bool force_single_sided,
+    bool force_double_sided,
+    thread_pool* pool
+){
+    using namespace std::chrono;
+    TR_LOG("Started loading glTF scene from ", path);
+    std::shared_ptr<gltf_file> file = std::make_shared<gltf_file>();
+    file->path = path;
+    file->dev = dev;
+    file->force_single_sided = force_single_sided;
+    file->force_double_sided = force_double_sided;
+    tinygltf::Model& gltf_model = file->model;
+
+    steady_clock::time_point start = steady_clock::now();
+
+    // TinyGLTF uses stb_image too, and expects this value. Other files may be
+    // decoded on other threads at the same time, so this must not touch the
+    // global setting.
+    stbi_set_flip_vertically_on_load_thread(true);
+
+    auto parse = [&](bool skip_images){
+        std::string err, warn;
+        tinygltf::TinyGLTF loader;
+        if(skip_images) loader.SetImageLoader(skip_image_data, nullptr);
+        gltf_model = tinygltf::Model();
+        if(!loader.LoadBinaryFromFile(&gltf_model, &err, &warn, path))
+            throw std::runtime_error(err);
+    };
+
+    // The JSON part is always parsed, but images and primitives come from the
+    // cache if there is a valid entry for this exact file.
+    std::string cache_key, cache_file;
+    if(!scene_cache_path.empty())
+        cache_key = build_scene_cache_key(path);
+    if(!cache_key.empty())
+        cache_file = (fs::path(scene_cache_path) / (
+            to_hex(fnv1a64(cache_key.data(), cache_key.size())) + ".scene"
+        )).string();
+
+    bool cached = false;
+    {
+        mapped_file cache;
+        if(!cache_file.empty() && cache.open(cache_file))
+        {
+            scene_cache_reader r{cache.data(), cache.size()};
+            if(read_scene_cache_header(r, cache_key))
+            {
+                parse(true);
+                cached = read_scene_cache(r, *file);
+                if(!cached)
+                {
+                    TR_WARN("Ignoring broken scene cache entry ", cache_file);
+                    file->opaque_images.clear();
+                    file->meshes.clear();
+                }
+            }
         }
-        else
-        {// URI
-            md.textures.emplace_back(new texture(dev, image.uri));
+    }
+
+    if(!cached)
+    {
+        parse(false);
+        file->opaque_images.resize(gltf_model.images.size(), false);
+        for(size_t i = 0; i < gltf_model.images.size(); ++i)
+        {
+            tinygltf::Image& image = gltf_model.images[i];
+            if(image.bufferView == -1) continue;
+            flip_vector_image(image.image, image.height);
+            file->opaque_images[i] = check_opaque(image);
         }
     }
 
+    steady_clock::time_point parse_end = steady_clock::now();
+    file->times.parse = parse_end - start;
+
     // Add animations
-    node_meta_info meta;
+    node_meta_info& meta = file->meta;
     for(tinygltf::Animation& anim: gltf_model.animations)
     {
         for(tinygltf::AnimationChannel& chan: anim.channels)
@@ -587,7 +812,7 @@ scene_assets load_gltf(
             if(it == meta.animations.end())
                 it = meta.animations.emplace(
                     chan.target_node,
-                    md.animation_pools.emplace_back(new animation_pool()).get()
+                    file->animation_pools.emplace_back(new animation_pool()).get()
                 ).first;
 
             animation& res = (*it->second)[anim.name];
@@ -651,23 +876,30 @@ scene_assets load_gltf(
         meta.skins.push_back(s);
     }
 
-    for(tinygltf::Mesh& tg_mesh: gltf_model.meshes)
+    if(cached)
     {
-        model m;
+        file->times.meshes = steady_clock::now() - parse_end;
+        TR_LOG("Loaded preprocessed data of ", path, " from the scene cache");
+        return file;
+    }
 
-        for(tinygltf::Primitive& p: tg_mesh.primitives)
+    // Primitives are independent of each other, so their attribute conversion
+    // and normal & tangent generation is spread over the pool.
+    std::vector<std::pair<int, int>> primitives;
+    file->meshes.resize(gltf_model.meshes.size());
+    for(size_t i = 0; i < gltf_model.meshes.size(); ++i)
+    {
+        file->meshes[i].resize(gltf_model.meshes[i].primitives.size());
+        for(size_t j = 0; j < gltf_model.meshes[i].primitives.size(); ++j)
+            primitives.push_back({int(i), int(j)});
+    }
+
+    auto decode_primitives = [&](size_t begin, size_t end){
+        for(size_t index = begin; index < end; ++index)
         {
-            material primitive_material;
-            if(p.material >= 0)
-            {
-                primitive_material = create_material(
-                    gltf_model.materials[p.material], gltf_model, md
-                );
-                if(force_single_sided && primitive_material.transmittance == 0)
-                    primitive_material.double_sided = false;
-                if(force_double_sided)
-                    primitive_material.double_sided = true;
-            }
+            auto [mesh_index, primitive_index] = primitives[index];
+            tinygltf::Mesh& tg_mesh = gltf_model.meshes[mesh_index];
+            tinygltf::Primitive& p = tg_mesh.primitives[primitive_index];
 
             std::vector<vec3> vert_pos;
             std::vector<vec3> vert_norm;
@@ -695,19 +927,24 @@ scene_assets load_gltf(
             bool generate_tangents = false;
             if(vert_tangent.size() == 0)
             {
-                if(primitive_material.normal_tex.first)
-                    TR_WARN(
-                        path, ": ", tg_mesh.name,
-                        " uses a normal map but is missing tangent data. Please "
-                        "export the asset with [Geometry > Tangents] ticked in "
-                        "Blender."
-                    );
+                if(
+                    p.material >= 0 &&
+                    gltf_model.materials[p.material].normalTexture.index != -1
+                ) TR_WARN(
+                    path, ": ", tg_mesh.name,
+                    " uses a normal map but is missing tangent data. Please "
+                    "export the asset with [Geometry > Tangents] ticked in "
+                    "Blender."
+                );
                 generate_tangents = true;
             }
 
             bool generate_normals = vert_norm.size() == 0;
 
             mesh* prim_mesh = new mesh(dev);
+            file->meshes[mesh_index][primitive_index] = {
+                std::unique_ptr<mesh>(prim_mesh), p.material
+            };
             std::vector<mesh::vertex>& mesh_vert = prim_mesh->get_vertices();
             std::vector<mesh::skin_data>& mesh_skin = prim_mesh->get_skin();
             std::vector<uint32_t>& mesh_ind = prim_mesh->get_indices();
@@ -742,13 +979,118 @@ scene_assets load_gltf(
                 prim_mesh->calculate_normals();
             if(generate_tangents)
                 prim_mesh->calculate_tangents();
+        }
+    };
+    if(pool) pool->parallel_for(primitives.size(), 16, decode_primitives);
+    else decode_primitives(0, primitives.size());
+
+    file->times.meshes = steady_clock::now() - parse_end;
+
+    if(!cache_file.empty())
+    {
+        std::string data = write_scene_cache(cache_key, *file);
+        if(!write_file_atomically(cache_file, data.data(), data.size()))
+            TR_WARN("Failed to write scene cache entry ", cache_file);
+    }
+    return file;
+}
+
+scene_assets instantiate_gltf(
+    scene& s,
+    gltf_file& file,
+    upload_batcher* batcher
+){
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+    scene_assets md;
+    tinygltf::Model& gltf_model = file.model;
+    device_mask dev = file.dev;
+
+    for(size_t i = 0; i < gltf_model.images.size(); ++i)
+    {
+        tinygltf::Image& image = gltf_model.images[i];
+        if(image.bufferView != -1)
+        {// Embedded image
+            vk::Format format;
+
+            switch(image.component)
+            {
+            case 1:
+                format = image.bits > 8 ? vk::Format::eR16Unorm : vk::Format::eR8Unorm;
+                break;
+            case 2:
+                format = image.bits > 8 ?
+                    vk::Format::eR16G16Unorm : vk::Format::eR8G8Unorm;
+                break;
+            default:
+            case 3:
+                format = image.bits > 8 ?
+                    vk::Format::eR16G16B16Unorm : vk::Format::eR8G8B8Unorm;
+                break;
+            case 4:
+                format = image.bits > 8 ?
+                    vk::Format::eR16G16B16A16Unorm :
+                    vk::Format::eR8G8B8A8Unorm;
+                break;
+            }
+
+            md.textures.emplace_back(new texture(
+                dev,
+                uvec2(image.width, image.height),
+                1,
+                format,
+                image.image.size(),
+                image.image.data(),
+                vk::ImageTiling::eOptimal,
+                vk::ImageUsageFlagBits::eSampled,
+                vk::ImageLayout::eShaderReadOnlyOptimal,
+                vk::SampleCountFlagBits::e1,
+                batcher
+            ));
+
+            if(file.opaque_images[i])
+                md.textures.back()->set_opaque(true);
+        }
+        else
+        {// URI
+            md.textures.emplace_back(new texture(dev, image.uri, batcher));
+        }
+    }
+
+    steady_clock::time_point textures_end = steady_clock::now();
+    file.times.textures = textures_end - start;
+
+    node_meta_info& meta = file.meta;
+    for(auto& pool: file.animation_pools)
+        md.animation_pools.emplace_back(std::move(pool));
+    file.animation_pools.clear();
 
-            md.meshes.emplace_back(prim_mesh);
+    for(std::vector<gltf_file::primitive>& primitives: file.meshes)
+    {
+        model m;
+
+        for(gltf_file::primitive& p: primitives)
+        {
+            material primitive_material;
+            if(p.material >= 0)
+            {
+                primitive_material = create_material(
+                    gltf_model.materials[p.material], gltf_model, md
+                );
+                if(file.force_single_sided && primitive_material.transmittance == 0)
+                    primitive_material.double_sided = false;
+                if(file.force_double_sided)
+                    primitive_material.double_sided = true;
+            }
+
+            mesh* prim_mesh = p.m.get();
+            md.meshes.emplace_back(std::move(p.m));
             m.add_vertex_group(primitive_material, prim_mesh);
         }
 
         meta.models.emplace_back(std::move(m));
     }
+    file.meshes.clear();
 
     // Add objects & cameras
     for(tinygltf::Scene& scene: gltf_model.scenes)
@@ -769,7 +1111,7 @@ scene_assets load_gltf(
 
     // Upload buffer data here so that we have had time to fill in joint data
     for(auto& m: md.meshes)
-        m->refresh_buffers();
+        m->refresh_buffers(batcher);
 
     // Post-processing
     s.foreach([&](entity id, added_by_this_file&, transformable& t, animated* a, model& animation_model){
@@ -793,8 +1135,27 @@ scene_assets load_gltf(
         s.remove<added_by_this_file>(id);
     });
 
-    TR_LOG("Finished loading glTF scene", path);
+    file.times.scene = steady_clock::now() - textures_end;
+    TR_LOG("Finished loading glTF scene ", file.path);
     return md;
 }
 
+const gltf_load_times& get_load_times(const gltf_file& file)
+{
+    return file.times;
+}
+
+scene_assets load_gltf(
+    device_mask dev,
+    scene& s,
+    const std::string& path,
+    bool force_single_sided,
+    bool force_double_sided
+){
+    std::shared_ptr<gltf_file> file = decode_gltf(
+        dev, path, force_single_sided, force_double_sided
+    );
+    return instantiate_gltf(s, *file);
+}
+
 }
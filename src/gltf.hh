@@ -2,10 +2,56 @@
 #define TAURAY_GLTF_HH
 #include "scene_assets.hh"
 #include "scene.hh"
+#include "thread_pool.hh"
+#include "upload_batcher.hh"
+#include <chrono>
+#include <memory>
 
 namespace tr
 {
 
+// Loading a glTF file is split in two phases. decode_gltf() parses the file,
+// decodes embedded images and converts mesh attributes. It doesn't touch the
+// scene or the GPU, so multiple files can be decoded in parallel.
+// instantiate_gltf() then uploads the data and adds the entities to the
+// scene; it must be called from one thread at a time.
+struct gltf_file;
+
+struct gltf_load_times
+{
+    std::chrono::steady_clock::duration parse =
+        std::chrono::steady_clock::duration::zero();
+    std::chrono::steady_clock::duration meshes =
+        std::chrono::steady_clock::duration::zero();
+    std::chrono::steady_clock::duration textures =
+        std::chrono::steady_clock::duration::zero();
+    std::chrono::steady_clock::duration scene =
+        std::chrono::steady_clock::duration::zero();
+};
+
+// Decoded images and primitives of .glb files are cached in this directory,
+// keyed by the path, size and modification time of the file. An empty path
+// disables the cache.
+void set_gltf_cache_path(const std::string& path);
+
+// If a pool is given, primitives are converted on it as well. This may be
+// called from a job running in the same pool.
+std::shared_ptr<gltf_file> decode_gltf(
+    device_mask dev,
+    const std::string& path,
+    bool force_single_sided = false,
+    bool force_double_sided = false,
+    thread_pool* pool = nullptr
+);
+// If a batcher is given, textures and meshes are uploaded through it and must
+// not be rendered before it has been flushed and the flush has completed.
+scene_assets instantiate_gltf(
+    scene& s,
+    gltf_file& file,
+    upload_batcher* batcher = nullptr
+);
+const gltf_load_times& get_load_times(const gltf_file& file);
+
 scene_assets load_gltf(
     device_mask dev,
     scene& s,
@@ -1,9 +1,26 @@
 #include "gpu_buffer.hh"
 #include "misc.hh"
+#include <algorithm>
+
+namespace
+{
+
+constexpr size_t MAX_TRACKED_CHANGES = 4096;
+
+}
 
 namespace tr
 {
 
+void gpu_buffer::change_list::add(size_t offset, size_t bytes)
+{
+    if(bytes == 0) return;
+    // Consecutive writes are common, so merge them right away.
+    if(ranges.size() > 0 && ranges.back().second == offset)
+        ranges.back().second += bytes;
+    else ranges.push_back({offset, offset + bytes});
+}
+
 gpu_buffer::gpu_buffer()
 : capacity(0), size(0), flags(0)
 {}
@@ -40,6 +57,9 @@ bool gpu_buffer::resize(size_t size)
         for(size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
             buf.staging[i] = create_staging_buffer(dev, this->capacity, nullptr);
     }
+    // The new GPU buffer has no valid contents yet.
+    for(size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+        mark_all_changed(i);
     return true;
 }
 
@@ -87,6 +107,7 @@ void gpu_buffer::update(uint32_t frame_index, const void* data, size_t offset, s
         vmaMapMemory(dev.allocator, staging_buffer.get_allocation(), (void**)&ptr);
         memcpy(ptr + offset, data, bytes);
         vmaUnmapMemory(dev.allocator, staging_buffer.get_allocation());
+        mark_changed(dev.id, frame_index, offset, bytes);
     }
 }
 
@@ -110,16 +131,56 @@ void gpu_buffer::update_one(device_id id, uint32_t frame_index, const void* data
     vmaMapMemory(dev.allocator, staging_buffer.get_allocation(), (void**)&ptr);
     memcpy(ptr + offset, data, bytes);
     vmaUnmapMemory(dev.allocator, staging_buffer.get_allocation());
+    mark_changed(id, frame_index, offset, bytes);
 }
 
-void gpu_buffer::upload(device_id id, uint32_t frame_index, vk::CommandBuffer cb)
+size_t gpu_buffer::upload(device_id id, uint32_t frame_index, vk::CommandBuffer cb)
 {
     if(size > 0)
     {
         buffer_data& buf = buffers[id];
         vk::Buffer src = buf.staging[frame_index];
         cb.copyBuffer(src, *buf.buffer, {{0, 0, size}});
+        buf.changes[frame_index].clear();
     }
+    return size;
+}
+
+size_t gpu_buffer::upload_changes(device_id id, uint32_t frame_index, vk::CommandBuffer cb)
+{
+    buffer_data& buf = buffers[id];
+    std::vector<std::pair<size_t, size_t>>& changes = buf.changes[frame_index];
+    if(changes.size() == 0)
+        return 0;
+
+    std::sort(changes.begin(), changes.end());
+    std::vector<vk::BufferCopy> regions;
+    for(auto [begin, end]: changes)
+    {
+        // Ranges may predate a shrinking resize().
+        end = std::min(end, size);
+        if(begin >= end) continue;
+
+        if(regions.size() > 0)
+        {
+            vk::BufferCopy& prev = regions.back();
+            if(prev.srcOffset + prev.size >= begin)
+            {
+                prev.size = std::max(prev.srcOffset + prev.size, end) - prev.srcOffset;
+                continue;
+            }
+        }
+        regions.push_back({begin, begin, end - begin});
+    }
+    changes.clear();
+
+    size_t bytes = 0;
+    for(const vk::BufferCopy& region: regions)
+        bytes += region.size;
+
+    if(regions.size() > 0)
+        cb.copyBuffer(buf.staging[frame_index], *buf.buffer, regions);
+    return bytes;
 }
 
 size_t gpu_buffer::calc_buffer_entry_alignment(device_id id, size_t entry_size) const
@@ -128,6 +189,32 @@ size_t gpu_buffer::calc_buffer_entry_alignment(device_id id, size_t entry_size)
     return (entry_size+min_uniform_offset-1)/min_uniform_offset*min_uniform_offset;
 }
 
+void gpu_buffer::mark_changed(device_id id, uint32_t frame_index, size_t offset, size_t bytes)
+{
+    if(bytes == 0) return;
+    std::vector<std::pair<size_t, size_t>>& changes = buffers[id].changes[frame_index];
+    if(changes.size() > 0 && changes.back().second >= offset && changes.back().first <= offset)
+        changes.back().second = std::max(changes.back().second, offset + bytes);
+    else if(changes.size() >= MAX_TRACKED_CHANGES)
+    {
+        // Buffers that are only ever uploaded with upload() would otherwise
+        // grow this list forever, and very scattered writes are cheaper to
+        // copy in one go anyway.
+        changes.clear();
+        changes.push_back({0, capacity});
+    }
+    else changes.push_back({offset, offset + bytes});
+}
+
+void gpu_buffer::mark_all_changed(uint32_t frame_index)
+{
+    for(auto[dev, buf]: buffers)
+    {
+        buf.changes[frame_index].clear();
+        buf.changes[frame_index].push_back({0, capacity});
+    }
+}
+
 void gpu_buffer::ensure_shared_data()
 {
     if(!shared_data)
@@ -10,9 +10,25 @@ namespace tr
 // shenanigans into one simple package. It also automatically handles
 // duplicating data to all specified devices, although this adds some overhead
 // (only present if there are more than one device involved, though.)
+//
+// Writes are tracked per device and staging buffer as byte ranges, so that
+// upload_changes() only copies the parts that were actually written.
+// update() and map_changes() track exact ranges, the other write functions
+// mark the whole buffer.
 class gpu_buffer
 {
 public:
+    // Collects the byte ranges written in map_changes().
+    class change_list
+    {
+    public:
+        void add(size_t offset, size_t bytes);
+
+    private:
+        friend class gpu_buffer;
+        std::vector<std::pair<size_t /*begin*/, size_t /*end*/>> ranges;
+    };
+
     gpu_buffer();
     gpu_buffer(
         device_mask dev,
@@ -38,12 +54,27 @@ public:
     void map(uint32_t frame_index, F&& f);
     template<typename T, typename F>
     void map_one(device_id id, uint32_t frame_index, F&& f);
-    void upload(device_id id, uint32_t frame_index, vk::CommandBuffer cb);
+    // f(T* data, change_list& changes) must add every range it writes to
+    // 'changes'. Other devices only receive those ranges.
+    template<typename T, typename F>
+    void map_changes(uint32_t frame_index, F&& f);
+
+    // Copies the whole staging buffer. Use this in command buffers that are
+    // recorded once and submitted many times. Returns the number of bytes
+    // copied.
+    size_t upload(device_id id, uint32_t frame_index, vk::CommandBuffer cb);
+    // Copies only the ranges written to this staging buffer since the last
+    // upload_changes() for it. The command buffer must be recorded for this
+    // frame only, since the ranges are cleared. Returns the number of bytes
+    // copied.
+    size_t upload_changes(device_id id, uint32_t frame_index, vk::CommandBuffer cb);
 
     size_t calc_buffer_entry_alignment(device_id id, size_t entry_size) const;
 
 private:
     void ensure_shared_data();
+    void mark_changed(device_id id, uint32_t frame_index, size_t offset, size_t bytes);
+    void mark_all_changed(uint32_t frame_index);
     size_t capacity;
     size_t size;
     std::unique_ptr<char[]> shared_data;
@@ -56,6 +87,9 @@ private:
     {
         vkm<vk::Buffer> buffer;
         vkm<vk::Buffer> staging[MAX_FRAMES_IN_FLIGHT];
+        // Written byte ranges of each staging buffer that have not been
+        // uploaded yet. May overlap, upload_changes() merges them.
+        std::vector<std::pair<size_t, size_t>> changes[MAX_FRAMES_IN_FLIGHT];
     };
     per_device<buffer_data> buffers;
 };
@@ -85,6 +119,7 @@ void gpu_buffer::foreach(uint32_t frame_index, size_t entries, F&& f)
         }
 
         vmaUnmapMemory(dev.allocator, staging_buffer.get_allocation());
+        mark_all_changed(frame_index);
     }
     else
     {
@@ -110,6 +145,7 @@ void gpu_buffer::foreach(uint32_t frame_index, size_t entries, F&& f)
 
                 vmaUnmapMemory(dev.allocator, staging_buffer.get_allocation());
             }
+            mark_all_changed(frame_index);
         }
         else update(frame_index, shared_data.get(), 0, size);
     }
@@ -145,6 +181,36 @@ void gpu_buffer::map_one(device_id id, uint32_t frame_index, F&& f)
     vmaMapMemory(dev.allocator, staging_buffer.get_allocation(), (void**)&data);
     f(data);
     vmaUnmapMemory(dev.allocator, staging_buffer.get_allocation());
+    mark_changed(id, frame_index, 0, size);
+}
+
+template<typename T, typename F>
+void gpu_buffer::map_changes(uint32_t frame_index, F&& f)
+{
+    if(!*this) return;
+
+    change_list changes;
+    if(buffers.get_mask().size() == 1)
+    {
+        device& dev = *buffers.get_mask().begin();
+        buffer_data& buf = buffers[dev.id];
+
+        vkm<vk::Buffer>& staging_buffer = buf.staging[frame_index];
+        T* data = nullptr;
+        vmaMapMemory(dev.allocator, staging_buffer.get_allocation(), (void**)&data);
+        f(data, changes);
+        vmaUnmapMemory(dev.allocator, staging_buffer.get_allocation());
+
+        for(auto [begin, end]: changes.ranges)
+            mark_changed(dev.id, frame_index, begin, end - begin);
+    }
+    else
+    {
+        ensure_shared_data();
+        f(reinterpret_cast<T*>(shared_data.get()), changes);
+        for(auto [begin, end]: changes.ranges)
+            update(frame_index, shared_data.get() + begin, begin, end - begin);
+    }
 }
 
 }
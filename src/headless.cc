@@ -1,6 +1,7 @@
 #include "headless.hh"
 #include "misc.hh"
 #include "log.hh"
+#include "pixel_conversion.hh"
 #include "tinyexr.h"
 #include "stb_image_write.h"
 #include <iostream>
@@ -87,6 +88,18 @@ headless::headless(const options& opt)
     if(!std::filesystem::exists(output_dir))
         std::filesystem::create_directories(output_dir);
 
+    if(!opt.viewer && opt.output_file_type != EMPTY)
+    {
+        unsigned thread_count = opt.save_thread_count;
+        if(thread_count == 0)
+            thread_count = max(std::thread::hardware_concurrency(), 1u);
+        save_pool.reset(new thread_pool(
+            thread_count,
+            opt.max_queued_saves ? opt.max_queued_saves : thread_count
+        ));
+        save_scratch.resize(save_pool->get_thread_count());
+    }
+
     if(opt.viewer) init_sdl();
     init_vulkan(vkGetInstanceProcAddr);
     init_devices();
@@ -96,11 +109,19 @@ headless::headless(const options& opt)
 
 headless::~headless()
 {
-    if(!opt.viewer)
+    if(save_pool)
     {
-        for(int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
-            headless::save_image(i);
-        reap_workers(false);
+        try
+        {
+            for(int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+                headless::save_image(i);
+            flush_saves();
+        }
+        catch(std::exception& e)
+        {
+            TR_ERR(e.what());
+        }
+        save_pool.reset();
     }
     deinit_resources();
     deinit_images();
@@ -297,245 +318,206 @@ void headless::save_image(uint32_t swapchain_index)
 
     (void)d.logical.waitForFences(*id.copy_fence, true, UINT64_MAX);
     d.logical.resetFences(*id.copy_fence);
+    id.copy_ongoing = false;
 
-    // Map memory, save images
+    // Map memory, hand the layers off to the encoders
     float* all_mem = nullptr;
     vmaMapMemory(d.allocator, id.staging_buffer.get_allocation(), (void**)&all_mem);
 
+    size_t image_pixels = opt.size.x*opt.size.y;
     for(size_t display_index = 0; display_index < opt.display_count; ++display_index)
     {
-        std::string filename = opt.output_prefix;
-        if(opt.display_count > 1) filename += std::to_string(display_index)+"_";
-        if(!opt.single_frame) filename += std::to_string(id.frame_number);
+        save_job job;
+        job.filename = opt.output_prefix;
+        if(opt.display_count > 1) job.filename += std::to_string(display_index)+"_";
+        if(!opt.single_frame) job.filename += std::to_string(id.frame_number);
 
-        reap_workers(true);
-        while(save_workers.size() >= std::thread::hardware_concurrency())
         {
+            std::lock_guard<std::mutex> lock(free_layers_mutex);
+            if(free_layers.size() != 0)
             {
-                std::unique_lock<std::mutex> lock(save_workers_mutex);
-                save_workers_cv.wait(lock);
+                job.pixels = std::move(free_layers.back());
+                free_layers.pop_back();
             }
-            reap_workers(true);
         }
+        job.pixels.resize(4*image_pixels);
 
-        size_t image_pixels = opt.size.x*opt.size.y;
         size_t pixel_offset = image_pixels * 4 * display_index;
-        float* mem = all_mem + pixel_offset;
+        memcpy(
+            job.pixels.data(),
+            all_mem + pixel_offset,
+            sizeof(float)*job.pixels.size()
+        );
 
-        if(!opt.skip_nan_check)
-        {
-            for(size_t j = 0; j < image_pixels; ++j)
-            {
-                if(any(isnan(vec4(
-                    mem[j*4+0],
-                    mem[j*4+1],
-                    mem[j*4+2],
-                    mem[j*4+3]
-                )))){
-                    TR_LOG("NaN pixel at: ", (j%opt.size.x), ", ", (j/opt.size.x));
-                }
-            }
+        save_pool->push([this, job = std::move(job)](size_t worker_index) mutable {
+            encode_image(job, save_scratch[worker_index]);
+            std::lock_guard<std::mutex> lock(free_layers_mutex);
+            free_layers.emplace_back(std::move(job.pixels));
+        });
+    }
+    vmaUnmapMemory(d.allocator, id.staging_buffer.get_allocation());
+}
+
+void headless::encode_image(const save_job& job, encoder_scratch& scratch)
+{
+    size_t image_pixels = opt.size.x*opt.size.y;
+    const float* mem = job.pixels.data();
+    std::string filename = job.filename;
+
+    if(!opt.skip_nan_check)
+    {
+        for(
+            size_t j = find_nan_rgba32f(mem, 0, image_pixels);
+            j < image_pixels;
+            j = find_nan_rgba32f(mem, j+1, image_pixels)
+        ){
+            TR_LOG("NaN pixel at: ", (j%opt.size.x), ", ", (j/opt.size.x));
         }
+    }
 
-        if(opt.output_file_type == headless::EXR)
+    if(opt.output_file_type == headless::EXR)
+    {
+        filename += ".exr";
+
+        std::vector<float>& channel_data = scratch.channel_data;
+        channel_data.resize(4*image_pixels);
+        deinterleave_rgba32f(mem, channel_data.data(), image_pixels);
+
+        int num_channels = 0;
+        int pixel_type = 0;
+        parse_pixel_format(opt.output_format, num_channels, pixel_type);
+
+        EXRHeader header;
+        InitEXRHeader(&header);
+        header.num_channels = num_channels;
+        header.compression_type = get_compression_type(opt.output_compression);
+        EXRChannelInfo channel_infos[4];
+        header.channels = channel_infos;
+
+        int pixel_types[4] = {
+            TINYEXR_PIXELTYPE_FLOAT,
+            TINYEXR_PIXELTYPE_FLOAT,
+            TINYEXR_PIXELTYPE_FLOAT,
+            TINYEXR_PIXELTYPE_FLOAT
+        };
+        header.pixel_types = pixel_types;
+        int requested_pixel_types[4] = {
+            pixel_type, pixel_type, pixel_type, pixel_type
+        };
+        header.requested_pixel_types = requested_pixel_types;
+
+        EXRImage image;
+        InitEXRImage(&image);
+        image.num_channels = num_channels;
+
+        // BGRA order
+        float* image_ptr[4];
+        if(num_channels == 3)
         {
-            filename += ".exr";
-
-            std::vector<float> channel_data(4*image_pixels);
-            for(int i = 0; i < 4; ++i)
-            for(size_t j = 0; j < image_pixels; ++j)
-                channel_data[i*image_pixels+j] = mem[j*4+i];
-
-            worker* w = new worker;
-            save_workers.emplace_back(w);
-            save_workers.back()->t = std::thread([
-                this,
-                filename,
-                image_pixels,
-                channel_data = std::move(channel_data),
-                w
-            ]() mutable {
-                int num_channels = 0;
-                int pixel_type = 0;
-                parse_pixel_format(opt.output_format, num_channels, pixel_type);
-
-                EXRHeader header;
-                InitEXRHeader(&header);
-                header.num_channels = num_channels;
-                header.compression_type = get_compression_type(opt.output_compression);
-                EXRChannelInfo channel_infos[4];
-                header.channels = channel_infos;
-
-                int pixel_types[4] = {
-                    TINYEXR_PIXELTYPE_FLOAT,
-                    TINYEXR_PIXELTYPE_FLOAT,
-                    TINYEXR_PIXELTYPE_FLOAT,
-                    TINYEXR_PIXELTYPE_FLOAT
-                };
-                header.pixel_types = pixel_types;
-                int requested_pixel_types[4] = {
-                    pixel_type, pixel_type, pixel_type, pixel_type
-                };
-                header.requested_pixel_types = requested_pixel_types;
-
-                EXRImage image;
-                InitEXRImage(&image);
-                image.num_channels = num_channels;
-
-                // BGRA order
-                float* image_ptr[4];
-                if(num_channels == 3)
-                {
-                    strncpy(channel_infos[0].name, "B", 2);
-                    strncpy(channel_infos[1].name, "G", 2);
-                    strncpy(channel_infos[2].name, "R", 2);
-                    image_ptr[0] = channel_data.data() + 2*image_pixels;
-                    image_ptr[1] = channel_data.data() + 1*image_pixels;
-                    image_ptr[2] = channel_data.data() + 0*image_pixels;
-                }
-                else
-                {
-                    strncpy(channel_infos[0].name, "A", 2);
-                    strncpy(channel_infos[1].name, "B", 2);
-                    strncpy(channel_infos[2].name, "G", 2);
-                    strncpy(channel_infos[3].name, "R", 2);
-                    image_ptr[0] = channel_data.data() + 3*image_pixels;
-                    image_ptr[1] = channel_data.data() + 2*image_pixels;
-                    image_ptr[2] = channel_data.data() + 1*image_pixels;
-                    image_ptr[3] = channel_data.data() + 0*image_pixels;
-                }
-                image.images = (uint8_t**)image_ptr;
-                image.width = opt.size.x;
-                image.height = opt.size.y;
-
-                const char* err = nullptr;
-                int ret = SaveEXRImageToFile(&image, &header, filename.c_str(), &err);
-                if(ret != TINYEXR_SUCCESS)
-                    throw std::runtime_error("Failed to write " + filename + ": " + err);
-
-                {
-                    std::lock_guard<std::mutex> lock(save_workers_mutex);
-                    TR_LOG("Saved ", filename);
-                    w->finished = true;
-                }
-                save_workers_cv.notify_one();
-            });
+            strncpy(channel_infos[0].name, "B", 2);
+            strncpy(channel_infos[1].name, "G", 2);
+            strncpy(channel_infos[2].name, "R", 2);
+            image_ptr[0] = channel_data.data() + 2*image_pixels;
+            image_ptr[1] = channel_data.data() + 1*image_pixels;
+            image_ptr[2] = channel_data.data() + 0*image_pixels;
         }
-        // Saving these is similiar enough and they both use stbi_write_*.
-        // Implementations can be separated in the future if they diverge.
-        else if(
-            opt.output_file_type == headless::PNG ||
-            opt.output_file_type == headless::BMP
-        ){
-            filename += opt.output_file_type == headless::PNG ? ".png" : ".bmp";
-
-            std::vector<uint8_t> pixel_data(4*image_pixels);
-            for(size_t j = 0; j < image_pixels*4; ++j)
-                pixel_data[j] = clamp((int)round(mem[j]*255.0f), 0, 255);
-
-            worker* w = new worker;
-            save_workers.emplace_back(w);
-            save_workers.back()->t = std::thread([
-                this,
-                filename,
-                pixel_data = std::move(pixel_data),
-                w
-            ]() mutable {
-                int ret = opt.output_file_type == headless::PNG ?
-                    stbi_write_png(
-                        filename.c_str(),
-                        opt.size.x,
-                        opt.size.y,
-                        4,
-                        pixel_data.data(),
-                        opt.size.x*4
-                    ) :
-                    stbi_write_bmp(
-                        filename.c_str(),
-                        opt.size.x,
-                        opt.size.y,
-                        4,
-                        pixel_data.data()
-                    );
-                if(ret == 0)
-                {
-                    throw std::runtime_error("Failed to write " + filename);
-                }
-
-                {
-                    std::lock_guard<std::mutex> lock(save_workers_mutex);
-                    TR_LOG("Saved ", filename);
-                    w->finished = true;
-                }
-                save_workers_cv.notify_one();
-            });
+        else
+        {
+            strncpy(channel_infos[0].name, "A", 2);
+            strncpy(channel_infos[1].name, "B", 2);
+            strncpy(channel_infos[2].name, "G", 2);
+            strncpy(channel_infos[3].name, "R", 2);
+            image_ptr[0] = channel_data.data() + 3*image_pixels;
+            image_ptr[1] = channel_data.data() + 2*image_pixels;
+            image_ptr[2] = channel_data.data() + 1*image_pixels;
+            image_ptr[3] = channel_data.data() + 0*image_pixels;
         }
-        else if(opt.output_file_type == headless::HDR)
+        image.images = (uint8_t**)image_ptr;
+        image.width = opt.size.x;
+        image.height = opt.size.y;
+
+        const char* err = nullptr;
+        int ret = SaveEXRImageToFile(&image, &header, filename.c_str(), &err);
+        if(ret != TINYEXR_SUCCESS)
+            throw std::runtime_error("Failed to write " + filename + ": " + err);
+    }
+    // Saving these is similiar enough and they both use stbi_write_*.
+    // Implementations can be separated in the future if they diverge.
+    else if(
+        opt.output_file_type == headless::PNG ||
+        opt.output_file_type == headless::BMP
+    ){
+        filename += opt.output_file_type == headless::PNG ? ".png" : ".bmp";
+
+        std::vector<uint8_t>& pixel_data = scratch.pixel_data;
+        pixel_data.resize(4*image_pixels);
+        quantize_rgba32f_to_rgba8(mem, pixel_data.data(), image_pixels);
+
+        int ret = opt.output_file_type == headless::PNG ?
+            stbi_write_png(
+                filename.c_str(),
+                opt.size.x,
+                opt.size.y,
+                4,
+                pixel_data.data(),
+                opt.size.x*4
+            ) :
+            stbi_write_bmp(
+                filename.c_str(),
+                opt.size.x,
+                opt.size.y,
+                4,
+                pixel_data.data()
+            );
+        if(ret == 0)
         {
-            filename += ".hdr";
-
-            std::vector<float> pixel_data(4*image_pixels);
-            for(size_t j = 0; j < image_pixels*4; ++j)
-                pixel_data[j] = mem[j];
-
-            worker* w = new worker;
-            save_workers.emplace_back(w);
-            save_workers.back()->t = std::thread([
-                this,
-                filename,
-                pixel_data = std::move(pixel_data),
-                w
-            ]() mutable {
-                int ret = stbi_write_hdr(
-                    filename.c_str(),
-                    opt.size.x,
-                    opt.size.y,
-                    4,
-                    pixel_data.data()
-                );
-                if(ret == 0)
-                {
-                    throw std::runtime_error("Failed to write " + filename);
-                }
-
-                {
-                    std::lock_guard<std::mutex> lock(save_workers_mutex);
-                    TR_LOG("Saved ", filename);
-                    w->finished = true;
-                }
-                save_workers_cv.notify_one();
-            });
+            throw std::runtime_error("Failed to write " + filename);
         }
-        else if(opt.output_file_type == headless::RAW)
+    }
+    else if(opt.output_file_type == headless::HDR)
+    {
+        filename += ".hdr";
+
+        int ret = stbi_write_hdr(
+            filename.c_str(),
+            opt.size.x,
+            opt.size.y,
+            4,
+            mem
+        );
+        if(ret == 0)
         {
-            filename += ".raw";
-
-            std::vector<float> pixel_data(4*image_pixels);
-            memcpy(pixel_data.data(), mem, sizeof(float)*pixel_data.size());
-
-            worker* w = new worker;
-            save_workers.emplace_back(w);
-            save_workers.back()->t = std::thread([
-                this,
-                filename,
-                pixel_data = std::move(pixel_data),
-                w
-            ]() mutable {
-                std::fstream f(filename, std::ios::out | std::ios::binary);
-                if(!f) throw std::runtime_error("Failed to write " + filename);
-                f.write((char*)pixel_data.data(), pixel_data.size()*sizeof(float));
-                f.close();
-
-                {
-                    std::lock_guard<std::mutex> lock(save_workers_mutex);
-                    TR_LOG("Saved ", filename);
-                    w->finished = true;
-                }
-                save_workers_cv.notify_one();
-            });
+            throw std::runtime_error("Failed to write " + filename);
         }
     }
-    vmaUnmapMemory(d.allocator, id.staging_buffer.get_allocation());
+    else if(opt.output_file_type == headless::RAW)
+    {
+        filename += ".raw";
+
+        std::fstream f(filename, std::ios::out | std::ios::binary);
+        if(!f) throw std::runtime_error("Failed to write " + filename);
+        f.write((const char*)mem, job.pixels.size()*sizeof(float));
+        f.close();
+    }
+    else return;
+
+    TR_LOG("Saved ", filename);
+}
+
+void headless::flush_saves()
+{
+    save_pool->wait();
+
+    thread_pool::stats stats = save_pool->get_stats();
+    float stall_ms = std::chrono::duration_cast<
+        std::chrono::duration<float, std::milli>
+    >(stats.blocked_time).count();
+    TR_LOG(
+        "Saved ", stats.finished_jobs, " images with ",
+        save_pool->get_thread_count(), " encoder threads. The render loop "
+        "stalled ", stats.blocked_pushes, " times for ", stall_ms,
+        " ms in total waiting for the encoders."
+    );
 }
 
 void headless::view_image(uint32_t swapchain_index)
@@ -559,23 +541,4 @@ void headless::view_image(uint32_t swapchain_index)
     SDL_UpdateWindowSurface(win);
 }
 
-void headless::reap_workers(bool finished_only)
-{
-    for(auto it = save_workers.begin(); it != save_workers.end();)
-    {
-        bool finished = true;
-        if(finished_only)
-        {
-            std::lock_guard<std::mutex> lock(save_workers_mutex);
-            finished = (*it)->finished;
-        }
-        if(finished)
-        {
-            (*it)->t.join();
-            it = save_workers.erase(it);
-        }
-        else it++;
-    }
-}
-
 }
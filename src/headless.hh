@@ -2,6 +2,7 @@
 #define TAURAY_HEADLESS_HH
 
 #include "context.hh"
+#include "thread_pool.hh"
 
 #if _WIN32
 #include <SDL.h>
@@ -11,9 +12,7 @@
 #include <SDL2/SDL_vulkan.h>
 #endif
 
-#include <thread>
 #include <mutex>
-#include <condition_variable>
 #include <map>
 
 namespace tr
@@ -76,6 +75,14 @@ public:
         // If you want the first number to be something other than 0, set this
         // to that number.
         unsigned first_frame_index = 0;
+
+        // Number of threads encoding and writing captured images. 0 uses the
+        // number of hardware threads.
+        unsigned save_thread_count = 0;
+
+        // Number of images that may wait for an encoder thread before the
+        // render loop is stalled. 0 uses save_thread_count.
+        unsigned max_queued_saves = 0;
     };
 
     headless(const options& opt);
@@ -107,7 +114,22 @@ private:
     void save_image(uint32_t swapchain_index);
     void view_image(uint32_t swapchain_index);
 
-    void reap_workers(bool finished_only);
+    struct save_job
+    {
+        std::string filename;
+        // Unmodified RGBA32F pixels of one display layer.
+        std::vector<float> pixels;
+    };
+
+    // Reused by each encoder thread across images.
+    struct encoder_scratch
+    {
+        std::vector<float> channel_data;
+        std::vector<uint8_t> pixel_data;
+    };
+
+    void encode_image(const save_job& job, encoder_scratch& scratch);
+    void flush_saves();
 
     options opt;
     SDL_Window* win;
@@ -124,14 +146,16 @@ private:
 
     std::vector<per_image_data> per_image;
 
-    struct worker
-    {
-        std::thread t;
-        bool finished = false;
-    };
-    std::vector<std::unique_ptr<worker>> save_workers;
-    std::condition_variable save_workers_cv;
-    std::mutex save_workers_mutex;
+    // The render thread only copies layers out of the staging buffers; NaN
+    // checks, conversion and encoding happen in the pool. The queue is
+    // bounded, so the render thread stalls if encoding can't keep up.
+    std::unique_ptr<thread_pool> save_pool;
+    std::vector<encoder_scratch> save_scratch;
+
+    // Layer buffers are recycled between jobs to avoid reallocating them
+    // every frame.
+    std::mutex free_layers_mutex;
+    std::vector<std::vector<float>> free_layers;
 };
 
 }
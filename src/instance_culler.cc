@@ -0,0 +1,171 @@
+#include "instance_culler.hh"
+#include "scene_stage.hh"
+#include "misc.hh"
+#include <algorithm>
+
+namespace
+{
+using namespace tr;
+
+// This must match the push_constant_buffer in shader/instance_cull.comp
+struct push_constant_buffer
+{
+    uint32_t instance_count;
+    uint32_t first_view;
+    uint32_t view_count;
+    uint32_t list_index;
+    uint32_t command_offset;
+};
+
+shader_source load_source(const instance_culler::options& opt)
+{
+    std::map<std::string, std::string> defines;
+    if(opt.opaque_only) defines["OPAQUE_ONLY"];
+    if(opt.custom_views) defines["CUSTOM_VIEWS"];
+    return {"shader/instance_cull.comp", defines};
+}
+
+}
+
+namespace tr
+{
+
+instance_culler::instance_culler(
+    device& dev,
+    scene_stage& ss,
+    const options& opt
+):  dev(&dev), ss(&ss), opt(opt), desc(dev), cull(dev),
+    list_capacity(0), instance_capacity(0)
+{
+    if(!ss.has_indirect_draw())
+        throw std::runtime_error(
+            "instance_culler requires a scene_stage with indirect_draw enabled"
+        );
+
+    shader_source src = load_source(opt);
+    desc.add(src);
+    cull.init(src, {&desc, &ss.get_descriptors()});
+}
+
+void instance_culler::record_cull(
+    vk::CommandBuffer cb,
+    const std::vector<draw_list>& lists,
+    const gpu_buffer* custom_views
+){
+    size_t instance_count = ss->get_instances().size();
+    if(lists.size() == 0 || instance_count == 0)
+        return;
+
+    if(list_capacity < lists.size() || instance_capacity < instance_count)
+    {
+        list_capacity = std::max(list_capacity, lists.size());
+        instance_capacity = std::max(instance_capacity, instance_count);
+        draw_commands = create_buffer(
+            *dev,
+            {
+                {}, list_capacity * instance_capacity *
+                    sizeof(vk::DrawIndexedIndirectCommand),
+                vk::BufferUsageFlagBits::eStorageBuffer|
+                vk::BufferUsageFlagBits::eIndirectBuffer,
+                vk::SharingMode::eExclusive
+            },
+            VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT
+        );
+        draw_counts = create_buffer(
+            *dev,
+            {
+                {}, list_capacity * sizeof(uint32_t),
+                vk::BufferUsageFlagBits::eStorageBuffer|
+                vk::BufferUsageFlagBits::eIndirectBuffer|
+                vk::BufferUsageFlagBits::eTransferDst,
+                vk::SharingMode::eExclusive
+            },
+            VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT
+        );
+    }
+
+    // Previous draws from the lists must finish before they're overwritten.
+    vk::MemoryBarrier barrier(
+        vk::AccessFlagBits::eIndirectCommandRead,
+        vk::AccessFlagBits::eTransferWrite|vk::AccessFlagBits::eShaderWrite
+    );
+    cb.pipelineBarrier(
+        vk::PipelineStageFlagBits::eDrawIndirect,
+        vk::PipelineStageFlagBits::eTransfer|vk::PipelineStageFlagBits::eComputeShader,
+        {}, barrier, {}, {}
+    );
+
+    cb.fillBuffer(draw_counts, 0, lists.size() * sizeof(uint32_t), 0);
+
+    // Also covers view matrices uploaded by the caller.
+    barrier = vk::MemoryBarrier(
+        vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eShaderRead|vk::AccessFlagBits::eShaderWrite
+    );
+    cb.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eComputeShader,
+        {}, barrier, {}, {}
+    );
+
+    cull.bind(cb);
+    desc.set_buffer(dev->id, "draw_commands", {{draw_commands, 0, VK_WHOLE_SIZE}});
+    desc.set_buffer(dev->id, "draw_counts", {{draw_counts, 0, VK_WHOLE_SIZE}});
+    if(opt.custom_views)
+        desc.set_buffer("views", *custom_views);
+    cull.push_descriptors(cb, desc, 0);
+    cull.set_descriptors(cb, ss->get_descriptors(), 0, 1);
+
+    for(size_t i = 0; i < lists.size(); ++i)
+    {
+        push_constant_buffer control;
+        control.instance_count = instance_count;
+        control.first_view = lists[i].first_view;
+        control.view_count = lists[i].view_count;
+        control.list_index = i;
+        control.command_offset = i * instance_capacity;
+        cull.push_constants(cb, control);
+        cb.dispatch((instance_count+63u)/64u, 1, 1);
+    }
+
+    barrier = vk::MemoryBarrier(
+        vk::AccessFlagBits::eShaderWrite,
+        vk::AccessFlagBits::eIndirectCommandRead
+    );
+    cb.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eDrawIndirect,
+        {}, barrier, {}, {}
+    );
+}
+
+void instance_culler::record_draw(
+    vk::CommandBuffer cb,
+    size_t list_index,
+    bool bind_prev_pos
+){
+    size_t instance_count = ss->get_instances().size();
+    if(instance_count == 0)
+        return;
+
+    vk::Buffer vertex_buffers[] = {
+        ss->get_merged_vertex_buffer(dev->id),
+        ss->get_merged_prev_pos_buffer(dev->id)
+    };
+    vk::DeviceSize offsets[] = {0, 0};
+    cb.bindVertexBuffers(0, bind_prev_pos ? 2 : 1, vertex_buffers, offsets);
+    cb.bindIndexBuffer(
+        ss->get_merged_index_buffer(dev->id),
+        0, vk::IndexType::eUint32
+    );
+    cb.drawIndexedIndirectCount(
+        draw_commands,
+        list_index * instance_capacity * sizeof(vk::DrawIndexedIndirectCommand),
+        draw_counts,
+        list_index * sizeof(uint32_t),
+        instance_count,
+        sizeof(vk::DrawIndexedIndirectCommand)
+    );
+}
+
+}
@@ -0,0 +1,70 @@
+#ifndef TAURAY_INSTANCE_CULLER_HH
+#define TAURAY_INSTANCE_CULLER_HH
+#include "context.hh"
+#include "compute_pipeline.hh"
+#include "descriptor_set.hh"
+#include "gpu_buffer.hh"
+
+namespace tr
+{
+
+class scene_stage;
+
+// Frustum culls the instances of a scene_stage that has indirect_draw enabled
+// on the GPU and draws the survivors from its merged geometry buffers with
+// drawIndexedIndirectCount. Instances are culled into draw lists, one per
+// render pass or multiview block, each visible if any of its views sees it.
+class instance_culler
+{
+public:
+    struct options
+    {
+        // Skips potentially transparent instances.
+        bool opaque_only = false;
+        // If set, views index the view_proj matrices given to record_cull()
+        // instead of the scene cameras.
+        bool custom_views = false;
+    };
+
+    struct draw_list
+    {
+        uint32_t first_view;
+        uint32_t view_count;
+    };
+
+    instance_culler(device& dev, scene_stage& ss, const options& opt);
+    instance_culler(const instance_culler& other) = delete;
+    instance_culler(instance_culler&& other) = delete;
+
+    // Must be recorded outside of render passes, before the draws. The same
+    // lists must be given for all command buffers recorded with this culler.
+    void record_cull(
+        vk::CommandBuffer cb,
+        const std::vector<draw_list>& lists,
+        const gpu_buffer* custom_views = nullptr
+    );
+
+    // Binds the merged geometry and draws the instances in the given list.
+    // The prev_pos buffer goes to vertex binding 1 if requested.
+    void record_draw(
+        vk::CommandBuffer cb,
+        size_t list_index,
+        bool bind_prev_pos = false
+    );
+
+private:
+    device* dev;
+    scene_stage* ss;
+    options opt;
+    push_descriptor_set desc;
+    compute_pipeline cull;
+
+    size_t list_capacity;
+    size_t instance_capacity;
+    vkm<vk::Buffer> draw_commands;
+    vkm<vk::Buffer> draw_counts;
+};
+
+}
+
+#endif
@@ -39,6 +39,12 @@ void apply_color(log_type type, std::ostream& os)
 #endif
 }
 
+std::mutex& get_log_mutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
 std::chrono::system_clock::time_point get_initial_time()
 {
     static std::chrono::system_clock::time_point initial =
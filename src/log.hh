@@ -6,6 +6,7 @@
 #include <chrono>
 #include <iostream>
 #include <iomanip>
+#include <mutex>
 
 // Thanks microsoft...
 #undef ERROR
@@ -75,6 +76,9 @@ extern bool enabled_log_types[5];
 extern std::ostream* log_output_streams[5];
 
 void apply_color(log_type type, std::ostream& os);
+// Held while a message is written, so that messages logged from multiple
+// threads don't get mixed up.
+std::mutex& get_log_mutex();
 
 template<typename... Args>
 void log_message(
@@ -89,8 +93,10 @@ void log_message(
             std::chrono::system_clock::now();
         std::chrono::system_clock::duration d = now - get_initial_time();
 
+        std::string message = make_string(rest...);
         std::ostream& o = *log_output_streams[(uint32_t)type];
 
+        std::lock_guard<std::mutex> lk(get_log_mutex());
         apply_color(type, o);
         if(type != log_type::TIMING)
         {
@@ -100,7 +106,7 @@ void log_message(
                 >(d).count()/1000.0
                 << "](" << file << ":" << line << ") ";
         }
-        o << make_string(rest...) << std::endl;
+        o << message << std::endl;
         apply_color(log_type::GENERAL, o);
     }
 }
@@ -259,6 +259,26 @@ uint16_t float_to_half(float value)
     return bits;
 }
 
+// https://gist.github.com/rygorous/2144712
+float half_to_float(uint16_t value)
+{
+    constexpr uint32_t shifted_exp = 0x7c00 << 13;
+    uint32_t bits = uint32_t(value & 0x7fff) << 13;
+    uint32_t exp = shifted_exp & bits;
+    bits += (127 - 15) << 23;
+    if(exp == shifted_exp) // Inf / NaN
+        bits += (128 - 16) << 23;
+    else if(exp == 0) // Zero / subnormal
+    {
+        bits += 1 << 23;
+        bits = bit_cast<uint32_t>(
+            bit_cast<float>(bits) - bit_cast<float>(uint32_t(113 << 23))
+        );
+    }
+    bits |= uint32_t(value & 0x8000) << 16;
+    return bit_cast<float>(bits);
+}
+
 uint32_t next_power_of_two(uint32_t n)
 {
     n--;
@@ -347,4 +367,63 @@ vec3 r3_noise(vec3 x)
     return fract(x * vec3(0.819172513f, 0.671043606f, 0.549700478f));
 }
 
+// Based on CC0 code from https://gist.github.com/juliusikkala/6c8c186f0150fe877a55cee4d266b1b0
+double build_alias_table(
+    float* weights,
+    size_t count,
+    std::vector<alias_table_entry>& table
+){
+    double sum_weight = 0;
+    for(size_t i = 0; i < count; ++i)
+        sum_weight += weights[i];
+
+    // All-zero weights would turn into NaNs, so fall back to uniform
+    // selection.
+    float inv_average = sum_weight > 0 ? double(count) / sum_weight : 0.0f;
+    for(size_t i = 0; i < count; ++i)
+        weights[i] = sum_weight > 0 ? weights[i] * inv_average : 1.0f;
+
+    // Average of 'probability' is now 1.
+    // Sweeping alias table build idea from: https://arxiv.org/pdf/1903.00227.pdf
+    table.resize(count);
+    for(size_t i = 0; i < count; ++i)
+        table[i] = {uint32_t(i), 0xFFFFFFFF, 1.0f, 1.0f};
+
+    auto to_probability = [](float weight){
+        return uint32_t(std::min(ldexp(double(weight), 32), 4294967295.0));
+    };
+
+    // i tracks light items, j tracks heavy items.
+    size_t i = 0, j = 0;
+    while(i < count && weights[i] > 1.0f) ++i;
+    while(j < count && weights[j] <= 1.0f) ++j;
+
+    float weight = j < count ? weights[j] : 0.0f;
+    while(j < count)
+    {
+        if(weight > 1.0f)
+        {
+            if(i >= count) break;
+            table[i].probability = to_probability(weights[i]);
+            table[i].alias_id = j;
+            weight = (weight + weights[i]) - 1.0f;
+            ++i;
+            while(i < count && weights[i] > 1.0f) ++i;
+        }
+        else
+        {
+            table[j].probability = to_probability(weight);
+            size_t old_j = j;
+            ++j;
+            while(j < count && weights[j] <= 1.0f) ++j;
+            if(j < count)
+            {
+                table[old_j].alias_id = j;
+                weight = (weight + weights[j]) - 1.0f;
+            }
+        }
+    }
+    return sum_weight;
+}
+
 }
@@ -138,6 +138,7 @@ ray operator*(const mat4& mat, const ray& r);
 bool flipped_winding_order(const mat3& transform);
 
 uint16_t float_to_half(float f);
+float half_to_float(uint16_t h);
 
 uint32_t next_power_of_two(uint32_t n);
 
@@ -164,6 +165,25 @@ float r1_noise(float x);
 vec2 r2_noise(vec2 x);
 vec3 r3_noise(vec3 x);
 
+// Must match alias_table_entry in shader/alias_table.glsl.
+struct alias_table_entry
+{
+    uint32_t alias_id;
+    uint32_t probability;
+    float pdf;
+    float alias_pdf;
+};
+
+// Builds an alias table for picking indices proportionally to their weights.
+// The weights are normalized in-place to an average of 1. The pdf fields are
+// left for the caller to fill, as their meaning depends on the sampled domain.
+// Returns the sum of the original weights.
+double build_alias_table(
+    float* weights,
+    size_t count,
+    std::vector<alias_table_entry>& table
+);
+
 }
 
 #include "math.tcc"
@@ -1,5 +1,6 @@
 #include "mesh.hh"
 #include "misc.hh"
+#include "upload_batcher.hh"
 
 namespace tr
 {
@@ -103,11 +104,11 @@ mesh* mesh::get_animation_source() const
     return animation_source;
 }
 
-void mesh::refresh_buffers()
+void mesh::refresh_buffers(upload_batcher* batcher)
 {
     // TODO: Make this smarter, no need to reinit if buffer size is the same
     // as before.
-    init_buffers();
+    init_buffers(batcher);
 }
 
 void mesh::calculate_normals()
@@ -184,7 +185,7 @@ void mesh::calculate_tangents()
     }
 }
 
-void mesh::init_buffers()
+void mesh::init_buffers(upload_batcher* batcher)
 {
     id = id_counter++;
 
@@ -205,69 +206,75 @@ void mesh::init_buffers()
 
     for(auto[dev, buf]: buffers)
     {
+        // Transfer source usage is for scene_stage's merged geometry buffers.
         vk::BufferUsageFlags buf_flags =
-            vk::BufferUsageFlagBits::eStorageBuffer;
+            vk::BufferUsageFlagBits::eStorageBuffer|
+            vk::BufferUsageFlagBits::eTransferSrc;
         if(dev.ctx->is_ray_tracing_supported())
             buf_flags = buf_flags | vk::BufferUsageFlagBits::eShaderDeviceAddress|
                 vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR;
-        vk::CommandBuffer cb = begin_command_buffer(dev);
+        // Without a batcher, all buffers of this mesh share one command
+        // buffer.
+        vk::CommandBuffer cb = batcher ?
+            vk::CommandBuffer() : begin_command_buffer(dev);
+        auto upload = [&](vk::BufferCreateInfo info, const void* data){
+            if(batcher)
+            {
+                return batcher->create_buffer(
+                    dev, info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT, data
+                );
+            }
+            return create_buffer(
+                dev, info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT, data, cb
+            );
+        };
 
-        buf.vertex_buffer = create_buffer(
-            dev,
+        buf.vertex_buffer = upload(
             {
                 {}, vertex_bytes,
                 vk::BufferUsageFlagBits::eVertexBuffer|buf_flags,
                 vk::SharingMode::eExclusive
             },
-            VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
-            vertices.data(),
-            cb
+            vertices.data()
         );
 
         if(animation_source)
         {
-            buf.prev_pos_buffer = create_buffer(
-                dev,
+            buf.prev_pos_buffer = upload(
                 {
                     {}, sizeof(pvec4)*vertices.size(),
-                    vk::BufferUsageFlagBits::eVertexBuffer|vk::BufferUsageFlagBits::eStorageBuffer,
+                    vk::BufferUsageFlagBits::eVertexBuffer|
+                    vk::BufferUsageFlagBits::eStorageBuffer|
+                    vk::BufferUsageFlagBits::eTransferSrc,
                     vk::SharingMode::eExclusive
                 },
-                VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
-                prev_pos.data(),
-                cb
+                prev_pos.data()
             );
         }
         else
         {
-            buf.index_buffer = create_buffer(
-                dev,
+            buf.index_buffer = upload(
                 {
                     {}, index_bytes,
                     vk::BufferUsageFlagBits::eIndexBuffer|buf_flags,
                     vk::SharingMode::eExclusive
                 },
-                VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
-                indices.data(),
-                cb
+                indices.data()
             );
             if(skin_bytes > 0)
             {
-                buf.skin_buffer = create_buffer(
-                    dev,
+                buf.skin_buffer = upload(
                     {
                         {}, skin_bytes,
                         vk::BufferUsageFlagBits::eStorageBuffer,
                         vk::SharingMode::eExclusive
                     },
-                    VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
-                    skin.data(),
-                    cb
+                    skin.data()
                 );
             }
         }
 
-        end_command_buffer(dev, cb);
+        if(cb) end_command_buffer(dev, cb);
     }
 }
 
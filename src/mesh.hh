@@ -11,6 +11,8 @@
 namespace tr
 {
 
+class upload_batcher;
+
 class mesh
 {
 public:
@@ -73,9 +75,10 @@ public:
     mesh* get_animation_source() const;
 
     // If you modify vertices or indices after constructor call, use this to
-    // reload the GPU buffer(s). If you give the command buffers, uploads are
-    // recorded into them instead of temporary ones.
-    void refresh_buffers();
+    // reload the GPU buffer(s). If you give a batcher, uploads are recorded
+    // into it and the buffers must not be used before its next flush has
+    // completed.
+    void refresh_buffers(upload_batcher* batcher = nullptr);
 
     // Calculates new normals for existing vertices. Assumes that vertices and
     // indices are already filled out, but that normals and tangents are garbage.
@@ -89,7 +92,7 @@ public:
     static std::vector<vk::VertexInputAttributeDescription> get_attributes(bool animated = false);
 
 private:
-    void init_buffers();
+    void init_buffers(upload_batcher* batcher = nullptr);
 
     static uint64_t id_counter;
 
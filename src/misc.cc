@@ -7,7 +7,17 @@
 #include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <random>
+#include <thread>
 namespace fs = std::filesystem;
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #ifdef _WIN32
 #define aligned_alloc(alignment, size) _aligned_malloc(size, alignment)
 #define free          _aligned_free
@@ -387,6 +397,71 @@ void deduce_layout_access_stage(
     }
 }
 
+void record_image_upload(
+    vk::CommandBuffer cb,
+    vk::Image img,
+    const vk::ImageCreateInfo& info,
+    vk::ImageLayout final_layout,
+    vk::Buffer staging,
+    vk::DeviceSize staging_offset
+){
+    transition_image_layout(
+        cb, img, info.format,
+        vk::ImageLayout::eUndefined,
+        vk::ImageLayout::eTransferDstOptimal,
+        0, info.mipLevels
+    );
+
+    vk::BufferImageCopy region(
+        staging_offset, 0, 0,
+        {deduce_aspect_mask(info.format), 0, 0, 1},
+        {0,0,0},
+        info.extent
+    );
+    cb.copyBufferToImage(
+        staging, img, vk::ImageLayout::eTransferDstOptimal, 1, &region
+    );
+
+    // Generate mipmaps.
+    ivec2 sz = ivec2(info.extent.width, info.extent.height);
+    for(uint32_t i = 1; i < info.mipLevels; ++i)
+    {
+        transition_image_layout(
+            cb, img, info.format,
+            vk::ImageLayout::eTransferDstOptimal,
+            vk::ImageLayout::eTransferSrcOptimal,
+            i-1, 1
+        );
+        ivec2 next_sz = max(sz/2, ivec2(1));
+        vk::ImageAspectFlags mask = deduce_aspect_mask(info.format);
+        vk::ImageBlit blit(
+            {mask, i-1, 0, 1},
+            {{{0,0,0}, {sz.x,sz.y,1}}},
+            {mask, i, 0, 1},
+            {{{0,0,0}, {next_sz.x,next_sz.y,1}}}
+        );
+        cb.blitImage(
+            img, vk::ImageLayout::eTransferSrcOptimal,
+            img, vk::ImageLayout::eTransferDstOptimal,
+            blit, vk::Filter::eLinear
+        );
+        sz = next_sz;
+        transition_image_layout(
+            cb, img, info.format,
+            vk::ImageLayout::eTransferSrcOptimal,
+            final_layout,
+            i-1, 1
+        );
+    }
+
+    transition_image_layout(
+        cb, img, info.format,
+        vk::ImageLayout::eTransferDstOptimal,
+        final_layout,
+        info.mipLevels-1, 1
+    );
+}
+
 vkm<vk::Image> sync_create_gpu_image(
     device& dev,
     vk::ImageCreateInfo info,
@@ -434,62 +509,7 @@ vkm<vk::Image> sync_create_gpu_image(
         );
 
         vk::CommandBuffer cb = begin_command_buffer(dev);
-        transition_image_layout(
-            cb, img, info.format,
-            vk::ImageLayout::eUndefined,
-            vk::ImageLayout::eTransferDstOptimal,
-            0, info.mipLevels
-        );
-
-        vk::BufferImageCopy region(
-            0, 0, 0,
-            {deduce_aspect_mask(info.format), 0, 0, 1},
-            {0,0,0},
-            info.extent
-        );
-        cb.copyBufferToImage(
-            staging_buffer, img, vk::ImageLayout::eTransferDstOptimal, 1, &region
-        );
-
-        // Generate mipmaps.
-        ivec2 sz = ivec2(info.extent.width, info.extent.height);
-        for(uint32_t i = 1; i < info.mipLevels; ++i)
-        {
-            transition_image_layout(
-                cb, img, info.format,
-                vk::ImageLayout::eTransferDstOptimal,
-                vk::ImageLayout::eTransferSrcOptimal,
-                i-1, 1
-            );
-            ivec2 next_sz = max(sz/2, ivec2(1));
-            vk::ImageAspectFlags mask = deduce_aspect_mask(info.format);
-            vk::ImageBlit blit(
-                {mask, i-1, 0, 1},
-                {{{0,0,0}, {sz.x,sz.y,1}}},
-                {mask, i, 0, 1},
-                {{{0,0,0}, {next_sz.x,next_sz.y,1}}}
-            );
-            cb.blitImage(
-                img, vk::ImageLayout::eTransferSrcOptimal,
-                img, vk::ImageLayout::eTransferDstOptimal,
-                blit, vk::Filter::eLinear
-            );
-            sz = next_sz;
-            transition_image_layout(
-                cb, img, info.format,
-                vk::ImageLayout::eTransferSrcOptimal,
-                final_layout,
-                i-1, 1
-            );
-        }
-
-        transition_image_layout(
-            cb, img, info.format,
-            vk::ImageLayout::eTransferDstOptimal,
-            final_layout,
-            info.mipLevels-1, 1
-        );
-
+        record_image_upload(cb, img, info, final_layout, staging_buffer);
         end_command_buffer(dev, cb);
 
         staging_buffer.destroy();
@@ -585,6 +605,145 @@ std::string load_text_file(const std::string& path)
     return ret;
 }
 
+bool try_load_binary_file(const std::string& path, std::string& data)
+{
+    std::ifstream f(path, std::ios::binary);
+    if(!f) return false;
+    std::ostringstream ss;
+    ss << f.rdbuf();
+    data = ss.str();
+    return !f.bad();
+}
+
+bool write_file_atomically(
+    const std::string& path,
+    const void* data,
+    size_t size
+){
+    std::error_code ec;
+    fs::path fs_path(path);
+    if(fs_path.has_parent_path())
+        fs::create_directories(fs_path.parent_path(), ec);
+
+    std::random_device rd;
+    char suffix[32];
+    snprintf(
+        suffix, sizeof(suffix), ".tmp.%016llx",
+        (unsigned long long)(
+            ((uint64_t(rd()) << 32) ^ rd()) ^
+            std::hash<std::thread::id>()(std::this_thread::get_id())
+        )
+    );
+    fs::path tmp_path = fs_path;
+    tmp_path += suffix;
+
+    {
+        std::ofstream f(tmp_path, std::ios::binary|std::ios::trunc);
+        if(!f) return false;
+        f.write((const char*)data, size);
+        if(!f)
+        {
+            f.close();
+            fs::remove(tmp_path, ec);
+            return false;
+        }
+    }
+
+    fs::rename(tmp_path, fs_path, ec);
+    if(ec)
+    {
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    return true;
+}
+
+uint64_t fnv1a64(const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+std::string to_hex(uint64_t value)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)value);
+    return buf;
+}
+
+std::string get_user_cache_dir()
+{
+#ifdef _WIN32
+    if(const char* local = std::getenv("LOCALAPPDATA"))
+        return (fs::path(local)/"tauray").string();
+#else
+    if(const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+        return (fs::path(xdg)/"tauray").string();
+    if(const char* home = std::getenv("HOME"); home && *home)
+        return (fs::path(home)/".cache"/"tauray").string();
+#endif
+    return "";
+}
+
+mapped_file::~mapped_file()
+{
+    close();
+}
+
+bool mapped_file::open(const std::string& path)
+{
+    close();
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(mem != MAP_FAILED)
+        {
+            ptr = (const uint8_t*)mem;
+            length = st.st_size;
+            mapped = true;
+        }
+    }
+    ::close(fd);
+    if(mapped) return true;
+#endif
+    if(!try_load_binary_file(path, fallback))
+        return false;
+    ptr = (const uint8_t*)fallback.data();
+    length = fallback.size();
+    return true;
+}
+
+void mapped_file::close()
+{
+#ifndef _WIN32
+    if(mapped) munmap((void*)ptr, length);
+#endif
+    ptr = nullptr;
+    length = 0;
+    mapped = false;
+    fallback.clear();
+}
+
+const uint8_t* mapped_file::data() const
+{
+    return ptr;
+}
+
+size_t mapped_file::size() const
+{
+    return length;
+}
+
 bool nonblock_getline(std::string& line)
 {
     static std::stringstream reading;
@@ -95,6 +95,18 @@ void deduce_layout_access_stage(
     vk::PipelineStageFlags& stage
 );
 
+// Copies the first mip level of 'img' from the staging buffer, generates the
+// rest of the mip chain with blits and transitions all levels to final_layout.
+// The image must be in an undefined layout and have transfer src & dst usage.
+void record_image_upload(
+    vk::CommandBuffer cb,
+    vk::Image img,
+    const vk::ImageCreateInfo& info,
+    vk::ImageLayout final_layout,
+    vk::Buffer staging,
+    vk::DeviceSize staging_offset = 0
+);
+
 vkm<vk::Image> sync_create_gpu_image(
     device& dev,
     vk::ImageCreateInfo info,
@@ -114,8 +126,51 @@ vk::SampleCountFlagBits get_max_available_sample_count(context& ctx);
 
 std::string get_resource_path(const std::string& path);
 std::string load_text_file(const std::string& path);
+// Returns false if the file can't be read.
+bool try_load_binary_file(const std::string& path, std::string& data);
+// Writes to a uniquely named temporary file first and then renames it over
+// 'path', so concurrent readers, also in other processes, only ever see
+// complete files. Creates missing parent directories. Returns false on
+// failure.
+bool write_file_atomically(
+    const std::string& path,
+    const void* data,
+    size_t size
+);
 bool nonblock_getline(std::string& line);
 
+// Stable across runs and platforms, unlike std::hash. Not for security.
+uint64_t fnv1a64(const void* data, size_t size);
+std::string to_hex(uint64_t value);
+
+// Per-user directory for tauray's caches, or an empty string if there is no
+// suitable place.
+std::string get_user_cache_dir();
+
+// Read-only view of a whole file. The file is memory-mapped where possible and
+// read into memory otherwise.
+class mapped_file
+{
+public:
+    mapped_file() = default;
+    mapped_file(const mapped_file& other) = delete;
+    mapped_file(mapped_file&& other) = delete;
+    ~mapped_file();
+
+    // Returns false if the file can't be opened.
+    bool open(const std::string& path);
+    void close();
+
+    const uint8_t* data() const;
+    size_t size() const;
+
+private:
+    const uint8_t* ptr = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    std::string fallback;
+};
+
 template<typename T>
 void sorted_insert(
     std::vector<T>& vec,
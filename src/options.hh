@@ -40,6 +40,14 @@
         {"piz", headless::PIZ}, \
         {"none", headless::NONE} \
     )\
+    TR_INT_OPT(save_threads, \
+        "Number of threads encoding and writing captured frames in " \
+        "headless mode. 0 uses the number of hardware threads.", \
+        0, 0, INT_MAX) \
+    TR_INT_OPT(max_queued_saves, \
+        "Number of captured frames that may wait to be saved before " \
+        "rendering stalls. 0 uses the number of save threads.", \
+        0, 0, INT_MAX) \
     TR_ENUM_OPT(distribution_strategy, tr::distribution_strategy, \
         "Set the the rendering distribution strategy", \
         tr::distribution_strategy::DISTRIBUTION_SHUFFLED_STRIPS, \
@@ -258,6 +266,48 @@
     TR_FLOAT_OPT(dshgi_temporal_ratio, \
         "Sets the exponential blend factor for DDISH-GI.", \
         0.01f, 0.0f, 1.0f) \
+    TR_INT_OPT(dshgi_ray_budget, \
+        "Limits the number of samples traced for DDISH-GI probes per frame, " \
+        "summed over all devices. " \
+        "Probes near cameras, moved objects and lights or with changing " \
+        "lighting are traced first, converged ones are skipped. 0 traces " \
+        "every probe on every frame.", \
+        0, 0, INT_MAX) \
+    TR_FLOAT_OPT(dshgi_convergence_threshold, \
+        "With a ray budget, DDISH-GI probes whose luminance changes by less " \
+        "than this fraction per update stop being traced until something " \
+        "moves near them.", \
+        0.005f, 0.0f, FLT_MAX) \
+    TR_ENUM_OPT(dshgi_codec, sh_grid_codec, \
+        "Sets how the DDISH-GI server encodes SH probes. fp16 sends them as " \
+        "they are, shared-exp8 quantizes them to about half the size.", \
+        sh_grid_codec::FP16, \
+        {"fp16", sh_grid_codec::FP16}, \
+        {"shared-exp8", sh_grid_codec::SHARED_EXP8} \
+    )\
+    TR_FLOAT_OPT(dshgi_delta_threshold, \
+        "The DDISH-GI server only resends a brick of SH probes once one of " \
+        "its coefficients has changed by more than this.", \
+        0.001f, 0.0f, FLT_MAX) \
+    TR_INT_OPT(dshgi_keyframe_interval, \
+        "Sets the interval in frames at which the DDISH-GI server sends all " \
+        "SH probes, so that clients recover from lost messages. 0 only " \
+        "sends them to new clients.", \
+        60, 0, INT_MAX) \
+    TR_ENUM_OPT(dshgi_transport, dshgi_transport_type, \
+        "Sets how SH probes are sent from the DDISH-GI server to its " \
+        "clients. tcp sends a copy to each client; udp-multicast and " \
+        "shared-memory send each message once for all clients, the latter " \
+        "only to clients on the same machine. Both ends must use the same " \
+        "transport.", \
+        dshgi_transport_type::TCP, \
+        {"tcp", dshgi_transport_type::TCP}, \
+        {"udp-multicast", dshgi_transport_type::UDP_MULTICAST}, \
+        {"shared-memory", dshgi_transport_type::SHARED_MEMORY} \
+    )\
+    TR_STRING_OPT(dshgi_multicast_group, \
+        "Sets the multicast group for --dshgi-transport=udp-multicast.", \
+        "239.255.42.42") \
     TR_BOOL_OPT(alpha_to_transmittance, \
         "Crudely translates albedo + alpha into transmittance for all " \
         "materials in the scene that have a constant alpha factor below 1.0. " \
@@ -313,6 +363,21 @@
         "overdraw is a significant concern. There should be no visual " \
         "difference.", \
         true) \
+    TR_BOOL_OPT(indirect_draw, \
+        "Frustum cull instances on the GPU and draw them with indirect draw " \
+        "calls in rasterization. This can speed up rendering of scenes " \
+        "with many instances, especially with many viewports.", \
+        false) \
+    TR_BOOL_OPT(light_clustering, \
+        "Bin point lights and spotlights into view-space clusters every frame " \
+        "so that rasterized and hybrid shading only evaluates the nearby " \
+        "ones. Lights are ignored past their cutoff radius.", \
+        false) \
+    TR_INT_OPT(update_threads, \
+        "Number of threads updating animations and instances of large " \
+        "scenes every frame. " \
+        "0 uses the number of hardware threads.", \
+        0, 0, INT_MAX) \
     TR_ENUM_OPT(force_projection, options::projection_option_type, \
         "Forces a specific projection type on the primary camera.", \
         std::optional<tr::camera::projection_type>(), \
@@ -346,6 +411,28 @@
     TR_STRING_OPT(connect, \
         "Sets the server address for client modes.", \
         "localhost:3333") \
+    TR_ENUM_OPT(stream_codec, frame_codec, \
+        "Sets the preferred codec for the frame client. The server uses it " \
+        "if it supports it. delta is lossless and skips unchanged parts of " \
+        "the image; lossy subsamples color and never waits for keyframes.", \
+        frame_codec::DELTA_ZSTD, \
+        {"raw", frame_codec::RAW}, \
+        {"delta", frame_codec::DELTA_ZSTD}, \
+        {"lossy", frame_codec::YCOCG420_ZSTD} \
+    )\
+    TR_INT_OPT(stream_queue_length, \
+        "Sets the number of frames the frame server can queue up while " \
+        "waiting for the network. Longer queues smooth out hiccups but add " \
+        "latency.", \
+        2, 1, 64) \
+    TR_ENUM_OPT(stream_drop_policy, frame_server::drop_policy, \
+        "Sets what the frame server does when the frame queue is full. " \
+        "latest-wins drops the oldest queued frame, block makes the renderer " \
+        "wait for the network.", \
+        frame_server::LATEST_WINS, \
+        {"latest-wins", frame_server::LATEST_WINS}, \
+        {"block", frame_server::BLOCK_RENDERER} \
+    )\
     TR_FLOAT_OPT(throttle, \
         "Set framerate throttle. Does not affect frametime in replay mode.", \
         0.0f, 0.0f, FLT_MAX) \
@@ -449,6 +536,15 @@
         {"solid-angle", tri_light_sampling_mode::SOLID_ANGLE}, \
         {"hybrid", tri_light_sampling_mode::HYBRID} \
     )\
+    TR_ENUM_OPT(tri_light_selection, tri_light_selection_mode, \
+        "Sets how an emissive triangle is picked for next event estimation. " \
+        "uniform picks every triangle with equal probability. power picks " \
+        "triangles proportionally to their emitted power, which is much " \
+        "less noisy when there are many dim emitters.", \
+        tri_light_selection_mode::UNIFORM, \
+        {"uniform", tri_light_selection_mode::UNIFORM}, \
+        {"power", tri_light_selection_mode::POWER} \
+    )\
     TR_BOOL_OPT(transparent_background, \
         "Replaces background with alpha transparency, regardless of " \
         "environment map usage.", \
@@ -530,6 +626,25 @@
         {"static-merged-dynamic-per-model", blas_strategy::STATIC_MERGED_DYNAMIC_PER_MODEL}, \
         {"all-merged", blas_strategy::ALL_MERGED_STATIC} \
     ) \
+    TR_INT_OPT(blas_build_budget, \
+        "Builds new BLASes in the background with this many triangles " \
+        "started per frame, instead of stalling until they are done. " \
+        "Geometry is missing from ray tracing until its BLAS is ready, so " \
+        "this is only useful in interactive use. 0 disables.", \
+        0, 0, INT_MAX) \
+    TR_INT_OPT(blas_refit_limit, \
+        "Rebuilds a dynamic BLAS after it has been refitted this many times. " \
+        "0 disables.", \
+        300, 0, INT_MAX) \
+    TR_FLOAT_OPT(blas_rebuild_growth, \
+        "Rebuilds a skinned BLAS once the surface area of the bounds of its " \
+        "joints has grown by this factor since it was last built. 0 " \
+        "disables.", \
+        1.5f, 0.0f, FLT_MAX) \
+    TR_INT_OPT(blas_rebuilds_per_frame, \
+        "Sets how many dynamic BLASes may be rebuilt per frame. Further " \
+        "rebuilds are postponed to later frames. 0 only refits them.", \
+        1, 0, INT_MAX) \
     TR_BOOL_OPT(silent, \
         "Disables general prints. Errors and timing data is still shown.", \
         false \
@@ -538,6 +653,18 @@
         "Sets the timing data output file. Default is stdout.", \
         "" \
     ) \
+    TR_STRING_OPT(shader_cache, \
+        "Sets the directory where compiled shaders and pipelines are cached " \
+        "between runs. By default, the user's cache directory is used. " \
+        "\"none\" disables the cache.", \
+        "" \
+    ) \
+    TR_STRING_OPT(scene_cache, \
+        "Sets the directory where decoded glTF scenes are cached between " \
+        "runs. By default, the user's cache directory is used. \"none\" " \
+        "disables the cache.", \
+        "" \
+    ) \
     TR_STRUCT_OPT(restir, \
         "Parameters for ReSTIR", \
         TR_STRUCT_OPT_FLOAT(max_confidence, 16, 0, FLT_MAX) \
@@ -567,6 +694,9 @@
 
 #include "math.hh"
 #include "headless.hh"
+#include "frame_server.hh"
+#include "sh_grid_codec.hh"
+#include "dshgi_transport.hh"
 #include "tonemap_stage.hh"
 #include "path_tracer_stage.hh"
 #include "restir_stage.hh"
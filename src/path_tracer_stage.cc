@@ -40,8 +40,8 @@ path_tracer_stage::path_tracer_stage(
     gfx(dev),
     opt(opt)
 {
-    shader_source pl_rint("shader/rt_common_point_light.rint");
-    shader_source shadow_chit("shader/rt_common_shadow.rchit");
+    auto pl_rint = shader_source::compile_async("shader/rt_common_point_light.rint");
+    auto shadow_chit = shader_source::compile_async("shader/rt_common_shadow.rchit");
     std::map<std::string, std::string> defines;
     defines["MAX_BOUNCES"] = std::to_string(opt.max_ray_depth);
     defines["SAMPLES_PER_PASS"] = std::to_string(opt.samples_per_pass);
@@ -80,35 +80,44 @@ path_tracer_stage::path_tracer_stage(
 
     get_common_defines(defines);
 
+    // Start all compilations before waiting for any of them.
+    auto rgen = shader_source::compile_async("shader/path_tracer.rgen", defines);
+    auto chit = shader_source::compile_async("shader/rt_common.rchit", defines);
+    auto ahit = shader_source::compile_async("shader/rt_common.rahit", defines);
+    auto shadow_ahit = shader_source::compile_async("shader/rt_common_shadow.rahit", defines);
+    auto pl_chit = shader_source::compile_async("shader/rt_common_point_light.rchit", defines);
+    auto miss = shader_source::compile_async("shader/rt_common.rmiss", defines);
+    auto shadow_miss = shader_source::compile_async("shader/rt_common_shadow.rmiss", defines);
+
     rt_shader_sources src = {
-        {"shader/path_tracer.rgen", defines},
+        rgen.get(),
         {
             {
                 vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup,
-                {"shader/rt_common.rchit", defines},
-                {"shader/rt_common.rahit", defines}
+                chit.get(),
+                ahit.get()
             },
             {
                 vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup,
-                shadow_chit,
-                {"shader/rt_common_shadow.rahit", defines}
+                shadow_chit.get(),
+                shadow_ahit.get()
             },
             {
                 vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
-                {"shader/rt_common_point_light.rchit", defines},
+                pl_chit.get(),
                 {},
-                pl_rint
+                pl_rint.get()
             },
             {
                 vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
-                shadow_chit,
+                shadow_chit.get(),
                 {},
-                pl_rint
+                pl_rint.get()
             }
         },
         {
-            {"shader/rt_common.rmiss", defines},
-            {"shader/rt_common_shadow.rmiss", defines}
+            miss.get(),
+            shadow_miss.get()
         }
     };
     desc.add(src);
@@ -0,0 +1,444 @@
+#include "pixel_conversion.hh"
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define TR_PIXEL_CONVERSION_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TR_TARGET(x)
+#else
+#define TR_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+namespace
+{
+using namespace tr;
+
+//==============================================================================
+// Scalar reference implementations
+//==============================================================================
+size_t find_nan_rgba32f_scalar(
+    const float* src, size_t start, size_t pixel_count
+){
+    for(size_t i = start; i < pixel_count; ++i)
+    {
+        const float* p = src + i*4;
+        if(std::isnan(p[0]) || std::isnan(p[1]) || std::isnan(p[2]) || std::isnan(p[3]))
+            return i;
+    }
+    return pixel_count;
+}
+
+void deinterleave_rgba32f_scalar(
+    const float* src, float* dst, size_t pixel_count
+){
+    for(size_t i = 0; i < pixel_count; ++i)
+    {
+        dst[i] = src[i*4+0];
+        dst[pixel_count + i] = src[i*4+1];
+        dst[2*pixel_count + i] = src[i*4+2];
+        dst[3*pixel_count + i] = src[i*4+3];
+    }
+}
+
+inline uint8_t quantize_unorm8(float x)
+{
+    float v = x * 255.0f;
+    // Written this way around so that NaN maps to zero too.
+    if(!(v > 0.0f)) return 0;
+    if(v >= 255.0f) return 255;
+    return (uint8_t)std::round(v);
+}
+
+void quantize_rgba32f_to_rgba8_scalar(
+    const float* src, uint8_t* dst, size_t pixel_count
+){
+    for(size_t i = 0; i < pixel_count*4; ++i)
+        dst[i] = quantize_unorm8(src[i]);
+}
+
+void rgba8_to_rgb8_scalar(
+    const uint8_t* src, uint8_t* dst, size_t pixel_count
+){
+    for(size_t i = 0; i < pixel_count; ++i)
+    {
+        dst[i*3+0] = src[i*4+0];
+        dst[i*3+1] = src[i*4+1];
+        dst[i*3+2] = src[i*4+2];
+    }
+}
+
+const pixel_conversion_kernels scalar_kernels = {
+    find_nan_rgba32f_scalar,
+    deinterleave_rgba32f_scalar,
+    quantize_rgba32f_to_rgba8_scalar,
+    rgba8_to_rgb8_scalar
+};
+
+#ifdef TR_PIXEL_CONVERSION_X86
+//==============================================================================
+// SSE4.1 implementations
+//==============================================================================
+TR_TARGET("sse4.1")
+size_t find_nan_rgba32f_sse4(
+    const float* src, size_t start, size_t pixel_count
+){
+    size_t i = start;
+    // Four pixels per iteration, the exact pixel is found by the scalar
+    // version once a block has a NaN somewhere.
+    for(; i + 4 <= pixel_count; i += 4)
+    {
+        const float* p = src + i*4;
+        __m128 a = _mm_loadu_ps(p);
+        __m128 b = _mm_loadu_ps(p+4);
+        __m128 c = _mm_loadu_ps(p+8);
+        __m128 d = _mm_loadu_ps(p+12);
+        __m128 nan = _mm_or_ps(
+            _mm_or_ps(_mm_cmpunord_ps(a, a), _mm_cmpunord_ps(b, b)),
+            _mm_or_ps(_mm_cmpunord_ps(c, c), _mm_cmpunord_ps(d, d))
+        );
+        if(_mm_movemask_ps(nan))
+            return find_nan_rgba32f_scalar(src, i, i + 4);
+    }
+    return find_nan_rgba32f_scalar(src, i, pixel_count);
+}
+
+TR_TARGET("sse4.1")
+void deinterleave_rgba32f_sse4(
+    const float* src, float* dst, size_t pixel_count
+){
+    float* r = dst;
+    float* g = dst + pixel_count;
+    float* b = dst + 2*pixel_count;
+    float* a = dst + 3*pixel_count;
+    size_t i = 0;
+    for(; i + 4 <= pixel_count; i += 4)
+    {
+        __m128 p0 = _mm_loadu_ps(src + i*4);
+        __m128 p1 = _mm_loadu_ps(src + i*4 + 4);
+        __m128 p2 = _mm_loadu_ps(src + i*4 + 8);
+        __m128 p3 = _mm_loadu_ps(src + i*4 + 12);
+        _MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+        _mm_storeu_ps(r + i, p0);
+        _mm_storeu_ps(g + i, p1);
+        _mm_storeu_ps(b + i, p2);
+        _mm_storeu_ps(a + i, p3);
+    }
+    for(; i < pixel_count; ++i)
+    {
+        r[i] = src[i*4+0];
+        g[i] = src[i*4+1];
+        b[i] = src[i*4+2];
+        a[i] = src[i*4+3];
+    }
+}
+
+// Rounds half away from zero like std::round, _mm_round_ps can only do
+// half-to-even.
+TR_TARGET("sse4.1")
+inline __m128i quantize_unorm8_sse4(__m128 x)
+{
+    __m128 v = _mm_mul_ps(x, _mm_set1_ps(255.0f));
+    // maxps returns the second operand for NaN, so NaN becomes zero.
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+    __m128 t = _mm_round_ps(v, _MM_FROUND_TO_ZERO|_MM_FROUND_NO_EXC);
+    __m128 up = _mm_and_ps(
+        _mm_cmpge_ps(_mm_sub_ps(v, t), _mm_set1_ps(0.5f)),
+        _mm_set1_ps(1.0f)
+    );
+    return _mm_cvttps_epi32(_mm_add_ps(t, up));
+}
+
+TR_TARGET("sse4.1")
+void quantize_rgba32f_to_rgba8_sse4(
+    const float* src, uint8_t* dst, size_t pixel_count
+){
+    size_t count = pixel_count * 4;
+    size_t i = 0;
+    for(; i + 16 <= count; i += 16)
+    {
+        __m128i a = quantize_unorm8_sse4(_mm_loadu_ps(src + i));
+        __m128i b = quantize_unorm8_sse4(_mm_loadu_ps(src + i + 4));
+        __m128i c = quantize_unorm8_sse4(_mm_loadu_ps(src + i + 8));
+        __m128i d = quantize_unorm8_sse4(_mm_loadu_ps(src + i + 12));
+        __m128i packed = _mm_packus_epi16(
+            _mm_packus_epi32(a, b),
+            _mm_packus_epi32(c, d)
+        );
+        _mm_storeu_si128((__m128i*)(dst + i), packed);
+    }
+    for(; i < count; ++i)
+        dst[i] = quantize_unorm8(src[i]);
+}
+
+TR_TARGET("sse4.1")
+void rgba8_to_rgb8_sse4(
+    const uint8_t* src, uint8_t* dst, size_t pixel_count
+){
+    const __m128i shuffle = _mm_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+    );
+    size_t i = 0;
+    // The 16-byte store writes 4 bytes past the 12 useful ones, which the next
+    // iteration overwrites. Stop early enough that it never goes past the end.
+    for(; i + 6 <= pixel_count; i += 4)
+    {
+        __m128i p = _mm_loadu_si128((const __m128i*)(src + i*4));
+        _mm_storeu_si128((__m128i*)(dst + i*3), _mm_shuffle_epi8(p, shuffle));
+    }
+    rgba8_to_rgb8_scalar(src + i*4, dst + i*3, pixel_count - i);
+}
+
+const pixel_conversion_kernels sse4_kernels = {
+    find_nan_rgba32f_sse4,
+    deinterleave_rgba32f_sse4,
+    quantize_rgba32f_to_rgba8_sse4,
+    rgba8_to_rgb8_sse4
+};
+
+//==============================================================================
+// AVX2 implementations
+//==============================================================================
+TR_TARGET("avx2")
+size_t find_nan_rgba32f_avx2(
+    const float* src, size_t start, size_t pixel_count
+){
+    size_t i = start;
+    for(; i + 8 <= pixel_count; i += 8)
+    {
+        const float* p = src + i*4;
+        __m256 a = _mm256_loadu_ps(p);
+        __m256 b = _mm256_loadu_ps(p+8);
+        __m256 c = _mm256_loadu_ps(p+16);
+        __m256 d = _mm256_loadu_ps(p+24);
+        __m256 nan = _mm256_or_ps(
+            _mm256_or_ps(
+                _mm256_cmp_ps(a, a, _CMP_UNORD_Q),
+                _mm256_cmp_ps(b, b, _CMP_UNORD_Q)
+            ),
+            _mm256_or_ps(
+                _mm256_cmp_ps(c, c, _CMP_UNORD_Q),
+                _mm256_cmp_ps(d, d, _CMP_UNORD_Q)
+            )
+        );
+        if(_mm256_movemask_ps(nan))
+            return find_nan_rgba32f_scalar(src, i, i + 8);
+    }
+    return find_nan_rgba32f_scalar(src, i, pixel_count);
+}
+
+TR_TARGET("avx2")
+void deinterleave_rgba32f_avx2(
+    const float* src, float* dst, size_t pixel_count
+){
+    float* r = dst;
+    float* g = dst + pixel_count;
+    float* b = dst + 2*pixel_count;
+    float* a = dst + 3*pixel_count;
+    size_t i = 0;
+    for(; i + 8 <= pixel_count; i += 8)
+    {
+        const float* p = src + i*4;
+        // Pixel n goes to the low lane and n+4 to the high lane, so that an
+        // in-lane 4x4 transpose results in eight consecutive pixels.
+        __m256 v0 = _mm256_insertf128_ps(
+            _mm256_castps128_ps256(_mm_loadu_ps(p)), _mm_loadu_ps(p+16), 1
+        );
+        __m256 v1 = _mm256_insertf128_ps(
+            _mm256_castps128_ps256(_mm_loadu_ps(p+4)), _mm_loadu_ps(p+20), 1
+        );
+        __m256 v2 = _mm256_insertf128_ps(
+            _mm256_castps128_ps256(_mm_loadu_ps(p+8)), _mm_loadu_ps(p+24), 1
+        );
+        __m256 v3 = _mm256_insertf128_ps(
+            _mm256_castps128_ps256(_mm_loadu_ps(p+12)), _mm_loadu_ps(p+28), 1
+        );
+        __m256 t0 = _mm256_unpacklo_ps(v0, v1);
+        __m256 t1 = _mm256_unpacklo_ps(v2, v3);
+        __m256 t2 = _mm256_unpackhi_ps(v0, v1);
+        __m256 t3 = _mm256_unpackhi_ps(v2, v3);
+        _mm256_storeu_ps(r + i, _mm256_shuffle_ps(t0, t1, 0x44));
+        _mm256_storeu_ps(g + i, _mm256_shuffle_ps(t0, t1, 0xEE));
+        _mm256_storeu_ps(b + i, _mm256_shuffle_ps(t2, t3, 0x44));
+        _mm256_storeu_ps(a + i, _mm256_shuffle_ps(t2, t3, 0xEE));
+    }
+    for(; i < pixel_count; ++i)
+    {
+        r[i] = src[i*4+0];
+        g[i] = src[i*4+1];
+        b[i] = src[i*4+2];
+        a[i] = src[i*4+3];
+    }
+}
+
+TR_TARGET("avx2")
+inline __m256i quantize_unorm8_avx2(__m256 x)
+{
+    __m256 v = _mm256_mul_ps(x, _mm256_set1_ps(255.0f));
+    v = _mm256_min_ps(
+        _mm256_max_ps(v, _mm256_setzero_ps()), _mm256_set1_ps(255.0f)
+    );
+    __m256 t = _mm256_round_ps(v, _MM_FROUND_TO_ZERO|_MM_FROUND_NO_EXC);
+    __m256 up = _mm256_and_ps(
+        _mm256_cmp_ps(_mm256_sub_ps(v, t), _mm256_set1_ps(0.5f), _CMP_GE_OQ),
+        _mm256_set1_ps(1.0f)
+    );
+    return _mm256_cvttps_epi32(_mm256_add_ps(t, up));
+}
+
+TR_TARGET("avx2")
+void quantize_rgba32f_to_rgba8_avx2(
+    const float* src, uint8_t* dst, size_t pixel_count
+){
+    size_t count = pixel_count * 4;
+    size_t i = 0;
+    // The packs operate per 128-bit lane, this puts the dwords back in order.
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for(; i + 32 <= count; i += 32)
+    {
+        __m256i a = quantize_unorm8_avx2(_mm256_loadu_ps(src + i));
+        __m256i b = quantize_unorm8_avx2(_mm256_loadu_ps(src + i + 8));
+        __m256i c = quantize_unorm8_avx2(_mm256_loadu_ps(src + i + 16));
+        __m256i d = quantize_unorm8_avx2(_mm256_loadu_ps(src + i + 24));
+        __m256i packed = _mm256_packus_epi16(
+            _mm256_packus_epi32(a, b),
+            _mm256_packus_epi32(c, d)
+        );
+        packed = _mm256_permutevar8x32_epi32(packed, order);
+        _mm256_storeu_si256((__m256i*)(dst + i), packed);
+    }
+    for(; i < count; ++i)
+        dst[i] = quantize_unorm8(src[i]);
+}
+
+TR_TARGET("avx2")
+void rgba8_to_rgb8_avx2(
+    const uint8_t* src, uint8_t* dst, size_t pixel_count
+){
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+    );
+    const __m256i order = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t i = 0;
+    // Like the SSE version, this writes 8 garbage bytes after the useful 24.
+    for(; i + 11 <= pixel_count; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((const __m256i*)(src + i*4));
+        p = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(p, shuffle), order);
+        _mm256_storeu_si256((__m256i*)(dst + i*3), p);
+    }
+    rgba8_to_rgb8_scalar(src + i*4, dst + i*3, pixel_count - i);
+}
+
+const pixel_conversion_kernels avx2_kernels = {
+    find_nan_rgba32f_avx2,
+    deinterleave_rgba32f_avx2,
+    quantize_rgba32f_to_rgba8_avx2,
+    rgba8_to_rgb8_avx2
+};
+
+simd_level detect_simd_level()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    int max_leaf = info[0];
+    if(max_leaf < 1) return simd_level::SCALAR;
+
+    __cpuid(info, 1);
+    bool sse41 = info[2] & (1<<19);
+    bool osxsave = info[2] & (1<<27);
+    bool avx = info[2] & (1<<28);
+    bool avx2 = false;
+    if(max_leaf >= 7 && osxsave && avx)
+    {
+        // The OS must also save the YMM registers.
+        bool ymm_enabled = (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        avx2 = ymm_enabled && (info[1] & (1<<5));
+    }
+#else
+    __builtin_cpu_init();
+    bool sse41 = __builtin_cpu_supports("sse4.1");
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+    if(avx2) return simd_level::AVX2;
+    if(sse41) return simd_level::SSE4;
+    return simd_level::SCALAR;
+}
+#endif
+
+const pixel_conversion_kernels& get_best_kernels()
+{
+    static const pixel_conversion_kernels& kernels =
+        get_pixel_conversion_kernels(get_supported_simd_level());
+    return kernels;
+}
+
+}
+
+namespace tr
+{
+
+size_t find_nan_rgba32f(const float* src, size_t start, size_t pixel_count)
+{
+    return get_best_kernels().find_nan_rgba32f(src, start, pixel_count);
+}
+
+void deinterleave_rgba32f(const float* src, float* dst, size_t pixel_count)
+{
+    get_best_kernels().deinterleave_rgba32f(src, dst, pixel_count);
+}
+
+void quantize_rgba32f_to_rgba8(
+    const float* src,
+    uint8_t* dst,
+    size_t pixel_count
+){
+    get_best_kernels().quantize_rgba32f_to_rgba8(src, dst, pixel_count);
+}
+
+void rgba8_to_rgb8(const uint8_t* src, uint8_t* dst, size_t pixel_count)
+{
+    get_best_kernels().rgba8_to_rgb8(src, dst, pixel_count);
+}
+
+simd_level get_supported_simd_level()
+{
+#ifdef TR_PIXEL_CONVERSION_X86
+    static const simd_level level = detect_simd_level();
+    return level;
+#else
+    return simd_level::SCALAR;
+#endif
+}
+
+const char* get_simd_level_name(simd_level level)
+{
+    switch(level)
+    {
+    case simd_level::SCALAR: return "scalar";
+    case simd_level::SSE4: return "sse4";
+    case simd_level::AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+const pixel_conversion_kernels& get_pixel_conversion_kernels(
+    simd_level level
+){
+    switch(level)
+    {
+#ifdef TR_PIXEL_CONVERSION_X86
+    case simd_level::AVX2: return avx2_kernels;
+    case simd_level::SSE4: return sse4_kernels;
+#endif
+    default: return scalar_kernels;
+    }
+}
+
+}
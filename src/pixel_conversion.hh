@@ -0,0 +1,65 @@
+#ifndef TAURAY_PIXEL_CONVERSION_HH
+#define TAURAY_PIXEL_CONVERSION_HH
+#include <cstddef>
+#include <cstdint>
+
+namespace tr
+{
+
+// Conversions for pixel data read back from the GPU. The free functions pick
+// the fastest implementation supported by the running CPU on first use.
+
+// Returns the index of the first pixel at or after 'start' that has a NaN in
+// any channel, or pixel_count if there are none.
+size_t find_nan_rgba32f(const float* src, size_t start, size_t pixel_count);
+
+// Splits interleaved RGBA into four consecutive planes of pixel_count floats
+// each, in R, G, B, A order.
+void deinterleave_rgba32f(const float* src, float* dst, size_t pixel_count);
+
+// clamp(round(x * 255), 0, 255) for every channel. NaN becomes 0.
+void quantize_rgba32f_to_rgba8(
+    const float* src,
+    uint8_t* dst,
+    size_t pixel_count
+);
+
+// Drops the alpha channel.
+void rgba8_to_rgb8(const uint8_t* src, uint8_t* dst, size_t pixel_count);
+
+enum class simd_level
+{
+    SCALAR = 0,
+    SSE4,
+    AVX2
+};
+
+simd_level get_supported_simd_level();
+const char* get_simd_level_name(simd_level level);
+
+struct pixel_conversion_kernels
+{
+    size_t (*find_nan_rgba32f)(
+        const float* src, size_t start, size_t pixel_count
+    );
+    void (*deinterleave_rgba32f)(
+        const float* src, float* dst, size_t pixel_count
+    );
+    void (*quantize_rgba32f_to_rgba8)(
+        const float* src, uint8_t* dst, size_t pixel_count
+    );
+    void (*rgba8_to_rgb8)(
+        const uint8_t* src, uint8_t* dst, size_t pixel_count
+    );
+};
+
+// Returns the implementations for a specific level. This is mostly useful for
+// testing; the scalar level is the reference implementation. Levels above
+// get_supported_simd_level() must not be called on this CPU.
+const pixel_conversion_kernels& get_pixel_conversion_kernels(
+    simd_level level
+);
+
+}
+
+#endif
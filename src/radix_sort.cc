@@ -34,7 +34,7 @@ radix_sort::radix_sort(device& dev)
     rs_instance = radix_sort_vk_create(
         dev.logical,
         nullptr,
-        VK_NULL_HANDLE,
+        dev.pp_cache,
         rs_target
     );
 
@@ -262,8 +262,10 @@ void raster_pipeline::init_pipeline()
         nullptr,
         -1
     );
+    pipeline_info.pNext = begin_cache_feedback(stages.size());
 
     pipeline = vkm(*dev, dev->logical.createGraphicsPipeline(dev->pp_cache, pipeline_info).value);
+    end_cache_feedback();
 
     init_framebuffers();
 }
@@ -27,22 +27,29 @@ struct push_constant_buffer
     pvec3 ambient_color;
 };
 
-raster_shader_sources load_sources(const raster_stage::options& opt, const gbuffer_target& gbuf)
-{
-    std::map<std::string, std::string> defines;
+raster_shader_sources load_sources(
+    const raster_stage::options& opt,
+    const gbuffer_target& gbuf,
+    const scene_stage& ss
+){
+    std::map<std::string, std::string> vert_defines;
+    if(ss.has_indirect_draw()) vert_defines["INDIRECT_DRAW"];
+
+    std::map<std::string, std::string> defines = vert_defines;
     defines["SH_ORDER"] = std::to_string(opt.sh_order);
     if(opt.estimate_indirect) defines["ESTIMATE_INDIRECT"];
     if(opt.estimate_direct) defines["ESTIMATE_DIRECT"];
     defines["SH_COEF_COUNT"] = std::to_string(
         sh_grid::get_coef_count(opt.sh_order)
     );
+    ss.get_defines(defines);
     if(!opt.use_probe_visibility)
         defines["SH_INTERPOLATION_TRILINEAR"];
     if(opt.unjitter_textures)
         defines["UNJITTER_TEXTURES"];
     gbuf.get_location_defines(defines);
     return {
-        {"shader/forward.vert"},
+        {"shader/forward.vert", vert_defines},
         {"shader/forward.frag", defines}
     };
 }
@@ -136,13 +143,16 @@ raster_stage::raster_stage(
         " viewports)"
     )
 {
+    if(ss.has_indirect_draw())
+        culler.emplace(dev, ss, instance_culler::options{});
+
     for(const gbuffer_target& target: output_array_targets)
     {
         array_pipelines.emplace_back(new raster_pipeline(dev));
         array_pipelines.back()->init({
             target.get_size(),
             uvec4(0, 0, target.get_size()),
-            load_sources(opt, target),
+            load_sources(opt, target, ss),
             {&ss.get_descriptors(), &ss.get_raster_descriptors()},
             mesh::get_bindings(true),
             mesh::get_attributes(true),
@@ -170,11 +180,14 @@ raster_stage::raster_stage(
         " rasterization"
     )
 {
+    if(ss.has_indirect_draw())
+        culler.emplace(dev, ss, instance_culler::options{});
+
     array_pipelines.emplace_back(new raster_pipeline(dev));
     array_pipelines.back()->init({
         output_target.get_size(),
         uvec4(0, 0, output_target.get_size()),
-        load_sources(opt, output_target),
+        load_sources(opt, output_target, ss),
         {&ss.get_descriptors(), &ss.get_raster_descriptors()},
         mesh::get_bindings(true),
         mesh::get_attributes(true),
@@ -196,9 +209,23 @@ void raster_stage::update(uint32_t)
         vk::CommandBuffer cb = begin_graphics();
 
         raster_timer.begin(cb, dev->id, i);
+        if(culler)
+        {
+            std::vector<instance_culler::draw_list> lists;
+            uint32_t first_view = opt.base_camera_index;
+            for(std::unique_ptr<raster_pipeline>& gfx: array_pipelines)
+            {
+                uint32_t view_count = gfx->get_multiview_layer_count();
+                lists.push_back({first_view, view_count});
+                first_view += view_count;
+            }
+            culler->record_cull(cb, lists);
+        }
+
         size_t j = opt.base_camera_index;
-        for(std::unique_ptr<raster_pipeline>& gfx: array_pipelines)
+        for(size_t list_index = 0; list_index < array_pipelines.size(); ++list_index)
         {
+            std::unique_ptr<raster_pipeline>& gfx = array_pipelines[list_index];
             gfx->begin_render_pass(cb, i);
             gfx->bind(cb);
             gfx->set_descriptors(cb, ss->get_descriptors(), 0, 0);
@@ -212,7 +239,16 @@ void raster_stage::update(uint32_t)
             control.base_camera_index = j;
             control.frame_index = dev->ctx->get_frame_counter();
 
-            for(size_t i = 0; i < instances.size(); ++i)
+            if(culler)
+            {
+                // Per-instance data comes from the draw info buffer instead.
+                control.instance_id = 0;
+                control.flipped_winding_order = 0;
+                control.has_prev_pos_data = 0;
+                gfx->push_constants(cb, control);
+                culler->record_draw(cb, list_index, true);
+            }
+            else for(size_t i = 0; i < instances.size(); ++i)
             {
                 const scene_stage::instance& inst = instances[i];
                 const mesh* m = inst.m;
@@ -9,6 +9,7 @@
 #include "gpu_buffer.hh"
 #include "shadow_map.hh"
 #include "stage.hh"
+#include "instance_culler.hh"
 
 namespace tr
 {
@@ -65,6 +66,8 @@ private:
     std::vector<std::unique_ptr<raster_pipeline>> array_pipelines;
     std::vector<gbuffer_target> output_targets;
     options opt;
+    // Only used if the scene_stage has indirect drawing enabled.
+    std::optional<instance_culler> culler;
 
     uint32_t scene_state_counter;
     scene_stage* ss;
@@ -363,8 +363,16 @@ restir_stage::restir_stage(
     set.set_binding_params("spatial_candidates", 1, vk::DescriptorBindingFlagBits::ePartiallyBound); \
     set.set_binding_params("mis_data", 1, vk::DescriptorBindingFlagBits::ePartiallyBound);
 
+    // Start all compilations before waiting for any of them.
+    auto canonical_src = shader_source::compile_async("shader/restir_canonical.comp", defines);
+    auto temporal_src = shader_source::compile_async("shader/restir_temporal.comp", defines);
+    std::shared_future<shader_source> spatial_trace_src;
+    if(opt.spatial_samples > 0)
+        spatial_trace_src = shader_source::compile_async("shader/restir_spatial_trace.comp", defines);
+    auto spatial_gather_src = shader_source::compile_async("shader/restir_spatial_gather.comp", defines);
+
     { // CANONICAL
-        shader_source shader = {"shader/restir_canonical.comp", defines};
+        const shader_source& shader = canonical_src.get();
         SET_BINDING_PARAMS(canonical_set);
         canonical.init(
             shader,
@@ -377,7 +385,7 @@ restir_stage::restir_stage(
     }
 
     { // TEMPORAL
-        shader_source shader = {"shader/restir_temporal.comp", defines};
+        const shader_source& shader = temporal_src.get();
         SET_BINDING_PARAMS(temporal_set);
         temporal.init(
             shader,
@@ -429,7 +437,7 @@ restir_stage::restir_stage(
 
     if(opt.spatial_samples > 0)
     { // SPATIAL TRACE
-        shader_source shader = {"shader/restir_spatial_trace.comp", defines};
+        const shader_source& shader = spatial_trace_src.get();
         SET_BINDING_PARAMS(spatial_trace_set);
         spatial_trace.init(
             shader,
@@ -442,7 +450,7 @@ restir_stage::restir_stage(
     }
 
     { // SPATIAL GATHER
-        shader_source shader = {"shader/restir_spatial_gather.comp", defines};
+        const shader_source& shader = spatial_gather_src.get();
         SET_BINDING_PARAMS(spatial_gather_set);
         spatial_gather.init(
             shader,
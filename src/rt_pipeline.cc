@@ -108,8 +108,10 @@ void rt_pipeline::init(
         {},
         -1
     );
+    pipeline_info.pNext = begin_cache_feedback(stages.size());
 
     pipeline = vkm(*dev, dev->logical.createRayTracingPipelineKHR({}, dev->pp_cache, pipeline_info).value);
+    end_cache_feedback();
 
     // Create shader binding table
     uint32_t group_handle_size = align_up_to(
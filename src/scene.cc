@@ -7,6 +7,16 @@
 #include "environment_map.hh"
 #include <algorithm>
 #include <unordered_set>
+#include <cfloat>
+
+namespace
+{
+
+// Animated entities are sampled in jobs of this many. Sampling one is cheap,
+// so small scenes stay on the calling thread.
+constexpr size_t ANIMATION_CHUNK_SIZE = 256;
+
+}
 
 namespace tr
 {
@@ -210,6 +220,178 @@ sh_grid* get_largest_sh_grid(scene& s, int* index)
     return best != INVALID_ENTITY ? s.get<sh_grid>(best) : nullptr;
 }
 
+namespace
+{
+
+// Average number of grids per cell the uniform grid is sized for.
+constexpr float SH_GRID_INDEX_CELL_DENSITY = 2.0f;
+constexpr unsigned SH_GRID_INDEX_MAX_CELLS = 64;
+
+}
+
+bool sh_grid_index::refresh(scene& s)
+{
+    size_t count = 0;
+    bool changed = false;
+    s.foreach([&](entity id, transformable& self, sh_grid& g){
+        if(
+            changed || count >= entries.size() ||
+            entries[count].id != id ||
+            entries[count].transform != self.get_global_transform() ||
+            entries[count].radius != g.get_radius() ||
+            entries[count].resolution != g.get_resolution()
+        ) changed = true;
+        count++;
+    });
+    if(!changed && count == entries.size())
+        return false;
+
+    entries.clear();
+    largest = -1;
+    float largest_volume = 0.0f;
+    s.foreach([&](entity id, transformable& self, sh_grid& g){
+        entries.push_back({
+            id,
+            self.get_global_transform(),
+            transpose(self.get_global_inverse_transpose_transform()),
+            g.get_radius(),
+            g.calc_density(self),
+            g.get_resolution()
+        });
+        // Same comparison as in get_largest_sh_grid().
+        float volume = g.calc_volume(self);
+        if(volume > largest_volume)
+        {
+            largest_volume = volume;
+            largest = entries.size()-1;
+        }
+    });
+
+    // World-space bounds of the influence volumes, i.e. the unit cube grown
+    // by the radius. They are padded a bit so that rounding in
+    // point_distance() can't place a point inside a volume but outside its
+    // bounds.
+    std::vector<aabb> entry_bounds(entries.size());
+    bounds = {vec3(FLT_MAX), vec3(-FLT_MAX)};
+    for(size_t i = 0; i < entries.size(); ++i)
+    {
+        aabb& b = entry_bounds[i];
+        b = {vec3(FLT_MAX), vec3(-FLT_MAX)};
+        float extent = 1.0f + entries[i].radius;
+        for(int j = 0; j < 8; ++j)
+        {
+            vec3 corner = vec3(
+                j&1 ? extent : -extent,
+                j&2 ? extent : -extent,
+                j&4 ? extent : -extent
+            );
+            vec3 p = entries[i].transform * vec4(corner, 1.0f);
+            b.min = min(b.min, p);
+            b.max = max(b.max, p);
+        }
+        vec3 pad = (b.max - b.min) * 1e-4f + 1e-4f;
+        b.min -= pad;
+        b.max += pad;
+        bounds.min = min(bounds.min, b.min);
+        bounds.max = max(bounds.max, b.max);
+    }
+
+    cell_offsets.clear();
+    cell_entries.clear();
+    if(entries.size() == 0)
+    {
+        cell_count = uvec3(0);
+        return true;
+    }
+
+    unsigned axis_cells = clamp(
+        (unsigned)std::ceil(std::cbrt(entries.size() / SH_GRID_INDEX_CELL_DENSITY)),
+        1u, SH_GRID_INDEX_MAX_CELLS
+    );
+    cell_count = uvec3(axis_cells);
+    cell_size = max(bounds.max - bounds.min, vec3(1e-6f)) / vec3(cell_count);
+
+    auto cell_range = [&](const aabb& b, uvec3& lo, uvec3& hi){
+        lo = uvec3(clamp(ivec3(floor((b.min - bounds.min) / cell_size)), ivec3(0), ivec3(cell_count)-1));
+        hi = uvec3(clamp(ivec3(floor((b.max - bounds.min) / cell_size)), ivec3(0), ivec3(cell_count)-1));
+    };
+
+    // Two passes, first counting entries per cell, then filling them in. The
+    // entries are visited in order, so each cell stays sorted.
+    cell_offsets.resize(cell_count.x * cell_count.y * cell_count.z + 1, 0);
+    std::vector<uint32_t> cursor;
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        if(pass == 1)
+        {
+            for(size_t i = 1; i < cell_offsets.size(); ++i)
+                cell_offsets[i] += cell_offsets[i-1];
+            cell_entries.resize(cell_offsets.back());
+            cursor.assign(cell_offsets.begin(), cell_offsets.end()-1);
+        }
+        for(size_t i = 0; i < entries.size(); ++i)
+        {
+            uvec3 lo, hi;
+            cell_range(entry_bounds[i], lo, hi);
+            for(unsigned z = lo.z; z <= hi.z; ++z)
+            for(unsigned y = lo.y; y <= hi.y; ++y)
+            for(unsigned x = lo.x; x <= hi.x; ++x)
+            {
+                unsigned cell = ravel_tex_coord(uvec3(x, y, z), cell_count);
+                if(pass == 0) cell_offsets[cell+1]++;
+                else cell_entries[cursor[cell]++] = i;
+            }
+        }
+    }
+    return true;
+}
+
+int sh_grid_index::find(vec3 pos) const
+{
+    if(
+        entries.size() == 0 ||
+        any(lessThan(pos, bounds.min)) ||
+        any(greaterThan(pos, bounds.max))
+    ) return -1;
+
+    uvec3 cell_pos = uvec3(clamp(
+        ivec3(floor((pos - bounds.min) / cell_size)),
+        ivec3(0), ivec3(cell_count)-1
+    ));
+    unsigned cell = ravel_tex_coord(cell_pos, cell_count);
+
+    // Same selection logic as in get_sh_grid(), but skipping the grids that
+    // would be out of influence anyway.
+    float closest_distance = std::numeric_limits<float>::infinity();
+    float densest = 0.0f;
+    int best = -1;
+    for(uint32_t j = cell_offsets[cell]; j < cell_offsets[cell+1]; ++j)
+    {
+        uint32_t i = cell_entries[j];
+        const entry& e = entries[i];
+        float distance = sh_grid::point_distance(e.local_from_world, e.radius, pos);
+        if(distance >= 0 && distance <= closest_distance)
+        {
+            closest_distance = distance;
+            if(distance == 0)
+            {
+                if(e.density > densest)
+                {
+                    densest = e.density;
+                    best = i;
+                }
+            }
+            else best = i;
+        }
+    }
+    return best;
+}
+
+int sh_grid_index::find_largest() const
+{
+    return largest;
+}
+
 void play(
     scene& s,
     const std::string& name,
@@ -223,14 +405,29 @@ void play(
     s.emit(animation_update_event{true, 0});
 }
 
-void update(scene& s, time_ticks dt, bool force_update)
+void update(scene& s, time_ticks dt, bool force_update, thread_pool* pool)
 {
     s.foreach([&](camera& c){ c.step_jitter(); });
 
     if(dt > 0 || force_update)
     {
-        s.foreach([&](transformable& t, animated& a){ a.update(t, dt); });
+        if(pool)
+        {
+            std::vector<std::pair<transformable*, animated*>> targets;
+            s.foreach([&](transformable& t, animated& a){
+                targets.push_back({&t, &a});
+            });
+            pool->parallel_for(
+                targets.size(), ANIMATION_CHUNK_SIZE,
+                [&](size_t begin, size_t end){
+                    for(size_t i = begin; i < end; ++i)
+                        targets[i].second->update(*targets[i].first, dt);
+                }
+            );
+        }
+        else s.foreach([&](transformable& t, animated& a){ a.update(t, dt); });
     }
+    transform_hierarchy::get().update();
     s.emit(animation_update_event{false, dt});
 }
 
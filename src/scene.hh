@@ -3,6 +3,7 @@
 #include "monkeroecs.hh"
 #include "math.hh"
 #include "animation.hh"
+#include "thread_pool.hh"
 #include <set>
 
 namespace tr
@@ -55,13 +56,56 @@ void track_shadow_maps(scene& s);
 sh_grid* get_sh_grid(scene& s, vec3 pos, int* index = nullptr);
 sh_grid* get_largest_sh_grid(scene& s, int* index = nullptr);
 
+// Answers the same queries as get_sh_grid() and get_largest_sh_grid() with
+// the same results, but only visits the grids near the queried position. The
+// index is rebuilt by refresh() when the grids have changed.
+class sh_grid_index
+{
+public:
+    // Returns true if the index had to be rebuilt.
+    bool refresh(scene& s);
+
+    // Indices are in the order of s.foreach(transformable, sh_grid), -1 if
+    // there's no match.
+    int find(vec3 pos) const;
+    int find_largest() const;
+
+private:
+    struct entry
+    {
+        entity id;
+        mat4 transform;
+        mat4 local_from_world;
+        float radius;
+        float density;
+        uvec3 resolution;
+    };
+    std::vector<entry> entries;
+    int largest = -1;
+
+    // Uniform grid over the influence bounds of all entries. Cells list
+    // overlapping entries in ascending order.
+    aabb bounds;
+    uvec3 cell_count = uvec3(0);
+    vec3 cell_size;
+    std::vector<uint32_t> cell_offsets;
+    std::vector<uint32_t> cell_entries;
+};
+
 void play(
     scene& s,
     const std::string& name,
     bool loop = false,
     bool use_fallback = false
 );
-void update(scene& s, time_ticks dt, bool force_update = false);
+// Animations are sampled on 'pool' when given. Each entity only touches its
+// own transformable, so they can be evaluated in any order.
+void update(
+    scene& s,
+    time_ticks dt,
+    bool force_update = false,
+    thread_pool* pool = nullptr
+);
 bool is_playing(scene& s);
 void set_animation_time(scene& s, time_ticks dt);
 
@@ -6,6 +6,8 @@
 #include "light.hh"
 #include "misc.hh"
 #include "log.hh"
+#include <cfloat>
+#include <unordered_set>
 
 namespace
 {
@@ -209,6 +211,70 @@ struct temporal_light_data
     uint32_t prev_index;
 };
 
+// These must match the DRAW_FLAG_* defines in shader/indirect_draw.glsl
+constexpr uint32_t DRAW_FLAG_FLIPPED_WINDING_ORDER = 1<<0;
+constexpr uint32_t DRAW_FLAG_HAS_PREV_POS = 1<<1;
+constexpr uint32_t DRAW_FLAG_POTENTIALLY_TRANSPARENT = 1<<2;
+
+struct draw_info_entry
+{
+    // xyz = object space bounding sphere center, w = radius. Negative radius
+    // means that the instance must never be culled, as is the case for
+    // skinned meshes.
+    pvec4 bounds;
+    uint32_t index_count;
+    uint32_t first_index;
+    int32_t vertex_offset;
+    uint32_t flags;
+};
+
+vec4 calc_bounding_sphere(const std::vector<mesh::vertex>& vertices)
+{
+    if(vertices.size() == 0)
+        return vec4(0);
+
+    vec3 lo = vertices[0].pos;
+    vec3 hi = lo;
+    for(const mesh::vertex& v: vertices)
+    {
+        lo = min(lo, vec3(v.pos));
+        hi = max(hi, vec3(v.pos));
+    }
+
+    vec3 center = (lo + hi) * 0.5f;
+    float radius2 = 0.0f;
+    for(const mesh::vertex& v: vertices)
+    {
+        vec3 d = vec3(v.pos) - center;
+        radius2 = max(radius2, dot(d, d));
+    }
+    return vec4(center, sqrt(radius2));
+}
+
+// These must match the LIGHT_CLUSTER_* defines in shader/light_cluster.glsl
+constexpr uint32_t LIGHT_CLUSTER_TILES_X = 16;
+constexpr uint32_t LIGHT_CLUSTER_TILES_Y = 8;
+constexpr uint32_t LIGHT_CLUSTER_SLICES = 24;
+constexpr uint32_t LIGHT_CLUSTER_COUNT =
+    LIGHT_CLUSTER_TILES_X * LIGHT_CLUSTER_TILES_Y * LIGHT_CLUSTER_SLICES;
+constexpr uint32_t LIGHT_CLUSTER_STRIDE = 32;
+// Must match WORKGROUP_SIZE in shader/light_cluster.comp
+constexpr uint32_t LIGHT_CLUSTER_WORKGROUP_SIZE = 64;
+// The slices only cover this many times the near plane distance, the last
+// slice extends to infinity past that. Otherwise, cameras with distant or
+// infinite far planes would get uselessly long slices.
+constexpr float LIGHT_CLUSTER_MAX_DEPTH_RATIO = 1000.0f;
+
+// Per-instance loops in update() are split into jobs of this many items.
+// Smaller scenes end up in a single job, which runs on the frame thread.
+constexpr size_t UPDATE_CHUNK_SIZE = 1024;
+
+struct light_cluster_slicing_entry
+{
+    float scale;
+    float bias;
+};
+
 const quat face_orientations[6] = {
     glm::quatLookAt(vec3(-1,0,0), vec3(0,1,0)),
     glm::quatLookAt(vec3(1,0,0), vec3(0,1,0)),
@@ -238,11 +304,27 @@ scene_stage::scene_stage(device_mask dev, const options& opt)
     geometry_outdated(true),
     lights_outdated(true),
     force_instance_refresh_frames(0),
+    uploaded_bytes(0),
     cur_scene(nullptr),
     envmap(nullptr),
     ambient(0),
     pre_transformed_vertices(dev),
+    pending_blas_builds(0),
+    pending_blas_batches(dev),
+    blas_rebuild_count(0),
     group_strategy(opt.group_strategy),
+    instance_cache_outdated(true),
+    instance_ids_stable(false),
+    update_pool(opt.update_thread_count),
+    merged_geometry(dev),
+    merged_geometry_outdated(false),
+    draw_info_refresh_frames(0),
+    draw_info_data(dev, 0, vk::BufferUsageFlagBits::eStorageBuffer),
+    light_cluster_camera_count(0),
+    light_cluster_slicing_data(dev, 0, vk::BufferUsageFlagBits::eStorageBuffer),
+    light_clusters(dev),
+    tri_light_alias_table_count(0),
+    tri_light_alias_table(dev),
     total_shadow_map_count(0),
     total_cascade_count(0),
     shadow_map_range(0),
@@ -311,6 +393,19 @@ scene_stage::scene_stage(device_mask dev, const options& opt)
     pre_transform_desc(dev),
     opt(opt), stage_timer(dev, "scene update")
 {
+    if(opt.indirect_draw)
+    {
+        for(device& d: dev)
+        {
+            if(!d.feats.drawIndirectFirstInstance || !d.vulkan_12_feats.drawIndirectCount)
+                throw std::runtime_error(
+                    "Indirect drawing requires drawIndirectFirstInstance and "
+                    "drawIndirectCount, which are not supported by " +
+                    std::string(d.props.deviceName.data())
+                );
+        }
+    }
+
     skinning.emplace(dev);
     extract_tri_lights.emplace(dev);
     pre_transform.emplace(dev);
@@ -340,6 +435,13 @@ scene_stage::scene_stage(device_mask dev, const options& opt)
             p.init(src, {&pre_transform_desc, &scene_desc});
     }
 
+    if(opt.light_clustering)
+    {
+        light_cluster.emplace(dev);
+        for(const auto&[dev, p]: light_cluster)
+            p.init(shader_source("shader/light_cluster.comp"), {&scene_desc});
+    }
+
     if(opt.shadow_mapping)
     {
         shadow_atlas.reset(new atlas(
@@ -382,8 +484,8 @@ void scene_stage::set_scene(scene* target)
 {
     cur_scene = target;
 
-    events[0].emplace(target->subscribe([this](scene&, const add_component<model>&){ geometry_outdated = true; }));
-    events[1].emplace(target->subscribe([this](scene&, const remove_component<model>&){ geometry_outdated = true; }));
+    events[0].emplace(target->subscribe([this](scene&, const add_component<model>&){ geometry_outdated = true; instance_cache_outdated = true; }));
+    events[1].emplace(target->subscribe([this](scene&, const remove_component<model>&){ geometry_outdated = true; instance_cache_outdated = true; }));
     events[2].emplace(target->subscribe([this](scene&, const add_component<point_light>&){ lights_outdated = true; }));
     events[3].emplace(target->subscribe([this](scene&, const remove_component<point_light>&){ lights_outdated = true; }));
     events[4].emplace(target->subscribe([this](scene&, const add_component<directional_light>&){ lights_outdated = true; }));
@@ -392,9 +494,12 @@ void scene_stage::set_scene(scene* target)
     events[7].emplace(target->subscribe([this](scene&, const remove_component<spotlight>&){ lights_outdated = true; }));
     events[8].emplace(target->subscribe([this](scene&, const add_component<sh_grid>&){ lights_outdated = true; }));
     events[9].emplace(target->subscribe([this](scene&, const remove_component<sh_grid>&){ lights_outdated = true; }));
+    events[10].emplace(target->subscribe([this](scene&, const add_component<transformable>&){ instance_cache_outdated = true; }));
+    events[11].emplace(target->subscribe([this](scene&, const remove_component<transformable>&){ instance_cache_outdated = true; }));
 
     prev_was_rebuild = false;
     force_instance_refresh_frames = MAX_FRAMES_IN_FLIGHT;
+    instance_cache_outdated = true;
 
     envmap_change_counter++;
     geometry_change_counter++;
@@ -429,6 +534,11 @@ bool scene_stage::has_prev_tlas() const
     return opt.track_prev_tlas;
 }
 
+size_t scene_stage::get_uploaded_bytes() const
+{
+    return uploaded_bytes;
+}
+
 environment_map* scene_stage::get_environment_map() const
 {
     return envmap;
@@ -444,6 +554,37 @@ const std::vector<scene_stage::instance>& scene_stage::get_instances() const
     return instances;
 }
 
+bool scene_stage::has_indirect_draw() const
+{
+    return opt.indirect_draw;
+}
+
+vk::Buffer scene_stage::get_merged_vertex_buffer(device_id id) const
+{
+    return merged_geometry[id].vertices;
+}
+
+vk::Buffer scene_stage::get_merged_prev_pos_buffer(device_id id) const
+{
+    return merged_geometry[id].prev_pos;
+}
+
+vk::Buffer scene_stage::get_merged_index_buffer(device_id id) const
+{
+    return merged_geometry[id].indices;
+}
+
+bool scene_stage::has_light_clusters() const
+{
+    return opt.light_clustering;
+}
+
+bool scene_stage::has_tri_light_alias_table() const
+{
+    return opt.gather_emissive_triangles &&
+        opt.tri_light_selection == tri_light_selection_mode::POWER;
+}
+
 const std::unordered_map<sh_grid*, texture>& scene_stage::get_sh_grid_textures() const
 {
     return sh_grid_textures;
@@ -468,6 +609,10 @@ void scene_stage::get_defines(std::map<std::string, std::string>& defines)
 {
     if(opt.pre_transform_vertices)
         defines["PRE_TRANSFORMED_VERTICES"];
+    if(opt.light_clustering)
+        defines["LIGHT_CLUSTERING"];
+    if(has_tri_light_alias_table())
+        defines["TRI_LIGHT_SELECTION_POWER"];
 }
 
 vec2 scene_stage::get_shadow_map_atlas_pixel_margin() const
@@ -663,13 +808,22 @@ int scene_stage::get_shadow_map_index(const light* l)
 
 bool scene_stage::refresh_instance_cache()
 {
+    if(!instance_cache_outdated)
+    {
+        refresh_dynamic_instances();
+        return false;
+    }
+    instance_cache_outdated = false;
+
     uint64_t frame_counter = get_context()->get_frame_counter();
     uint32_t i = 0;
     entity last_object_id = INVALID_ENTITY;
     group_cache.clear();
+    dynamic_instances.clear();
 
     prev_instance_count = backward_instance_ids.size();
     backward_instance_ids.clear();
+    instance_ids_stable = false;
 
     bool scene_changed = false;
 
@@ -726,6 +880,7 @@ bool scene_stage::refresh_instance_cache()
                 });
             }
 
+            uint32_t first_instance = i;
             bool flip_winding_order = flipped_winding_order(transform);
             for(const auto& vg: mod)
             {
@@ -798,6 +953,9 @@ bool scene_stage::refresh_instance_cache()
                     prev_i++;
                 ++i;
             }
+
+            if(!t.is_static() && i != first_instance)
+                dynamic_instances.push_back({id, &t, first_instance, i - first_instance});
         });
     };
     add_instances(true, true);
@@ -818,14 +976,60 @@ bool scene_stage::refresh_instance_cache()
     return scene_changed;
 }
 
+void scene_stage::refresh_dynamic_instances()
+{
+    uint64_t frame_counter = get_context()->get_frame_counter();
+
+    // Nothing was added, removed or reordered, so every instance keeps its ID.
+    prev_instance_count = instances.size();
+    if(!instance_ids_stable)
+    {
+        backward_instance_ids.resize(instances.size());
+        for(uint32_t i = 0; i < instances.size(); ++i)
+            backward_instance_ids[i] = i;
+        instance_ids_stable = true;
+    }
+
+    // Same as the dynamic transformable case of refresh_instance_cache().
+    for(const dynamic_instance_range& range: dynamic_instances)
+    {
+        temporal_instance_data* td = cur_scene->get<temporal_instance_data>(range.id);
+        if(td->frame_stamp != frame_counter)
+        {
+            td->frame_stamp = frame_counter;
+            td->prev_transform = td->cur_transform;
+            td->prev_normal_transform = td->cur_normal_transform;
+            td->cur_transform = range.t->get_global_transform();
+            td->cur_normal_transform = range.t->get_global_inverse_transpose_transform();
+        }
+
+        for(uint32_t i = range.first_instance; i < range.first_instance + range.count; ++i)
+        {
+            instance& inst = instances[i];
+            if(inst.prev_transform != td->prev_transform)
+            {
+                inst.prev_transform = td->prev_transform;
+                inst.last_refresh_frame = frame_counter;
+            }
+            if(inst.transform != td->cur_transform)
+            {
+                inst.transform = td->cur_transform;
+                inst.normal_transform = td->cur_normal_transform;
+                inst.last_refresh_frame = frame_counter;
+            }
+        }
+    }
+}
+
 void scene_stage::ensure_blas()
 {
     if(!get_context()->is_ray_tracing_supported())
         return;
-    bool built_one = false;
-    // Goes through all groups and ensures they have valid BLASes.
+    bool deferred = opt.blas_build_budget != 0;
+    // Goes through all groups and ensures they have valid BLASes. They are
+    // built together afterwards, so that compaction only needs one round trip.
+    std::vector<std::pair<blas_info*, std::vector<bottom_level_acceleration_structure::entry>>> new_blases;
     size_t offset = 0;
-    std::vector<bottom_level_acceleration_structure::entry> entries;
     for(const instance_group& group: group_cache)
     {
         auto it = blas_cache.find(group.id);
@@ -835,12 +1039,10 @@ void scene_stage::ensure_blas()
             continue;
         }
 
-        if(!built_one)
+        if(new_blases.size() == 0 && !deferred)
             TR_LOG("Building acceleration structures");
 
-        built_one = true;
-
-        entries.clear();
+        std::vector<bottom_level_acceleration_structure::entry> entries;
         bool double_sided = false;
         for(size_t i = 0; i < group.size; ++i, ++offset)
         {
@@ -857,18 +1059,238 @@ void scene_stage::ensure_blas()
         bool dynamic = group_strategy == blas_strategy::ALL_MERGED_STATIC ? false : !group.static_mesh;
         blas_info info;
         info.blas[0] = bottom_level_acceleration_structure(
-            get_device_mask(), entries, !double_sided, dynamic, group.static_mesh
+            get_device_mask(), entries, !double_sided, dynamic, group.static_mesh,
+            true
         );
         if (dynamic && opt.track_prev_tlas)
         {
             info.blas[1] = bottom_level_acceleration_structure(
-                get_device_mask(), entries, !double_sided, true, false
+                get_device_mask(), entries, !double_sided, true, false, true
+            );
+        }
+        blas_info& bi = blas_cache.emplace(group.id, std::move(info)).first->second;
+        if(deferred) pending_blas_builds++;
+        else new_blases.push_back({&bi, std::move(entries)});
+    }
+
+    if(new_blases.size() == 0)
+        return;
+
+    for(device& dev: get_device_mask())
+    {
+        blas_batch batch(dev);
+        for(auto& [bi, entries]: new_blases)
+        for(auto& blas: bi->blas)
+            if(blas.has_value()) batch.add(*blas, entries);
+
+        vk::CommandBuffer cb = begin_command_buffer(dev);
+        batch.record_build(0, cb);
+        end_command_buffer(dev, cb);
+
+        cb = begin_command_buffer(dev);
+        batch.record_compaction(cb, true);
+        end_command_buffer(dev, cb);
+
+        log_blas_batch(batch);
+    }
+    TR_LOG("Finished building acceleration structures");
+}
+
+void scene_stage::log_blas_batch(const blas_batch& batch)
+{
+    TR_LOG(
+        "Built ", batch.size(), " BLASes in ", batch.get_build_time_ms(),
+        " ms, compaction saved ",
+        (double(batch.get_uncompacted_size()) -
+            double(batch.get_compacted_size()))/1048576.0,
+        " MiB"
+    );
+}
+
+bool scene_stage::blas_info::is_built() const
+{
+    return blas[0]->is_built() && (!blas[1].has_value() || blas[1]->is_built());
+}
+
+bool scene_stage::process_blas_builds(uint32_t frame_index)
+{
+    if(pending_blas_builds == 0)
+        return false;
+
+    // Deferred BLASes are only built for groups that still exist, so that the
+    // meshes of removed instances are never touched.
+    std::vector<std::pair<blas_info*, std::vector<bottom_level_acceleration_structure::entry>>> started;
+    size_t triangles = 0;
+    size_t offset = 0;
+    for(const instance_group& group: group_cache)
+    {
+        blas_info& bi = blas_cache.at(group.id);
+        if(bi.build_recorded)
+        {
+            offset += group.size;
+            continue;
+        }
+
+        size_t group_triangles = 0;
+        std::vector<bottom_level_acceleration_structure::entry> entries;
+        for(size_t i = 0; i < group.size; ++i, ++offset)
+        {
+            const instance& inst = instances[offset];
+            group_triangles += inst.m->get_indices().size()/3;
+            entries.push_back({
+                inst.m,
+                0, nullptr,
+                group.static_transformable ? inst.transform : mat4(1),
+                !inst.mat->potentially_transparent()
+            });
+        }
+
+        if(triangles != 0 && triangles + group_triangles > opt.blas_build_budget)
+            break;
+        triangles += group_triangles;
+        bi.build_recorded = true;
+        started.push_back({&bi, std::move(entries)});
+    }
+
+    bool finished_any = false;
+    uint64_t frame_counter = get_context()->get_frame_counter();
+    for(auto[dev, batches]: pending_blas_batches)
+    {
+        vk::CommandBuffer cb = begin_graphics(dev.id, true);
+
+        // Compact the builds of earlier frames. Their queries are only read
+        // once the frame has surely finished, which also ensures that they
+        // have been reset.
+        for(auto it = batches.begin(); it != batches.end();)
+        {
+            if(
+                it->first + MAX_FRAMES_IN_FLIGHT <= frame_counter &&
+                it->second.record_compaction(cb)
+            ){
+                log_blas_batch(it->second);
+                finished_any = true;
+                it = batches.erase(it);
+            }
+            else ++it;
+        }
+
+        if(started.size() != 0)
+        {
+            blas_batch batch(dev);
+            for(auto& [bi, entries]: started)
+            for(auto& blas: bi->blas)
+                if(blas.has_value()) batch.add(*blas, entries);
+            batch.record_build(frame_index, cb);
+            batches.emplace_back(frame_counter, std::move(batch));
+        }
+
+        end_graphics_once(cb, dev.id);
+    }
+
+    // Builds without compaction are ready right away.
+    for(auto& [bi, entries]: started)
+        if(bi->is_built()) finished_any = true;
+
+    size_t remaining = 0;
+    for(const instance_group& group: group_cache)
+        if(!blas_cache.at(group.id).is_built()) remaining++;
+    pending_blas_builds = remaining;
+    return finished_any;
+}
+
+size_t scene_stage::schedule_blas_rebuilds()
+{
+    // The joints of skinned models are the only cheap proxy for how far the
+    // vertices have moved since the BLAS was built. Rigid motion keeps the
+    // bounds' area intact, while stretching limbs out grows it.
+    struct candidate
+    {
+        float degradation;
+        float joint_area;
+        blas_info* bi;
+    };
+    std::vector<candidate> candidates;
+    std::unordered_set<uint64_t> visited;
+    size_t refits = 0;
+    size_t offset = 0;
+    for(const instance_group& group: group_cache)
+    {
+        size_t first_instance = offset;
+        offset += group.size;
+        if(
+            group.static_mesh ||
+            group_strategy == blas_strategy::ALL_MERGED_STATIC ||
+            !visited.insert(group.id).second
+        ) continue;
+
+        blas_info& bi = blas_cache.at(group.id);
+        bi.rebuild_scheduled = false;
+        if(!bi.is_built())
+            continue;
+
+        float joint_area = get_joint_bounds_area(first_instance, group.size);
+        if(bi.rebuild_joint_area == 0.0f)
+            bi.rebuild_joint_area = joint_area;
+
+        float degradation = 0.0f;
+        if(opt.blas_refit_limit != 0)
+            degradation = float(bi.refits_since_rebuild)/opt.blas_refit_limit;
+        if(opt.blas_rebuild_growth > 0.0f && bi.rebuild_joint_area > 0.0f)
+            degradation = max(
+                degradation,
+                joint_area/(bi.rebuild_joint_area * opt.blas_rebuild_growth)
             );
+
+        if(degradation >= 1.0f)
+            candidates.push_back({degradation, joint_area, &bi});
+        bi.refits_since_rebuild++;
+        refits++;
+    }
+
+    size_t rebuilds = std::min(candidates.size(), opt.blas_rebuilds_per_frame);
+    std::partial_sort(
+        candidates.begin(), candidates.begin() + rebuilds, candidates.end(),
+        [](const candidate& a, const candidate& b){
+            return a.degradation > b.degradation;
+        }
+    );
+    for(size_t i = 0; i < rebuilds; ++i)
+    {
+        blas_info& bi = *candidates[i].bi;
+        bi.rebuild_scheduled = true;
+        bi.refits_since_rebuild = 0;
+        bi.rebuild_joint_area = candidates[i].joint_area;
+    }
+
+    tracing_record& timing = get_context()->get_timing();
+    timing.set_counter("BLAS refits", refits - rebuilds);
+    timing.set_counter("BLAS rebuilds", rebuilds);
+    timing.set_counter("BLAS rebuilds postponed", candidates.size() - rebuilds);
+    return rebuilds;
+}
+
+float scene_stage::get_joint_bounds_area(size_t first_instance, size_t count) const
+{
+    aabb bounds = {vec3(FLT_MAX), vec3(-FLT_MAX)};
+    const model* prev_mod = nullptr;
+    for(size_t i = first_instance; i < first_instance + count; ++i)
+    {
+        // Instances of the same model are consecutive.
+        const model* mod = instances[i].mod;
+        if(mod == prev_mod) continue;
+        prev_mod = mod;
+
+        for(const model::joint_data& joint: mod->get_joints())
+        {
+            vec3 pos = joint.node->get_global_position();
+            bounds.min = min(bounds.min, pos);
+            bounds.max = max(bounds.max, pos);
         }
-        blas_cache.emplace(group.id, std::move(info));
     }
-    if(built_one)
-        TR_LOG("Finished building acceleration structures");
+    if(bounds.min.x > bounds.max.x)
+        return 0.0f;
+    vec3 size = bounds.max - bounds.min;
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
 }
 
 void scene_stage::assign_group_cache(
@@ -1023,6 +1445,120 @@ void scene_stage::update_temporal_tables(uint32_t frame_index)
     temporal_tables.update(frame_index, forward_point_light_ids.data(), point_light_forward_map_offset, forward_point_light_ids.size() * sizeof(uint32_t));
 }
 
+void scene_stage::refresh_merged_geometry()
+{
+    merged_vertex_ranges.clear();
+    merged_index_ranges.clear();
+    merged_instance_offsets.resize(instances.size());
+
+    std::unordered_map<const mesh*, uint32_t> vertex_offsets;
+    std::unordered_map<const mesh*, uint32_t> index_offsets;
+    std::unordered_map<uint64_t, vec4> new_mesh_bounds;
+    size_t vertex_count = 0;
+    size_t index_count = 0;
+    for(size_t i = 0; i < instances.size(); ++i)
+    {
+        const mesh* m = instances[i].m;
+        auto vit = vertex_offsets.find(m);
+        if(vit == vertex_offsets.end())
+        {
+            vit = vertex_offsets.emplace(m, (uint32_t)vertex_count).first;
+            merged_vertex_ranges.push_back({m, (uint32_t)vertex_count});
+            vertex_count += m->get_vertices().size();
+        }
+
+        // Animated meshes share the index buffer of their source mesh.
+        const mesh* index_source = m->get_animation_source() ?
+            m->get_animation_source() : m;
+        auto iit = index_offsets.find(index_source);
+        if(iit == index_offsets.end())
+        {
+            iit = index_offsets.emplace(index_source, (uint32_t)index_count).first;
+            merged_index_ranges.push_back({index_source, (uint32_t)index_count});
+            index_count += index_source->get_indices().size();
+        }
+        merged_instance_offsets[i] = uvec2(vit->second, iit->second);
+
+        if(m->is_skinned() || m->get_animation_source())
+            continue;
+        uint64_t id = m->get_id();
+        if(new_mesh_bounds.count(id))
+            continue;
+        auto bit = mesh_bounds.find(id);
+        new_mesh_bounds[id] = bit != mesh_bounds.end() ?
+            bit->second : calc_bounding_sphere(m->get_vertices());
+    }
+    mesh_bounds = std::move(new_mesh_bounds);
+
+    for(auto[dev, mg]: merged_geometry)
+    {
+        if(mg.vertex_capacity < vertex_count)
+        {
+            mg.vertices = create_buffer(
+                dev,
+                {
+                    {}, vertex_count * sizeof(mesh::vertex),
+                    vk::BufferUsageFlagBits::eVertexBuffer|vk::BufferUsageFlagBits::eTransferDst,
+                    vk::SharingMode::eExclusive
+                },
+                VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT
+            );
+            mg.prev_pos = create_buffer(
+                dev,
+                {
+                    {}, vertex_count * sizeof(pvec4),
+                    vk::BufferUsageFlagBits::eVertexBuffer|vk::BufferUsageFlagBits::eTransferDst,
+                    vk::SharingMode::eExclusive
+                },
+                VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT
+            );
+            mg.vertex_capacity = vertex_count;
+        }
+        if(mg.index_capacity < index_count)
+        {
+            mg.indices = create_buffer(
+                dev,
+                {
+                    {}, index_count * sizeof(uint32_t),
+                    vk::BufferUsageFlagBits::eIndexBuffer|vk::BufferUsageFlagBits::eTransferDst,
+                    vk::SharingMode::eExclusive
+                },
+                VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT
+            );
+            mg.index_capacity = index_count;
+        }
+    }
+
+    draw_info_data.resize(sizeof(draw_info_entry) * instances.size());
+    draw_info_refresh_frames = MAX_FRAMES_IN_FLIGHT;
+    merged_geometry_outdated = true;
+}
+
+void scene_stage::update_draw_info(uint32_t frame_index)
+{
+    // Draw info only depends on the mesh layout, so it's only written when
+    // that changes. Every in-flight staging buffer needs a copy, though.
+    if(draw_info_refresh_frames == 0)
+        return;
+    draw_info_refresh_frames--;
+
+    draw_info_data.foreach<draw_info_entry>(
+        frame_index, instances.size(),
+        [&](draw_info_entry& d, size_t i){
+            const instance& inst = instances[i];
+            bool animated = inst.m->is_skinned() || inst.m->get_animation_source();
+            d.bounds = animated ? vec4(0, 0, 0, -1) : mesh_bounds.at(inst.m->get_id());
+            d.index_count = inst.m->get_indices().size();
+            d.first_index = merged_instance_offsets[i].y;
+            d.vertex_offset = merged_instance_offsets[i].x;
+            d.flags =
+                (inst.flip_winding_order ? DRAW_FLAG_FLIPPED_WINDING_ORDER : 0) |
+                (inst.m->get_animation_source() ? DRAW_FLAG_HAS_PREV_POS : 0) |
+                (inst.mat->potentially_transparent() ? DRAW_FLAG_POTENTIALLY_TRANSPARENT : 0);
+        }
+    );
+}
+
 void scene_stage::update(uint32_t frame_index)
 {
     if(!cur_scene) return;
@@ -1043,6 +1579,10 @@ void scene_stage::update(uint32_t frame_index)
         lights_outdated = true;
     }
 
+    // Computes all outdated global transforms in one pass, so that the many
+    // lookups below don't each have to walk up their parents.
+    transform_hierarchy::get().update();
+
     geometry_outdated |= refresh_instance_cache();
     track_shadow_maps(*cur_scene);
 
@@ -1063,57 +1603,95 @@ void scene_stage::update(uint32_t frame_index)
         s_table.update_scene(this);
     }
 
-    instance_data.resize(sizeof(instance_buffer) * instances.size());
-    instance_data.foreach<instance_buffer>(
-        frame_index, instances.size(),
-        [&](instance_buffer& inst, size_t i){
-            if(instances[i].mat->emission_factor != vec3(0))
-            {
-                inst.light_base_id = tri_light_count;
-                tri_light_count += instances[i].m->get_indices().size() / 3;
-            }
-            else inst.light_base_id = -1;
+    auto needs_refresh = [&](size_t i){
+        return force_instance_refresh_frames != 0 ||
+            instances[i].last_refresh_frame+MAX_FRAMES_IN_FLIGHT >= frame_counter;
+    };
 
-            vertex_count += instances[i].m->get_indices().size();
+    // A reallocated buffer has garbage in every staging buffer, so all of them
+    // must be filled again before only the changes are uploaded.
+    if(instance_data.resize(sizeof(instance_buffer) * instances.size()))
+        force_instance_refresh_frames = MAX_FRAMES_IN_FLIGHT;
+
+    // Light base IDs are a running sum, so they are resolved here on the frame
+    // thread. Everything else is packed in parallel below, each job writing its
+    // own range of instance_data.
+    instance_light_base_ids.resize(instances.size(), -1);
+    instance_dirty.resize(instances.size());
+    if(opt.alloc_sh_grids)
+        sh_grid_lookup.refresh(*cur_scene);
+    for(size_t i = 0; i < instances.size(); ++i)
+    {
+        int32_t light_base_id = -1;
+        if(instances[i].mat->emission_factor != vec3(0))
+        {
+            light_base_id = tri_light_count;
+            tri_light_count += instances[i].m->get_indices().size() / 3;
+        }
 
-            // Skip unchanged instances.
-            if(
-                force_instance_refresh_frames == 0 &&
-                instances[i].last_refresh_frame+MAX_FRAMES_IN_FLIGHT < frame_counter
-            ) return;
-
-            pmat4 model = instances[i].transform;
-            inst.model = model;
-            inst.model_normal = instances[i].normal_transform;
-            inst.model_prev = instances[i].prev_transform;
-            int index = -1;
-            if(opt.alloc_sh_grids && !get_sh_grid(*cur_scene, model[3], &index))
-                get_largest_sh_grid(*cur_scene, &index);
-            inst.sh_grid_index = index;
-            inst.pad = 0;
-            inst.shadow_terminator_mul = 1.0f/(
-                1.0f-0.5f * instances[i].mod->get_shadow_terminator_offset()
-            );
+        vertex_count += instances[i].m->get_indices().size();
+
+        instance_dirty[i] =
+            needs_refresh(i) || instance_light_base_ids[i] != light_base_id;
+        instance_light_base_ids[i] = light_base_id;
+    }
 
-            const material& mat = *instances[i].mat;
-            inst.mat.albedo_factor = mat.albedo_factor;
-            inst.mat.metallic_roughness_factor =
-                vec4(mat.metallic_factor, mat.roughness_factor, 0, 0);
-            inst.mat.emission_factor = vec4(mat.emission_factor, 0.0f);
-            inst.mat.flags =
-                (mat.double_sided ? MATERIAL_FLAG_DOUBLE_SIDED : 0) |
-                (mat.transient ? MATERIAL_FLAG_TRANSIENT : 0);
-            inst.mat.transmittance = mat.transmittance;
-            inst.mat.ior = mat.ior;
-            inst.mat.normal_factor = mat.normal_factor;
-
-            inst.mat.albedo_tex_id = s_table.find_tex_id(mat.albedo_tex);
-            inst.mat.metallic_roughness_tex_id =
-                s_table.find_tex_id(mat.metallic_roughness_tex);
-            inst.mat.normal_tex_id = s_table.find_tex_id(mat.normal_tex);
-            inst.mat.emission_tex_id = s_table.find_tex_id(mat.emission_tex);
+    instance_data.map_changes<instance_buffer>(frame_index, [&](
+        instance_buffer* data, gpu_buffer::change_list& changes
+    ){
+        update_pool.parallel_for(
+            instances.size(), UPDATE_CHUNK_SIZE,
+            [&](size_t begin, size_t end){
+                for(size_t i = begin; i < end; ++i)
+                {
+                    // Skip unchanged instances.
+                    if(!instance_dirty[i]) continue;
+
+                    instance_buffer& inst = data[i];
+                    inst.light_base_id = instance_light_base_ids[i];
+                    inst.model = instances[i].transform;
+                    inst.model_normal = instances[i].normal_transform;
+                    inst.model_prev = instances[i].prev_transform;
+                    inst.sh_grid_index = -1;
+                    if(opt.alloc_sh_grids)
+                    {
+                        inst.sh_grid_index =
+                            sh_grid_lookup.find(instances[i].transform[3]);
+                        if(inst.sh_grid_index < 0)
+                            inst.sh_grid_index = sh_grid_lookup.find_largest();
+                    }
+                    inst.pad = 0;
+                    inst.shadow_terminator_mul = 1.0f/(
+                        1.0f-0.5f * instances[i].mod->get_shadow_terminator_offset()
+                    );
+
+                    const material& mat = *instances[i].mat;
+                    inst.mat.albedo_factor = mat.albedo_factor;
+                    inst.mat.metallic_roughness_factor =
+                        vec4(mat.metallic_factor, mat.roughness_factor, 0, 0);
+                    inst.mat.emission_factor = vec4(mat.emission_factor, 0.0f);
+                    inst.mat.flags =
+                        (mat.double_sided ? MATERIAL_FLAG_DOUBLE_SIDED : 0) |
+                        (mat.transient ? MATERIAL_FLAG_TRANSIENT : 0);
+                    inst.mat.transmittance = mat.transmittance;
+                    inst.mat.ior = mat.ior;
+                    inst.mat.normal_factor = mat.normal_factor;
+
+                    inst.mat.albedo_tex_id = s_table.find_tex_id(mat.albedo_tex);
+                    inst.mat.metallic_roughness_tex_id =
+                        s_table.find_tex_id(mat.metallic_roughness_tex);
+                    inst.mat.normal_tex_id = s_table.find_tex_id(mat.normal_tex);
+                    inst.mat.emission_tex_id = s_table.find_tex_id(mat.emission_tex);
+                }
+            }
+        );
+
+        for(size_t i = 0; i < instances.size(); ++i)
+        {
+            if(instance_dirty[i])
+                changes.add(i * sizeof(instance_buffer), sizeof(instance_buffer));
         }
-    );
+    });
     if(force_instance_refresh_frames > 0) force_instance_refresh_frames--;
 
     size_t sh_grid_count = cur_scene->count<sh_grid>();
@@ -1173,6 +1751,9 @@ void scene_stage::update(uint32_t frame_index)
         }
     );
 
+    if(opt.light_clustering)
+        update_light_clusters(frame_index, camera_entities);
+
     if(opt.shadow_mapping)
     {
         lights_outdated |= update_shadow_map_params();
@@ -1386,6 +1967,23 @@ void scene_stage::update(uint32_t frame_index)
             }
         );
 
+        if(process_blas_builds(frame_index))
+            geometry_outdated = true;
+
+        // TLAS instances are filled in parallel, so the first instance of
+        // each group is needed up front. Groups whose BLAS is still being
+        // built are left out.
+        group_offsets.resize(group_cache.size());
+        tlas_groups.clear();
+        size_t group_offset = 0;
+        for(size_t j = 0; j < group_cache.size(); ++j)
+        {
+            group_offsets[j] = group_offset;
+            group_offset += group_cache[j].size;
+            if(pending_blas_builds == 0 || blas_cache.at(group_cache[j].id).is_built())
+                tlas_groups.push_back(j);
+        }
+
         for(device& dev: get_device_mask())
         {
             if(geometry_outdated)
@@ -1418,40 +2016,45 @@ void scene_stage::update(uint32_t frame_index)
 
             auto& instance_buffer = tlas->get_instances_buffer();
 
-            as_instance_count = 0;
             uint32_t total_max_capacity = opt.max_instances + opt.max_lights;
+            as_instance_count = std::min(tlas_groups.size(), size_t(total_max_capacity));
             instance_buffer.map_one<vk::AccelerationStructureInstanceKHR>(
                 dev.id,
                 frame_index,
                 [&](vk::AccelerationStructureInstanceKHR* as_instances){
                     // Update instance staging buffer
-                    size_t offset = 0;
-                    for(size_t j = 0; j < group_cache.size() && as_instance_count < total_max_capacity; ++j)
-                    {
-                        const instance_group& group = group_cache[j];
-                        const blas_info& bi = blas_cache.at(group.id);
-
-                        bool dynamic = group_strategy == blas_strategy::ALL_MERGED_STATIC ? false : !group.static_mesh;
-                        int blas_index = dynamic && opt.track_prev_tlas ? (frame_index&1) : 0;
-
-                        const bottom_level_acceleration_structure& blas = *bi.blas[blas_index];
-                        vk::AccelerationStructureInstanceKHR inst = vk::AccelerationStructureInstanceKHR(
-                            {}, offset, 1<<0, 0, // Hit group 0 for triangle meshes.
-                            {}, blas.get_blas_address(dev.id)
-                        );
-                        if(!blas.is_backface_culled())
-                            inst.setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
-
-                        mat4 global_transform = group.static_transformable ?
-                            mat4(1) : transpose(instances[offset].transform);
-                        memcpy(
-                            (void*)&inst.transform,
-                            (void*)&global_transform,
-                            sizeof(inst.transform)
-                        );
-                        as_instances[as_instance_count++] = inst;
-                        offset += group.size;
-                    }
+                    update_pool.parallel_for(
+                        as_instance_count, UPDATE_CHUNK_SIZE,
+                        [&](size_t begin, size_t end){
+                            for(size_t j = begin; j < end; ++j)
+                            {
+                                size_t group_index = tlas_groups[j];
+                                const instance_group& group = group_cache[group_index];
+                                const blas_info& bi = blas_cache.at(group.id);
+                                size_t offset = group_offsets[group_index];
+
+                                bool dynamic = group_strategy == blas_strategy::ALL_MERGED_STATIC ? false : !group.static_mesh;
+                                int blas_index = dynamic && opt.track_prev_tlas ? (frame_index&1) : 0;
+
+                                const bottom_level_acceleration_structure& blas = *bi.blas[blas_index];
+                                vk::AccelerationStructureInstanceKHR inst = vk::AccelerationStructureInstanceKHR(
+                                    {}, offset, 1<<0, 0, // Hit group 0 for triangle meshes.
+                                    {}, blas.get_blas_address(dev.id)
+                                );
+                                if(!blas.is_backface_culled())
+                                    inst.setFlags(vk::GeometryInstanceFlagBitsKHR::eTriangleFacingCullDisable);
+
+                                mat4 global_transform = group.static_transformable ?
+                                    mat4(1) : transpose(instances[offset].transform);
+                                memcpy(
+                                    (void*)&inst.transform,
+                                    (void*)&global_transform,
+                                    sizeof(inst.transform)
+                                );
+                                as_instances[j] = inst;
+                            }
+                        }
+                    );
 
                     if(light_aabb_count != 0 && as_instance_count < total_max_capacity && light_blas.has_value())
                     {
@@ -1468,12 +2071,30 @@ void scene_stage::update(uint32_t frame_index)
             );
         }
 
+        blas_rebuild_count = opt.blas_rebuilds_per_frame != 0 ?
+            schedule_blas_rebuilds() : 0;
+
         if(opt.pre_transform_vertices)
             geometry_outdated |= reserve_pre_transformed_vertices(vertex_count);
         else
             clear_pre_transformed_vertices();
     }
 
+    if(opt.indirect_draw)
+    {
+        if(geometry_outdated)
+            refresh_merged_geometry();
+        update_draw_info(frame_index);
+    }
+
+    if(
+        has_tri_light_alias_table() &&
+        (geometry_outdated || tri_light_count != tri_light_alias_table_count)
+    ){
+        update_tri_light_alias_table(tri_light_count);
+        lights_outdated = true;
+    }
+
     update_temporal_tables(frame_index);
     if(lights_outdated) light_change_counter++;
     if(geometry_outdated) geometry_change_counter++;
@@ -1488,11 +2109,49 @@ void scene_stage::update(uint32_t frame_index)
         lights_outdated = false;
         geometry_outdated = false;
     }
-    else if(prev_was_rebuild)
+    else if(prev_was_rebuild || blas_rebuild_count != 0)
     {
+        // BLAS rebuilds must not be replayed on the following frames either.
         record_command_buffers(light_aabb_count, false);
-        prev_was_rebuild = false;
+        prev_was_rebuild = blas_rebuild_count != 0;
     }
+
+    record_uploads(frame_index);
+}
+
+void scene_stage::record_uploads(uint32_t frame_index)
+{
+    // Only the ranges written this frame are copied, so this can't be baked
+    // into the command buffers from record_command_buffers().
+    uploaded_bytes = 0;
+    for(device& dev: get_device_mask())
+    {
+        vk::CommandBuffer cb = begin_graphics(dev.id, true);
+
+        // Copy over previous light data.
+        if(prev_point_light_count != 0)
+        {
+            cb.copyBuffer(point_light_data[dev.id], prev_point_light_data[dev.id], vk::BufferCopy{0, 0, prev_point_light_count * sizeof(point_light_entry)});
+        }
+
+        uploaded_bytes += instance_data.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += directional_light_data.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += point_light_data.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += sh_grid_data.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += shadow_map_data.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += camera_data.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += scene_metadata.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += light_aabb_buffer.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += temporal_tables.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += draw_info_data.upload_changes(dev.id, frame_index, cb);
+        uploaded_bytes += light_cluster_slicing_data.upload_changes(dev.id, frame_index, cb);
+
+        bulk_upload_barrier(cb, vk::PipelineStageFlagBits::eComputeShader);
+        end_graphics_once(cb, dev.id);
+    }
+
+    tracing_record& timing = get_context()->get_timing();
+    timing.set_counter("Uploaded bytes", uploaded_bytes);
 }
 
 void scene_stage::record_command_buffers(size_t light_aabb_count, bool rebuild_as)
@@ -1506,25 +2165,12 @@ void scene_stage::record_command_buffers(size_t light_aabb_count, bool rebuild_a
             vk::CommandBuffer cb = begin_graphics(dev.id);
             stage_timer.begin(cb, dev.id, i);
 
-            // Copy over previous light data.
-            if(prev_point_light_count != 0)
-            {
-                cb.copyBuffer(point_light_data[dev.id], prev_point_light_data[dev.id], vk::BufferCopy{0, 0, prev_point_light_count * sizeof(point_light_entry)});
-            }
-
-            instance_data.upload(dev.id, i, cb);
-            directional_light_data.upload(dev.id, i, cb);
-            point_light_data.upload(dev.id, i, cb);
-            sh_grid_data.upload(dev.id, i, cb);
-            shadow_map_data.upload(dev.id, i, cb);
-            camera_data.upload(dev.id, i, cb);
-            scene_metadata.upload(dev.id, i, cb);
-            light_aabb_buffer.upload(dev.id, i, cb);
-            temporal_tables.upload(dev.id, i, cb);
-
-            bulk_upload_barrier(cb, vk::PipelineStageFlagBits::eComputeShader);
-
+            // Scene data uploads are in record_uploads().
             record_skinning(dev.id, i, cb);
+            if(opt.light_clustering)
+                record_light_clustering(dev.id, cb);
+            if(opt.indirect_draw)
+                record_merged_geometry_copy(dev.id, cb, merged_geometry_outdated);
             if(dev.ctx->is_ray_tracing_supported())
             {
                 record_as_build(dev.id, i, cb, light_aabb_count, rebuild_as);
@@ -1538,6 +2184,7 @@ void scene_stage::record_command_buffers(size_t light_aabb_count, bool rebuild_a
             end_graphics(cb, dev.id, i);
         }
     }
+    merged_geometry_outdated = false;
 }
 
 void scene_stage::record_skinning(device_id id, uint32_t frame_index, vk::CommandBuffer cb)
@@ -1587,7 +2234,7 @@ void scene_stage::record_skinning(device_id id, uint32_t frame_index, vk::Comman
         std::vector<bottom_level_acceleration_structure::entry> entries;
         for(const instance_group& group: group_cache)
         {
-            if(group.static_mesh)
+            if(group.static_mesh || !blas_cache.at(group.id).is_built())
             {
                 offset += group.size;
                 continue;
@@ -1608,10 +2255,14 @@ void scene_stage::record_skinning(device_id id, uint32_t frame_index, vk::Comman
             int prev_blas_index = dynamic && opt.track_prev_tlas ? ((frame_index+1)&1) : 0;
             int cur_blas_index = dynamic && opt.track_prev_tlas ? (frame_index&1) : 0;
 
+            // Scheduled rebuilds are only recorded for a single frame, see
+            // schedule_blas_rebuilds(). A refit from the rebuilt BLAS also
+            // refreshes the other ping-pong BLAS on the next frame.
             blas_info& bi = blas_cache.at(group.id);
             bi.blas[cur_blas_index]->rebuild_from(
                 id, *bi.blas[prev_blas_index], frame_index, cb, entries,
-                group_strategy == blas_strategy::ALL_MERGED_STATIC ? false : true
+                group_strategy != blas_strategy::ALL_MERGED_STATIC &&
+                !bi.rebuild_scheduled
             );
         }
     }
@@ -1722,6 +2373,214 @@ void scene_stage::record_pre_transform(
     );
 }
 
+void scene_stage::record_merged_geometry_copy(
+    device_id id,
+    vk::CommandBuffer cb,
+    bool copy_static
+){
+    merged_geometry_data& mg = merged_geometry[id];
+
+    // Animated vertices are written by the skinning shader just before this.
+    vk::MemoryBarrier barrier(
+        vk::AccessFlagBits::eShaderWrite,
+        vk::AccessFlagBits::eTransferRead
+    );
+    cb.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eTransfer,
+        {}, barrier, {}, {}
+    );
+
+    for(const merged_range& r: merged_vertex_ranges)
+    {
+        bool animated = r.m->get_animation_source() != nullptr;
+        size_t count = r.m->get_vertices().size();
+        if(count == 0 || (!animated && !copy_static))
+            continue;
+
+        cb.copyBuffer(
+            r.m->get_vertex_buffer(id), mg.vertices,
+            {{0, r.offset * sizeof(mesh::vertex), count * sizeof(mesh::vertex)}}
+        );
+        if(animated)
+        {
+            cb.copyBuffer(
+                r.m->get_prev_pos_buffer(id), mg.prev_pos,
+                {{0, r.offset * sizeof(pvec4), count * sizeof(pvec4)}}
+            );
+        }
+    }
+
+    if(copy_static)
+    {
+        for(const merged_range& r: merged_index_ranges)
+        {
+            size_t count = r.m->get_indices().size();
+            if(count == 0)
+                continue;
+            cb.copyBuffer(
+                r.m->get_index_buffer(id), mg.indices,
+                {{0, r.offset * sizeof(uint32_t), count * sizeof(uint32_t)}}
+            );
+        }
+    }
+
+    barrier = vk::MemoryBarrier(
+        vk::AccessFlagBits::eTransferWrite,
+        vk::AccessFlagBits::eVertexAttributeRead|vk::AccessFlagBits::eIndexRead
+    );
+    cb.pipelineBarrier(
+        vk::PipelineStageFlagBits::eTransfer,
+        vk::PipelineStageFlagBits::eVertexInput,
+        {}, barrier, {}, {}
+    );
+}
+
+void scene_stage::update_light_clusters(
+    uint32_t frame_index,
+    const std::vector<entity>& camera_entities
+){
+    light_cluster_camera_count = camera_entities.size();
+    lights_outdated |= light_cluster_slicing_data.resize(
+        sizeof(light_cluster_slicing_entry) * light_cluster_camera_count
+    );
+    light_cluster_slicing_data.map<light_cluster_slicing_entry>(
+        frame_index, [&](light_cluster_slicing_entry* slicing){
+            for(size_t i = 0; i < camera_entities.size(); ++i)
+            {
+                camera* cam = cur_scene->get<camera>(camera_entities[i]);
+                slicing[i] = {0.0f, 0.0f};
+                if(cam->get_projection_type() != camera::PERSPECTIVE)
+                    continue;
+
+                float near = cam->get_near();
+                float far = min(
+                    cam->get_far(), near * LIGHT_CLUSTER_MAX_DEPTH_RATIO
+                );
+                if(near <= 0.0f || far <= near)
+                    continue;
+
+                float scale = LIGHT_CLUSTER_SLICES / log(far / near);
+                slicing[i] = {scale, -log(near) * scale};
+            }
+        }
+    );
+
+    for(auto[dev, lc]: light_clusters)
+    {
+        if(lc.camera_capacity >= light_cluster_camera_count)
+            continue;
+
+        lc.clusters = create_buffer(
+            dev,
+            {
+                {}, light_cluster_camera_count * LIGHT_CLUSTER_COUNT *
+                    LIGHT_CLUSTER_STRIDE * sizeof(uint32_t),
+                vk::BufferUsageFlagBits::eStorageBuffer,
+                vk::SharingMode::eExclusive
+            },
+            VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT
+        );
+        lc.camera_capacity = light_cluster_camera_count;
+        // The descriptor set and the dispatch size must be updated.
+        lights_outdated = true;
+    }
+}
+
+void scene_stage::update_tri_light_alias_table(size_t tri_light_count)
+{
+    tri_light_alias_table_count = tri_light_count;
+    if(tri_light_count == 0)
+    {
+        for(auto[dev, table]: tri_light_alias_table)
+            table.drop();
+        return;
+    }
+
+    // Triangles are visited in the same order as in record_tri_light_extraction.
+    std::vector<float> power;
+    power.reserve(tri_light_count);
+    for(const instance& inst: instances)
+    {
+        if(inst.mat->emission_factor == vec3(0))
+            continue;
+
+        float luminance = dot(
+            inst.mat->emission_factor, vec3(0.2126, 0.7152, 0.0722)
+        );
+        const std::vector<mesh::vertex>& vertices = inst.m->get_vertices();
+        const std::vector<uint32_t>& indices = inst.m->get_indices();
+        for(size_t i = 0; i + 3 <= indices.size(); i += 3)
+        {
+            vec3 a = vec3(inst.transform * vec4(vertices[indices[i+0]].pos, 1.0f));
+            vec3 b = vec3(inst.transform * vec4(vertices[indices[i+1]].pos, 1.0f));
+            vec3 c = vec3(inst.transform * vec4(vertices[indices[i+2]].pos, 1.0f));
+            float area = 0.5f * length(cross(b - a, c - a));
+            power.push_back(max(luminance * area, 0.0f));
+        }
+    }
+
+    std::vector<alias_table_entry> table;
+    build_alias_table(power.data(), power.size(), table);
+
+    // Weights now average to 1, so the selection probabilities are just the
+    // weights divided by the triangle count.
+    float inv_count = 1.0f / power.size();
+    for(size_t i = 0; i < table.size(); ++i)
+    {
+        table[i].pdf = power[i] * inv_count;
+        table[i].alias_pdf = power[table[i].alias_id] * inv_count;
+    }
+
+    for(auto[dev, buf]: tri_light_alias_table)
+    {
+        buf = create_buffer(
+            dev,
+            {
+                {}, table.size() * sizeof(alias_table_entry),
+                vk::BufferUsageFlagBits::eStorageBuffer,
+                vk::SharingMode::eExclusive
+            },
+            VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT,
+            table.data()
+        );
+    }
+}
+
+void scene_stage::record_light_clustering(device_id id, vk::CommandBuffer cb)
+{
+    if(light_cluster_camera_count == 0)
+        return;
+
+    // Earlier frames may still be reading the clusters.
+    vk::MemoryBarrier barrier(
+        vk::AccessFlagBits::eShaderRead,
+        vk::AccessFlagBits::eShaderWrite
+    );
+    cb.pipelineBarrier(
+        vk::PipelineStageFlagBits::eAllCommands,
+        vk::PipelineStageFlagBits::eComputeShader,
+        {}, barrier, {}, {}
+    );
+
+    light_cluster[id].bind(cb);
+    light_cluster[id].set_descriptors(cb, scene_desc, 0, 0);
+    cb.dispatch(
+        light_cluster_camera_count * LIGHT_CLUSTER_COUNT /
+        LIGHT_CLUSTER_WORKGROUP_SIZE, 1, 1
+    );
+
+    barrier = vk::MemoryBarrier(
+        vk::AccessFlagBits::eShaderWrite,
+        vk::AccessFlagBits::eShaderRead
+    );
+    cb.pipelineBarrier(
+        vk::PipelineStageFlagBits::eComputeShader,
+        vk::PipelineStageFlagBits::eAllCommands,
+        {}, barrier, {}, {}
+    );
+}
+
 void scene_stage::init_descriptor_set_layout()
 {
     scene_desc.add("instances", {0, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eAll, nullptr});
@@ -1739,6 +2598,15 @@ void scene_stage::init_descriptor_set_layout()
     device_mask dev = get_device_mask();
     if(dev.get_context()->is_ray_tracing_supported())
         scene_desc.add("tlas", {11, vk::DescriptorType::eAccelerationStructureKHR, 1, vk::ShaderStageFlagBits::eAll, nullptr});
+    if(opt.indirect_draw)
+        scene_desc.add("draw_info", {12, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eAll, nullptr}, vk::DescriptorBindingFlagBits::ePartiallyBound);
+    if(opt.light_clustering)
+    {
+        scene_desc.add("light_cluster_slicings", {13, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eAll, nullptr}, vk::DescriptorBindingFlagBits::ePartiallyBound);
+        scene_desc.add("light_clusters", {14, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eAll, nullptr}, vk::DescriptorBindingFlagBits::ePartiallyBound);
+    }
+    if(has_tri_light_alias_table())
+        scene_desc.add("tri_light_alias_table", {15, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eAll, nullptr}, vk::DescriptorBindingFlagBits::ePartiallyBound);
 
     scene_raster_desc.add("sh_grid_data", {0, vk::DescriptorType::eCombinedImageSampler, opt.max_3d_samplers, vk::ShaderStageFlagBits::eAll, nullptr}, vk::DescriptorBindingFlagBits::ePartiallyBound);
     scene_raster_desc.add("sh_grids", {1, vk::DescriptorType::eStorageBuffer, 1, vk::ShaderStageFlagBits::eAll, nullptr}, vk::DescriptorBindingFlagBits::ePartiallyBound);
@@ -1768,6 +2636,10 @@ void scene_stage::update_descriptor_set()
     scene_desc.set_buffer(0, "tri_lights", tri_light_data);
     scene_desc.set_buffer(0, "scene_metadata", scene_metadata);
     scene_desc.set_buffer(0, "camera", camera_data);
+    if(opt.indirect_draw)
+        scene_desc.set_buffer(0, "draw_info", draw_info_data);
+    if(opt.light_clustering)
+        scene_desc.set_buffer(0, "light_cluster_slicings", light_cluster_slicing_data);
 
     if(envmap)
         scene_desc.set_texture(0, "environment_map_tex", *envmap, envmap_sampler);
@@ -1819,6 +2691,20 @@ void scene_stage::update_descriptor_set()
             }});
         }
 
+        if(opt.light_clustering && light_clusters[id].camera_capacity != 0)
+        {
+            scene_desc.set_buffer(id, 0, "light_clusters", {{
+                light_clusters[id].clusters, 0, VK_WHOLE_SIZE
+            }});
+        }
+
+        if(has_tri_light_alias_table() && tri_light_alias_table_count != 0)
+        {
+            scene_desc.set_buffer(id, 0, "tri_light_alias_table", {{
+                tri_light_alias_table[id], 0, VK_WHOLE_SIZE
+            }});
+        }
+
         if(dev.ctx->is_ray_tracing_supported())
         {
             scene_desc.set_acceleration_structure(id, 0, "tlas", *this->tlas->get_tlas_handle(id));
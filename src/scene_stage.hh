@@ -13,6 +13,7 @@
 #include "atlas.hh"
 #include "camera.hh"
 #include "descriptor_set.hh"
+#include "thread_pool.hh"
 
 namespace tr
 {
@@ -25,6 +26,15 @@ enum class blas_strategy
     ALL_MERGED_STATIC
 };
 
+enum class tri_light_selection_mode
+{
+    UNIFORM,
+    // Uses an alias table built from the luminance of the emission factor
+    // times the world-space area of each triangle. Emission textures are not
+    // accounted for.
+    POWER
+};
+
 class scene_stage: public multi_device_stage
 {
 public:
@@ -40,6 +50,34 @@ public:
         bool alloc_sh_grids = false;
         blas_strategy group_strategy = blas_strategy::STATIC_MERGED_DYNAMIC_PER_MODEL;
         bool track_prev_tlas = false;
+        // Packs the geometry of all instances into shared buffers and keeps
+        // per-instance draw parameters and bounds on the GPU, so that raster
+        // stages can cull and draw instances with instance_culler.
+        bool indirect_draw = false;
+        // Bins point lights and spotlights into a view-space froxel grid for
+        // each perspective camera every frame, so that POINT_LIGHT_FOR_BEGIN
+        // only visits the lights near the shaded point. Lights are culled
+        // beyond their cutoff radius.
+        bool light_clustering = false;
+        // Only has an effect with gather_emissive_triangles.
+        tri_light_selection_mode tri_light_selection = tri_light_selection_mode::UNIFORM;
+        // Worker threads for the per-instance loops of update(). 0 uses the
+        // hardware thread count.
+        size_t update_thread_count = 0;
+        // If non-zero, new BLASes are built in the background instead of
+        // stalling update(). New builds are started each frame until this many
+        // triangles have been submitted; at least one build is always started.
+        // Instances are left out of the TLAS until their BLAS is ready.
+        size_t blas_build_budget = 0;
+        // Dynamic BLASes are refitted every frame, which slowly degrades them
+        // as the geometry deforms. They are rebuilt after blas_refit_limit
+        // refits, or once the surface area of the bounds of their joints has
+        // grown by blas_rebuild_growth times since the last build; 0 disables
+        // either check. At most blas_rebuilds_per_frame BLASes are rebuilt
+        // per frame, the most degraded first. The rest wait for later frames.
+        size_t blas_refit_limit = 300;
+        float blas_rebuild_growth = 1.5f;
+        size_t blas_rebuilds_per_frame = 1;
     };
 
     scene_stage(device_mask dev, const options& opt);
@@ -56,6 +94,10 @@ public:
 
     bool check_update(uint32_t categories, uint32_t& prev_counter) const;
     bool has_prev_tlas() const;
+    // Bytes of scene data copied to each device during the latest update,
+    // summed over devices. Only changed ranges are copied. Also recorded as
+    // the "Uploaded bytes" counter of the frame's timing.
+    size_t get_uploaded_bytes() const;
 
     environment_map* get_environment_map() const;
     vec3 get_ambient() const;
@@ -73,6 +115,20 @@ public:
     };
     const std::vector<instance>& get_instances() const;
 
+    // The merged buffers are only available with options::indirect_draw.
+    // Instance i is drawn from them with the parameters in draw_infos.d[i]
+    // (shader/indirect_draw.glsl) and gl_InstanceIndex = i.
+    bool has_indirect_draw() const;
+    vk::Buffer get_merged_vertex_buffer(device_id id) const;
+    vk::Buffer get_merged_prev_pos_buffer(device_id id) const;
+    vk::Buffer get_merged_index_buffer(device_id id) const;
+
+    // Shaders need LIGHT_CLUSTERING from get_defines() for the clusters.
+    bool has_light_clusters() const;
+    // Shaders need TRI_LIGHT_SELECTION_POWER from get_defines() for the
+    // table.
+    bool has_tri_light_alias_table() const;
+
     const std::unordered_map<sh_grid*, texture>& get_sh_grid_textures() const;
 
     descriptor_set& get_descriptors();
@@ -114,10 +170,13 @@ protected:
 
 private:
     void record_command_buffers(size_t light_aabb_count, bool rebuild_as);
+    void record_uploads(uint32_t frame_index);
     void record_skinning(device_id id, uint32_t frame_index, vk::CommandBuffer cb);
     void record_as_build(device_id id, uint32_t frame_index, vk::CommandBuffer cb, size_t light_aabb_count, bool rebuild);
     void record_tri_light_extraction(device_id id, vk::CommandBuffer cb);
     void record_pre_transform(device_id id, vk::CommandBuffer cb);
+    void record_merged_geometry_copy(device_id id, vk::CommandBuffer cb, bool copy_static);
+    void record_light_clustering(device_id id, vk::CommandBuffer cb);
 
     void init_descriptor_set_layout();
     void update_descriptor_set();
@@ -132,6 +191,7 @@ private:
     bool lights_outdated;
 
     unsigned force_instance_refresh_frames;
+    size_t uploaded_bytes;
     scene* cur_scene;
 
     //==========================================================================
@@ -142,6 +202,31 @@ private:
     std::optional<bottom_level_acceleration_structure> light_blas;
     gpu_buffer light_aabb_buffer;
 
+    // Clusters are only built for options::light_clustering. Cameras are in
+    // the same order as in camera_data.
+    size_t light_cluster_camera_count;
+    gpu_buffer light_cluster_slicing_data;
+    struct light_cluster_data
+    {
+        size_t camera_capacity = 0;
+        vkm<vk::Buffer> clusters;
+    };
+    per_device<light_cluster_data> light_clusters;
+
+    void update_light_clusters(
+        uint32_t frame_index,
+        const std::vector<entity>& camera_entities
+    );
+
+    // Only built for tri_light_selection_mode::POWER. Entries are in the same
+    // order as tri_light_data, but the table is only rebuilt when the set of
+    // emissive instances changes. It stays consistent with itself even when
+    // the emitters move, so sampling remains unbiased.
+    size_t tri_light_alias_table_count;
+    per_device<vkm<vk::Buffer>> tri_light_alias_table;
+
+    void update_tri_light_alias_table(size_t tri_light_count);
+
     //==========================================================================
     // Mesh stuff
     //==========================================================================
@@ -169,14 +254,57 @@ private:
         // If track_prev_tlas = false or the BLAS is static, only blas[0] is in
         // use. Otherwise, it's a ping-pong buffer.
         std::optional<bottom_level_acceleration_structure> blas[2];
+        // Only used with options::blas_build_budget.
+        bool build_recorded = false;
+        // Only used for dynamic BLASes. The refits are recorded once, so
+        // they're counted per update() instead.
+        size_t refits_since_rebuild = 0;
+        float rebuild_joint_area = 0.0f;
+        bool rebuild_scheduled = false;
+
+        bool is_built() const;
     };
     std::unordered_map<uint64_t, blas_info> blas_cache;
+    size_t pending_blas_builds;
+    // Builds waiting for compaction, with the frame they were started on.
+    per_device<std::vector<std::pair<uint64_t, blas_batch>>> pending_blas_batches;
+    size_t blas_rebuild_count;
+    std::vector<size_t> tlas_groups;
     std::vector<instance> instances;
     std::vector<instance_group> group_cache;
     blas_strategy group_strategy;
 
+    // The whole scene is only walked again when models or transformables are
+    // added or removed. Otherwise, only the instances of non-static
+    // transformables are revisited. Making a transformable static or dynamic
+    // after it has been added to the scene is not detected, nor is replacing
+    // the vertex groups of a model in place.
+    struct dynamic_instance_range
+    {
+        entity id;
+        const transformable* t;
+        uint32_t first_instance;
+        uint32_t count;
+    };
+    bool instance_cache_outdated;
+    bool instance_ids_stable;
+    std::vector<dynamic_instance_range> dynamic_instances;
+
+    // Scratch data for update(), resolved serially before the instances are
+    // packed in parallel.
+    thread_pool update_pool;
+    std::vector<int32_t> instance_light_base_ids;
+    std::vector<uint8_t> instance_dirty;
+    sh_grid_index sh_grid_lookup;
+    std::vector<size_t> group_offsets;
+
     bool refresh_instance_cache();
+    void refresh_dynamic_instances();
     void ensure_blas();
+    bool process_blas_builds(uint32_t frame_index);
+    void log_blas_batch(const blas_batch& batch);
+    size_t schedule_blas_rebuilds();
+    float get_joint_bounds_area(size_t first_instance, size_t count) const;
     void assign_group_cache(
         uint64_t id,
         bool static_mesh,
@@ -188,6 +316,38 @@ private:
     void clear_pre_transformed_vertices();
     void update_temporal_tables(uint32_t frame_index);
 
+    //==========================================================================
+    // Indirect draw stuff
+    //==========================================================================
+    struct merged_geometry_data
+    {
+        size_t vertex_capacity = 0;
+        size_t index_capacity = 0;
+        vkm<vk::Buffer> vertices;
+        // Parallel to 'vertices', only filled for animated meshes.
+        vkm<vk::Buffer> prev_pos;
+        vkm<vk::Buffer> indices;
+    };
+    per_device<merged_geometry_data> merged_geometry;
+    // Each distinct mesh is stored only once, even if it has many instances.
+    struct merged_range
+    {
+        const mesh* m;
+        uint32_t offset;
+    };
+    std::vector<merged_range> merged_vertex_ranges;
+    std::vector<merged_range> merged_index_ranges;
+    // x = vertex offset, y = first index of each instance.
+    std::vector<uvec2> merged_instance_offsets;
+    // Object-space bounding spheres by mesh ID.
+    std::unordered_map<uint64_t, vec4> mesh_bounds;
+    bool merged_geometry_outdated;
+    unsigned draw_info_refresh_frames;
+    gpu_buffer draw_info_data;
+
+    void refresh_merged_geometry();
+    void update_draw_info(uint32_t frame_index);
+
     //==========================================================================
     // Shadow map stuff.
     //==========================================================================
@@ -231,7 +391,7 @@ private:
 
     std::optional<top_level_acceleration_structure> tlas;
     std::optional<top_level_acceleration_structure> prev_tlas;
-    std::optional<event_subscription> events[10];
+    std::optional<event_subscription> events[12];
 
     sampler brdf_integration_sampler;
     texture brdf_integration;
@@ -264,6 +424,7 @@ private:
     per_device<compute_pipeline> extract_tri_lights;
     push_descriptor_set pre_transform_desc;
     per_device<compute_pipeline> pre_transform;
+    per_device<compute_pipeline> light_cluster;
 
     options opt;
     timer stage_timer;
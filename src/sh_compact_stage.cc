@@ -8,6 +8,7 @@ struct push_constant_buffer
 {
     int samples;
     int samples_per_work_item;
+    int grid_height;
 };
 
 }
@@ -18,13 +19,47 @@ namespace tr
 sh_compact_stage::sh_compact_stage(
     device& dev,
     texture& inflated_source,
-    texture& compacted_output
+    texture& compacted_output,
+    uvec3 probe_resolution
 ):  single_device_stage(dev),
     desc(dev),
     comp(dev),
     compact_timer(dev, "SH compact")
 {
-    shader_source src("shader/sh_compact.comp");
+    bool track_changes = probe_resolution != uvec3(0);
+    size_t changes_size = sizeof(pvec2) *
+        probe_resolution.x * probe_resolution.y * probe_resolution.z;
+
+    std::map<std::string, std::string> defines;
+    if(track_changes)
+    {
+        defines["TRACK_CHANGES"];
+
+        vk::BufferCreateInfo info(
+            {}, changes_size,
+            vk::BufferUsageFlagBits::eStorageBuffer |
+            vk::BufferUsageFlagBits::eTransferSrc |
+            vk::BufferUsageFlagBits::eTransferDst,
+            vk::SharingMode::eExclusive
+        );
+        probe_luminance = create_buffer(dev, info, VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT);
+
+        vk::CommandBuffer cb = begin_command_buffer(dev);
+        cb.fillBuffer(probe_luminance, 0, VK_WHOLE_SIZE, 0);
+        end_command_buffer(dev, cb);
+
+        for(size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+        {
+            probe_changes[i] = create_download_buffer(dev, changes_size);
+            vmaMapMemory(
+                dev.allocator,
+                probe_changes[i].get_allocation(),
+                &probe_changes_mem[i]
+            );
+        }
+    }
+
+    shader_source src("shader/sh_compact.comp", defines);
     desc.add(src);
     comp.init(src, {&desc});
 
@@ -52,6 +87,8 @@ sh_compact_stage::sh_compact_stage(
 
         desc.set_image(dev.id, "input_sh", {{{}, inflated_source.get_image_view(dev.id), vk::ImageLayout::eGeneral}});
         desc.set_image(dev.id, "output_sh", {{{}, compacted_output.get_image_view(dev.id), vk::ImageLayout::eGeneral}});
+        if(track_changes)
+            desc.set_buffer(dev.id, "probe_luminance", {{*probe_luminance, 0, VK_WHOLE_SIZE}});
         comp.push_descriptors(cb, desc, 0);
 
         push_constant_buffer control;
@@ -60,6 +97,7 @@ sh_compact_stage::sh_compact_stage(
         int samples = src_dim.z / dst_dim.z;
         control.samples = samples;
         control.samples_per_work_item = (samples+255)/256;
+        control.grid_height = probe_resolution.y;
 
         comp.push_constants(cb, control);
 
@@ -75,9 +113,55 @@ sh_compact_stage::sh_compact_stage(
             {}, {}, {}, img_barrier
         );
 
+        if(track_changes)
+        {
+            vk::MemoryBarrier barrier(
+                vk::AccessFlagBits::eShaderWrite,
+                vk::AccessFlagBits::eTransferRead
+            );
+            cb.pipelineBarrier(
+                vk::PipelineStageFlagBits::eComputeShader,
+                vk::PipelineStageFlagBits::eTransfer,
+                {}, barrier, {}, {}
+            );
+            cb.copyBuffer(
+                *probe_luminance, *probe_changes[i],
+                vk::BufferCopy(0, 0, changes_size)
+            );
+            barrier = vk::MemoryBarrier(
+                vk::AccessFlagBits::eTransferWrite,
+                vk::AccessFlagBits::eHostRead
+            );
+            cb.pipelineBarrier(
+                vk::PipelineStageFlagBits::eTransfer,
+                vk::PipelineStageFlagBits::eHost,
+                {}, barrier, {}, {}
+            );
+        }
+
         compact_timer.end(cb, dev.id, i);
         end_compute(cb, i);
     }
 }
 
+sh_compact_stage::~sh_compact_stage()
+{
+    for(size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+    {
+        if(probe_changes_mem[i])
+            vmaUnmapMemory(dev->allocator, probe_changes[i].get_allocation());
+    }
+}
+
+const pvec2* sh_compact_stage::get_probe_changes(uint32_t frame_index)
+{
+    if(!probe_changes_mem[frame_index])
+        return nullptr;
+    vmaInvalidateAllocation(
+        dev->allocator, probe_changes[frame_index].get_allocation(),
+        0, VK_WHOLE_SIZE
+    );
+    return static_cast<const pvec2*>(probe_changes_mem[frame_index]);
+}
+
 }
@@ -13,16 +13,30 @@ namespace tr
 class sh_compact_stage: public single_device_stage
 {
 public:
+    // If 'probe_resolution' is given, the luminance of each probe and its
+    // change since the previous compaction are downloaded on every frame.
     sh_compact_stage(
         device& dev, 
         texture& inflated_source,
-        texture& compacted_output
+        texture& compacted_output,
+        uvec3 probe_resolution = uvec3(0)
     );
+    ~sh_compact_stage();
+
+    // Returns the (luminance, change) pairs of each probe from the last
+    // compaction that used 'frame_index', or nullptr if changes aren't
+    // tracked. The data is valid only until this frame index is rendered
+    // again.
+    const pvec2* get_probe_changes(uint32_t frame_index);
 
 private:
     push_descriptor_set desc;
     compute_pipeline comp;
     timer compact_timer;
+
+    vkm<vk::Buffer> probe_luminance;
+    vkm<vk::Buffer> probe_changes[MAX_FRAMES_IN_FLIGHT];
+    void* probe_changes_mem[MAX_FRAMES_IN_FLIGHT] = {};
 };
 
 }
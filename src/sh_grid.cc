@@ -115,7 +115,17 @@ int sh_grid::get_coef_count(int order)
 
 float sh_grid::point_distance(transformable& self, vec3 p) const
 {
-    vec3 local_p = transpose(self.get_global_inverse_transpose_transform()) * vec4(p, 1);
+    return point_distance(
+        transpose(self.get_global_inverse_transpose_transform()), radius, p
+    );
+}
+
+float sh_grid::point_distance(
+    const mat4& local_from_world,
+    float radius,
+    vec3 p
+){
+    vec3 local_p = local_from_world * vec4(p, 1);
 
     if(all(lessThanEqual(abs(local_p), vec3(1.0f))))
         return 0.0f;
@@ -46,6 +46,13 @@ public:
     // Negative: out of influence. Zero: fully in influence. Positive: outside,
     // but within radius.
     float point_distance(transformable& self, vec3 p) const;
+    // Same as above, with local_from_world being the transpose of the global
+    // inverse transpose transform of 'self'.
+    static float point_distance(
+        const mat4& local_from_world,
+        float radius,
+        vec3 p
+    );
     float calc_density(transformable& self) const;
     float calc_volume(transformable& self) const;
 
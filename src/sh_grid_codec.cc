@@ -0,0 +1,363 @@
+#include "sh_grid_codec.hh"
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+using namespace tr;
+
+uvec3 get_brick_count(uvec3 resolution)
+{
+    return (resolution + SH_GRID_BRICK_SIZE - 1u) / SH_GRID_BRICK_SIZE;
+}
+
+uint32_t get_total_brick_count(uvec3 resolution)
+{
+    uvec3 bricks = get_brick_count(resolution);
+    return bricks.x * bricks.y * bricks.z;
+}
+
+void get_brick_range(uvec3 resolution, uint32_t brick, uvec3& start, uvec3& end)
+{
+    uvec3 bricks = get_brick_count(resolution);
+    start = uvec3(
+        brick % bricks.x,
+        brick / bricks.x % bricks.y,
+        brick / (bricks.x * bricks.y)
+    ) * SH_GRID_BRICK_SIZE;
+    end = min(start + SH_GRID_BRICK_SIZE, resolution);
+}
+
+size_t get_brick_texel_count(uvec3 resolution, uint32_t brick)
+{
+    uvec3 start, end;
+    get_brick_range(resolution, brick, start, end);
+    uvec3 size = end - start;
+    return size_t(size.x) * size.y * size.z;
+}
+
+// Calls f with the index of the first value of each texel of one coefficient
+// in the brick. Coefficients are stacked along Y in the grid texture.
+template<typename F>
+void foreach_brick_texel(
+    uvec3 resolution, int coef_count, uint32_t brick, int coef, F&& f
+){
+    uvec3 start, end;
+    get_brick_range(resolution, brick, start, end);
+    size_t layer_height = size_t(resolution.y) * coef_count;
+    for(uint32_t z = start.z; z < end.z; ++z)
+    for(uint32_t y = start.y; y < end.y; ++y)
+    {
+        size_t row = (z * layer_height + coef * resolution.y + y) * resolution.x;
+        for(uint32_t x = start.x; x < end.x; ++x)
+            f((row + x) * 4);
+    }
+}
+
+size_t get_encoded_coef_bytes(sh_grid_codec codec, size_t texel_count)
+{
+    switch(codec)
+    {
+    case sh_grid_codec::FP16:
+        return texel_count * 4 * sizeof(uint16_t);
+    case sh_grid_codec::SHARED_EXP8:
+        return 4 + texel_count * 4;
+    }
+    return 0;
+}
+
+// Values that have no exponent are stored as zero.
+float get_finite(uint16_t value)
+{
+    float f = half_to_float(value);
+    return std::isfinite(f) ? f : 0.0f;
+}
+
+int8_t get_shared_exponent(float max_abs)
+{
+    if(max_abs == 0.0f) return INT8_MIN;
+    int exponent = 0;
+    std::frexp(max_abs, &exponent);
+    return clamp(exponent, -127, 127);
+}
+
+float get_mantissa_scale(int8_t exponent)
+{
+    return exponent == INT8_MIN ? 0.0f : std::ldexp(1.0f, exponent - 7);
+}
+
+}
+
+namespace tr
+{
+
+const char* get_sh_grid_codec_name(sh_grid_codec codec)
+{
+    switch(codec)
+    {
+    case sh_grid_codec::FP16: return "fp16";
+    case sh_grid_codec::SHARED_EXP8: return "shared-exp8";
+    }
+    return "unknown";
+}
+
+bool is_known_sh_grid_codec(uint32_t codec)
+{
+    return codec <= (uint32_t)sh_grid_codec::SHARED_EXP8;
+}
+
+sh_grid_encoder::sh_grid_encoder(sh_grid_codec codec, float threshold)
+: codec(codec), threshold(threshold)
+{
+}
+
+sh_grid_codec sh_grid_encoder::get_codec() const
+{
+    return codec;
+}
+
+sh_grid_header sh_grid_encoder::encode(
+    const uint16_t* texels,
+    uvec3 resolution,
+    int coef_count,
+    std::vector<uint8_t>& out,
+    bool force_keyframe
+){
+    sh_grid_header header;
+    header.codec = codec;
+    header.frame_index = frame_index++;
+    header.brick_count = 0;
+    header.keyframe = force_keyframe;
+    header.raw = false;
+
+    if(this->resolution != resolution || this->coef_count != coef_count)
+    {
+        this->resolution = resolution;
+        this->coef_count = coef_count;
+        reference.assign(
+            size_t(resolution.x) * resolution.y * resolution.z * coef_count * 4,
+            0
+        );
+        header.keyframe = true;
+    }
+
+    out.clear();
+    uint32_t total_bricks = get_total_brick_count(resolution);
+    if(header.keyframe && codec == sh_grid_codec::FP16)
+    {
+        memcpy(reference.data(), texels, reference.size() * sizeof(uint16_t));
+        header.brick_count = total_bricks;
+        header.raw = true;
+        return header;
+    }
+
+    for(uint32_t brick = 0; brick < total_bricks; ++brick)
+    {
+        if(!header.keyframe && !brick_changed(texels, brick))
+            continue;
+
+        size_t texel_count = get_brick_texel_count(resolution, brick);
+        size_t offset = out.size();
+        out.resize(
+            offset + sizeof(brick) +
+            get_encoded_coef_bytes(codec, texel_count) * coef_count
+        );
+        uint8_t* dst = out.data() + offset;
+        memcpy(dst, &brick, sizeof(brick));
+        dst += sizeof(brick);
+
+        for(int coef = 0; coef < coef_count; ++coef)
+        {
+            switch(codec)
+            {
+            case sh_grid_codec::FP16:
+                foreach_brick_texel(resolution, coef_count, brick, coef,
+                    [&](size_t i){
+                        memcpy(dst, texels + i, 4 * sizeof(uint16_t));
+                        memcpy(reference.data() + i, texels + i, 4 * sizeof(uint16_t));
+                        dst += 4 * sizeof(uint16_t);
+                    }
+                );
+                break;
+            case sh_grid_codec::SHARED_EXP8:
+                {
+                    vec4 max_abs = vec4(0);
+                    foreach_brick_texel(resolution, coef_count, brick, coef,
+                        [&](size_t i){
+                            for(int c = 0; c < 4; ++c)
+                                max_abs[c] = max(max_abs[c], std::fabs(get_finite(texels[i+c])));
+                        }
+                    );
+                    vec4 scale;
+                    for(int c = 0; c < 4; ++c)
+                    {
+                        int8_t exponent = get_shared_exponent(max_abs[c]);
+                        scale[c] = get_mantissa_scale(exponent);
+                        memcpy(dst++, &exponent, 1);
+                    }
+                    foreach_brick_texel(resolution, coef_count, brick, coef,
+                        [&](size_t i){
+                            for(int c = 0; c < 4; ++c)
+                            {
+                                int8_t q = 0;
+                                if(scale[c] != 0.0f)
+                                    q = clamp(std::round(get_finite(texels[i+c]) / scale[c]), -127.0f, 127.0f);
+                                memcpy(dst++, &q, 1);
+                                reference[i+c] = texels[i+c];
+                            }
+                        }
+                    );
+                }
+                break;
+            }
+        }
+        header.brick_count++;
+    }
+    return header;
+}
+
+bool sh_grid_encoder::brick_changed(const uint16_t* texels, uint32_t brick) const
+{
+    bool changed = false;
+    for(int coef = 0; !changed && coef < coef_count; ++coef)
+    {
+        foreach_brick_texel(resolution, coef_count, brick, coef,
+            [&](size_t i){
+                for(int c = 0; !changed && c < 4; ++c)
+                {
+                    uint16_t a = texels[i+c];
+                    uint16_t b = reference[i+c];
+                    changed = a != b && (
+                        threshold == 0.0f ||
+                        std::fabs(get_finite(a) - get_finite(b)) > threshold
+                    );
+                }
+            }
+        );
+    }
+    return changed;
+}
+
+bool sh_grid_decoder::decode(
+    const sh_grid_header& header,
+    uvec3 resolution,
+    int coef_count,
+    const uint8_t* data,
+    size_t data_size
+){
+    if(this->resolution != resolution || this->coef_count != coef_count)
+    {
+        this->resolution = resolution;
+        this->coef_count = coef_count;
+        texels.assign(
+            size_t(resolution.x) * resolution.y * resolution.z * coef_count * 4,
+            0
+        );
+        has_keyframe = false;
+    }
+
+    uint32_t total_bricks = get_total_brick_count(resolution);
+    if(
+        !is_known_sh_grid_codec((uint32_t)header.codec) ||
+        (header.keyframe && header.brick_count != total_bricks) ||
+        (!header.keyframe && !has_keyframe)
+    ) return false;
+
+    if(header.raw)
+    {
+        if(
+            header.codec != sh_grid_codec::FP16 || !header.keyframe ||
+            data_size != texels.size() * sizeof(uint16_t)
+        ) return false;
+        memcpy(texels.data(), data, data_size);
+        has_keyframe = true;
+        return true;
+    }
+
+    // A corrupt message may have been partially applied already.
+    has_keyframe = false;
+
+    const uint8_t* src = data;
+    const uint8_t* src_end = data + data_size;
+    for(uint32_t i = 0; i < header.brick_count; ++i)
+    {
+        uint32_t brick = 0;
+        if(size_t(src_end - src) < sizeof(brick)) return false;
+        memcpy(&brick, src, sizeof(brick));
+        src += sizeof(brick);
+        if(brick >= total_bricks) return false;
+
+        size_t texel_count = get_brick_texel_count(resolution, brick);
+        size_t brick_bytes =
+            get_encoded_coef_bytes(header.codec, texel_count) * coef_count;
+        if(size_t(src_end - src) < brick_bytes) return false;
+
+        for(int coef = 0; coef < coef_count; ++coef)
+        {
+            switch(header.codec)
+            {
+            case sh_grid_codec::FP16:
+                foreach_brick_texel(resolution, coef_count, brick, coef,
+                    [&](size_t i){
+                        memcpy(texels.data() + i, src, 4 * sizeof(uint16_t));
+                        src += 4 * sizeof(uint16_t);
+                    }
+                );
+                break;
+            case sh_grid_codec::SHARED_EXP8:
+                {
+                    vec4 scale;
+                    for(int c = 0; c < 4; ++c)
+                    {
+                        int8_t exponent;
+                        memcpy(&exponent, src++, 1);
+                        scale[c] = get_mantissa_scale(exponent);
+                    }
+                    foreach_brick_texel(resolution, coef_count, brick, coef,
+                        [&](size_t i){
+                            for(int c = 0; c < 4; ++c)
+                            {
+                                int8_t q;
+                                memcpy(&q, src++, 1);
+                                texels[i+c] = float_to_half(q * scale[c]);
+                            }
+                        }
+                    );
+                }
+                break;
+            }
+        }
+    }
+    if(src != src_end) return false;
+
+    has_keyframe = true;
+    return true;
+}
+
+const std::vector<uint16_t>& sh_grid_decoder::get_texels() const
+{
+    return texels;
+}
+
+void sh_grid_decoder::reset()
+{
+    has_keyframe = false;
+}
+
+std::string sh_grid_stream_stats::report(
+    const char* label,
+    sh_grid_codec codec,
+    unsigned clients,
+    std::chrono::steady_clock::duration interval
+){
+    std::string summary = stream_stats::report(interval);
+    if(summary.empty()) return summary;
+
+    std::string res = std::string(label) + " " +
+        get_sh_grid_codec_name(codec) + ": " + summary + " per client";
+    if(clients != 0)
+        res += ", " + std::to_string(clients) + " clients";
+    return res;
+}
+
+}
@@ -0,0 +1,131 @@
+#ifndef TAURAY_SH_GRID_CODEC_HH
+#define TAURAY_SH_GRID_CODEC_HH
+#include "math.hh"
+#include "stream_stats.hh"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace tr
+{
+
+// Codecs used for streaming SH grids from dshgi_server to dshgi_client. The
+// values are sent over the network, so don't reorder them.
+//
+// Grids are split into bricks of SH_GRID_BRICK_SIZE^3 probes, with all of
+// their coefficients. Only bricks that changed since they were last sent are
+// included, so the decoder applies each message on top of the previous ones.
+enum class sh_grid_codec: uint32_t
+{
+    // Bricks are sent as the RGBA16F texels of the grid texture.
+    FP16 = 0,
+    // Each coefficient and channel of a brick shares an exponent, and the
+    // values are stored as 8-bit signed mantissas. About half the size of
+    // FP16, with errors of up to 1/128 of the largest value sharing the
+    // exponent.
+    SHARED_EXP8 = 1
+};
+
+const char* get_sh_grid_codec_name(sh_grid_codec codec);
+bool is_known_sh_grid_codec(uint32_t codec);
+
+constexpr uint32_t SH_GRID_BRICK_SIZE = 4;
+// Flag bits in the SH grid messages sent by dshgi_server.
+constexpr uint32_t SH_GRID_STREAM_KEYFRAME_BIT = 1<<0;
+constexpr uint32_t SH_GRID_STREAM_RAW_BIT = 1<<1;
+
+struct sh_grid_header
+{
+    sh_grid_codec codec;
+    uint32_t frame_index;
+    uint32_t brick_count;
+    // Keyframes contain every brick of the grid. Other messages only contain
+    // the bricks that changed, so they can only be applied on top of a
+    // keyframe.
+    bool keyframe;
+    // The message is the whole grid texture as it is, instead of bricks.
+    // FP16 keyframes are sent this way, so that the texture data can be
+    // passed on without copying it.
+    bool raw;
+};
+
+class sh_grid_encoder
+{
+public:
+    // Bricks are only sent once some value in them differs by more than
+    // 'threshold' from what was last sent. 0 sends every change.
+    sh_grid_encoder(sh_grid_codec codec, float threshold = 0.0f);
+
+    sh_grid_codec get_codec() const;
+
+    // Encodes the RGBA16F texels of an sh_grid texture, as laid out by
+    // sh_grid::create_texture(), into 'out'. A keyframe is made regardless of
+    // force_keyframe when the layout of the grid changes. 'out' is left empty
+    // for raw messages; 'texels' should be sent in its place.
+    sh_grid_header encode(
+        const uint16_t* texels,
+        uvec3 resolution,
+        int coef_count,
+        std::vector<uint8_t>& out,
+        bool force_keyframe = false
+    );
+
+private:
+    bool brick_changed(const uint16_t* texels, uint32_t brick) const;
+
+    sh_grid_codec codec;
+    float threshold;
+    uint32_t frame_index = 0;
+    uvec3 resolution = uvec3(0);
+    int coef_count = 0;
+    // The input texels as they were when their brick was last sent. The
+    // quantization error is not included, so that unchanged bricks are never
+    // resent.
+    std::vector<uint16_t> reference;
+};
+
+class sh_grid_decoder
+{
+public:
+    // Applies a message to the internal texels. Returns false if the data is
+    // corrupt or no keyframe has been received for the current layout; the
+    // texels are incomplete until a keyframe arrives.
+    bool decode(
+        const sh_grid_header& header,
+        uvec3 resolution,
+        int coef_count,
+        const uint8_t* data,
+        size_t data_size
+    );
+
+    // Valid after a successful decode(). Same layout as the encoder input.
+    const std::vector<uint16_t>& get_texels() const;
+
+    // Makes decode() wait for a keyframe again, for when messages that
+    // may have had deltas for this grid were lost.
+    void reset();
+
+private:
+    bool has_keyframe = false;
+    uvec3 resolution = uvec3(0);
+    int coef_count = 0;
+    std::vector<uint16_t> texels;
+};
+
+// stream_stats with the codec name and client count in the summary.
+class sh_grid_stream_stats: public stream_stats
+{
+public:
+    // 'clients' is the number of clients that each get a copy of the stream.
+    std::string report(
+        const char* label,
+        sh_grid_codec codec,
+        unsigned clients,
+        std::chrono::steady_clock::duration interval
+    );
+};
+
+}
+
+#endif
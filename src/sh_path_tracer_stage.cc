@@ -55,8 +55,8 @@ sh_path_tracer_stage::sh_path_tracer_stage(
 {
     sample_count_multiplier = opt.samples_per_probe;
 
-    shader_source pl_rint("shader/rt_common_point_light.rint");
-    shader_source shadow_chit("shader/rt_common_shadow.rchit");
+    auto pl_rint = shader_source::compile_async("shader/rt_common_point_light.rint");
+    auto shadow_chit = shader_source::compile_async("shader/rt_common_shadow.rchit");
     std::map<std::string, std::string> defines;
     defines["MAX_BOUNCES"] = std::to_string(opt.max_ray_depth);
 
@@ -75,46 +75,74 @@ sh_path_tracer_stage::sh_path_tracer_stage(
         sh_grid::get_coef_count(opt.sh_order)
     );
 
+    if(opt.ray_budget != 0)
+    {
+        defines["USE_PROBE_SCHEDULE"];
+        uvec3 res = ss.get_scene()->get<sh_grid>(opt.sh_grid_id)->get_resolution();
+        probe_mix_ratios.resize(res.x * res.y * res.z, 0.0f);
+        probe_schedule = gpu_buffer(
+            dev, probe_mix_ratios.size() * sizeof(float),
+            vk::BufferUsageFlagBits::eStorageBuffer
+        );
+    }
+
     get_common_defines(defines);
 
+    // Start all compilations before waiting for any of them.
+    auto rgen = shader_source::compile_async("shader/sh_path_tracer.rgen", defines);
+    auto chit = shader_source::compile_async("shader/rt_common.rchit");
+    auto ahit = shader_source::compile_async("shader/rt_common.rahit");
+    auto shadow_ahit = shader_source::compile_async("shader/rt_common_shadow.rahit");
+    auto pl_chit = shader_source::compile_async("shader/rt_common_point_light.rchit");
+    auto miss = shader_source::compile_async("shader/rt_common.rmiss");
+    auto shadow_miss = shader_source::compile_async("shader/rt_common_shadow.rmiss", defines);
+
     rt_shader_sources src = {
-        {"shader/sh_path_tracer.rgen", defines},
+        rgen.get(),
         {
             {
                 vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup,
-                {"shader/rt_common.rchit"},
-                {"shader/rt_common.rahit"}
+                chit.get(),
+                ahit.get()
             },
             {
                 vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup,
-                shadow_chit,
-                {"shader/rt_common_shadow.rahit"}
+                shadow_chit.get(),
+                shadow_ahit.get()
             },
             {
                 vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
-                {"shader/rt_common_point_light.rchit"},
+                pl_chit.get(),
                 {},
-                pl_rint
+                pl_rint.get()
             },
             {
                 vk::RayTracingShaderGroupTypeKHR::eProceduralHitGroup,
-                shadow_chit,
+                shadow_chit.get(),
                 {},
-                pl_rint
+                pl_rint.get()
             }
         },
         {
-            {"shader/rt_common.rmiss"},
-            {"shader/rt_common_shadow.rmiss", defines}
+            miss.get(),
+            shadow_miss.get()
         }
     };
     desc.add(src, 0);
     gfx.init(src, {&desc, &ss.get_descriptors()});
 }
 
+void sh_path_tracer_stage::set_probe_schedule(const std::vector<float>& mix_ratios)
+{
+    probe_mix_ratios = mix_ratios;
+}
+
 void sh_path_tracer_stage::update(uint32_t frame_index)
 {
     rt_stage::update(frame_index);
+    if(probe_schedule)
+        probe_schedule.update(frame_index, probe_mix_ratios.data());
+
     sh_grid* grid = ss->get_scene()->get<sh_grid>(opt.sh_grid_id);
     transformable* grid_transform = ss->get_scene()->get<transformable>(opt.sh_grid_id);
     mat4 transform = grid_transform->get_global_transform();
@@ -141,6 +169,8 @@ void sh_path_tracer_stage::record_command_buffer(
     bool /*first_in_command_buffer*/
 ){
     grid_data.upload(dev->id, frame_index, cb);
+    if(probe_schedule)
+        probe_schedule.upload(dev->id, frame_index, cb);
 
     sh_grid* grid = ss->get_scene()->get<sh_grid>(opt.sh_grid_id);
     uvec3 dim = grid->get_resolution();
@@ -162,6 +192,8 @@ void sh_path_tracer_stage::record_command_buffer(
     gfx.bind(cb);
     desc.set_image("inout_data", *output_grid);
     desc.set_buffer("grid", grid_data);
+    if(probe_schedule)
+        desc.set_buffer("probe_schedule", probe_schedule);
     get_descriptors(desc);
     gfx.push_descriptors(cb, desc, 0);
     gfx.set_descriptors(cb, ss->get_descriptors(), 0, 1);
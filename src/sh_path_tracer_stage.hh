@@ -23,6 +23,12 @@ public:
         float temporal_ratio = 0.02f;
         float indirect_clamping = 100.0f;
         float regularization_gamma = 1.0f; // 0 disables path regularization
+        // Rays traced per frame over all grids, the rest of the probes wait
+        // for later frames. 0 traces every probe on every frame.
+        uint64_t ray_budget = 0;
+        // Relative luminance change per update below which a probe stops
+        // being traced, when ray_budget is in use.
+        float convergence_threshold = 0.005f;
 
         light_sampling_weights sampling_weights;
 
@@ -38,6 +44,10 @@ public:
         const options& opt
     );
 
+    // Sets the temporal blend ratio of each probe for the next frame when
+    // ray_budget is in use. Probes with a ratio of 0 are not traced.
+    void set_probe_schedule(const std::vector<float>& mix_ratios);
+
 protected:
     void update(uint32_t frame_index) override;
     void record_command_buffer(
@@ -59,6 +69,8 @@ private:
     texture* output_grid;
     vk::ImageLayout output_layout;
     gpu_buffer grid_data;
+    gpu_buffer probe_schedule;
+    std::vector<float> probe_mix_ratios;
     uint64_t history_length;
 };
 
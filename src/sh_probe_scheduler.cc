@@ -0,0 +1,398 @@
+#include "sh_probe_scheduler.hh"
+#include "sh_grid.hh"
+#include "model.hh"
+#include "light.hh"
+#include "camera.hh"
+#include "environment_map.hh"
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+using namespace tr;
+
+// Probes that something moved near are traced this many times sooner.
+constexpr float DIRTY_PRIORITY_MULTIPLIER = 16.0f;
+// Weight of the latest update in the moving average of luminance changes.
+constexpr float CHANGE_AVERAGE_RATIO = 0.25f;
+
+const aabb INFINITE_BOUNDS = {vec3(-INFINITY), vec3(INFINITY)};
+
+bool is_infinite(const aabb& bounds)
+{
+    return any(isinf(bounds.min)) || any(isinf(bounds.max)) ||
+        any(isnan(bounds.min)) || any(isnan(bounds.max));
+}
+
+aabb transform_bounds(const mat4& transform, const aabb& bounds)
+{
+    aabb res = {vec3(INFINITY), vec3(-INFINITY)};
+    for(int i = 0; i < 8; ++i)
+    {
+        vec3 corner = vec3(
+            i&1 ? bounds.max.x : bounds.min.x,
+            i&2 ? bounds.max.y : bounds.min.y,
+            i&4 ? bounds.max.z : bounds.min.z
+        );
+        vec3 p = vec3(transform * vec4(corner, 1.0f));
+        res.min = min(res.min, p);
+        res.max = max(res.max, p);
+    }
+    return res;
+}
+
+aabb merge_bounds(const aabb& a, const aabb& b)
+{
+    return {min(a.min, b.min), max(a.max, b.max)};
+}
+
+}
+
+namespace tr
+{
+
+sh_probe_scheduler::sh_probe_scheduler(const options& opt)
+: opt(opt)
+{
+}
+
+void sh_probe_scheduler::reset(
+    scene& s,
+    const std::vector<entity>& grid_ids,
+    const std::vector<uint32_t>& rays_per_probe
+){
+    cur_scene = &s;
+    grids.clear();
+    objects.clear();
+    mesh_bounds.clear();
+    for(size_t i = 0; i < grid_ids.size(); ++i)
+    {
+        sh_grid* grid = s.get<sh_grid>(grid_ids[i]);
+        grid_state& gs = grids.emplace_back();
+        gs.id = grid_ids[i];
+        gs.resolution = grid->get_resolution();
+        gs.rays_per_probe = max(rays_per_probe[i], 1u);
+        gs.probes.resize(size_t(gs.resolution.x) * gs.resolution.y * gs.resolution.z);
+    }
+}
+
+void sh_probe_scheduler::add_feedback(
+    size_t grid,
+    uint32_t frame_index,
+    const pvec2* changes
+){
+    grid_state& gs = grids[grid];
+    for(uint32_t i: gs.traced[frame_index])
+    {
+        probe_state& ps = gs.probes[i];
+        float luminance = changes[i].x;
+        float change = changes[i].y;
+        if(!std::isfinite(luminance) || !std::isfinite(change))
+            continue;
+
+        float relative_change = fabs(change) / max(fabs(luminance), 1e-3f);
+        ps.change = ps.update_count <= 1 ?
+            relative_change :
+            mix(ps.change, relative_change, CHANGE_AVERAGE_RATIO);
+        ps.converged =
+            !ps.dirty &&
+            ps.update_count * opt.temporal_ratio >= 1.0f &&
+            ps.change < opt.convergence_threshold;
+    }
+    gs.traced[frame_index].clear();
+}
+
+void sh_probe_scheduler::schedule(
+    uint32_t frame_index,
+    std::vector<std::vector<float>>& mix_ratios
+){
+    frame_counter++;
+    for(grid_state& gs: grids)
+    {
+        transformable* t = cur_scene->get<transformable>(gs.id);
+        gs.transform = t->get_global_transform();
+        vec3 cell = vec3(
+            length(vec3(gs.transform[0])),
+            length(vec3(gs.transform[1])),
+            length(vec3(gs.transform[2]))
+        ) * 2.0f / vec3(gs.resolution);
+        gs.cell_size = max((cell.x + cell.y + cell.z) / 3.0f, 1e-6f);
+    }
+
+    find_moved_objects();
+
+    std::vector<vec3> camera_positions;
+    cur_scene->foreach([&](transformable& t, camera&, camera_metadata* md){
+        if(!md || md->enabled)
+            camera_positions.push_back(t.get_global_position());
+    });
+
+    struct candidate
+    {
+        float priority;
+        uint32_t grid;
+        uint32_t probe;
+    };
+    std::vector<candidate> candidates;
+    converged_probes = 0;
+    for(uint32_t g = 0; g < grids.size(); ++g)
+    {
+        grid_state& gs = grids[g];
+        for(uint32_t z = 0, i = 0; z < gs.resolution.z; ++z)
+        for(uint32_t y = 0; y < gs.resolution.y; ++y)
+        for(uint32_t x = 0; x < gs.resolution.x; ++x, ++i)
+        {
+            probe_state& ps = gs.probes[i];
+            if(ps.converged)
+            {
+                converged_probes++;
+                continue;
+            }
+
+            float priority = INFINITY;
+            if(ps.update_count != 0)
+            {
+                float distance_weight = 1.0f;
+                if(camera_positions.size() != 0)
+                {
+                    vec3 local = ((vec3(x, y, z) + 0.5f) / vec3(gs.resolution)) * 2.0f - 1.0f;
+                    vec3 pos = vec3(gs.transform * vec4(local, 1.0f));
+                    float dist = INFINITY;
+                    for(vec3 cam: camera_positions)
+                        dist = min(dist, distance(cam, pos));
+                    distance_weight = 1.0f / (1.0f + dist / gs.cell_size);
+                }
+                float age = frame_counter - ps.last_update;
+                priority = age * distance_weight *
+                    (1.0f + ps.change / max(opt.convergence_threshold, 1e-6f)) *
+                    (ps.dirty ? DIRTY_PRIORITY_MULTIPLIER : 1.0f);
+            }
+            candidates.push_back({priority, g, i});
+        }
+    }
+
+    // Only the highest priorities can fit in the budget, so only they need
+    // to be sorted.
+    uint32_t min_rays = UINT32_MAX;
+    for(const grid_state& gs: grids)
+        min_rays = min(min_rays, gs.rays_per_probe);
+    size_t max_count = min(
+        candidates.size(),
+        size_t(opt.ray_budget / max(min_rays, 1u)) + 1
+    );
+    auto higher_priority = [](const candidate& a, const candidate& b){
+        return a.priority > b.priority;
+    };
+    std::partial_sort(
+        candidates.begin(), candidates.begin() + max_count, candidates.end(),
+        higher_priority
+    );
+
+    mix_ratios.resize(grids.size());
+    for(size_t g = 0; g < grids.size(); ++g)
+        mix_ratios[g].assign(grids[g].probes.size(), 0.0f);
+
+    uint64_t rays = 0;
+    scheduled_probes = 0;
+    for(size_t i = 0; i < max_count; ++i)
+    {
+        const candidate& c = candidates[i];
+        grid_state& gs = grids[c.grid];
+        // Always trace at least one probe, even if it doesn't fit.
+        if(scheduled_probes != 0 && rays + gs.rays_per_probe > opt.ray_budget)
+            continue;
+        rays += gs.rays_per_probe;
+        scheduled_probes++;
+
+        probe_state& ps = gs.probes[c.probe];
+        uint32_t age = ps.update_count == 0 ? 1 : frame_counter - ps.last_update;
+        ps.update_count++;
+        ps.last_update = frame_counter;
+        ps.dirty = false;
+
+        // Gives the new samples the same weight that 'age' consecutive
+        // frames of blending would have given them.
+        mix_ratios[c.grid][c.probe] = max(
+            1.0f / ps.update_count,
+            1.0f - std::pow(1.0f - opt.temporal_ratio, float(age))
+        );
+        gs.traced[frame_index].push_back(c.probe);
+    }
+}
+
+size_t sh_probe_scheduler::get_scheduled_probe_count() const
+{
+    return scheduled_probes;
+}
+
+size_t sh_probe_scheduler::get_converged_probe_count() const
+{
+    return converged_probes;
+}
+
+void sh_probe_scheduler::find_moved_objects()
+{
+    for(auto& pair: objects)
+        pair.second.seen = false;
+    for(auto& pair: mesh_bounds)
+        pair.second.seen = false;
+
+    cur_scene->foreach([&](entity id, transformable& t, model& mod){
+        mat4 transform = t.get_global_transform();
+        aabb local = {vec3(INFINITY), vec3(-INFINITY)};
+        for(const model::vertex_group& vg: mod)
+        {
+            const mesh* m = vg.m->get_animation_source() ?
+                vg.m->get_animation_source() : vg.m;
+            local = merge_bounds(local, get_mesh_bounds(m));
+        }
+        aabb bounds = local;
+        if(!any(greaterThan(local.min, local.max)))
+            bounds = transform_bounds(transform, local);
+        // Skinned models move with their joints without the model's own
+        // transform changing.
+        for(const model::joint_data& joint: mod.get_joints())
+        {
+            vec3 pos = joint.node->get_global_position();
+            bounds = merge_bounds(bounds, {pos, pos});
+        }
+        track(id, transform, vec4(0), bounds);
+    });
+
+    auto track_point_light = [&](entity id, transformable& t, point_light& pl){
+        vec3 pos = t.get_global_position();
+        float radius = pl.get_cutoff_radius();
+        track(
+            id, t.get_global_transform(), vec4(pl.get_color(), pl.get_radius()),
+            std::isfinite(radius) ?
+                aabb{pos - radius, pos + radius} : INFINITE_BOUNDS
+        );
+    };
+    cur_scene->foreach(track_point_light);
+    cur_scene->foreach([&](entity id, transformable& t, spotlight& sl){
+        track_point_light(id, t, sl);
+    });
+    cur_scene->foreach([&](entity id, transformable& t, directional_light& dl){
+        track(
+            id, t.get_global_transform(), vec4(dl.get_color(), dl.get_angle()),
+            INFINITE_BOUNDS
+        );
+    });
+
+    // The environment and ambient light reach every probe.
+    environment_map* envmap = get_environment_map(*cur_scene);
+    mat4 env_transform = envmap ? envmap->get_global_transform() : mat4(1);
+    track(
+        INVALID_ENTITY, env_transform,
+        vec4(get_ambient_light(*cur_scene), envmap ? 1.0f : 0.0f),
+        INFINITE_BOUNDS
+    );
+
+    // Removed objects.
+    for(auto it = objects.begin(); it != objects.end();)
+    {
+        if(!it->second.seen)
+        {
+            mark_dirty(it->second.bounds);
+            it = objects.erase(it);
+        }
+        else ++it;
+    }
+
+    for(auto it = mesh_bounds.begin(); it != mesh_bounds.end();)
+    {
+        if(!it->second.seen) it = mesh_bounds.erase(it);
+        else ++it;
+    }
+}
+
+void sh_probe_scheduler::track(
+    entity id,
+    const mat4& transform,
+    vec4 params,
+    const aabb& bounds
+){
+    auto it = objects.find(id);
+    if(it == objects.end())
+    {
+        objects[id] = {transform, params, bounds, true};
+        mark_dirty(bounds);
+        return;
+    }
+
+    tracked_object& obj = it->second;
+    obj.seen = true;
+    if(
+        obj.transform == transform && obj.params == params &&
+        obj.bounds.min == bounds.min && obj.bounds.max == bounds.max
+    ) return;
+
+    mark_dirty(merge_bounds(obj.bounds, bounds));
+    obj.transform = transform;
+    obj.params = params;
+    obj.bounds = bounds;
+}
+
+void sh_probe_scheduler::mark_dirty(const aabb& bounds)
+{
+    // Empty, e.g. a model without meshes.
+    if(any(greaterThan(bounds.min, bounds.max)))
+        return;
+    if(is_infinite(bounds))
+    {
+        mark_all_dirty();
+        return;
+    }
+
+    for(grid_state& gs: grids)
+    {
+        // Probes affect the space up to their neighbors, so one probe of
+        // margin is added.
+        aabb local = transform_bounds(inverse(gs.transform), bounds);
+        vec3 res = vec3(gs.resolution);
+        ivec3 start = ivec3(floor((local.min + 1.0f) * 0.5f * res - 0.5f)) - 1;
+        ivec3 end = ivec3(ceil((local.max + 1.0f) * 0.5f * res - 0.5f)) + 1;
+        start = max(start, ivec3(0));
+        end = min(end, ivec3(gs.resolution) - 1);
+        for(int z = start.z; z <= end.z; ++z)
+        for(int y = start.y; y <= end.y; ++y)
+        for(int x = start.x; x <= end.x; ++x)
+        {
+            probe_state& ps = gs.probes[
+                (size_t(z) * gs.resolution.y + y) * gs.resolution.x + x
+            ];
+            ps.dirty = true;
+            ps.converged = false;
+        }
+    }
+}
+
+void sh_probe_scheduler::mark_all_dirty()
+{
+    for(grid_state& gs: grids)
+    for(probe_state& ps: gs.probes)
+    {
+        ps.dirty = true;
+        ps.converged = false;
+    }
+}
+
+const aabb& sh_probe_scheduler::get_mesh_bounds(const mesh* m)
+{
+    auto it = mesh_bounds.find(m->get_id());
+    if(it != mesh_bounds.end())
+    {
+        it->second.seen = true;
+        return it->second.bounds;
+    }
+
+    aabb bounds = {vec3(INFINITY), vec3(-INFINITY)};
+    for(const mesh::vertex& v: m->get_vertices())
+    {
+        bounds.min = min(bounds.min, vec3(v.pos));
+        bounds.max = max(bounds.max, vec3(v.pos));
+    }
+    return (mesh_bounds[m->get_id()] = {bounds, true}).bounds;
+}
+
+}
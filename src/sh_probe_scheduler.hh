@@ -0,0 +1,115 @@
+#ifndef TAURAY_SH_PROBE_SCHEDULER_HH
+#define TAURAY_SH_PROBE_SCHEDULER_HH
+#include "context.hh"
+#include "scene.hh"
+#include <unordered_map>
+
+namespace tr
+{
+
+class mesh;
+// Picks which SH probes sh_renderer traces on each frame when there are more
+// of them than the ray budget allows. Probes near the cameras, probes whose
+// luminance is still changing and probes near moved geometry or lights go
+// first. Converged probes are skipped until something moves near them.
+class sh_probe_scheduler
+{
+public:
+    struct options
+    {
+        // Rays traced per frame over all grids. 0 traces every probe on
+        // every frame, so this class isn't used at all.
+        uint64_t ray_budget = 0;
+        float temporal_ratio = 0.02f;
+        // Probes whose luminance changes by less than this fraction per
+        // update are converged once their history is full.
+        float convergence_threshold = 0.005f;
+    };
+
+    sh_probe_scheduler(const options& opt);
+
+    // Forgets all probe state. 'grids' are the entities of the grids, and
+    // 'rays_per_probe' is the cost of tracing one probe in each of them.
+    void reset(
+        scene& s,
+        const std::vector<entity>& grids,
+        const std::vector<uint32_t>& rays_per_probe
+    );
+
+    // Applies the luminances and their changes downloaded after the probes
+    // traced on the previous use of 'frame_index' were compacted. There is
+    // one entry per probe of the grid.
+    void add_feedback(size_t grid, uint32_t frame_index, const pvec2* changes);
+
+    // Picks the probes to trace on this frame. 'mix_ratios' gets the
+    // temporal blend ratio of each probe of each grid, 0 for skipped probes.
+    // The ratios account for the frames since the probe was last traced.
+    void schedule(
+        uint32_t frame_index,
+        std::vector<std::vector<float>>& mix_ratios
+    );
+
+    size_t get_scheduled_probe_count() const;
+    size_t get_converged_probe_count() const;
+
+private:
+    struct probe_state
+    {
+        uint32_t last_update = 0;
+        uint32_t update_count = 0;
+        // Moving average of the relative luminance change per update.
+        float change = 0.0f;
+        bool converged = false;
+        // Something moved near the probe since it was last traced.
+        bool dirty = false;
+    };
+
+    struct grid_state
+    {
+        entity id;
+        uvec3 resolution;
+        uint32_t rays_per_probe;
+        mat4 transform;
+        float cell_size;
+        std::vector<probe_state> probes;
+        // Probes traced on the last use of each frame index, waiting for
+        // feedback.
+        std::vector<uint32_t> traced[MAX_FRAMES_IN_FLIGHT];
+    };
+
+    // The last seen state of a model or light.
+    struct tracked_object
+    {
+        mat4 transform;
+        vec4 params;
+        aabb bounds;
+        bool seen;
+    };
+
+    struct cached_bounds
+    {
+        aabb bounds;
+        bool seen;
+    };
+
+    void find_moved_objects();
+    void track(entity id, const mat4& transform, vec4 params, const aabb& bounds);
+    void mark_dirty(const aabb& bounds);
+    void mark_all_dirty();
+    const aabb& get_mesh_bounds(const mesh* m);
+
+    options opt;
+    scene* cur_scene = nullptr;
+    uint32_t frame_counter = 0;
+    std::vector<grid_state> grids;
+    std::unordered_map<entity, tracked_object> objects;
+    // Keyed by mesh::get_id(), which is never reused and changes whenever
+    // the vertices are refreshed.
+    std::unordered_map<uint64_t, cached_bounds> mesh_bounds;
+    size_t scheduled_probes = 0;
+    size_t converged_probes = 0;
+};
+
+}
+
+#endif
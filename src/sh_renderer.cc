@@ -12,6 +12,12 @@ sh_renderer::sh_renderer(
     const options& opt
 ): dev(dev), opt(opt), ss(&ss)
 {
+    if(opt.ray_budget != 0)
+    {
+        scheduler.reset(new sh_probe_scheduler({
+            opt.ray_budget, opt.temporal_ratio, opt.convergence_threshold
+        }));
+    }
 }
 
 sh_renderer::~sh_renderer()
@@ -21,6 +27,8 @@ sh_renderer::~sh_renderer()
 void sh_renderer::update_grids()
 {
     per_grid.clear();
+    std::vector<entity> grid_ids;
+    std::vector<uint32_t> rays_per_probe;
     ss->get_scene()->foreach([&](entity id, sh_grid& s){
         sh_grid_targets.emplace(
             &s, s.create_target_texture(dev, opt.samples_per_probe)
@@ -46,11 +54,47 @@ void sh_renderer::update_grids()
                 d, *ss, *output_grids, vk::ImageLayout::eGeneral, sh_opt
             ));
 
+            // The scheduler only needs the probe changes from one device.
+            bool track_changes = scheduler && p.compact.size() == 0;
             p.compact.emplace_back(new sh_compact_stage(
-                d, *output_grids, *const_cast<texture*>(compact_grids)
+                d, *output_grids, *const_cast<texture*>(compact_grids),
+                track_changes ? s.get_resolution() : uvec3(0)
             ));
         }
+        grid_ids.push_back(id);
+        // Every device traces each scheduled probe, so the budget is shared
+        // among all of them.
+        rays_per_probe.push_back(sh_opt.samples_per_probe * dev.size());
     });
+
+    if(scheduler)
+        scheduler->reset(*ss->get_scene(), grid_ids, rays_per_probe);
+}
+
+void sh_renderer::schedule_probes()
+{
+    context* ctx = dev.get_context();
+    uint32_t swapchain_index, frame_index;
+    ctx->get_indices(swapchain_index, frame_index);
+
+    // This frame index was last used MAX_FRAMES_IN_FLIGHT frames ago and has
+    // finished, so the changes from its compaction can be read.
+    for(size_t i = 0; i < per_grid.size(); ++i)
+    {
+        const pvec2* changes = per_grid[i].compact[0]->get_probe_changes(frame_index);
+        scheduler->add_feedback(i, frame_index, changes);
+    }
+
+    scheduler->schedule(frame_index, probe_mix_ratios);
+    for(size_t i = 0; i < per_grid.size(); ++i)
+    {
+        for(auto& s: per_grid[i].pt)
+            s->set_probe_schedule(probe_mix_ratios[i]);
+    }
+
+    tracing_record& timing = ctx->get_timing();
+    timing.set_counter("SH probes traced", scheduler->get_scheduled_probe_count());
+    timing.set_counter("SH probes converged", scheduler->get_converged_probe_count());
 }
 
 dependencies sh_renderer::render(dependencies deps)
@@ -58,6 +102,9 @@ dependencies sh_renderer::render(dependencies deps)
     if(ss->check_update(scene_stage::LIGHT, scene_state_counter))
         update_grids();
 
+    if(scheduler)
+        schedule_probes();
+
     for(auto& p: per_grid)
     {
         for(auto& s: p.pt) deps = s->run(deps);
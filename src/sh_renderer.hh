@@ -5,6 +5,7 @@
 #include "renderer.hh"
 #include "sh_path_tracer_stage.hh"
 #include "sh_compact_stage.hh"
+#include "sh_probe_scheduler.hh"
 #include "renderer.hh"
 
 namespace tr
@@ -30,6 +31,7 @@ public:
 
 private:
     void update_grids();
+    void schedule_probes();
 
     device_mask dev;
     options opt;
@@ -44,6 +46,10 @@ private:
         std::vector<std::unique_ptr<sh_compact_stage>> compact;
     };
     std::vector<per_grid_data> per_grid;
+
+    // Only used with a ray budget.
+    std::unique_ptr<sh_probe_scheduler> scheduler;
+    std::vector<std::vector<float>> probe_mix_ratios;
 };
 
 }
@@ -9,7 +9,13 @@
 #include "spirv_reflect.h"
 
 #include <filesystem>
+#include <sstream>
+#include <mutex>
+#include <set>
+#include <cstdlib>
+#include <cstring>
 #include "misc.hh"
+#include "thread_pool.hh"
 namespace fs = std::filesystem;
 
 namespace
@@ -68,6 +74,216 @@ std::string generate_definition_src(
     return ss.str();
 }
 
+// Compiler settings, also included in the disk cache key.
+constexpr int GLSL_CLIENT_VERSION = 100;
+constexpr glslang::EShTargetClientVersion VULKAN_VERSION =
+    glslang::EShTargetVulkan_1_2;
+constexpr glslang::EShTargetLanguageVersion SPIRV_VERSION =
+    glslang::EShTargetSpv_1_5;
+constexpr EShMessages COMPILE_MESSAGES =
+    (EShMessages)(EShMsgSpvRules|EShMsgVulkanRules);
+
+// Bump this whenever the cache file layout or anything else that affects
+// the compiled shaders but isn't in the key changes.
+constexpr uint32_t DISK_CACHE_VERSION = 1;
+constexpr char DISK_CACHE_MAGIC[4] = {'T', 'R', 'S', 'C'};
+
+// Appends the path, size and hash of every file that 'src' includes,
+// recursively. This mirrors how DirStackFileIncluder resolves local includes:
+// first relative to the including file, then relative to the top-level
+// shader. Includes inside disabled #if blocks are listed too, which is only
+// overly conservative.
+void append_include_hashes(
+    std::string& key,
+    const std::string& src,
+    const fs::path& includer_dir,
+    const fs::path& root_dir,
+    std::set<std::string>& visited
+){
+    std::istringstream lines(src);
+    std::string line;
+    while(std::getline(lines, line))
+    {
+        size_t pos = line.find_first_not_of(" \t");
+        if(pos == std::string::npos || line.compare(pos, 1, "#") != 0)
+            continue;
+        pos = line.find_first_not_of(" \t", pos + 1);
+        if(pos == std::string::npos || line.compare(pos, 7, "include") != 0)
+            continue;
+        size_t begin = line.find('"', pos + 7);
+        size_t end = begin == std::string::npos ?
+            std::string::npos : line.find('"', begin + 1);
+        if(end == std::string::npos) continue;
+        std::string name = line.substr(begin + 1, end - begin - 1);
+
+        fs::path resolved = includer_dir / name;
+        if(!fs::exists(resolved)) resolved = root_dir / name;
+        std::string resolved_str = resolved.lexically_normal().generic_string();
+
+        if(!visited.insert(resolved_str).second)
+            continue;
+
+        if(!fs::exists(resolved))
+        {
+            // Compilation will fail anyway, but make sure that the key changes
+            // once the file appears.
+            key += "include " + resolved_str + " missing\n";
+            continue;
+        }
+
+        std::string content = load_text_file(resolved.string());
+        key += "include " + resolved_str + " " +
+            std::to_string(content.size()) + " " +
+            to_hex(fnv1a64(content.data(), content.size())) + "\n";
+        append_include_hashes(
+            key, content, resolved.parent_path(), root_dir, visited
+        );
+    }
+}
+
+std::string build_disk_cache_key(
+    const std::string& src,
+    const std::string& ext,
+    const std::string& dir_path
+){
+    std::string key = "tauray-spirv " + std::to_string(DISK_CACHE_VERSION) + "\n";
+    // glslang upgrades and changed targets must not reuse old SPIR-V.
+    glslang::Version glslang_version = glslang::GetVersion();
+    key += "glslang " + std::to_string(glslang_version.major) + "." +
+        std::to_string(glslang_version.minor) + "." +
+        std::to_string(glslang_version.patch) + glslang_version.flavor + "\n";
+    key += "target " + std::to_string(GLSL_CLIENT_VERSION) + " " +
+        std::to_string(VULKAN_VERSION) + " " +
+        std::to_string(SPIRV_VERSION) + " " +
+        std::to_string(COMPILE_MESSAGES) + "\n";
+    key += "stage " + ext + "\n";
+    // The defines have already been spliced into the source.
+    key += "source " + std::to_string(src.size()) + " " +
+        to_hex(fnv1a64(src.data(), src.size())) + "\n";
+    std::set<std::string> visited;
+    append_include_hashes(key, src, dir_path, dir_path, visited);
+    return key;
+}
+
+void write_u32(std::string& out, uint32_t value)
+{
+    out.append((const char*)&value, sizeof(value));
+}
+
+void write_string(std::string& out, const std::string& str)
+{
+    write_u32(out, str.size());
+    out += str;
+}
+
+struct disk_cache_reader
+{
+    const std::string& data;
+    size_t offset = 0;
+    bool ok = true;
+
+    uint32_t read_u32()
+    {
+        uint32_t value = 0;
+        if(offset + sizeof(value) > data.size())
+        {
+            ok = false;
+            return 0;
+        }
+        memcpy(&value, data.data() + offset, sizeof(value));
+        offset += sizeof(value);
+        return value;
+    }
+
+    std::string read_string()
+    {
+        uint32_t size = read_u32();
+        if(!ok || offset + size > data.size())
+        {
+            ok = false;
+            return {};
+        }
+        std::string str = data.substr(offset, size);
+        offset += size;
+        return str;
+    }
+};
+
+std::string serialize_shader(const std::string& key, const shader_source& src)
+{
+    std::string out(DISK_CACHE_MAGIC, sizeof(DISK_CACHE_MAGIC));
+    write_u32(out, DISK_CACHE_VERSION);
+    write_string(out, key);
+
+    write_u32(out, src.data.size());
+    out.append((const char*)src.data.data(), src.data.size() * sizeof(uint32_t));
+
+    write_u32(out, src.bindings.size());
+    for(const auto& [name, info]: src.bindings)
+    {
+        write_string(out, name);
+        write_u32(out, info.set);
+        write_u32(out, info.binding.binding);
+        write_u32(out, (uint32_t)info.binding.descriptorType);
+        write_u32(out, info.binding.descriptorCount);
+        write_u32(out, (uint32_t)info.binding.stageFlags);
+    }
+
+    write_u32(out, src.push_constant_ranges.size());
+    for(const vk::PushConstantRange& range: src.push_constant_ranges)
+    {
+        write_u32(out, (uint32_t)range.stageFlags);
+        write_u32(out, range.offset);
+        write_u32(out, range.size);
+    }
+    return out;
+}
+
+// Returns false if the data is corrupt or was written for a different key.
+bool deserialize_shader(
+    const std::string& data,
+    const std::string& key,
+    shader_source& src
+){
+    if(data.compare(0, sizeof(DISK_CACHE_MAGIC), DISK_CACHE_MAGIC, sizeof(DISK_CACHE_MAGIC)) != 0)
+        return false;
+
+    disk_cache_reader r{data, sizeof(DISK_CACHE_MAGIC)};
+    if(r.read_u32() != DISK_CACHE_VERSION || r.read_string() != key || !r.ok)
+        return false;
+
+    uint32_t word_count = r.read_u32();
+    if(!r.ok || r.offset + size_t(word_count) * sizeof(uint32_t) > data.size())
+        return false;
+    src.data.resize(word_count);
+    memcpy(src.data.data(), data.data() + r.offset, word_count * sizeof(uint32_t));
+    r.offset += word_count * sizeof(uint32_t);
+
+    uint32_t binding_count = r.read_u32();
+    for(uint32_t i = 0; i < binding_count && r.ok; ++i)
+    {
+        std::string name = r.read_string();
+        shader_source::binding_info info;
+        info.set = r.read_u32();
+        info.binding.binding = r.read_u32();
+        info.binding.descriptorType = vk::DescriptorType(r.read_u32());
+        info.binding.descriptorCount = r.read_u32();
+        info.binding.stageFlags = vk::ShaderStageFlags(r.read_u32());
+        src.bindings[name] = info;
+    }
+
+    uint32_t range_count = r.read_u32();
+    for(uint32_t i = 0; i < range_count && r.ok; ++i)
+    {
+        vk::PushConstantRange range;
+        range.stageFlags = vk::ShaderStageFlags(r.read_u32());
+        range.offset = r.read_u32();
+        range.size = r.read_u32();
+        src.push_constant_ranges.push_back(range);
+    }
+    return r.ok && r.offset == data.size();
+}
+
 void append_shader_pc_ranges(
     std::vector<vk::PushConstantRange>& ranges,
     const shader_source& src
@@ -89,7 +305,177 @@ namespace tr
 
 // Ad-hoc binary caching :P SPIR-V is platform independent, so the same
 // "binaries" are fine on all GPUs.
+static std::mutex binaries_mutex;
 static std::map<std::string, shader_source> binaries;
+// Shaders that are currently being loaded or compiled by some thread. Others
+// asking for the same source wait for that result instead of compiling it
+// again.
+static std::map<std::string, std::shared_future<shader_source>> pending_binaries;
+static std::string disk_cache_path;
+static std::mutex stats_mutex;
+static shader_source::cache_stats stats;
+
+static void init_glslang()
+{
+    // InitializeProcess() and FinalizeProcess() modify global state without
+    // any locking, so calling them around each compile is not safe once
+    // shaders are compiled from multiple threads. glslang is therefore
+    // initialized once and stays that way until the process exits.
+    static std::once_flag flag;
+    std::call_once(flag, [](){ glslang::InitializeProcess(); });
+}
+
+static thread_pool& get_compile_pool()
+{
+    static thread_pool pool;
+    return pool;
+}
+
+static void compile_shader(
+    const std::string& path,
+    const std::string& ext,
+    const std::string& dir_path,
+    const std::string& src,
+    shader_source& res
+){
+    init_glslang();
+
+    // Prepare the shader source for glslang
+    EShLanguage type = detect_shader_language(ext);
+    glslang::TShader shader(type);
+    const char* c_str = src.c_str();
+    shader.setStrings(&c_str, 1);
+    shader.setEnvInput(
+        glslang::EShSourceGlsl, type, glslang::EShClientVulkan,
+        GLSL_CLIENT_VERSION
+    );
+    shader.setEnvClient(glslang::EShClientVulkan, VULKAN_VERSION);
+    shader.setEnvTarget(glslang::EShTargetSpv, SPIRV_VERSION);
+
+    TBuiltInResource resources = glslang::DefaultTBuiltInResource;
+
+    EShMessages messages = COMPILE_MESSAGES;
+
+    // Preprocessing
+    DirStackFileIncluder includer;
+    includer.pushExternalLocalDirectory(dir_path);
+
+    // Compiling
+    if(!shader.parse(&resources, 100, ENoProfile, false, false, messages, includer))
+        throw std::runtime_error(
+            "Failed to compile " + path + ": " + shader.getInfoLog()
+        );
+
+    glslang::TProgram program;
+    program.addShader(&shader);
+
+    if(!program.link(messages))
+        throw std::runtime_error(
+            "Failed to link " + path + ": " + shader.getInfoLog()
+        );
+
+    spv::SpvBuildLogger logger;
+    glslang::SpvOptions options;
+    options.generateDebugInfo = true;
+    glslang::GlslangToSpv(
+        *program.getIntermediate(type), res.data, &logger, &options
+    );
+
+    // glslang has built-in reflection, but it's crap! It doesn't find all
+    // things, like blocks that contain unsized arrays. That's why we have
+    // to use a separate library for this.
+    vk::ShaderStageFlags stage = detect_shader_stage(ext);
+
+    SpvReflectShaderModule mod;
+    SpvReflectResult reflect_res = spvReflectCreateShaderModule(
+        res.data.size() * sizeof(res.data[0]),
+        res.data.data(),
+        &mod
+    );
+    if(reflect_res != SPV_REFLECT_RESULT_SUCCESS)
+        throw std::runtime_error(
+            "Failed to reflect " + path + ": " + std::to_string(reflect_res)
+        );
+
+    // Determine descriptor bindings
+    uint32_t count = 0;
+    spvReflectEnumerateDescriptorBindings(&mod, &count, nullptr);
+    std::vector<SpvReflectDescriptorBinding*> bindings(count);
+    spvReflectEnumerateDescriptorBindings(&mod, &count, bindings.data());
+    for(auto* binding: bindings)
+    {
+        res.bindings[binding->name] = shader_source::binding_info{binding->set,
+            vk::DescriptorSetLayoutBinding{
+                binding->binding,
+                vk::DescriptorType(binding->descriptor_type),
+                binding->count,
+                stage
+            }
+        };
+    }
+
+    // Determine push constant range
+    spvReflectEnumeratePushConstantBlocks(&mod, &count, nullptr);
+    std::vector<SpvReflectBlockVariable*> push_constant_blocks(count);
+    spvReflectEnumeratePushConstantBlocks(
+        &mod, &count, push_constant_blocks.data()
+    );
+
+    for(auto* pc: push_constant_blocks)
+    {
+        res.push_constant_ranges.push_back({
+            stage, pc->offset, pc->size
+        });
+    }
+
+    spvReflectDestroyShaderModule(&mod);
+}
+
+static void load_shader(
+    const std::string& path,
+    const std::string& ext,
+    const std::string& dir_path,
+    const std::string& src,
+    shader_source& res
+){
+    fs::path cache_entry_path;
+    std::string cache_key;
+    if(!disk_cache_path.empty())
+    {
+        auto load_start = std::chrono::steady_clock::now();
+        cache_key = build_disk_cache_key(src, ext, dir_path);
+        cache_entry_path = fs::path(disk_cache_path) /
+            (to_hex(fnv1a64(cache_key.data(), cache_key.size())) + ".spvc");
+
+        std::string cached;
+        if(
+            try_load_binary_file(cache_entry_path.string(), cached) &&
+            deserialize_shader(cached, cache_key, res)
+        ){
+            std::lock_guard<std::mutex> lk(stats_mutex);
+            stats.disk_hits++;
+            stats.disk_load_time += std::chrono::steady_clock::now() - load_start;
+            return;
+        }
+        // Possibly a partially parsed corrupt entry, start over.
+        res = shader_source();
+    }
+
+    auto compile_start = std::chrono::steady_clock::now();
+    compile_shader(path, ext, dir_path, src, res);
+
+    // Failing to write the cache is not an error, it just makes the next
+    // startup slower.
+    if(!cache_entry_path.empty())
+    {
+        std::string entry = serialize_shader(cache_key, res);
+        write_file_atomically(cache_entry_path.string(), entry.data(), entry.size());
+    }
+
+    std::lock_guard<std::mutex> lk(stats_mutex);
+    stats.compiled++;
+    stats.compile_time += std::chrono::steady_clock::now() - compile_start;
+}
 
 shader_source::shader_source(
     const std::string& path,
@@ -113,110 +499,89 @@ shader_source::shader_source(
         src = src.substr(0, offset) + definition_src + src.substr(offset);
     }
 
-    auto it = binaries.find(src);
-    if(it == binaries.end())
+    std::promise<shader_source> promise;
+    std::shared_future<shader_source> other;
+    bool cached = false;
     {
-        glslang::InitializeProcess();
-
-        // Prepare the shader source for glslang
-        EShLanguage type = detect_shader_language(ext);
-        glslang::TShader shader(type);
-        const char* c_str = src.c_str();
-        shader.setStrings(&c_str, 1);
-        shader.setEnvInput(glslang::EShSourceGlsl, type, glslang::EShClientVulkan, 100);
-        shader.setEnvClient(glslang::EShClientVulkan, glslang::EShTargetVulkan_1_2);
-        shader.setEnvTarget(glslang::EShTargetSpv, glslang::EShTargetSpv_1_5);
-
-        TBuiltInResource resources = glslang::DefaultTBuiltInResource;
-
-        EShMessages messages = (EShMessages)(EShMsgSpvRules|EShMsgVulkanRules);
-
-        // Preprocessing
-        DirStackFileIncluder includer;
-        includer.pushExternalLocalDirectory(dir_path);
-
-        // Compiling
-        if(!shader.parse(&resources, 100, ENoProfile, false, false, messages, includer))
-            throw std::runtime_error(
-                "Failed to compile " + path + ": " + shader.getInfoLog()
-            );
-
-        glslang::TProgram program;
-        program.addShader(&shader);
-
-        if(!program.link(messages))
-            throw std::runtime_error(
-                "Failed to link " + path + ": " + shader.getInfoLog()
-            );
-
-        spv::SpvBuildLogger logger;
-        glslang::SpvOptions options;
-        options.generateDebugInfo = true;
-        glslang::GlslangToSpv(
-            *program.getIntermediate(type), data, &logger, &options
-        );
-
-        glslang::FinalizeProcess();
-
-        // glslang has built-in reflection, but it's crap! It doesn't find all
-        // things, like blocks that contain unsized arrays. That's why we have
-        // to use a separate library for this.
-        vk::ShaderStageFlags stage = detect_shader_stage(ext);
-
-        SpvReflectShaderModule mod;
-        SpvReflectResult res = spvReflectCreateShaderModule(
-            data.size() * sizeof(data[0]),
-            data.data(),
-            &mod
-        );
-        if(res != SPV_REFLECT_RESULT_SUCCESS)
-            throw std::runtime_error(
-                "Failed to reflect " + path + ": " + std::to_string(res)
-            );
-
-        // Determine descriptor bindings
-        uint32_t count = 0;
-        spvReflectEnumerateDescriptorBindings(&mod, &count, nullptr);
-        std::vector<SpvReflectDescriptorBinding*> bindings(count);
-        spvReflectEnumerateDescriptorBindings(&mod, &count, bindings.data());
-        for(auto* binding: bindings)
+        std::lock_guard<std::mutex> lk(binaries_mutex);
+        auto it = binaries.find(src);
+        if(it != binaries.end())
         {
-            this->bindings[binding->name] = binding_info{binding->set,
-                vk::DescriptorSetLayoutBinding{
-                    binding->binding,
-                    vk::DescriptorType(binding->descriptor_type),
-                    binding->count,
-                    stage
-                }
-            };
+            operator=(it->second);
+            cached = true;
         }
+        else if(
+            auto pending = pending_binaries.find(src);
+            pending != pending_binaries.end()
+        ) other = pending->second;
+        else pending_binaries[src] = promise.get_future().share();
+    }
 
-        // Determine push constant range
-        spvReflectEnumeratePushConstantBlocks(&mod, &count, nullptr);
-        std::vector<SpvReflectBlockVariable*> push_constant_blocks(count);
-        spvReflectEnumeratePushConstantBlocks(
-            &mod, &count, push_constant_blocks.data()
-        );
+    if(cached || other.valid())
+    {
+        // Another thread is already working on this shader, so waiting for
+        // it can't deadlock.
+        if(other.valid()) operator=(other.get());
+        std::lock_guard<std::mutex> lk(stats_mutex);
+        stats.memory_hits++;
+        return;
+    }
 
-        for(auto* pc: push_constant_blocks)
+    try
+    {
+        load_shader(path, ext, dir_path, src, *this);
+    }
+    catch(...)
+    {
         {
-            this->push_constant_ranges.push_back({
-                stage, pc->offset, pc->size
-            });
+            std::lock_guard<std::mutex> lk(binaries_mutex);
+            pending_binaries.erase(src);
         }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
 
-        spvReflectDestroyShaderModule(&mod);
-
+    {
+        std::lock_guard<std::mutex> lk(binaries_mutex);
         binaries[src] = *this;
+        pending_binaries.erase(src);
     }
-    else operator=(it->second);
+    promise.set_value(*this);
+}
+
+std::shared_future<shader_source> shader_source::compile_async(
+    const std::string& path,
+    const std::map<std::string, std::string>& defines
+){
+    return get_compile_pool().submit(
+        [path, defines](){ return shader_source(path, defines); }
+    ).share();
 }
 
 void shader_source::clear_binary_cache()
 {
+    std::lock_guard<std::mutex> lk(binaries_mutex);
     binaries.clear();
 }
 
+void shader_source::set_disk_cache_path(const std::string& path)
+{
+    disk_cache_path = path;
+}
+
+std::string shader_source::get_default_disk_cache_path()
+{
+    std::string dir = get_user_cache_dir();
+    if(dir.empty()) return "";
+    return (fs::path(dir)/"shaders").string();
+}
+
+shader_source::cache_stats shader_source::get_cache_stats()
+{
+    std::lock_guard<std::mutex> lk(stats_mutex);
+    return stats;
+}
+
 std::vector<vk::PushConstantRange>
 get_push_constant_ranges(const rt_shader_sources& src)
 {
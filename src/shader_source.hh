@@ -5,6 +5,8 @@
 #include <utility>
 #include <vector>
 #include <map>
+#include <chrono>
+#include <future>
 #include "context.hh"
 
 namespace tr
@@ -35,7 +37,40 @@ struct shader_source
     std::vector<vk::PushConstantRange> push_constant_ranges;
     std::vector<uint32_t> data;
 
+    // Only clears the in-memory cache; the disk cache is content-addressed
+    // and never goes stale.
     static void clear_binary_cache();
+
+    // Compiles the shader on a shared pool of worker threads. Stages should
+    // request all of their shaders this way before waiting on any of them, so
+    // that the compilations run in parallel. Identical shaders requested
+    // concurrently are only compiled once. Don't wait on the result from a
+    // job that runs in the same pool.
+    static std::shared_future<shader_source> compile_async(
+        const std::string& path,
+        const std::map<std::string, std::string>& defines = {}
+    );
+
+    // Compiled shaders are also stored in this directory, so that later
+    // processes can skip glslang and reflection entirely. Entries are keyed by
+    // the spliced source (including defines), the shader stage and the
+    // contents of all included files. An empty path disables the disk cache.
+    static void set_disk_cache_path(const std::string& path);
+    // $XDG_CACHE_HOME/tauray/shaders or similar, depending on the platform.
+    // Empty if no suitable directory is known.
+    static std::string get_default_disk_cache_path();
+
+    struct cache_stats
+    {
+        size_t compiled = 0;
+        size_t disk_hits = 0;
+        size_t memory_hits = 0;
+        std::chrono::steady_clock::duration compile_time =
+            std::chrono::steady_clock::duration::zero();
+        std::chrono::steady_clock::duration disk_load_time =
+            std::chrono::steady_clock::duration::zero();
+    };
+    static cache_stats get_cache_stats();
 };
 
 struct raster_shader_sources
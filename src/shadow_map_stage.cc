@@ -24,16 +24,21 @@ struct push_constant_buffer
 
 namespace shadow
 {
-    raster_shader_sources load_sources()
+    raster_shader_sources load_sources(bool indirect_draw)
     {
-        static bool loaded = false;
-        static raster_shader_sources src;
-        if(!loaded)
+        static bool loaded[2] = {false, false};
+        static raster_shader_sources src[2];
+        if(!loaded[indirect_draw])
         {
-            src = {{"shader/shadow_map.vert"}, {"shader/shadow_map.frag"}};
-            loaded = true;
+            std::map<std::string, std::string> defines;
+            if(indirect_draw) defines["INDIRECT_DRAW"];
+            src[indirect_draw] = {
+                {"shader/shadow_map.vert", defines},
+                {"shader/shadow_map.frag", defines}
+            };
+            loaded[indirect_draw] = true;
         }
-        return src;
+        return src[indirect_draw];
     }
 }
 
@@ -79,6 +84,12 @@ shadow_map_stage::shadow_map_stage(
     ss(&ss),
     scene_state_counter(0)
 {
+    if(ss.has_indirect_draw())
+    {
+        instance_culler::options culler_opt;
+        culler_opt.custom_views = true;
+        culler.emplace(dev, ss, culler_opt);
+    }
 }
 
 void shadow_map_stage::update(uint32_t frame_index)
@@ -127,7 +138,7 @@ void shadow_map_stage::update(uint32_t frame_index)
         prev_atlas_size = shadow_map_atlas->get_size();
         clear_commands();
         scene_state_counter = 0; // Force refresh
-        raster_shader_sources src = shadow::load_sources();
+        raster_shader_sources src = shadow::load_sources(culler.has_value());
         desc.add(src);
         gfx.init(raster_pipeline::pipeline_state{
             uvec2(shadow_map_atlas->get_size()),
@@ -168,6 +179,15 @@ void shadow_map_stage::update(uint32_t frame_index)
             shadow_timer.begin(cb, dev->id, i);
             camera_data.upload(dev->id, i, cb);
 
+            if(culler)
+            {
+                // Each face and cascade is its own render pass and list.
+                std::vector<instance_culler::draw_list> lists;
+                for(uint32_t cam = 0; cam < total_passes; ++cam)
+                    lists.push_back({cam, 1});
+                culler->record_cull(cb, lists, &camera_data);
+            }
+
             unsigned cam_index = 0;
             auto render_cam = [&](
                 unsigned atlas_index, unsigned face_index, unsigned face_count
@@ -198,7 +218,16 @@ void shadow_map_stage::update(uint32_t frame_index)
 
                 cb.setViewport(0, 1, &vp);
 
-                for(size_t i = 0; i < instances.size(); ++i)
+                if(culler)
+                {
+                    push_constant_buffer control;
+                    control.instance_id = 0;
+                    control.alpha_clip = 1.0f;
+                    control.cam_index = cam_index;
+                    gfx.push_constants(cb, control);
+                    culler->record_draw(cb, cam_index);
+                }
+                else for(size_t i = 0; i < instances.size(); ++i)
                 {
                     const scene_stage::instance& inst = instances[i];
                     const mesh* m = inst.m;
@@ -9,6 +9,7 @@
 #include "stage.hh"
 #include "atlas.hh"
 #include "scene_stage.hh"
+#include "instance_culler.hh"
 
 namespace tr
 {
@@ -29,6 +30,8 @@ private:
     raster_pipeline gfx;
     options opt;
     gpu_buffer camera_data;
+    // Only used if the scene_stage has indirect drawing enabled.
+    std::optional<instance_culler> culler;
     std::vector<scene_stage::shadow_map_instance> shadow_maps;
     uvec2 prev_atlas_size;
 
@@ -43,11 +43,15 @@ dependencies multi_device_stage::run(dependencies deps)
 
     for(auto[dev, c]: buffers)
     {
-        dev.ctx->get_progress_tracker().set_timeline(dev.id, c.progress, c.command_buffers[cb_index].size());
+        size_t transient_count = c.transient_command_buffers.size();
+        size_t total_count = transient_count + c.command_buffers[cb_index].size();
+        dev.ctx->get_progress_tracker().set_timeline(dev.id, c.progress, total_count);
 
-        for(size_t i = 0; i < c.command_buffers[cb_index].size(); ++i)
+        for(size_t i = 0; i < total_count; ++i)
         {
-            const vkm<vk::CommandBuffer>& cmd = c.command_buffers[cb_index][i];
+            const vkm<vk::CommandBuffer>& cmd = i < transient_count ?
+                c.transient_command_buffers[i] :
+                c.command_buffers[cb_index][i - transient_count];
 
             vk::TimelineSemaphoreSubmitInfo timeline_info = deps.get_timeline_info(dev.id);
             c.local_step_counter++;
@@ -70,6 +74,7 @@ dependencies multi_device_stage::run(dependencies deps)
             deps.clear(dev.id);
             deps.add({dev.id, *c.progress, c.local_step_counter});
         }
+        c.transient_command_buffers.clear();
     }
 
     return deps;
@@ -122,6 +127,13 @@ void multi_device_stage::end_graphics(vk::CommandBuffer buf, device_id id, uint3
     end_commands(buf, buffers.get_device(id).graphics_pool, id, frame_index, swapchain_index);
 }
 
+void multi_device_stage::end_graphics_once(vk::CommandBuffer buf, device_id id)
+{
+    buf.end();
+    device& dev = buffers.get_device(id);
+    buffers[id].transient_command_buffers.emplace_back(dev, buf, dev.graphics_pool);
+}
+
 vk::CommandBuffer multi_device_stage::begin_transfer(device_id id, bool single_use)
 {
     return begin_commands(buffers.get_device(id).transfer_pool, id, single_use);
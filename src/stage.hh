@@ -36,6 +36,10 @@ protected:
 
     vk::CommandBuffer begin_graphics(device_id id, bool single_use = false);
     void end_graphics(vk::CommandBuffer buf, device_id id, uint32_t frame_index, uint32_t swapchain_index = 0);
+    // The command buffer is only submitted on the next run(), before the
+    // recorded ones. Use from update() with single_use command buffers for
+    // work that changes every frame.
+    void end_graphics_once(vk::CommandBuffer buf, device_id id);
 
     vk::CommandBuffer begin_transfer(device_id id, bool single_use = false);
     void end_transfer(vk::CommandBuffer buf, device_id id, uint32_t frame_index, uint32_t swapchain_index = 0);
@@ -49,6 +53,7 @@ private:
     struct cb_data
     {
         std::vector<std::vector<vkm<vk::CommandBuffer>>> command_buffers;
+        std::vector<vkm<vk::CommandBuffer>> transient_command_buffers;
         uint64_t local_step_counter = 0;
         vkm<vk::Semaphore> progress;
     };
@@ -0,0 +1,46 @@
+#include "stream_stats.hh"
+#include "math.hh"
+#include <sstream>
+#include <iomanip>
+
+namespace tr
+{
+
+void stream_stats::add(
+    size_t raw_bytes,
+    size_t encoded_bytes,
+    std::chrono::steady_clock::duration time
+){
+    this->frames++;
+    this->raw_bytes += raw_bytes;
+    this->encoded_bytes += encoded_bytes;
+    this->time += time;
+}
+
+std::string stream_stats::report(std::chrono::steady_clock::duration interval)
+{
+    auto now = std::chrono::steady_clock::now();
+    if(now - last_report < interval || frames == 0)
+        return "";
+
+    float seconds = std::chrono::duration<float>(now - last_report).count();
+    float ms = std::chrono::duration<float, std::milli>(time).count();
+
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2)
+        << frames << " frames, "
+        << encoded_bytes / 1024.0f / frames << " KiB/frame ("
+        << 100.0f * encoded_bytes / max(raw_bytes, size_t(1)) << "% of raw), ";
+    if(time != std::chrono::steady_clock::duration::zero())
+        ss << ms / frames << " ms/frame, ";
+    ss << encoded_bytes / (1024.0f * 1024.0f) / seconds << " MiB/s";
+
+    frames = 0;
+    raw_bytes = 0;
+    encoded_bytes = 0;
+    time = std::chrono::steady_clock::duration::zero();
+    last_report = now;
+    return ss.str();
+}
+
+}
@@ -0,0 +1,39 @@
+#ifndef TAURAY_STREAM_STATS_HH
+#define TAURAY_STREAM_STATS_HH
+#include <chrono>
+#include <string>
+
+namespace tr
+{
+
+// Accumulates per-frame sizes and timings of an encoded stream, for printing
+// a summary every now and then.
+class stream_stats
+{
+public:
+    void add(
+        size_t raw_bytes,
+        size_t encoded_bytes,
+        std::chrono::steady_clock::duration time =
+            std::chrono::steady_clock::duration::zero()
+    );
+
+    // Returns the frame count, frame sizes and bandwidth, and resets the
+    // counters if at least 'interval' has passed since the previous summary.
+    // Otherwise, returns an empty string. Time per frame is only included if
+    // any time was added.
+    std::string report(std::chrono::steady_clock::duration interval);
+
+private:
+    size_t frames = 0;
+    size_t raw_bytes = 0;
+    size_t encoded_bytes = 0;
+    std::chrono::steady_clock::duration time =
+        std::chrono::steady_clock::duration::zero();
+    std::chrono::steady_clock::time_point last_report =
+        std::chrono::steady_clock::now();
+};
+
+}
+
+#endif
@@ -76,30 +76,35 @@ svgf_stage::svgf_stage(
     scene_state_counter(0),
     uniforms(dev, sizeof(uint32_t), vk::BufferUsageFlagBits::eStorageBuffer)
 {
+    std::map<std::string, std::string> atrous_defines;
+    if (opt.color_buffer_contains_direct_light) atrous_defines["COLOR_IS_ADDITIVE"] = "";
+    auto atrous_src = shader_source::compile_async("shader/svgf_atrous.comp", atrous_defines);
+    auto temporal_src = shader_source::compile_async("shader/svgf_temporal.comp");
+    auto firefly_suppression_src = shader_source::compile_async("shader/svgf_firefly_suppression.comp");
+    auto disocclusion_fix_src = shader_source::compile_async("shader/svgf_disocclusion_fix.comp");
+    auto hit_dist_reconstruction_src = shader_source::compile_async("shader/svgf_hit_dist_reconstruction.comp");
     {
-        std::map<std::string, std::string> defines;
-        if (opt.color_buffer_contains_direct_light) defines["COLOR_IS_ADDITIVE"] = "";
-        shader_source src("shader/svgf_atrous.comp", defines);
+        const shader_source& src = atrous_src.get();
         atrous_desc.add(src);
         atrous_comp.init(src, { &atrous_desc,  &ss.get_descriptors() });
     }
     {
-        shader_source src("shader/svgf_temporal.comp");
+        const shader_source& src = temporal_src.get();
         temporal_desc.add(src);
         temporal_comp.init(src, {&temporal_desc, &ss.get_descriptors()});
     }
     {
-        shader_source src("shader/svgf_firefly_suppression.comp");
+        const shader_source& src = firefly_suppression_src.get();
         firefly_suppression_desc.add(src);
         firefly_suppression_comp.init(src, {&firefly_suppression_desc});
     }
     {
-        shader_source src("shader/svgf_disocclusion_fix.comp");
+        const shader_source& src = disocclusion_fix_src.get();
         disocclusion_fix_desc.add(src);
         disocclusion_fix_comp.init(src, { &disocclusion_fix_desc, &ss.get_descriptors() });
     }
     {
-        shader_source src("shader/svgf_hit_dist_reconstruction.comp");
+        const shader_source& src = hit_dist_reconstruction_src.get();
         hit_dist_reconstruction_desc.add(src);
         hit_dist_reconstruction_comp.init(src, { &hit_dist_reconstruction_desc, &ss.get_descriptors() });
     }
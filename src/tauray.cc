@@ -23,6 +23,9 @@
 #include "assimp.hh"
 #include "misc.hh"
 #include "load_balancer.hh"
+#include "thread_pool.hh"
+#include "shader_source.hh"
+#include "upload_batcher.hh"
 #include <chrono>
 #include <iostream>
 #include <thread>
@@ -125,28 +128,83 @@ scene_data load_scenes(context& ctx, const options& opt)
     if(opt.display == options::display_type::FRAME_CLIENT)
         return {};
 
+    using namespace std::chrono;
+    auto ms = [](steady_clock::duration d){
+        return duration_cast<duration<double, std::milli>>(d).count();
+    };
+    steady_clock::time_point load_start = steady_clock::now();
+
     device_mask dev = device_mask::all(ctx);
     scene_data data;
     data.s.reset(new scene);
 
-    for(const std::string& path: opt.scene_paths)
+    std::string scene_cache_path = opt.scene_cache;
+    if(scene_cache_path == "none") scene_cache_path = "";
+    else if(scene_cache_path.size() == 0 && get_user_cache_dir().size() != 0)
+        scene_cache_path = (fs::path(get_user_cache_dir())/"scenes").string();
+    set_gltf_cache_path(scene_cache_path);
+
+    auto is_gltf = [](const std::string& path){
+        fs::path fsp(path);
+        return fsp.extension() == ".gltf" || fsp.extension() == ".glb";
+    };
+
+    // glTF files are decoded in parallel, but they're added to the scene
+    // strictly in the given order so that the resulting scene is always the
+    // same.
+    thread_pool pool;
+    std::vector<std::future<std::shared_ptr<gltf_file>>> decoded(
+        opt.scene_paths.size()
+    );
+    for(size_t i = 0; i < opt.scene_paths.size(); ++i)
     {
+        if(!is_gltf(opt.scene_paths[i])) continue;
+        decoded[i] = pool.submit([
+            dev, path = opt.scene_paths[i], &pool,
+            single_sided = opt.force_single_sided,
+            double_sided = opt.force_double_sided
+        ](){
+            return decode_gltf(dev, path, single_sided, double_sided, &pool);
+        });
+    }
+
+    // Uploads of each file are submitted together and left running on the
+    // GPU while the next file is instantiated.
+    upload_batcher uploads(dev);
+    for(size_t i = 0; i < opt.scene_paths.size(); ++i)
+    {
+        const std::string& path = opt.scene_paths[i];
         scene_assets& sa = data.assets.emplace_back();
 
-        fs::path fsp(path);
-        if(fsp.extension() == ".gltf" || fsp.extension() == ".glb")
+        if(is_gltf(path))
         {
-            sa = load_gltf(
-                dev, *data.s, path, opt.force_single_sided, opt.force_double_sided
+            std::shared_ptr<gltf_file> file = decoded[i].get();
+            sa = instantiate_gltf(*data.s, *file, &uploads);
+            uploads.flush();
+            const gltf_load_times& times = get_load_times(*file);
+            TR_LOG(
+                path, ": parsing ", ms(times.parse), " ms, meshes ",
+                ms(times.meshes), " ms, textures ", ms(times.textures),
+                " ms, scene ", ms(times.scene), " ms"
             );
         }
         else
         {
             sa = load_assimp(dev, *data.s, path);
         }
-
     }
 
+    uploads.wait();
+    upload_batcher::stats upload_stats = uploads.get_stats();
+
+    TR_LOG(
+        "Loaded ", opt.scene_paths.size(), " scene file(s) in ",
+        ms(steady_clock::now() - load_start), " ms. Uploaded ",
+        upload_stats.uploads, " resources (", upload_stats.bytes/(1024*1024),
+        " MiB) in ", upload_stats.submissions, " submissions, waited ",
+        ms(upload_stats.wait_time), " ms"
+    );
+
     data.s->foreach([&](sh_grid& sg){
         sg.set_order(opt.sh_order);
     });
@@ -250,7 +308,10 @@ scene_data load_scenes(context& ctx, const options& opt)
     set_camera_params(opt, *data.s);
 
     if(opt.animation_flag)
+    {
         play(*data.s, opt.animation, !opt.replay, opt.animation == "");
+        data.update_pool.reset(new thread_pool(opt.update_threads));
+    }
 
     return data;
 }
@@ -261,6 +322,12 @@ context* create_context(const options& opt)
     if(opt.display == options::display_type::FRAME_CLIENT)
         return nullptr;
 
+    std::string cache_path = opt.shader_cache;
+    if(cache_path == "none") cache_path = "";
+    else if(cache_path.size() == 0)
+        cache_path = shader_source::get_default_disk_cache_path();
+    shader_source::set_disk_cache_path(cache_path);
+
     context::options ctx_opt;
     if(auto rtype = std::get_if<options::basic_pipeline_type>(&opt.renderer))
     {
@@ -278,6 +345,7 @@ context* create_context(const options& opt)
     ctx_opt.max_timestamps = 128;
     ctx_opt.enable_vulkan_validation = opt.validation;
     ctx_opt.fake_device_multiplier = opt.fake_devices;
+    ctx_opt.pipeline_cache_path = cache_path;
 
     if(opt.renderer == options::DSHGI_SERVER)
     {
@@ -298,6 +366,8 @@ context* create_context(const options& opt)
             opt.headful ? 1 : opt.camera_grid.w * opt.camera_grid.h;
         hd_opt.single_frame = !opt.animation_flag && !opt.frames;
         hd_opt.first_frame_index = opt.skip_frames;
+        hd_opt.save_thread_count = opt.save_threads;
+        hd_opt.max_queued_saves = opt.max_queued_saves;
         hd_opt.skip_nan_check =
             (std::holds_alternative<feature_stage::feature>(opt.renderer) &&
              isnan(opt.default_value)) ||
@@ -338,6 +408,8 @@ context* create_context(const options& opt)
         (context::options&)fs_opt = ctx_opt;
         fs_opt.size = uvec2(opt.width, opt.height);
         fs_opt.port_number = opt.port;
+        fs_opt.queue_capacity = opt.stream_queue_length;
+        fs_opt.policy = opt.stream_drop_policy;
         return new frame_server(fs_opt);
     }
     else
@@ -352,7 +424,7 @@ context* create_context(const options& opt)
     }
 }
 
-renderer* create_renderer(context& ctx, options& opt, scene& s)
+renderer* create_renderer_instance(context& ctx, options& opt, scene& s)
 {
     tonemap_stage::options tonemap;
     tonemap.tonemap_operator = opt.tonemap;
@@ -383,6 +455,12 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
     scene_options.gather_emissive_triangles = has_tri_lights && opt.sample_emissive_triangles > 0;
     scene_options.pre_transform_vertices = opt.pre_transform_vertices;
     scene_options.group_strategy = opt.as_strategy;
+    scene_options.blas_build_budget = opt.blas_build_budget;
+    scene_options.blas_refit_limit = opt.blas_refit_limit;
+    scene_options.blas_rebuild_growth = opt.blas_rebuild_growth;
+    scene_options.blas_rebuilds_per_frame = opt.blas_rebuilds_per_frame;
+    scene_options.tri_light_selection = opt.tri_light_selection;
+    scene_options.update_thread_count = opt.update_threads;
 
     taa_stage::options taa;
     taa.alpha = 1.0f/opt.taa.sequence_length;
@@ -428,6 +506,8 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
     sh.mis_mode = opt.multiple_importance_sampling;
     sh.russian_roulette_delta = opt.russian_roulette;
     sh.temporal_ratio = opt.dshgi_temporal_ratio;
+    sh.ray_budget = opt.dshgi_ray_budget;
+    sh.convergence_threshold = opt.dshgi_convergence_threshold;
     sh.indirect_clamping = opt.indirect_clamping;
     sh.regularization_gamma = opt.regularization;
     sh.sampling_weights = sampling_weights;
@@ -579,6 +659,8 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
                 rr_opt.filter = sm_filter;
                 rr_opt.z_pre_pass = opt.use_z_pre_pass;
                 rr_opt.scene_options = scene_options;
+                rr_opt.scene_options.indirect_draw = opt.indirect_draw;
+                rr_opt.scene_options.light_clustering = opt.light_clustering;
                 return new raster_renderer(ctx, rr_opt);
             }
         case options::DSHGI:
@@ -596,6 +678,8 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
                 dr_opt.z_pre_pass = opt.use_z_pre_pass;
                 dr_opt.scene_options = scene_options;
                 dr_opt.scene_options.alloc_sh_grids = true;
+                dr_opt.scene_options.indirect_draw = opt.indirect_draw;
+                dr_opt.scene_options.light_clustering = opt.light_clustering;
                 return new dshgi_renderer(ctx, dr_opt);
             }
         case options::DSHGI_SERVER:
@@ -603,6 +687,11 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
                 dshgi_server::options dr_opt;
                 dr_opt.sh = sh;
                 dr_opt.port_number = opt.port;
+                dr_opt.codec = opt.dshgi_codec;
+                dr_opt.delta_threshold = opt.dshgi_delta_threshold;
+                dr_opt.keyframe_interval = opt.dshgi_keyframe_interval;
+                dr_opt.transport.type = opt.dshgi_transport;
+                dr_opt.transport.multicast_group = opt.dshgi_multicast_group;
                 return new dshgi_server(ctx, dr_opt);
             }
         case options::DSHGI_CLIENT:
@@ -610,6 +699,8 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
                 dshgi_renderer::options dr_opt;
                 dshgi_client::options client;
                 client.server_address = opt.connect;
+                client.transport.type = opt.dshgi_transport;
+                client.transport.multicast_group = opt.dshgi_multicast_group;
                 dr_opt.sh_source = client;
                 dr_opt.sh_order = opt.sh_order;
                 dr_opt.use_probe_visibility = opt.use_probe_visibility;
@@ -622,6 +713,8 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
                 dr_opt.z_pre_pass = opt.use_z_pre_pass;
                 dr_opt.scene_options = scene_options;
                 dr_opt.scene_options.alloc_sh_grids = true;
+                dr_opt.scene_options.indirect_draw = opt.indirect_draw;
+                dr_opt.scene_options.light_clustering = opt.light_clustering;
                 return new dshgi_renderer(ctx, dr_opt);
             }
         case options::RESTIR:
@@ -652,6 +745,9 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
                 re_opt.restir_options.assume_unchanged_temporal_visibility = opt.restir.assume_unchanged_temporal_visibility;
                 re_opt.restir_options.shade_all_explicit_lights = *rtype == options::RESTIR_HYBRID;
                 re_opt.restir_options.shade_fake_indirect = *rtype == options::RESTIR_HYBRID && has_sh_grids;
+                // Only hybrid shading loops over the point lights.
+                re_opt.scene_options.light_clustering =
+                    opt.light_clustering && *rtype == options::RESTIR_HYBRID;
 
                 if(opt.taa.sequence_length > 1)
                     re_opt.taa_options = taa;
@@ -677,6 +773,45 @@ renderer* create_renderer(context& ctx, options& opt, scene& s)
     return nullptr;
 }
 
+// Most shaders and pipelines are compiled while the renderer is being created,
+// so this is where the difference between cold and warm caches shows up.
+renderer* create_renderer(context& ctx, options& opt, scene& s)
+{
+    using namespace std::chrono;
+    auto count_pipeline_cache = [&](size_t& hits, size_t& misses){
+        hits = misses = 0;
+        for(device& dev: ctx.get_devices())
+        {
+            hits += dev.pp_cache_hits;
+            misses += dev.pp_cache_misses;
+        }
+    };
+    shader_source::cache_stats before = shader_source::get_cache_stats();
+    size_t hits_before, misses_before;
+    count_pipeline_cache(hits_before, misses_before);
+    steady_clock::time_point start = steady_clock::now();
+
+    renderer* rr = create_renderer_instance(ctx, opt, s);
+
+    shader_source::cache_stats after = shader_source::get_cache_stats();
+    size_t hits_after, misses_after;
+    count_pipeline_cache(hits_after, misses_after);
+    auto ms = [](steady_clock::duration d){
+        return duration_cast<duration<double, std::milli>>(d).count();
+    };
+    TR_LOG(
+        "Renderer created in ", ms(steady_clock::now() - start), " ms. Shaders: ",
+        after.compiled - before.compiled, " compiled (",
+        ms(after.compile_time - before.compile_time), " ms), ",
+        after.disk_hits - before.disk_hits, " loaded from disk cache (",
+        ms(after.disk_load_time - before.disk_load_time), " ms), ",
+        after.memory_hits - before.memory_hits, " reused from memory. "
+        "Pipeline cache: ", hits_after - hits_before, " hits, ",
+        misses_after - misses_before, " misses"
+    );
+    return rr;
+}
+
 std::vector<entity> generate_cameras(entity cam_id, scene& s, options& opt, bool enable_by_default)
 {
     if(
@@ -978,7 +1113,10 @@ void interactive_viewer(context& ctx, scene_data& sd, options& opt)
             if(rr) rr->reset_accumulation(false);
         }
 
-        update(s, paused || !opt.animation_flag ? 0 : delta * 1000000);
+        update(
+            s, paused || !opt.animation_flag ? 0 : delta * 1000000, false,
+            sd.update_pool.get()
+        );
 
         try
         {
@@ -1077,7 +1215,7 @@ void replay_viewer(context& ctx, scene_data& sd, options& opt)
             {
                 if(!opt.skip_render)
                 {
-                    update(s, 0, true);
+                    update(s, 0, true, sd.update_pool.get());
                     rr->render();
                     lb.update(*rr);
                 }
@@ -1090,7 +1228,7 @@ void replay_viewer(context& ctx, scene_data& sd, options& opt)
 
         // First frame should not update time.
         time_ticks dt = i == 0 ? 0 : update_dt;
-        update(s, dt, true);
+        update(s, dt, true, sd.update_pool.get());
         for(camera_log& clog: camera_logs)
             clog.frame(dt);
 
@@ -1147,7 +1285,7 @@ void headless_server(context& ctx, scene_data& sd, options& opt)
         if(ctx.init_frame())
             break;
 
-        update(s, delta * 1000000, true);
+        update(s, delta * 1000000, true, sd.update_pool.get());
 
         rr->reset_accumulation();
 
@@ -5,6 +5,7 @@
 #include "scene.hh"
 #include "scene_assets.hh"
 #include "log.hh"
+#include "thread_pool.hh"
 #include <memory>
 #include <vector>
 
@@ -14,6 +15,8 @@ namespace tr
     {
         std::vector<scene_assets> assets;
         std::unique_ptr<scene> s;
+        // Samples animations in update().
+        std::unique_ptr<thread_pool> update_pool;
     };
 
     scene_data load_scenes(context& ctx, const options& opt);
@@ -1,6 +1,7 @@
 #include "texture.hh"
 #include "stb_image.h"
 #include "misc.hh"
+#include "upload_batcher.hh"
 #include <filesystem>
 #include "tinyexr.h"
 namespace fs = std::filesystem;
@@ -177,10 +178,13 @@ bool texture_view_params::operator==(const texture_view_params& other) const
         type == other.type;
 }
 
-texture::texture(device_mask dev, const std::string& path)
-: opaque(false), buffers(dev)
+texture::texture(
+    device_mask dev,
+    const std::string& path,
+    upload_batcher* batcher
+): opaque(false), buffers(dev)
 {
-    load_from_file(path);
+    load_from_file(path, batcher);
 }
 
 texture::texture(
@@ -193,12 +197,13 @@ texture::texture(
     vk::ImageTiling tiling,
     vk::ImageUsageFlags usage,
     vk::ImageLayout layout,
-    vk::SampleCountFlagBits msaa
+    vk::SampleCountFlagBits msaa,
+    upload_batcher* batcher
 ):  dim(size, 1), array_layers(array_layers),
     fmt(fmt), type(vk::ImageType::e2D), tiling(tiling), usage(usage),
     layout(layout), msaa(msaa), opaque(false), buffers(dev)
 {
-    create(data_size, data);
+    create(data_size, data, batcher);
 }
 
 texture::texture(
@@ -402,7 +407,7 @@ void texture::resize(uvec2 size)
     create(0, nullptr);
 }
 
-void texture::load_from_file(const std::string& path)
+void texture::load_from_file(const std::string& path, upload_batcher* batcher)
 {
     array_layers = 1;
     fs::path fp(path);
@@ -450,7 +455,7 @@ void texture::load_from_file(const std::string& path)
     }
     else
     {
-        stbi_set_flip_vertically_on_load(false);
+        stbi_set_flip_vertically_on_load_thread(false);
         bool hdr = stbi_is_hdr(path.c_str());
         int n = 0, w = 0, h = 0;
 
@@ -523,10 +528,10 @@ void texture::load_from_file(const std::string& path)
         layout = vk::ImageLayout::eShaderReadOnlyOptimal;
     }
 
-    create(pixel_data.size(), pixel_data.data());
+    create(pixel_data.size(), pixel_data.data(), batcher);
 }
 
-void texture::create(size_t data_size, void* data)
+void texture::create(size_t data_size, void* data, upload_batcher* batcher)
 {
     mip_levels = data ? calculate_mipmap_count(uvec2(dim.x, dim.y)) : 1;
     vk::ImageCreateInfo img_info{
@@ -544,13 +549,22 @@ void texture::create(size_t data_size, void* data)
 
     for(auto[dev, buf]: buffers)
     {
-        buf.img = sync_create_gpu_image(
-            dev,
-            img_info,
-            layout,
-            data_size,
-            data
-        );
+        if(batcher)
+        {
+            buf.img = batcher->create_gpu_image(
+                dev, img_info, layout, data_size, data
+            );
+        }
+        else
+        {
+            buf.img = sync_create_gpu_image(
+                dev,
+                img_info,
+                layout,
+                data_size,
+                data
+            );
+        }
     }
 }
 
@@ -6,6 +6,7 @@
 namespace tr
 {
 class texture;
+class upload_batcher;
 
 struct texture_view_params
 {
@@ -34,7 +35,13 @@ namespace tr
 class texture
 {
 public:
-    texture(device_mask dev, const std::string& path);
+    // If a batcher is given, the upload is recorded into it and the texture
+    // must not be used before the batcher's next flush has completed.
+    texture(
+        device_mask dev,
+        const std::string& path,
+        upload_batcher* batcher = nullptr
+    );
     // If no data is given, it is assumed that the texture will be a render
     // target!
     texture(
@@ -47,7 +54,8 @@ public:
         vk::ImageTiling tiling = vk::ImageTiling::eOptimal,
         vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eSampled,
         vk::ImageLayout layout = vk::ImageLayout::eGeneral,
-        vk::SampleCountFlagBits msaa = vk::SampleCountFlagBits::e1
+        vk::SampleCountFlagBits msaa = vk::SampleCountFlagBits::e1,
+        upload_batcher* batcher = nullptr
     );
     texture(
         device_mask dev,
@@ -90,8 +98,8 @@ protected:
 
 private:
     // Also creates mip chain.
-    void load_from_file(const std::string& path);
-    void create(size_t data_size, void* data);
+    void load_from_file(const std::string& path, upload_batcher* batcher);
+    void create(size_t data_size, void* data, upload_batcher* batcher = nullptr);
     vk::ImageView get_mipmap_view(device_id id, texture_view_params params) const;
 
     uvec3 dim;
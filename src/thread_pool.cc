@@ -0,0 +1,124 @@
+#include "thread_pool.hh"
+
+namespace tr
+{
+
+thread_pool::thread_pool(size_t thread_count, size_t max_queued_jobs)
+: max_queued_jobs(max_queued_jobs)
+{
+    if(thread_count == 0)
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+
+    for(size_t i = 0; i < thread_count; ++i)
+        workers.emplace_back(&thread_pool::worker, this, i);
+}
+
+thread_pool::~thread_pool()
+{
+    {
+        std::unique_lock<std::mutex> lk(queue_mutex);
+        quit = true;
+    }
+    job_cv.notify_all();
+    room_cv.notify_all();
+    for(std::thread& t: workers)
+        t.join();
+}
+
+size_t thread_pool::get_thread_count() const
+{
+    return workers.size();
+}
+
+void thread_pool::push(std::function<void(size_t worker_index)>&& job)
+{
+    rethrow_pending();
+    enqueue(std::move(job), true);
+}
+
+void thread_pool::wait()
+{
+    {
+        std::unique_lock<std::mutex> lk(queue_mutex);
+        idle_cv.wait(lk, [&](){
+            return queue.empty() && busy_workers == 0;
+        });
+    }
+    rethrow_pending();
+}
+
+thread_pool::stats thread_pool::get_stats() const
+{
+    std::unique_lock<std::mutex> lk(queue_mutex);
+    return counters;
+}
+
+void thread_pool::worker(size_t worker_index)
+{
+    std::unique_lock<std::mutex> lk(queue_mutex);
+    for(;;)
+    {
+        job_cv.wait(lk, [&](){ return quit || !queue.empty(); });
+        if(queue.empty()) break;
+
+        std::function<void(size_t)> job = std::move(queue.front());
+        queue.pop_front();
+        busy_workers++;
+        lk.unlock();
+        room_cv.notify_one();
+
+        try
+        {
+            job(worker_index);
+        }
+        catch(...)
+        {
+            lk.lock();
+            if(!pending_exception)
+                pending_exception = std::current_exception();
+            lk.unlock();
+        }
+        // Make sure captured resources are released before anyone waiting on
+        // the pool is woken up.
+        job = {};
+
+        lk.lock();
+        busy_workers--;
+        counters.finished_jobs++;
+        if(queue.empty() && busy_workers == 0)
+            idle_cv.notify_all();
+    }
+}
+
+void thread_pool::enqueue(std::function<void(size_t)>&& job, bool bounded)
+{
+    std::unique_lock<std::mutex> lk(queue_mutex);
+    if(bounded && max_queued_jobs != 0 && queue.size() >= max_queued_jobs)
+    {
+        auto start = std::chrono::steady_clock::now();
+        room_cv.wait(lk, [&](){
+            return quit || queue.size() < max_queued_jobs;
+        });
+        counters.blocked_pushes++;
+        counters.blocked_time += std::chrono::steady_clock::now() - start;
+    }
+    queue.emplace_back(std::move(job));
+    counters.pushed_jobs++;
+    counters.max_queue_length = std::max(
+        counters.max_queue_length, queue.size()
+    );
+    lk.unlock();
+    job_cv.notify_one();
+}
+
+void thread_pool::rethrow_pending()
+{
+    std::exception_ptr e;
+    {
+        std::unique_lock<std::mutex> lk(queue_mutex);
+        std::swap(e, pending_exception);
+    }
+    if(e) std::rethrow_exception(e);
+}
+
+}
@@ -0,0 +1,164 @@
+#ifndef TAURAY_THREAD_POOL_HH
+#define TAURAY_THREAD_POOL_HH
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <exception>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+
+namespace tr
+{
+
+// A fixed-size pool of worker threads with an optionally bounded job queue.
+// When the queue is bounded, push() blocks the calling thread until there is
+// room; the time spent blocked is recorded in the stats so that callers can
+// tell when the workers cannot keep up.
+class thread_pool
+{
+public:
+    // thread_count = 0 uses std::thread::hardware_concurrency().
+    // max_queued_jobs = 0 means that the queue is unbounded.
+    thread_pool(size_t thread_count = 0, size_t max_queued_jobs = 0);
+    thread_pool(const thread_pool& other) = delete;
+    thread_pool(thread_pool&& other) = delete;
+    ~thread_pool();
+
+    size_t get_thread_count() const;
+
+    // The job is given the index of the worker running it, which is in the
+    // range [0, get_thread_count()). This can be used to index per-worker
+    // scratch data without locking. If a job throws, the exception is stored
+    // and rethrown from the next push() or wait() on the calling thread.
+    void push(std::function<void(size_t worker_index)>&& job);
+
+    // Like push(), but returns a future for the result instead. Exceptions
+    // thrown by the job are delivered through the future.
+    template<typename F>
+    auto submit(F&& f) -> std::future<decltype(f())>;
+
+    // Runs f(begin, end) over [0, count) in chunks of chunk_size. The calling
+    // thread participates and this returns only once all chunks are done, so
+    // it is safe to call from within a job as well.
+    template<typename F>
+    void parallel_for(size_t count, size_t chunk_size, F&& f);
+
+    // Blocks until the queue is empty and all workers are idle.
+    void wait();
+
+    struct stats
+    {
+        size_t pushed_jobs = 0;
+        size_t finished_jobs = 0;
+        // Number of push() calls that had to wait for room in the queue.
+        size_t blocked_pushes = 0;
+        std::chrono::steady_clock::duration blocked_time =
+            std::chrono::steady_clock::duration::zero();
+        size_t max_queue_length = 0;
+    };
+    stats get_stats() const;
+
+private:
+    void worker(size_t worker_index);
+    void enqueue(std::function<void(size_t)>&& job, bool bounded);
+    void rethrow_pending();
+
+    size_t max_queued_jobs;
+    std::vector<std::thread> workers;
+
+    mutable std::mutex queue_mutex;
+    std::condition_variable job_cv;
+    std::condition_variable room_cv;
+    std::condition_variable idle_cv;
+    std::deque<std::function<void(size_t)>> queue;
+    size_t busy_workers = 0;
+    bool quit = false;
+    std::exception_ptr pending_exception;
+    stats counters;
+};
+
+template<typename F>
+auto thread_pool::submit(F&& f) -> std::future<decltype(f())>
+{
+    using result_type = decltype(f());
+    auto task = std::make_shared<std::packaged_task<result_type()>>(
+        std::forward<F>(f)
+    );
+    std::future<result_type> res = task->get_future();
+    push([task](size_t){ (*task)(); });
+    return res;
+}
+
+template<typename F>
+void thread_pool::parallel_for(size_t count, size_t chunk_size, F&& f)
+{
+    if(count == 0) return;
+    if(chunk_size == 0) chunk_size = 1;
+    size_t chunk_count = (count + chunk_size - 1) / chunk_size;
+    if(chunk_count == 1 || workers.size() == 0)
+    {
+        f(size_t(0), count);
+        return;
+    }
+
+    struct shared_state
+    {
+        std::atomic<size_t> next_chunk = 0;
+        std::atomic<size_t> done_chunks = 0;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::exception_ptr exception;
+    };
+    auto state = std::make_shared<shared_state>();
+
+    // Helpers only borrow 'f', which outlives them because this function
+    // does not return before every chunk has been completed.
+    auto run_chunks = [state, count, chunk_size, chunk_count, &f](){
+        for(;;)
+        {
+            size_t chunk = state->next_chunk.fetch_add(1);
+            if(chunk >= chunk_count) break;
+            size_t begin = chunk * chunk_size;
+            size_t end = std::min(begin + chunk_size, count);
+            try
+            {
+                f(begin, end);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lk(state->mutex);
+                if(!state->exception)
+                    state->exception = std::current_exception();
+            }
+            if(state->done_chunks.fetch_add(1) + 1 == chunk_count)
+            {
+                std::lock_guard<std::mutex> lk(state->mutex);
+                state->cv.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min(workers.size(), chunk_count - 1);
+    // The helpers skip the queue bound, since blocking here from within a job
+    // could deadlock the pool.
+    for(size_t i = 0; i < helpers; ++i)
+        enqueue([run_chunks](size_t){ run_chunks(); }, false);
+
+    run_chunks();
+
+    std::unique_lock<std::mutex> lk(state->mutex);
+    state->cv.wait(lk, [&](){
+        return state->done_chunks.load() == chunk_count;
+    });
+    if(state->exception) std::rethrow_exception(state->exception);
+}
+
+}
+
+#endif
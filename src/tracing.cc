@@ -69,7 +69,7 @@ void tracing_record::begin_frame()
     if(times.size() != 0 && times.front().frame_number + 1 < device_finished_frame_counter)
         times.pop_front();
 
-    times.push_back({frame_counter, {}, {}});
+    times.push_back({frame_counter, {}, {}, {}});
     frame_counter++;
 }
 
@@ -199,6 +199,12 @@ float tracing_record::get_duration(size_t device_index, const std::string& name)
     return total_time;
 }
 
+void tracing_record::set_counter(const std::string& name, double value)
+{
+    if(max_timestamps == 0 || times.size() == 0) return;
+    times.back().counters[name] = value;
+}
+
 void tracing_record::print_last_trace(trace_format format)
 {
     const timing_result* res = find_latest_finished_frame();
@@ -276,6 +282,13 @@ void tracing_record::print_simple_trace(const timing_result& res)
     {
         TR_TIME("\t\t[", t.name, "] ", t.duration_ns/1e6, " ms");
     }
+
+    if(res.counters.size() != 0)
+    {
+        TR_TIME("\tCOUNTERS:");
+        for(const auto& [name, value]: res.counters)
+            TR_TIME("\t\t[", name, "] ", value);
+    }
 }
 
 void tracing_record::print_tef_trace(const timing_result& res)
@@ -299,6 +312,19 @@ void tracing_record::print_tef_trace(const timing_result& res)
         };
         TR_TIME(output.dump(-1, '\t'), ",");
     }
+    double frame_start_ns = res.host_traces.size() == 0 ?
+        0.0 : res.host_traces.front().start_ns;
+    for(const auto& [name, value]: res.counters)
+    {
+        nlohmann::json output = {
+            {"pid", "CPU"},
+            {"ts",int64_t(frame_start_ns*1e-3)},
+            {"ph", "C"},
+            {"name", name},
+            {"args", {{"value", value}}}
+        };
+        TR_TIME(output.dump(-1, '\t'), ",");
+    }
     const auto& devices = ctx->get_devices();
     for(size_t i = 0; i < res.device_traces.size(); ++i)
     {
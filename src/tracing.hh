@@ -42,6 +42,9 @@ public:
     vk::QueryPool get_timestamp_pool(size_t device_index, uint32_t frame_index);
 
     float get_duration(size_t device_index, const std::string& name) const;
+    // Counters belong to the frame currently being recorded, and are printed
+    // along with its timings.
+    void set_counter(const std::string& name, double value);
     void print_last_trace(trace_format format = SIMPLE);
 
 private:
@@ -50,6 +53,7 @@ private:
         uint32_t frame_number = 0;
         std::vector<trace_event> host_traces;
         std::vector<std::vector<trace_event>> device_traces;
+        std::map<std::string, double> counters;
     };
 
     void finish_host_frame();
@@ -0,0 +1,362 @@
+#include "transform_hierarchy.hh"
+#include <cassert>
+
+namespace
+{
+using namespace tr;
+
+template<typename T>
+void permute(std::vector<T>& data, const std::vector<uint32_t>& order)
+{
+    std::vector<T> res;
+    res.reserve(order.size());
+    for(uint32_t slot: order)
+        res.push_back(data[slot]);
+    data = std::move(res);
+}
+
+}
+
+namespace tr
+{
+
+transform_hierarchy& transform_hierarchy::get()
+{
+    static transform_hierarchy hierarchy;
+    return hierarchy;
+}
+
+transform_hierarchy::node_id transform_hierarchy::create(transformable* owner)
+{
+    node_id id;
+    uint32_t slot = allocate(id);
+    positions[slot] = vec3(0);
+    orientations[slot] = quat(1,0,0,0);
+    scalings[slot] = vec3(1);
+    parents[slot] = NONE;
+    parent_slots[slot] = NONE;
+    revisions[slot] = 1;
+    cached_revisions[slot] = 0;
+    cached_parent_revisions[slot] = 0;
+    static_locked[slot] = false;
+    global_transforms[slot] = mat4(1);
+    global_inverse_transpose_transforms[slot] = mat4(1);
+    owners[slot] = owner;
+    return id;
+}
+
+transform_hierarchy::node_id transform_hierarchy::clone(
+    node_id other,
+    transformable* owner
+){
+    node_id id = create(owner);
+    copy(other, id);
+    return id;
+}
+
+void transform_hierarchy::copy(node_id src, node_id dst)
+{
+    uint32_t from = slots[src];
+    uint32_t to = slots[dst];
+    positions[to] = positions[from];
+    orientations[to] = orientations[from];
+    scalings[to] = scalings[from];
+    revisions[to] = revisions[from];
+    cached_revisions[to] = cached_revisions[from];
+    cached_parent_revisions[to] = cached_parent_revisions[from];
+    static_locked[to] = static_locked[from];
+    global_transforms[to] = global_transforms[from];
+    global_inverse_transpose_transforms[to] =
+        global_inverse_transpose_transforms[from];
+    set_parent_slot(to, parents[from]);
+    // The children of 'dst' must notice the change even if the revisions
+    // happened to match.
+    ++revisions[to];
+    changed = true;
+}
+
+void transform_hierarchy::release(node_id id)
+{
+    uint32_t slot = slots[id];
+    set_parent_slot(slot, NONE);
+    while(first_children[id] != NONE)
+    {
+        uint32_t child_slot = slots[first_children[id]];
+        set_parent_slot(child_slot, NONE);
+        ++revisions[child_slot];
+        changed = true;
+    }
+    ids[slot] = NONE;
+    owners[slot] = nullptr;
+    released_ids.push_back(id);
+    // Free slots are just skipped until there are enough of them to be
+    // worth compacting. This keeps short-lived temporaries cheap.
+    if(released_ids.size() > max(size_t(64), ids.size()/4))
+    {
+        order_outdated = true;
+        changed = true;
+    }
+}
+
+void transform_hierarchy::set_owner(node_id id, transformable* owner)
+{
+    owners[slots[id]] = owner;
+}
+
+transformable* transform_hierarchy::get_owner(node_id id) const
+{
+    return id == NONE ? nullptr : owners[slots[id]];
+}
+
+void transform_hierarchy::touch(node_id id)
+{
+    uint32_t slot = slots[id];
+    assert(!static_locked[slot]);
+    ++revisions[slot];
+    // Only written when needed, so that threads changing different nodes
+    // don't fight over the cache line.
+    if(!changed.load(std::memory_order_relaxed))
+        changed.store(true, std::memory_order_relaxed);
+}
+
+void transform_hierarchy::set_parent(node_id id, node_id parent)
+{
+    set_parent_slot(slots[id], parent);
+    touch(id);
+    // Setting cached_parent_revision is unnecessary, since the changed revision
+    // should already force cache invalidation.
+}
+
+transform_hierarchy::node_id transform_hierarchy::get_parent(node_id id) const
+{
+    return parents[slots[id]];
+}
+
+void transform_hierarchy::set_static(node_id id, bool s)
+{
+    uint32_t slot = slots[id];
+    if(!static_locked[slot])
+        update_node(slot);
+    static_locked[slot] = s;
+}
+
+bool transform_hierarchy::is_static(node_id id) const
+{
+    return static_locked[slots[id]];
+}
+
+const mat4& transform_hierarchy::get_global_transform(node_id id)
+{
+    uint32_t slot = slots[id];
+    if(changed.load(std::memory_order_relaxed)) update_node(slot);
+    return global_transforms[slot];
+}
+
+const mat4& transform_hierarchy::get_global_inverse_transpose_transform(
+    node_id id
+){
+    uint32_t slot = slots[id];
+    if(changed.load(std::memory_order_relaxed)) update_node(slot);
+    return global_inverse_transpose_transforms[slot];
+}
+
+void transform_hierarchy::update()
+{
+    if(!changed) return;
+    if(order_outdated) reorder();
+
+    // Parents come first, so their global transforms and revisions are
+    // already final when their children are reached.
+    for(uint32_t slot = 0; slot < ids.size(); ++slot)
+    {
+        if(ids[slot] == NONE || static_locked[slot])
+            continue;
+
+        uint32_t parent_slot = parent_slots[slot];
+        if(
+            cached_revisions[slot] != revisions[slot] ||
+            (parent_slot != NONE &&
+                cached_parent_revisions[slot] != revisions[parent_slot])
+        ) recompute(slot, parent_slot);
+    }
+    changed = false;
+}
+
+size_t transform_hierarchy::get_node_count() const
+{
+    return slots.size() - free_ids.size() - released_ids.size();
+}
+
+mat4 transform_hierarchy::compose(vec3 position, quat orientation, vec3 scaling)
+{
+    mat4 rot = glm::toMat4(orientation);
+    return mat4(
+        rot[0]*scaling.x,
+        rot[1]*scaling.y,
+        rot[2]*scaling.z,
+        vec4(position, 1)
+    );
+}
+
+uint16_t transform_hierarchy::update_node(uint32_t slot)
+{
+    if(static_locked[slot]) return revisions[slot];
+
+    node_id parent = parents[slot];
+    if(parent != NONE)
+    {
+        uint32_t parent_slot = slots[parent];
+        uint16_t parent_revision = update_node(parent_slot);
+        if(
+            cached_revisions[slot] != revisions[slot] ||
+            cached_parent_revisions[slot] != parent_revision
+        ) recompute(slot, parent_slot);
+    }
+    else if(cached_revisions[slot] != revisions[slot])
+        recompute(slot, NONE);
+    return revisions[slot];
+}
+
+void transform_hierarchy::recompute(uint32_t slot, uint32_t parent_slot)
+{
+    mat4 transform = compose(positions[slot], orientations[slot], scalings[slot]);
+    if(parent_slot != NONE)
+    {
+        transform = global_transforms[parent_slot] * transform;
+        cached_parent_revisions[slot] = revisions[parent_slot];
+    }
+    global_transforms[slot] = transform;
+    global_inverse_transpose_transforms[slot] = transpose(affineInverse(transform));
+    // Local revision must change if parent transform has changed. This
+    // ensures that further children update properly.
+    cached_revisions[slot] = ++revisions[slot];
+}
+
+uint32_t transform_hierarchy::allocate(node_id& id)
+{
+    uint32_t slot = ids.size();
+    if(free_ids.size() != 0)
+    {
+        id = free_ids.back();
+        free_ids.pop_back();
+        slots[id] = slot;
+    }
+    else
+    {
+        id = slots.size();
+        slots.push_back(slot);
+        first_children.push_back(NONE);
+        next_siblings.push_back(NONE);
+        prev_siblings.push_back(NONE);
+    }
+
+    // New nodes go last, so they can only come before their parents once
+    // set_parent() is called.
+    positions.emplace_back();
+    orientations.emplace_back();
+    scalings.emplace_back();
+    parents.push_back(NONE);
+    parent_slots.push_back(NONE);
+    revisions.push_back(0);
+    cached_revisions.push_back(0);
+    cached_parent_revisions.push_back(0);
+    static_locked.push_back(false);
+    global_transforms.emplace_back();
+    global_inverse_transpose_transforms.emplace_back();
+    owners.push_back(nullptr);
+    ids.push_back(id);
+    changed = true;
+    return slot;
+}
+
+void transform_hierarchy::set_parent_slot(uint32_t slot, node_id parent)
+{
+    node_id id = ids[slot];
+    node_id old_parent = parents[slot];
+    if(old_parent != NONE)
+    {
+        node_id prev = prev_siblings[id];
+        node_id next = next_siblings[id];
+        if(prev != NONE) next_siblings[prev] = next;
+        else first_children[old_parent] = next;
+        if(next != NONE) prev_siblings[next] = prev;
+        prev_siblings[id] = NONE;
+        next_siblings[id] = NONE;
+    }
+
+    parents[slot] = parent;
+    parent_slots[slot] = parent == NONE ? NONE : slots[parent];
+    if(parent != NONE)
+    {
+        node_id next = first_children[parent];
+        next_siblings[id] = next;
+        if(next != NONE) prev_siblings[next] = id;
+        first_children[parent] = id;
+        if(parent_slots[slot] > slot)
+            order_outdated = true;
+    }
+}
+
+void transform_hierarchy::reorder()
+{
+    // Find the depth of each node. Parents may still come after their
+    // children here, so each unknown chain of parents is walked once.
+    size_t slot_count = ids.size();
+    constexpr uint32_t UNKNOWN = UINT32_MAX;
+    std::vector<uint32_t> depths(slot_count, UNKNOWN);
+    std::vector<uint32_t> chain;
+    uint32_t max_depth = 0;
+    for(uint32_t slot = 0; slot < slot_count; ++slot)
+    {
+        if(ids[slot] == NONE) continue;
+
+        uint32_t cur = slot;
+        while(depths[cur] == UNKNOWN)
+        {
+            chain.push_back(cur);
+            if(parents[cur] == NONE) break;
+            cur = slots[parents[cur]];
+        }
+        uint32_t depth = depths[cur] == UNKNOWN ? 0 : depths[cur] + 1;
+        for(auto it = chain.rbegin(); it != chain.rend(); ++it, ++depth)
+            depths[*it] = depth;
+        chain.clear();
+        max_depth = max(max_depth, depths[slot]);
+    }
+
+    // Counting sort by depth, which also drops free slots. Nodes of the same
+    // depth keep their relative order.
+    std::vector<uint32_t> offsets(max_depth + 2, 0);
+    for(uint32_t slot = 0; slot < slot_count; ++slot)
+        if(ids[slot] != NONE) offsets[depths[slot] + 1]++;
+    for(size_t i = 1; i < offsets.size(); ++i)
+        offsets[i] += offsets[i-1];
+    std::vector<uint32_t> order(offsets.back());
+    for(uint32_t slot = 0; slot < slot_count; ++slot)
+        if(ids[slot] != NONE) order[offsets[depths[slot]]++] = slot;
+
+    permute(positions, order);
+    permute(orientations, order);
+    permute(scalings, order);
+    permute(parents, order);
+    permute(revisions, order);
+    permute(cached_revisions, order);
+    permute(cached_parent_revisions, order);
+    permute(static_locked, order);
+    permute(global_transforms, order);
+    permute(global_inverse_transpose_transforms, order);
+    permute(owners, order);
+    permute(ids, order);
+
+    for(uint32_t slot = 0; slot < ids.size(); ++slot)
+        slots[ids[slot]] = slot;
+    parent_slots.resize(ids.size());
+    for(uint32_t slot = 0; slot < ids.size(); ++slot)
+        parent_slots[slot] = parents[slot] == NONE ? NONE : slots[parents[slot]];
+
+    free_ids.insert(free_ids.end(), released_ids.begin(), released_ids.end());
+    released_ids.clear();
+    order_outdated = false;
+}
+
+}
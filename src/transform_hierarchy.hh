@@ -0,0 +1,112 @@
+#ifndef TAURAY_TRANSFORM_HIERARCHY_HH
+#define TAURAY_TRANSFORM_HIERARCHY_HH
+#include "math.hh"
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace tr
+{
+
+class transformable;
+
+// Stores the local transforms of all transformables in flat arrays, ordered
+// so that parents always come before their children. update() can then
+// compute every outdated global transform in a single linear pass, instead of
+// each get_global_transform() recursing through scattered parents.
+//
+// Nodes are addressed by IDs that stay the same when the arrays are reordered.
+// Global transforms are still computed on demand if something changes between
+// calls to update(), so results are always up to date; update() just makes the
+// following calls cheap. Those calls only read, so they can be made from
+// multiple threads until something changes again. Different nodes can also be
+// changed from multiple threads at once, but creating and releasing nodes must
+// happen on one thread while nothing else uses the hierarchy.
+class transform_hierarchy
+{
+public:
+    using node_id = uint32_t;
+    static constexpr node_id NONE = UINT32_MAX;
+
+    // The hierarchy shared by all transformables.
+    static transform_hierarchy& get();
+
+    node_id create(transformable* owner);
+    // New node with the same transform, parent and static state as 'other'.
+    node_id clone(node_id other, transformable* owner);
+    // Copies the transform, parent and static state of 'src' to 'dst'.
+    void copy(node_id src, node_id dst);
+    // Any children of the released node become roots right away.
+    void release(node_id id);
+
+    void set_owner(node_id id, transformable* owner);
+    transformable* get_owner(node_id id) const;
+
+    // Changing these through the references requires calling touch() after.
+    vec3& position(node_id id) { return positions[slots[id]]; }
+    quat& orientation(node_id id) { return orientations[slots[id]]; }
+    vec3& scaling(node_id id) { return scalings[slots[id]]; }
+    void touch(node_id id);
+
+    void set_parent(node_id id, node_id parent);
+    node_id get_parent(node_id id) const;
+
+    void set_static(node_id id, bool s);
+    bool is_static(node_id id) const;
+
+    const mat4& get_global_transform(node_id id);
+    const mat4& get_global_inverse_transpose_transform(node_id id);
+
+    // Updates the global transforms of all nodes that have changed since the
+    // previous call. References returned by the functions above are no longer
+    // valid after this.
+    void update();
+
+    size_t get_node_count() const;
+
+    static mat4 compose(vec3 position, quat orientation, vec3 scaling);
+
+private:
+    uint16_t update_node(uint32_t slot);
+    void recompute(uint32_t slot, uint32_t parent_slot);
+    uint32_t allocate(node_id& id);
+    void reorder();
+    void set_parent_slot(uint32_t slot, node_id parent);
+
+    // Everything below is indexed by slot, except 'slots' which maps node IDs
+    // to their current slots. Free slots have an ID of NONE.
+    std::vector<vec3> positions;
+    std::vector<quat> orientations;
+    std::vector<vec3> scalings;
+    std::vector<node_id> parents;
+    std::vector<uint32_t> parent_slots;
+    std::vector<uint16_t> revisions;
+    std::vector<uint16_t> cached_revisions;
+    std::vector<uint16_t> cached_parent_revisions;
+    std::vector<uint8_t> static_locked;
+    std::vector<mat4> global_transforms;
+    std::vector<mat4> global_inverse_transpose_transforms;
+    std::vector<transformable*> owners;
+    std::vector<node_id> ids;
+
+    std::vector<uint32_t> slots;
+    // Children of each node as a doubly linked list, so that release() can
+    // detach them without searching. Indexed by node ID like 'slots'.
+    std::vector<node_id> first_children;
+    std::vector<node_id> next_siblings;
+    std::vector<node_id> prev_siblings;
+    std::vector<node_id> free_ids;
+    // Released IDs are only reused after reorder() has dropped their slots.
+    std::vector<node_id> released_ids;
+
+    // Set when a child may come before its parent, or when there are many
+    // free slots.
+    bool order_outdated = false;
+    // Set when anything has changed since the last update(). Atomic since
+    // animations set it from multiple threads.
+    std::atomic<bool> changed = false;
+};
+
+}
+
+#endif
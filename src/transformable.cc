@@ -1,6 +1,8 @@
 #include "transformable.hh"
 #include <cassert>
-#ifdef TR_TRANSFORM_CACHING
+#if defined(TR_TRANSFORM_HIERARCHY)
+#define REVISION transform_hierarchy::get().touch(node);
+#elif defined(TR_TRANSFORM_CACHING)
 #define REVISION ++revision; assert(!static_locked);
 #else
 #define REVISION assert(!static_locked);
@@ -9,6 +11,53 @@
 namespace tr
 {
 
+#ifdef TR_TRANSFORM_HIERARCHY
+transformable::transformable(transformable* parent)
+: node(transform_hierarchy::get().create(this))
+{
+    if(parent)
+        transform_hierarchy::get().set_parent(node, parent->node);
+}
+
+transformable::transformable(const transformable& other)
+: node(transform_hierarchy::get().clone(other.node, this))
+{
+}
+
+transformable::transformable(transformable&& other) noexcept
+: node(other.node)
+{
+    // The moved-from object stays usable, like it was before the hierarchy.
+    transform_hierarchy& h = transform_hierarchy::get();
+    h.set_owner(node, this);
+    other.node = h.create(&other);
+}
+
+transformable::~transformable()
+{
+    transform_hierarchy::get().release(node);
+}
+
+transformable& transformable::operator=(const transformable& other)
+{
+    if(this != &other)
+        transform_hierarchy::get().copy(other.node, node);
+    return *this;
+}
+
+transformable& transformable::operator=(transformable&& other) noexcept
+{
+    if(this != &other)
+    {
+        transform_hierarchy& h = transform_hierarchy::get();
+        h.release(node);
+        node = other.node;
+        h.set_owner(node, this);
+        other.node = h.create(&other);
+    }
+    return *this;
+}
+#else
 transformable::transformable(transformable* parent):
 #ifdef TR_TRANSFORM_CACHING
     cached_revision(0),
@@ -20,6 +69,7 @@ transformable::transformable(transformable* parent):
     parent(parent),
     orientation(1,0,0,0), position(0), scaling(1), static_locked(false)
 {}
+#endif
 
 transformable::transformable(vec3 pos, vec3 scale, vec3 direction, vec3 forward)
 : transformable(nullptr)
@@ -33,8 +83,8 @@ transformable::transformable(vec3 pos, vec3 scale, vec3 direction, vec3 forward)
 void transformable::rotate(float angle, vec3 axis, vec3 local_origin)
 {
     quat rotation = angleAxis(radians(angle), axis);
-    orientation = normalize(rotation * orientation);
-    position += local_origin + rotation * -local_origin;
+    local_orientation() = normalize(rotation * local_orientation());
+    local_position() += local_origin + rotation * -local_origin;
     REVISION;
 }
 
@@ -56,37 +106,37 @@ void transformable::rotate_local(
     vec3 axis,
     vec3 local_origin
 ){
-    axis = orientation * axis;
+    axis = local_orientation() * axis;
     rotate(angle, axis, local_origin);
 }
 
 void transformable::rotate(quat rotation)
 {
-    orientation = normalize(rotation * orientation);
+    local_orientation() = normalize(rotation * local_orientation());
     REVISION;
 }
 
 void transformable::set_orientation(float angle)
 {
-    orientation = angleAxis(radians(angle), vec3(0,0,1));
+    local_orientation() = angleAxis(radians(angle), vec3(0,0,1));
     REVISION;
 }
 
 void transformable::set_orientation(float angle, vec3 axis)
 {
-    orientation = angleAxis(radians(angle), normalize(axis));
+    local_orientation() = angleAxis(radians(angle), normalize(axis));
     REVISION;
 }
 
 void transformable::set_orientation(quat orientation)
 {
-    this->orientation = orientation;
+    local_orientation() = orientation;
     REVISION;
 }
 
 void transformable::set_orientation(float pitch, float yaw, float roll)
 {
-    this->orientation = quat(
+    local_orientation() = quat(
         vec3(
             radians(pitch),
             radians(yaw),
@@ -96,10 +146,10 @@ void transformable::set_orientation(float pitch, float yaw, float roll)
     REVISION;
 }
 
-quat transformable::get_orientation() const { return orientation; }
+quat transformable::get_orientation() const { return local_orientation(); }
 vec3 transformable::get_orientation_euler() const
 {
-    vec3 o = degrees(eulerAngles(normalize(dquat(orientation))));
+    vec3 o = degrees(eulerAngles(normalize(dquat(local_orientation()))));
     if(std::fabs(o.z) >= 90)
     {
         o.x += 180.f;
@@ -117,14 +167,14 @@ vec3 transformable::get_orientation_euler() const
 
 void transformable::translate(vec2 offset)
 {
-    this->position.x += offset.x;
-    this->position.y += offset.y;
+    local_position().x += offset.x;
+    local_position().y += offset.y;
     REVISION;
 }
 
 void transformable::translate(vec3 offset)
 {
-    this->position += offset;
+    local_position() += offset;
     REVISION;
 }
 
@@ -135,95 +185,111 @@ void transformable::translate_local(vec2 offset)
 
 void transformable::translate_local(vec3 offset)
 {
-    this->position += orientation * offset;
+    local_position() += local_orientation() * offset;
     REVISION;
 }
 
 void transformable::set_position(vec2 position)
 {
-    this->position.x = position.x;
-    this->position.y = position.y;
+    local_position().x = position.x;
+    local_position().y = position.y;
     REVISION;
 }
 
 void transformable::set_position(vec3 position)
 {
-    this->position = position;
+    local_position() = position;
     REVISION;
 }
 
 void transformable::set_depth(float depth)
 {
-    this->position.z = depth;
+    local_position().z = depth;
     REVISION;
 }
 
-vec3 transformable::get_position() const { return position; }
+vec3 transformable::get_position() const { return local_position(); }
 
 void transformable::scale(float scale)
 {
-    this->scaling *= scale;
+    local_scaling() *= scale;
     REVISION;
 }
 
 void transformable::scale(vec2 scale)
 {
-    this->scaling.x *= scale.x;
-    this->scaling.y *= scale.y;
+    local_scaling().x *= scale.x;
+    local_scaling().y *= scale.y;
     REVISION;
 }
 
 void transformable::scale(vec3 scale)
 {
-    this->scaling *= scale;
+    local_scaling() *= scale;
     REVISION;
 }
 
 void transformable::set_scaling(vec2 scaling)
 {
-    this->scaling.x = scaling.x;
-    this->scaling.y = scaling.y;
+    local_scaling().x = scaling.x;
+    local_scaling().y = scaling.y;
     REVISION;
 }
 
 void transformable::set_scaling(vec3 scaling)
 {
-    this->scaling = scaling;
+    local_scaling() = scaling;
     REVISION;
 }
-vec2 transformable::get_size() const { return scaling; }
-vec3 transformable::get_scaling() const { return scaling; }
+vec2 transformable::get_size() const { return local_scaling(); }
+vec3 transformable::get_scaling() const { return local_scaling(); }
 
 void transformable::set_transform(const mat4& transform)
 {
-    decompose_matrix(transform, position, scaling, orientation);
+    decompose_matrix(
+        transform, local_position(), local_scaling(), local_orientation()
+    );
+    REVISION;
+}
+
+void transformable::set_transform(vec3 position, quat orientation, vec3 scaling)
+{
+    local_position() = position;
+    local_orientation() = orientation;
+    local_scaling() = scaling;
     REVISION;
 }
 
 mat4 transformable::get_transform() const
 {
-    mat4 rot = glm::toMat4(orientation);
-    return mat4(
-        rot[0]*scaling.x,
-        rot[1]*scaling.y,
-        rot[2]*scaling.z,
-        vec4(position, 1)
+    return transform_hierarchy::compose(
+        local_position(), local_orientation(), local_scaling()
     );
 }
 
 void transformable::set_direction(vec3 direction, vec3 forward)
 {
-    orientation = glm::rotation(forward, direction);
+    local_orientation() = glm::rotation(forward, direction);
     REVISION;
 }
 
 vec3 transformable::get_direction(vec3 forward) const
 {
-    return orientation * forward;
+    return local_orientation() * forward;
 }
 
 
-#ifdef TR_TRANSFORM_CACHING
+#if defined(TR_TRANSFORM_HIERARCHY)
+const mat4& transformable::get_global_transform() const
+{
+    return transform_hierarchy::get().get_global_transform(node);
+}
+
+const mat4& transformable::get_global_inverse_transpose_transform() const
+{
+    return transform_hierarchy::get().get_global_inverse_transpose_transform(node);
+}
+#elif defined(TR_TRANSFORM_CACHING)
 const mat4& transformable::get_global_transform() const
 {
     update_cached_transform();
@@ -286,27 +352,27 @@ void transformable::set_global_orientation(vec3 euler_angles)
 
 void transformable::set_global_orientation(quat orientation)
 {
-    if(parent)
+    if(transformable* parent = get_parent())
         orientation = inverse(parent->get_global_orientation()) * orientation;
-    this->orientation = orientation;
+    local_orientation() = orientation;
     REVISION;
 }
 
 void transformable::set_global_position(vec3 pos)
 {
-    position = pos;
-    if(parent)
-        position = vec3(
+    if(transformable* parent = get_parent())
+        local_position() = vec3(
             affineInverse(parent->get_global_transform()) * vec4(pos, 1)
         );
-    else position = pos;
+    else local_position() = pos;
     REVISION;
 }
 
 void transformable::set_global_scaling(vec3 size)
 {
-    scaling = size;
-    if(parent) scaling /= parent->get_global_scaling();
+    local_scaling() = size;
+    if(transformable* parent = get_parent())
+        local_scaling() /= parent->get_global_scaling();
     REVISION;
 }
 
@@ -320,31 +386,52 @@ void transformable::set_parent(
         if(parent)
             transform =
                 affineInverse(parent->get_global_transform()) * transform;
-        decompose_matrix(transform, position, scaling, orientation);
+        decompose_matrix(
+            transform, local_position(), local_scaling(), local_orientation()
+        );
     }
+#ifdef TR_TRANSFORM_HIERARCHY
+    transform_hierarchy::get().set_parent(
+        node, parent ? parent->node : transform_hierarchy::NONE
+    );
+#else
     this->parent = parent;
     REVISION;
     // Setting cached_parent_revision is unnecessary, since the changed revision
     // should already force cache invalidation.
+#endif
 }
 
 transformable* transformable::get_parent() const
 {
+#ifdef TR_TRANSFORM_HIERARCHY
+    transform_hierarchy& h = transform_hierarchy::get();
+    return h.get_owner(h.get_parent(node));
+#else
     return parent;
+#endif
 }
 
 void transformable::set_static(bool s)
 {
+#if defined(TR_TRANSFORM_HIERARCHY)
+    transform_hierarchy::get().set_static(node, s);
+#else
 #ifdef TR_TRANSFORM_CACHING
     if(!this->static_locked)
         update_cached_transform();
 #endif
     this->static_locked = s;
+#endif
 }
 
 bool transformable::is_static() const
 {
+#ifdef TR_TRANSFORM_HIERARCHY
+    return transform_hierarchy::get().is_static(node);
+#else
     return static_locked;
+#endif
 }
 
 void transformable::lookat(
@@ -366,11 +453,13 @@ void transformable::lookat(
     quat global_orientation = quat_lookat(dir, up, forward);
     quat target = global_orientation;
 
-    if(parent)
+    if(transformable* parent = get_parent())
         target = inverse(parent->get_global_orientation()) * target;
 
-    if(angle_limit < 0) orientation = target;
-    else orientation = rotate_towards(orientation, target, angle_limit);
+    if(angle_limit < 0) local_orientation() = target;
+    else local_orientation() = rotate_towards(
+        local_orientation(), target, angle_limit
+    );
     REVISION;
 }
 
@@ -389,10 +478,10 @@ void transformable::set_global_direction(
 ){
     quat target = glm::rotation(forward, direction);
 
-    if(parent)
+    if(transformable* parent = get_parent())
         target = inverse(parent->get_global_orientation()) * target;
 
-    orientation = target;
+    local_orientation() = target;
     REVISION;
 }
 
@@ -421,7 +510,7 @@ void transformable::align_to_view(
         up = global_view_up_dir;
 
     vec3 face_axis = vec3(0,0,1);
-    if(parent)
+    if(transformable* parent = get_parent())
     { // If there is a parent, transform the face axis into world space.
         mat3 norm_mat = glm::inverseTranspose(
             mat3(parent->get_global_transform())
@@ -432,7 +521,7 @@ void transformable::align_to_view(
     set_orientation(quat_lookat(global_view_dir, up, -face_axis));
 }
 
-#ifdef TR_TRANSFORM_CACHING
+#if defined(TR_TRANSFORM_CACHING) && !defined(TR_TRANSFORM_HIERARCHY)
 uint16_t transformable::update_cached_transform() const
 {
     if(static_locked) return revision;
@@ -1,11 +1,18 @@
 #ifndef TAURAY_TRANSFORMABLE_HH
 #define TAURAY_TRANSFORMABLE_HH
 #include "math.hh"
+#include "transform_hierarchy.hh"
 
 // Transform caching doubles the size of transformable, but can make
 // get_global_transform() significantly faster in some cases.
 #define TR_TRANSFORM_CACHING
 
+// Stores all transforms in the shared transform_hierarchy, making
+// transformable only a handle to it. Global transforms are then cached and
+// updated in batches by transform_hierarchy::update(), regardless of
+// TR_TRANSFORM_CACHING.
+#define TR_TRANSFORM_HIERARCHY
+
 namespace tr
 {
 
@@ -14,6 +21,14 @@ class transformable
 public:
     transformable(transformable* parent = nullptr);
     transformable(vec3 pos, vec3 scale = vec3(1), vec3 direction = vec3(0,0,-1), vec3 forward = vec3(0,0,-1));
+#ifdef TR_TRANSFORM_HIERARCHY
+    transformable(const transformable& other);
+    transformable(transformable&& other) noexcept;
+    ~transformable();
+
+    transformable& operator=(const transformable& other);
+    transformable& operator=(transformable&& other) noexcept;
+#endif
 
     void rotate(float angle, vec3 axis, vec3 local_origin = vec3(0));
     void rotate(vec3 axis_magnitude, vec3 local_origin = vec3(0));
@@ -46,12 +61,13 @@ public:
     vec3 get_scaling() const;
 
     void set_transform(const mat4& transform = mat4());
+    void set_transform(vec3 position, quat orientation, vec3 scaling);
     mat4 get_transform() const;
 
     void set_direction(vec3 direction, vec3 forward = vec3(0,0,-1));
     vec3 get_direction(vec3 forward = vec3(0,0,-1)) const;
 
-#ifdef TR_TRANSFORM_CACHING
+#if defined(TR_TRANSFORM_HIERARCHY) || defined(TR_TRANSFORM_CACHING)
     const mat4& get_global_transform() const;
     const mat4& get_global_inverse_transpose_transform() const;
 #else
@@ -108,11 +124,28 @@ public:
         vec3 lock_axis = vec3(0)
     );
 
-#ifdef TR_TRANSFORM_CACHING
+#if defined(TR_TRANSFORM_CACHING) && !defined(TR_TRANSFORM_HIERARCHY)
     uint16_t update_cached_transform() const;
 #endif
 
 private:
+#ifdef TR_TRANSFORM_HIERARCHY
+    vec3& local_position() const
+    { return transform_hierarchy::get().position(node); }
+    quat& local_orientation() const
+    { return transform_hierarchy::get().orientation(node); }
+    vec3& local_scaling() const
+    { return transform_hierarchy::get().scaling(node); }
+
+    transform_hierarchy::node_id node;
+#else
+    vec3& local_position() { return position; }
+    const vec3& local_position() const { return position; }
+    quat& local_orientation() { return orientation; }
+    const quat& local_orientation() const { return orientation; }
+    vec3& local_scaling() { return scaling; }
+    const vec3& local_scaling() const { return scaling; }
+
 #ifdef TR_TRANSFORM_CACHING
     mutable uint16_t cached_revision;
     mutable uint16_t revision;
@@ -125,6 +158,7 @@ private:
     quat orientation;
     vec3 position, scaling;
     bool static_locked;
+#endif
 };
 
 }
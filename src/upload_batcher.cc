@@ -0,0 +1,304 @@
+#include "upload_batcher.hh"
+#include "misc.hh"
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+
+namespace
+{
+
+size_t align_up(size_t offset, size_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+}
+
+namespace tr
+{
+
+upload_batcher::upload_batcher(
+    device_mask dev,
+    size_t arena_size,
+    size_t max_arenas
+):  arena_size(arena_size), max_arenas(std::max(max_arenas, size_t(1))),
+    ticket_counter(0), devices(dev)
+{
+    for(auto[dev, d]: devices)
+        d.timeline = create_timeline_semaphore(dev);
+}
+
+upload_batcher::~upload_batcher()
+{
+    for(auto[dev, d]: devices)
+    {
+        // Unflushed work is dropped; nothing has been submitted from it.
+        if(d.cb)
+        {
+            d.cb.end();
+            dev.logical.freeCommandBuffers(dev.graphics_pool, d.cb);
+        }
+        for(arena& a: d.arenas)
+            destroy_arena(dev, a);
+        while(d.in_flight.size())
+            retire(dev, d, true);
+        for(arena& a: d.free_arenas)
+            destroy_arena(dev, a);
+    }
+}
+
+void upload_batcher::upload_buffer(
+    device& dev,
+    vk::Buffer dst,
+    vk::DeviceSize dst_offset,
+    const void* data,
+    size_t size
+){
+    if(size == 0) return;
+    vk::Buffer staging;
+    vk::DeviceSize offset;
+    vk::CommandBuffer cb = stage(dev, data, size, 16, staging, offset);
+    cb.copyBuffer(staging, dst, {{offset, dst_offset, size}});
+}
+
+vkm<vk::Buffer> upload_batcher::create_buffer(
+    device& dev,
+    vk::BufferCreateInfo info,
+    VmaAllocationCreateFlagBits flags,
+    const void* data
+){
+    if(data)
+        info.usage |= vk::BufferUsageFlagBits::eTransferDst;
+    vkm<vk::Buffer> res = tr::create_buffer(dev, info, flags);
+    if(data)
+        upload_buffer(dev, res, 0, data, info.size);
+    return res;
+}
+
+vkm<vk::Image> upload_batcher::create_gpu_image(
+    device& dev,
+    vk::ImageCreateInfo info,
+    vk::ImageLayout final_layout,
+    size_t data_size,
+    const void* data
+){
+    // Images without initial data only need a layout transition, which isn't
+    // worth batching.
+    if(!data)
+        return sync_create_gpu_image(dev, info, final_layout);
+
+    VmaAllocationCreateInfo alloc_info = {};
+    alloc_info.usage = VMA_MEMORY_USAGE_AUTO;
+    alloc_info.flags = VMA_ALLOCATION_CREATE_DEDICATED_MEMORY_BIT;
+    info.usage |= vk::ImageUsageFlagBits::eTransferDst |
+        vk::ImageUsageFlagBits::eTransferSrc;
+
+    vk::Image img;
+    VmaAllocation alloc;
+    vmaCreateImage(
+        dev.allocator, (VkImageCreateInfo*)&info,
+        &alloc_info, reinterpret_cast<VkImage*>(&img),
+        &alloc, nullptr
+    );
+
+    // Buffer offsets of image copies must be a multiple of both 4 and the
+    // texel size, which isn't always a power of two (e.g. RGB16).
+    size_t texel_count = size_t(info.extent.width) * info.extent.height *
+        info.extent.depth * info.arrayLayers;
+    size_t texel_size = std::max(data_size / std::max(texel_count, size_t(1)), size_t(1));
+    size_t alignment = std::lcm(size_t(16), texel_size);
+
+    vk::Buffer staging;
+    vk::DeviceSize offset;
+    vk::CommandBuffer cb = stage(
+        dev, data, data_size, alignment, staging, offset
+    );
+    record_image_upload(cb, img, info, final_layout, staging, offset);
+    return vkm<vk::Image>(dev, img, alloc);
+}
+
+uint64_t upload_batcher::flush()
+{
+    for(auto[dev, d]: devices)
+    {
+        if(d.cb) submit(dev, d);
+        retire(dev, d, false);
+    }
+    return ticket_counter;
+}
+
+bool upload_batcher::is_complete(uint64_t ticket)
+{
+    bool complete = true;
+    for(auto[dev, d]: devices)
+    {
+        retire(dev, d, false);
+        if(d.in_flight.size() && d.in_flight.front().ticket <= ticket)
+            complete = false;
+    }
+    return complete;
+}
+
+void upload_batcher::wait(uint64_t ticket)
+{
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    for(auto[dev, d]: devices)
+    {
+        while(d.in_flight.size() && d.in_flight.front().ticket <= ticket)
+            retire(dev, d, true);
+    }
+    counters.wait_time += std::chrono::steady_clock::now() - start;
+}
+
+void upload_batcher::wait()
+{
+    wait(flush());
+}
+
+upload_batcher::stats upload_batcher::get_stats() const
+{
+    return counters;
+}
+
+vk::CommandBuffer upload_batcher::stage(
+    device& dev,
+    const void* data,
+    size_t size,
+    size_t alignment,
+    vk::Buffer& staging,
+    vk::DeviceSize& offset
+){
+    device_data& d = devices[dev.id];
+    arena* target = nullptr;
+
+    if(size > arena_size)
+    {
+        // Dedicated arenas go to the front so that back() stays the arena
+        // that is being filled.
+        d.arenas.insert(d.arenas.begin(), create_arena(dev, size));
+        target = &d.arenas.front();
+    }
+    else if(
+        d.arenas.size() &&
+        align_up(d.arenas.back().used, alignment) + size <= d.arenas.back().size
+    ){
+        target = &d.arenas.back();
+    }
+    else
+    {
+        retire(dev, d, false);
+        if(d.free_arenas.empty())
+        {
+            size_t live = d.free_arenas.size();
+            for(arena& a: d.arenas)
+                if(a.size == arena_size) live++;
+            for(batch& b: d.in_flight)
+                for(arena& a: b.arenas)
+                    if(a.size == arena_size) live++;
+
+            if(live < max_arenas)
+                d.free_arenas.push_back(create_arena(dev, arena_size));
+            else
+            {
+                std::chrono::steady_clock::time_point start =
+                    std::chrono::steady_clock::now();
+                if(d.cb) submit(dev, d);
+                while(d.free_arenas.empty())
+                    retire(dev, d, true);
+                counters.wait_time += std::chrono::steady_clock::now() - start;
+            }
+        }
+        d.arenas.push_back(std::move(d.free_arenas.back()));
+        d.free_arenas.pop_back();
+        target = &d.arenas.back();
+    }
+
+    offset = align_up(target->used, alignment);
+    memcpy(target->mem + offset, data, size);
+    target->used = offset + size;
+    staging = target->buf;
+
+    if(!d.cb)
+    {
+        d.cb = dev.logical.allocateCommandBuffers({
+            dev.graphics_pool, vk::CommandBufferLevel::ePrimary, 1
+        })[0];
+        d.cb.begin(vk::CommandBufferBeginInfo{
+            vk::CommandBufferUsageFlagBits::eOneTimeSubmit
+        });
+    }
+
+    counters.uploads++;
+    counters.bytes += size;
+    return d.cb;
+}
+
+upload_batcher::arena upload_batcher::create_arena(device& dev, size_t size)
+{
+    arena a;
+    a.buf = create_staging_buffer(dev, size);
+    a.size = size;
+    vmaMapMemory(dev.allocator, a.buf.get_allocation(), (void**)&a.mem);
+    return a;
+}
+
+void upload_batcher::destroy_arena(device& dev, arena& a)
+{
+    if(!a.mem) return;
+    vmaUnmapMemory(dev.allocator, a.buf.get_allocation());
+    a.mem = nullptr;
+    a.buf.destroy();
+}
+
+void upload_batcher::retire(device& dev, device_data& d, bool block)
+{
+    if(block && d.in_flight.size())
+    {
+        uint64_t ticket = d.in_flight.front().ticket;
+        (void)dev.logical.waitSemaphores(
+            {{}, 1, d.timeline.get(), &ticket}, UINT64_MAX
+        );
+    }
+
+    uint64_t done = dev.logical.getSemaphoreCounterValue(d.timeline);
+    while(d.in_flight.size() && d.in_flight.front().ticket <= done)
+    {
+        batch& b = d.in_flight.front();
+        dev.logical.freeCommandBuffers(dev.graphics_pool, b.cb);
+        for(arena& a: b.arenas)
+        {
+            if(a.size == arena_size)
+            {
+                a.used = 0;
+                d.free_arenas.emplace_back(std::move(a));
+            }
+            else destroy_arena(dev, a);
+        }
+        d.in_flight.pop_front();
+    }
+}
+
+void upload_batcher::submit(device& dev, device_data& d)
+{
+    for(arena& a: d.arenas)
+        vmaFlushAllocation(dev.allocator, a.buf.get_allocation(), 0, a.used);
+
+    bulk_upload_barrier(d.cb);
+    d.cb.end();
+
+    uint64_t ticket = ++ticket_counter;
+    vk::TimelineSemaphoreSubmitInfo timeline_info(0, nullptr, 1, &ticket);
+    vk::SubmitInfo submit_info(
+        0, nullptr, nullptr, 1, &d.cb, 1, d.timeline.get()
+    );
+    submit_info.pNext = &timeline_info;
+    dev.graphics_queue.submit(submit_info, {});
+
+    d.in_flight.push_back({ticket, d.cb, std::move(d.arenas)});
+    d.arenas.clear();
+    d.cb = vk::CommandBuffer();
+    counters.submissions++;
+}
+
+}
@@ -0,0 +1,134 @@
+#ifndef TAURAY_UPLOAD_BATCHER_HH
+#define TAURAY_UPLOAD_BATCHER_HH
+#include "context.hh"
+#include <deque>
+#include <chrono>
+
+namespace tr
+{
+
+// Collects buffer and image uploads into large, reused staging arenas and
+// submits them in a few command buffers instead of one blocking submission
+// per resource. Completion is tracked with a timeline semaphore per device, so
+// flush() never waits for the GPU; resources uploaded through the batcher must
+// not be used before the ticket returned by flush() is complete.
+//
+// Submissions go to the graphics queue, like the one-off command buffers in
+// misc.hh, so this must be used from the thread that submits rendering work.
+class upload_batcher
+{
+public:
+    // Host memory usage is capped at roughly max_arenas * arena_size per
+    // device; once that is reached, recording blocks until the oldest
+    // submission has finished. Uploads larger than arena_size get a dedicated
+    // staging buffer.
+    upload_batcher(
+        device_mask dev,
+        size_t arena_size = 64 << 20,
+        size_t max_arenas = 4
+    );
+    upload_batcher(const upload_batcher& other) = delete;
+    upload_batcher(upload_batcher&& other) = delete;
+    // Waits for all submitted uploads and drops anything not yet flushed.
+    ~upload_batcher();
+
+    // The data is copied into staging memory immediately, so it need not
+    // outlive this call.
+    void upload_buffer(
+        device& dev,
+        vk::Buffer dst,
+        vk::DeviceSize dst_offset,
+        const void* data,
+        size_t size
+    );
+
+    // Batched counterpart of create_buffer() in misc.hh.
+    vkm<vk::Buffer> create_buffer(
+        device& dev,
+        vk::BufferCreateInfo info,
+        VmaAllocationCreateFlagBits flags,
+        const void* data
+    );
+
+    // Batched counterpart of sync_create_gpu_image() in misc.hh, including
+    // mipmap generation.
+    vkm<vk::Image> create_gpu_image(
+        device& dev,
+        vk::ImageCreateInfo info,
+        vk::ImageLayout final_layout,
+        size_t data_size,
+        const void* data
+    );
+
+    // Submits everything recorded so far on all devices and returns a ticket
+    // that can be given to is_complete() and wait(). Does not block.
+    uint64_t flush();
+
+    // Non-blocking; also recycles staging arenas of finished submissions.
+    bool is_complete(uint64_t ticket);
+    void wait(uint64_t ticket);
+    // Flushes and waits for everything.
+    void wait();
+
+    struct stats
+    {
+        size_t uploads = 0;
+        size_t bytes = 0;
+        size_t submissions = 0;
+        // Time spent blocked on the GPU, either in wait() or due to running
+        // out of staging arenas.
+        std::chrono::steady_clock::duration wait_time =
+            std::chrono::steady_clock::duration::zero();
+    };
+    stats get_stats() const;
+
+private:
+    struct arena
+    {
+        vkm<vk::Buffer> buf;
+        uint8_t* mem = nullptr;
+        size_t size = 0;
+        size_t used = 0;
+    };
+
+    struct batch
+    {
+        uint64_t ticket;
+        vk::CommandBuffer cb;
+        std::vector<arena> arenas;
+    };
+
+    struct device_data
+    {
+        vkm<vk::Semaphore> timeline;
+        vk::CommandBuffer cb;
+        std::vector<arena> arenas;
+        std::vector<arena> free_arenas;
+        std::deque<batch> in_flight;
+    };
+
+    // Returns the command buffer to record into and the staging location for
+    // 'size' bytes, flushing or waiting if needed.
+    vk::CommandBuffer stage(
+        device& dev,
+        const void* data,
+        size_t size,
+        size_t alignment,
+        vk::Buffer& staging,
+        vk::DeviceSize& offset
+    );
+    arena create_arena(device& dev, size_t size);
+    void destroy_arena(device& dev, arena& a);
+    void retire(device& dev, device_data& d, bool block);
+    void submit(device& dev, device_data& d);
+
+    size_t arena_size;
+    size_t max_arenas;
+    uint64_t ticket_counter;
+    per_device<device_data> devices;
+    stats counters;
+};
+
+}
+
+#endif
@@ -30,6 +30,15 @@ z_pass_stage::z_pass_stage(
     z_pass_timer(dev, "Z-pass (" + std::to_string(count_array_layers(depth_buffer_arrays)) + " viewports)"),
     scene_state_counter(0)
 {
+    std::map<std::string, std::string> defines;
+    if(ss.has_indirect_draw())
+    {
+        defines["INDIRECT_DRAW"];
+        instance_culler::options culler_opt;
+        culler_opt.opaque_only = true;
+        culler.emplace(dev, ss, culler_opt);
+    }
+
     for(const render_target& depth_buffer: depth_buffer_arrays)
     {
         array_pipelines.emplace_back(new raster_pipeline(dev));
@@ -37,7 +46,7 @@ z_pass_stage::z_pass_stage(
             depth_buffer.size,
             uvec4(0,0,depth_buffer.size),
             {
-                {"shader/z_pass.vert"},
+                {"shader/z_pass.vert", defines},
                 {"shader/z_pass.frag"}
             },
             {&ss.get_descriptors()},
@@ -76,9 +85,23 @@ void z_pass_stage::update(uint32_t)
         vk::CommandBuffer cb = begin_graphics();
         z_pass_timer.begin(cb, dev->id, i);
 
+        if(culler)
+        {
+            std::vector<instance_culler::draw_list> lists;
+            uint32_t first_view = 0;
+            for(std::unique_ptr<raster_pipeline>& gfx: array_pipelines)
+            {
+                uint32_t view_count = gfx->get_multiview_layer_count();
+                lists.push_back({first_view, view_count});
+                first_view += view_count;
+            }
+            culler->record_cull(cb, lists);
+        }
+
         size_t j = 0;
-        for(std::unique_ptr<raster_pipeline>& gfx: array_pipelines)
+        for(size_t list_index = 0; list_index < array_pipelines.size(); ++list_index)
         {
+            std::unique_ptr<raster_pipeline>& gfx = array_pipelines[list_index];
             // Bind descriptors
             gfx->begin_render_pass(cb, i);
             gfx->bind(cb);
@@ -87,7 +110,14 @@ void z_pass_stage::update(uint32_t)
             const std::vector<scene_stage::instance>& instances = ss->get_instances();
 
             push_constant_buffer control;
-            for(size_t i = 0; i < instances.size(); ++i)
+            if(culler)
+            {
+                control.instance_id = 0;
+                control.base_camera_index = j;
+                gfx->push_constants(cb, control);
+                culler->record_draw(cb, list_index);
+            }
+            else for(size_t i = 0; i < instances.size(); ++i)
             {
                 const scene_stage::instance& inst = instances[i];
                 // Only render opaque things.
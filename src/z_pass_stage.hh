@@ -5,6 +5,7 @@
 #include "raster_pipeline.hh"
 #include "gpu_buffer.hh"
 #include "stage.hh"
+#include "instance_culler.hh"
 
 namespace tr
 {
@@ -24,6 +25,8 @@ protected:
 
 private:
     std::vector<std::unique_ptr<raster_pipeline>> array_pipelines;
+    // Only used if the scene_stage has indirect drawing enabled.
+    std::optional<instance_culler> culler;
 
     scene_stage* ss;
     timer z_pass_timer;
@@ -0,0 +1,163 @@
+// Sends messages through the shared memory DSHGI transport to two clients in
+// the same process. Both must receive every message intact, and a client that
+// falls behind by more than the ring must ask for a keyframe and then continue
+// from the newest message, which is marked as following lost ones. A client
+// that dies without detaching must stop being counted after a while.
+#include "dshgi_transport.hh"
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace tr;
+using namespace std::chrono_literals;
+
+namespace
+{
+
+constexpr size_t RING_SIZE = 64 << 10;
+constexpr int MESSAGES = 20;
+
+std::vector<uint8_t> generate_payload(int index)
+{
+    std::vector<uint8_t> payload(997 * (index % 5));
+    for(size_t i = 0; i < payload.size(); ++i)
+        payload[i] = i * 31 + index;
+    return payload;
+}
+
+void publish(dshgi_publisher& pub, int index)
+{
+    std::vector<uint8_t> payload = generate_payload(index);
+    uint32_t header = index;
+    pub.publish("test ", {
+        {&header, sizeof(header)},
+        {payload.data(), payload.size()}
+    });
+}
+
+bool check(
+    const dshgi_message& msg,
+    int index,
+    const char* name,
+    bool follows_loss = false
+){
+    std::vector<uint8_t> payload = generate_payload(index);
+    uint32_t header = 0;
+    if(
+        msg.get_topic() != "test " ||
+        msg.get_part_count() != 2 ||
+        !msg.read(0, header) ||
+        header != uint32_t(index) ||
+        msg.get_part_size(1) != payload.size() ||
+        !std::equal(payload.begin(), payload.end(), msg.get_part_data(1)) ||
+        msg.get_follows_loss() != follows_loss
+    ){
+        std::cout << name << ": message " << index << " differs" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}
+
+int main()
+{
+    dshgi_transport_options opt;
+    opt.type = dshgi_transport_type::SHARED_MEMORY;
+    opt.shared_memory_size = RING_SIZE;
+    uint16_t port = 40000 + getpid() % 20000;
+    std::string address = "localhost:" + std::to_string(port);
+
+    std::unique_ptr<dshgi_publisher> pub = create_dshgi_publisher(opt, port);
+    std::unique_ptr<dshgi_subscriber> subs[2] = {
+        create_dshgi_subscriber(opt, address),
+        create_dshgi_subscriber(opt, address)
+    };
+    dshgi_message msg;
+    bool ok = true;
+
+    // Clients attach on their first receive.
+    for(auto& sub: subs)
+        sub->receive(msg, 0ms);
+    if(!pub->poll() || pub->get_subscriber_count() != 2)
+    {
+        std::cout << "clients were not noticed" << std::endl;
+        ok = false;
+    }
+
+    for(int i = 0; i < MESSAGES; ++i)
+    {
+        publish(*pub, i);
+        for(int j = 0; j < 2; ++j)
+        {
+            const char* name = j == 0 ? "client 0" : "client 1";
+            if(!subs[j]->receive(msg, 100ms))
+            {
+                std::cout << name << ": message " << i << " not received" << std::endl;
+                ok = false;
+            }
+            else ok &= check(msg, i, name);
+        }
+    }
+    if(pub->poll())
+    {
+        std::cout << "keyframe requested without lost messages" << std::endl;
+        ok = false;
+    }
+
+    // Overrun client 1 while only client 0 keeps up.
+    int index = MESSAGES;
+    for(size_t written = 0; written < 2 * RING_SIZE; ++index)
+    {
+        publish(*pub, index);
+        written += generate_payload(index).size() + 64;
+        if(!subs[0]->receive(msg, 100ms) || !check(msg, index, "client 0"))
+            ok = false;
+    }
+    if(subs[1]->receive(msg, 10ms) || !pub->poll())
+    {
+        std::cout << "overrun client did not ask for a keyframe" << std::endl;
+        ok = false;
+    }
+    publish(*pub, index);
+    if(!subs[1]->receive(msg, 100ms) || !check(msg, index, "client 1", true))
+    {
+        std::cout << "overrun client did not recover" << std::endl;
+        ok = false;
+    }
+
+    subs[1].reset();
+    if(pub->get_subscriber_count() != 1)
+    {
+        std::cout << "client did not detach" << std::endl;
+        ok = false;
+    }
+
+    // A client that crashes can't detach.
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        std::unique_ptr<dshgi_subscriber> sub = create_dshgi_subscriber(opt, address);
+        sub->receive(msg, 0ms);
+        _exit(0);
+    }
+    waitpid(pid, nullptr, 0);
+    if(pub->get_subscriber_count() != 2)
+    {
+        std::cout << "crashing client was not noticed" << std::endl;
+        ok = false;
+    }
+    // Client 0 has to keep receiving to stay alive.
+    auto deadline = std::chrono::steady_clock::now() + 6s;
+    while(std::chrono::steady_clock::now() < deadline)
+    {
+        pub->poll();
+        subs[0]->receive(msg, 100ms);
+    }
+    if(pub->get_subscriber_count() != 1)
+    {
+        std::cout << "crashed client was not timed out" << std::endl;
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+// Round-trips synthetic frames through every frame streaming codec and prints
+// the compressed sizes and timings. Lossless codecs must reproduce the input
+// exactly, lossy ones must stay above a PSNR threshold.
+#include "frame_codec.hh"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace tr;
+
+namespace
+{
+
+constexpr uint32_t WIDTH = 1920+5;
+constexpr uint32_t HEIGHT = 1080+3;
+constexpr int FRAMES = 20;
+constexpr double MIN_LOSSY_PSNR = 30.0;
+
+// Smooth gradients with a moving rectangle and a bit of noise, so that some
+// tiles change from frame to frame and others don't.
+void generate_frame(std::vector<uint8_t>& rgb, int frame, std::mt19937& rng)
+{
+    rgb.resize(WIDTH*HEIGHT*3);
+    for(uint32_t y = 0; y < HEIGHT; ++y)
+    for(uint32_t x = 0; x < WIDTH; ++x)
+    {
+        uint8_t* p = rgb.data() + (y*WIDTH + x)*3;
+        p[0] = x * 255 / WIDTH;
+        p[1] = y * 255 / HEIGHT;
+        p[2] = (x + y) / 8;
+        uint32_t rx = 100 + frame * 37;
+        if(x >= rx && x < rx + 200 && y >= 300 && y < 500)
+        {
+            p[0] = 255 - p[0];
+            p[1] = rng() % 4 + 200;
+        }
+    }
+}
+
+double psnr(const std::vector<uint8_t>& a, const uint8_t* b)
+{
+    double mse = 0;
+    for(size_t i = 0; i < a.size(); ++i)
+    {
+        double d = double(a[i]) - double(b[i]);
+        mse += d * d;
+    }
+    mse /= a.size();
+    return mse == 0 ? INFINITY : 10.0 * std::log10(255.0 * 255.0 / mse);
+}
+
+bool test_codec(frame_codec codec, bool lossless)
+{
+    std::mt19937 rng(0);
+    frame_encoder enc(codec, uvec2(WIDTH, HEIGHT));
+    frame_decoder dec;
+    std::vector<uint8_t> rgb;
+    std::vector<uint8_t> encoded;
+    size_t total_bytes = 0;
+    double encode_ms = 0;
+    double decode_ms = 0;
+    bool ok = true;
+
+    for(int i = 0; i < FRAMES; ++i)
+    {
+        generate_frame(rgb, i, rng);
+
+        auto start = std::chrono::steady_clock::now();
+        frame_header header = enc.encode(rgb.data(), encoded, i == FRAMES/2);
+        auto mid = std::chrono::steady_clock::now();
+        bool decoded = dec.decode(header, encoded.data(), encoded.size());
+        auto end = std::chrono::steady_clock::now();
+
+        encode_ms += std::chrono::duration<double, std::milli>(mid-start).count();
+        decode_ms += std::chrono::duration<double, std::milli>(end-mid).count();
+        total_bytes += encoded.size();
+
+        if(!decoded)
+        {
+            std::cout << get_frame_codec_name(codec)
+                << ": failed to decode frame " << i << std::endl;
+            ok = false;
+            continue;
+        }
+
+        if(lossless && memcmp(dec.get_frame(), rgb.data(), rgb.size()) != 0)
+        {
+            std::cout << get_frame_codec_name(codec)
+                << ": frame " << i << " differs" << std::endl;
+            ok = false;
+        }
+        else if(!lossless && psnr(rgb, dec.get_frame()) < MIN_LOSSY_PSNR)
+        {
+            std::cout << get_frame_codec_name(codec)
+                << ": frame " << i << " PSNR too low: "
+                << psnr(rgb, dec.get_frame()) << std::endl;
+            ok = false;
+        }
+    }
+
+    // A decoder that missed the previous frame must refuse delta frames.
+    frame_decoder late;
+    generate_frame(rgb, 0, rng);
+    frame_header header = enc.encode(rgb.data(), encoded);
+    if(!header.keyframe && late.decode(header, encoded.data(), encoded.size()))
+    {
+        std::cout << get_frame_codec_name(codec)
+            << ": decoded a delta frame without a reference" << std::endl;
+        ok = false;
+    }
+
+    std::cout << get_frame_codec_name(codec) << ": "
+        << total_bytes / 1024.0 / FRAMES << " KiB/frame ("
+        << 100.0 * total_bytes / (double(WIDTH) * HEIGHT * 3 * FRAMES)
+        << "% of raw), encode " << encode_ms / FRAMES
+        << " ms/frame, decode " << decode_ms / FRAMES << " ms/frame"
+        << std::endl;
+    return ok;
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+    ok &= test_codec(frame_codec::RAW, true);
+    ok &= test_codec(frame_codec::DELTA_ZSTD, true);
+    ok &= test_codec(frame_codec::YCOCG420_ZSTD, false);
+    return ok ? 0 : 1;
+}
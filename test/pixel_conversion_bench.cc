@@ -0,0 +1,161 @@
+// Checks every SIMD pixel conversion kernel against the scalar reference and
+// reports how long each one takes. Returns non-zero if any result differs.
+#include "pixel_conversion.hh"
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <random>
+#include <vector>
+
+using namespace tr;
+
+namespace
+{
+
+// 4K, plus a few pixels so that the scalar tails get exercised too.
+constexpr size_t PIXEL_COUNT = 3840*2160+7;
+constexpr int REPEATS = 10;
+
+template<typename F>
+double time_ms(F&& f)
+{
+    double best = std::numeric_limits<double>::infinity();
+    for(int i = 0; i < REPEATS; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        f();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(
+            best,
+            std::chrono::duration<double, std::milli>(end - start).count()
+        );
+    }
+    return best;
+}
+
+void report(const char* kernel, simd_level level, double ms, bool ok)
+{
+    std::cout
+        << std::left << std::setw(28) << kernel
+        << std::setw(8) << get_simd_level_name(level)
+        << std::right << std::fixed << std::setprecision(3)
+        << std::setw(10) << ms << " ms"
+        << (ok ? "" : "  MISMATCH") << std::endl;
+}
+
+}
+
+int main()
+{
+    std::mt19937 rng(0);
+    // Go a bit outside of [0, 1] to test clamping, and hit the exact
+    // rounding midpoints every now and then.
+    std::uniform_real_distribution<float> dist(-0.25f, 1.25f);
+    std::vector<float> rgba32f(PIXEL_COUNT*4);
+    for(size_t i = 0; i < rgba32f.size(); ++i)
+    {
+        if(i % 97 == 0) rgba32f[i] = (float(i % 255) + 0.5f) / 255.0f;
+        else rgba32f[i] = dist(rng);
+    }
+
+    std::vector<float> nan_input = rgba32f;
+    std::vector<size_t> nan_pixels = {
+        0, 1, 5, 8, 4093, PIXEL_COUNT/2, PIXEL_COUNT-2, PIXEL_COUNT-1
+    };
+    for(size_t i = 0; i < nan_pixels.size(); ++i)
+        nan_input[nan_pixels[i]*4 + i%4] = std::numeric_limits<float>::quiet_NaN();
+
+    std::vector<uint8_t> rgba8(PIXEL_COUNT*4);
+    for(size_t i = 0; i < rgba8.size(); ++i)
+        rgba8[i] = rng();
+
+    const pixel_conversion_kernels& ref = get_pixel_conversion_kernels(
+        simd_level::SCALAR
+    );
+    std::vector<float> ref_planar(PIXEL_COUNT*4);
+    std::vector<uint8_t> ref_quantized(PIXEL_COUNT*4);
+    std::vector<uint8_t> ref_rgb8(PIXEL_COUNT*3);
+    ref.deinterleave_rgba32f(rgba32f.data(), ref_planar.data(), PIXEL_COUNT);
+    ref.quantize_rgba32f_to_rgba8(
+        nan_input.data(), ref_quantized.data(), PIXEL_COUNT
+    );
+    ref.rgba8_to_rgb8(rgba8.data(), ref_rgb8.data(), PIXEL_COUNT);
+
+    bool all_ok = true;
+    for(
+        int l = (int)simd_level::SCALAR;
+        l <= (int)get_supported_simd_level();
+        ++l
+    ){
+        simd_level level = (simd_level)l;
+        const pixel_conversion_kernels& k = get_pixel_conversion_kernels(level);
+
+        std::vector<size_t> found;
+        double ms = time_ms([&](){
+            found.clear();
+            for(
+                size_t i = k.find_nan_rgba32f(nan_input.data(), 0, PIXEL_COUNT);
+                i < PIXEL_COUNT;
+                i = k.find_nan_rgba32f(nan_input.data(), i+1, PIXEL_COUNT)
+            ) found.push_back(i);
+        });
+        bool ok = found == nan_pixels;
+        report("find_nan_rgba32f", level, ms, ok);
+        all_ok &= ok;
+
+        std::vector<float> planar(PIXEL_COUNT*4);
+        ms = time_ms([&](){
+            k.deinterleave_rgba32f(rgba32f.data(), planar.data(), PIXEL_COUNT);
+        });
+        ok = memcmp(
+            planar.data(), ref_planar.data(), planar.size()*sizeof(float)
+        ) == 0;
+        report("deinterleave_rgba32f", level, ms, ok);
+        all_ok &= ok;
+
+        std::vector<uint8_t> quantized(PIXEL_COUNT*4);
+        ms = time_ms([&](){
+            k.quantize_rgba32f_to_rgba8(
+                nan_input.data(), quantized.data(), PIXEL_COUNT
+            );
+        });
+        ok = quantized == ref_quantized;
+        report("quantize_rgba32f_to_rgba8", level, ms, ok);
+        all_ok &= ok;
+
+        std::vector<uint8_t> rgb8(PIXEL_COUNT*3);
+        ms = time_ms([&](){
+            k.rgba8_to_rgb8(rgba8.data(), rgb8.data(), PIXEL_COUNT);
+        });
+        ok = rgb8 == ref_rgb8;
+        report("rgba8_to_rgb8", level, ms, ok);
+        all_ok &= ok;
+
+        // Short inputs only go through the tail handling.
+        for(size_t count = 0; count < 40; ++count)
+        {
+            std::vector<uint8_t> ref_rgb(count*3), rgb(count*3);
+            ref.rgba8_to_rgb8(rgba8.data(), ref_rgb.data(), count);
+            k.rgba8_to_rgb8(rgba8.data(), rgb.data(), count);
+            std::vector<uint8_t> ref_q(count*4), q(count*4);
+            ref.quantize_rgba32f_to_rgba8(nan_input.data(), ref_q.data(), count);
+            k.quantize_rgba32f_to_rgba8(nan_input.data(), q.data(), count);
+            std::vector<float> ref_p(count*4), p(count*4);
+            ref.deinterleave_rgba32f(rgba32f.data(), ref_p.data(), count);
+            k.deinterleave_rgba32f(rgba32f.data(), p.data(), count);
+            if(
+                rgb != ref_rgb || q != ref_q || p != ref_p ||
+                k.find_nan_rgba32f(nan_input.data(), 2, count) !=
+                ref.find_nan_rgba32f(nan_input.data(), 2, count)
+            ){
+                std::cout << "Mismatch with " << count << " pixels" << std::endl;
+                all_ok = false;
+            }
+        }
+    }
+
+    return all_ok ? 0 : 1;
+}
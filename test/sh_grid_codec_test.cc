@@ -0,0 +1,137 @@
+// Streams synthetic SH grids through every SH grid codec and prints the encoded
+// sizes. Without a threshold, fp16 must reproduce the input exactly, and
+// quantized codecs must stay within their error bound. Unchanged bricks must
+// not be sent.
+#include "sh_grid_codec.hh"
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace tr;
+
+namespace
+{
+
+const uvec3 RESOLUTION = uvec3(9, 6, 5);
+constexpr int COEF_COUNT = 9;
+constexpr int FRAMES = 10;
+// Half of a quantization step is at most 1/128 of the largest value in a
+// brick, and the decoded values are rounded to fp16 on top of that.
+constexpr float MAX_SHARED_EXP8_ERROR = 1.0f / 100.0f;
+
+// Smooth coefficients, where a slab of probes changes every frame and the rest
+// stay the same.
+void generate_grid(std::vector<uint16_t>& texels, int frame)
+{
+    texels.resize(RESOLUTION.x * RESOLUTION.y * RESOLUTION.z * COEF_COUNT * 4);
+    size_t i = 0;
+    for(uint32_t z = 0; z < RESOLUTION.z; ++z)
+    for(int coef = 0; coef < COEF_COUNT; ++coef)
+    for(uint32_t y = 0; y < RESOLUTION.y; ++y)
+    for(uint32_t x = 0; x < RESOLUTION.x; ++x)
+    for(int c = 0; c < 4; ++c)
+    {
+        float v = std::sin(x * 0.3f + y * 0.2f + c) / (coef + 1);
+        if(z == 1) v += frame * 0.25f;
+        texels[i++] = float_to_half(v);
+    }
+}
+
+bool test_codec(sh_grid_codec codec, bool lossless)
+{
+    sh_grid_encoder enc(codec);
+    sh_grid_decoder dec;
+    std::vector<uint16_t> texels;
+    std::vector<uint8_t> encoded;
+    size_t total_bytes = 0;
+    bool ok = true;
+
+    for(int i = 0; i < FRAMES; ++i)
+    {
+        generate_grid(texels, i);
+        sh_grid_header header = enc.encode(
+            texels.data(), RESOLUTION, COEF_COUNT, encoded, i == FRAMES/2
+        );
+        // Raw messages are the input texels as they are.
+        const uint8_t* data = header.raw ?
+            (const uint8_t*)texels.data() : encoded.data();
+        size_t data_size = header.raw ?
+            texels.size() * sizeof(uint16_t) : encoded.size();
+        total_bytes += data_size;
+
+        if(!dec.decode(header, RESOLUTION, COEF_COUNT, data, data_size))
+        {
+            std::cout << get_sh_grid_codec_name(codec)
+                << ": failed to decode frame " << i << std::endl;
+            ok = false;
+            continue;
+        }
+
+        const std::vector<uint16_t>& decoded = dec.get_texels();
+        if(lossless && decoded != texels)
+        {
+            std::cout << get_sh_grid_codec_name(codec)
+                << ": frame " << i << " differs" << std::endl;
+            ok = false;
+        }
+        else if(!lossless)
+        {
+            float max_error = 0.0f;
+            float max_value = 0.0f;
+            for(size_t j = 0; j < texels.size(); ++j)
+            {
+                float v = half_to_float(texels[j]);
+                max_error = std::max(max_error, std::fabs(half_to_float(decoded[j]) - v));
+                max_value = std::max(max_value, std::fabs(v));
+            }
+            if(max_error > max_value * MAX_SHARED_EXP8_ERROR)
+            {
+                std::cout << get_sh_grid_codec_name(codec)
+                    << ": frame " << i << " error too high: "
+                    << max_error << std::endl;
+                ok = false;
+            }
+        }
+    }
+
+    // Nothing changed, so nothing should be sent.
+    sh_grid_header header = enc.encode(
+        texels.data(), RESOLUTION, COEF_COUNT, encoded
+    );
+    if(header.brick_count != 0 || encoded.size() != 0)
+    {
+        std::cout << get_sh_grid_codec_name(codec)
+            << ": sent " << header.brick_count << " unchanged bricks"
+            << std::endl;
+        ok = false;
+    }
+
+    // A decoder that missed the keyframe must refuse deltas.
+    sh_grid_decoder late;
+    generate_grid(texels, FRAMES);
+    header = enc.encode(texels.data(), RESOLUTION, COEF_COUNT, encoded);
+    if(late.decode(header, RESOLUTION, COEF_COUNT, encoded.data(), encoded.size()))
+    {
+        std::cout << get_sh_grid_codec_name(codec)
+            << ": decoded a delta without a keyframe" << std::endl;
+        ok = false;
+    }
+
+    size_t raw_bytes = texels.size() * sizeof(uint16_t);
+    std::cout << get_sh_grid_codec_name(codec) << ": "
+        << total_bytes / 1024.0 / FRAMES << " KiB/frame ("
+        << 100.0 * total_bytes / (double(raw_bytes) * FRAMES)
+        << "% of raw)" << std::endl;
+    return ok;
+}
+
+}
+
+int main()
+{
+    bool ok = true;
+    ok &= test_codec(sh_grid_codec::FP16, true);
+    ok &= test_codec(sh_grid_codec::SHARED_EXP8, false);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,182 @@
+// Builds small trees of transformables and checks that their global positions
+// are right both when evaluated on demand and after a batched
+// transform_hierarchy::update(), including after reparenting to a parent that
+// was created later, copying, moving and destroying parents, and using
+// moved-from transformables.
+#include "transformable.hh"
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using namespace tr;
+
+namespace
+{
+
+bool check(const transformable& t, vec3 expected, const char* what)
+{
+    vec3 pos = t.get_global_position();
+    if(any(greaterThan(abs(pos - expected), vec3(1e-4f))))
+    {
+        std::cout << what << ": got (" << pos.x << ", " << pos.y << ", "
+            << pos.z << "), expected (" << expected.x << ", " << expected.y
+            << ", " << expected.z << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}
+
+int main()
+{
+    transform_hierarchy& h = transform_hierarchy::get();
+    bool ok = true;
+
+    transformable root;
+    root.set_position(vec3(1, 0, 0));
+    root.set_scaling(vec3(2));
+    transformable child(&root);
+    child.set_position(vec3(0, 1, 0));
+    transformable grandchild(&child);
+    grandchild.set_position(vec3(0, 0, 1));
+
+    ok &= check(grandchild, vec3(1, 2, 2), "lazy grandchild");
+    h.update();
+    ok &= check(grandchild, vec3(1, 2, 2), "batched grandchild");
+
+    // Moving the root must reach the grandchild through the batched pass.
+    root.translate(vec3(0, 0, 3));
+    h.update();
+    ok &= check(child, vec3(1, 2, 3), "child after root moved");
+    ok &= check(grandchild, vec3(1, 2, 5), "grandchild after root moved");
+
+    // A parent created after its children is ordered before them again.
+    transformable late_parent;
+    late_parent.set_position(vec3(-5, 0, 0));
+    root.set_parent(&late_parent);
+    ok &= check(grandchild, vec3(-4, 2, 5), "lazy after reparenting");
+    late_parent.set_position(vec3(-6, 0, 0));
+    h.update();
+    ok &= check(grandchild, vec3(-5, 2, 5), "batched after reparenting");
+    if(root.get_parent() != &late_parent)
+    {
+        std::cout << "wrong parent after reparenting" << std::endl;
+        ok = false;
+    }
+
+    // Copies are independent, but keep the parent.
+    transformable copy = child;
+    child.set_position(vec3(0));
+    h.update();
+    ok &= check(copy, vec3(-5, 2, 3), "copy");
+    ok &= check(child, vec3(-5, 0, 3), "original of copy");
+
+    // Moved transformables keep their children.
+    std::vector<transformable> parents;
+    std::vector<std::unique_ptr<transformable>> children;
+    for(int i = 0; i < 100; ++i)
+    {
+        parents.emplace_back(vec3(i, 0, 0));
+        children.emplace_back(new transformable(&parents.back()));
+        children.back()->set_position(vec3(0, i, 0));
+    }
+    parents[10].translate(vec3(0, 0, 1));
+    h.update();
+    for(int i = 0; i < 100; ++i)
+    {
+        if(children[i]->get_parent() != &parents[i])
+        {
+            std::cout << "parent of child " << i << " lost in move" << std::endl;
+            ok = false;
+        }
+        ok &= check(*children[i], vec3(i, i, i == 10 ? 1 : 0), "moved parent");
+    }
+
+    // Moved-from transformables can still be used, copied and assigned.
+    transformable moved_from(vec3(0, 4, 0));
+    transformable moved_to(std::move(moved_from));
+    ok &= check(moved_to, vec3(0, 4, 0), "move constructed");
+    transformable copy_of_moved(moved_from);
+    moved_from = moved_to;
+    ok &= check(moved_from, vec3(0, 4, 0), "copy assigned to moved-from");
+    transformable move_assigned;
+    move_assigned = std::move(moved_from);
+    moved_from.set_position(vec3(3, 0, 0));
+    moved_to = moved_from;
+    h.update();
+    ok &= check(move_assigned, vec3(0, 4, 0), "move assigned");
+    ok &= check(moved_to, vec3(3, 0, 0), "copy assigned from moved-from");
+
+    // Children that left a parent before it was destroyed are unaffected.
+    std::unique_ptr<transformable> family(new transformable(vec3(0, 0, 9)));
+    transformable first(family.get()), middle(family.get()), last(family.get());
+    middle.set_parent(&late_parent);
+    transformable adopted(&late_parent);
+    adopted.set_parent(family.get());
+    family.reset();
+    for(transformable* t: {&first, &last, &adopted})
+    {
+        if(t->get_parent() != nullptr)
+        {
+            std::cout << "child of destroyed parent still has a parent" << std::endl;
+            ok = false;
+        }
+        ok &= check(*t, vec3(0), "child of destroyed parent");
+    }
+    if(middle.get_parent() != &late_parent)
+    {
+        std::cout << "child that moved away lost its new parent" << std::endl;
+        ok = false;
+    }
+
+    // Long chains are torn down parent first, like scenes usually are.
+    std::vector<std::unique_ptr<transformable>> chain;
+    for(int i = 0; i < 20000; ++i)
+    {
+        chain.emplace_back(new transformable(
+            chain.size() ? chain.back().get() : nullptr
+        ));
+        chain.back()->set_position(vec3(1, 0, 0));
+    }
+    h.update();
+    ok &= check(*chain.back(), vec3(20000, 0, 0), "end of chain");
+    for(size_t i = 0; i + 1 < chain.size(); ++i)
+        chain[i].reset();
+    ok &= check(*chain.back(), vec3(1, 0, 0), "end of destroyed chain");
+    chain.clear();
+
+    // Children of destroyed parents become roots immediately.
+    size_t node_count = h.get_node_count();
+    std::unique_ptr<transformable> doomed(new transformable(vec3(0, 7, 0)));
+    transformable orphan(doomed.get());
+    ok &= check(orphan, vec3(0, 7, 0), "orphan before parent destroyed");
+    h.update();
+    doomed.reset();
+    if(orphan.get_parent() != nullptr)
+    {
+        std::cout << "orphan still has a parent" << std::endl;
+        ok = false;
+    }
+    ok &= check(orphan, vec3(0), "orphan before compaction");
+
+    // Short-lived transformables eventually get compacted away.
+    for(int i = 0; i < 1000; ++i)
+    {
+        transformable temp;
+        temp.set_position(vec3(i));
+        ok &= check(temp, vec3(i), "temporary");
+    }
+    h.update();
+    if(h.get_node_count() != node_count + 1)
+    {
+        std::cout << "expected " << node_count + 1 << " nodes, got "
+            << h.get_node_count() << std::endl;
+        ok = false;
+    }
+    ok &= check(orphan, vec3(0), "orphan after compaction");
+    ok &= check(grandchild, vec3(-5, 0, 5), "grandchild after compaction");
+    ok &= check(*children[99], vec3(99, 99, 0), "child after compaction");
+
+    return ok ? 0 : 1;
+}
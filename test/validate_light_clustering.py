@@ -0,0 +1,121 @@
+import argparse
+import json
+import struct
+import subprocess
+import sys
+import tempfile
+
+# Adds a grid of dim point lights to a GLB scene. With the default cutoff
+# brightness, each of them only reaches about one unit, so most light clusters
+# get a handful of them instead of overflowing.
+def add_point_lights(src_path, dst_path, grid):
+    with open(src_path, 'rb') as f:
+        data = f.read()
+    json_length = struct.unpack('<I', data[12:16])[0]
+    gltf = json.loads(data[20:20+json_length])
+    rest = data[20+json_length:]
+
+    lights = gltf['extensions']['KHR_lights_punctual']['lights']
+    scene_nodes = gltf['scenes'][gltf.get('scene', 0)]['nodes']
+    for x in range(grid[0]):
+        for y in range(grid[1]):
+            for z in range(grid[2]):
+                lights.append({
+                    'type': 'point',
+                    'color': [(x+1)/grid[0], (y+1)/grid[1], (z+1)/grid[2]],
+                    'intensity': 0.25
+                })
+                gltf['nodes'].append({
+                    'name': 'ClusterTestLight'+str(len(lights)),
+                    'translation': [
+                        -1.75 + 3.5*x/(grid[0]-1),
+                        -1.75 + 3.5*y/(grid[1]-1),
+                        -1.5 + 3.0*z/(grid[2]-1)
+                    ],
+                    'extensions': {
+                        'KHR_lights_punctual': {'light': len(lights)-1}
+                    }
+                })
+                scene_nodes.append(len(gltf['nodes'])-1)
+
+    json_data = json.dumps(gltf).encode('utf-8')
+    json_data += b' ' * (-len(json_data) % 4)
+    with open(dst_path, 'wb') as f:
+        f.write(struct.pack('<III', 0x46546C67, 2, 20+len(json_data)+len(rest)))
+        f.write(struct.pack('<II', len(json_data), 0x4E4F534A))
+        f.write(json_data)
+        f.write(rest)
+
+def render(executable, scene, renderer, width, height, output, clustering):
+    args = [
+        executable,
+        '--renderer='+renderer,
+        '--width='+str(width),
+        '--height='+str(height),
+        '--shadow-map-resolution=64',
+        '--light-clustering='+('on' if clustering else 'off'),
+        '--headless='+output,
+        scene,
+    ]
+    render = subprocess.run(capture_output=True, encoding='utf-8', args = args)
+    if render.returncode != 0:
+        print(' '.join(render.args))
+        print('Tauray returned error '+str(render.returncode)+'\nstdout:\n'+render.stdout+'\nstderr:\n'+render.stderr)
+    return render.returncode
+
+# Light clustering only skips lights past their cutoff radius, so a clustered
+# render should be nearly identical to an unclustered one.
+def validate_light_clustering(executable, scene, renderer, width, height, metric, tolerance):
+    with tempfile.TemporaryDirectory(prefix="tauray-test") as tmpdir:
+        lights_scene = tmpdir+'/lights.glb'
+        add_point_lights(scene, lights_scene, (4, 4, 4))
+
+        for clustering in (False, True):
+            ret = render(
+                executable, lights_scene, renderer, width, height,
+                tmpdir+('/clustered' if clustering else '/reference'),
+                clustering
+            )
+            if ret != 0:
+                return ret
+
+        compare = subprocess.run(capture_output=True, encoding='utf-8', args = [
+            'compare',
+            '-quiet', # disable warnings
+            '-metric', metric,
+            tmpdir+'/clustered.exr',
+            tmpdir+'/reference.exr',
+            'null:' # discard difference image
+        ])
+        if compare.returncode > 1:
+            print('Compare returned error '+str(compare.returncode)+'\nstdout:\n'+compare.stdout+'\nstderr:\n'+compare.stderr)
+            return compare.returncode
+
+        if float(str(compare.stderr).split()[0]) > tolerance:
+            print('Difference ' + str(compare.stderr).split()[0] + ' exceeds tolerance ' + str(tolerance))
+            return -1
+    return 0
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='Compares renders with and without light clustering.')
+    parser.add_argument('--executable')
+    parser.add_argument('--scene')
+    parser.add_argument('--renderer', default="raster")
+    parser.add_argument('--width', type=int, default=512)
+    parser.add_argument('--height', type=int, default=512)
+    parser.add_argument('--metric', default="mse")
+    parser.add_argument('--tolerance', type=float)
+    args = parser.parse_args()
+
+    ret = validate_light_clustering(
+        args.executable,
+        args.scene,
+        args.renderer,
+        args.width,
+        args.height,
+        args.metric,
+        args.tolerance
+    )
+
+    sys.exit(ret);